@@ -18,6 +18,7 @@
 
 #include "control.h"
 #include "cuse-maru.h"
+#include "handover.h"
 #include <sys/socket.h>
 #include <pthread.h>
 #include <string.h>
@@ -76,6 +77,43 @@ static void request_reply(int fd, const char *str)
    }
 }
 
+// Like request_reply(), with a descriptor passed along.
+static void request_reply_fd(int fd, const char *str, int pass_fd)
+{
+   char msg[256];
+   snprintf(msg, sizeof(msg), "MARU%4zu %s", strlen(str) + 1, str);
+
+   union
+   {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int))];
+   } cmsg = {};
+
+   struct iovec iov = {
+      .iov_base = msg,
+      .iov_len  = strlen(msg),
+   };
+
+   struct msghdr hdr = {
+      .msg_iov        = &iov,
+      .msg_iovlen     = 1,
+      .msg_control    = cmsg.buf,
+      .msg_controllen = sizeof(cmsg.buf),
+   };
+
+   struct cmsghdr *c = CMSG_FIRSTHDR(&hdr);
+   c->cmsg_level = SOL_SOCKET;
+   c->cmsg_type  = SCM_RIGHTS;
+   c->cmsg_len   = CMSG_LEN(sizeof(int));
+   memcpy(CMSG_DATA(c), &pass_fd, sizeof(int));
+
+   if (sendmsg(fd, &hdr, MSG_NOSIGNAL) != (ssize_t)iov.iov_len)
+   {
+      fprintf(stderr, "Failed to write ...\n");
+      close(fd);
+   }
+}
+
 static void request_setplayvol(int fd, int argc, char *argv[])
 {
    if (argc < 2)
@@ -179,6 +217,68 @@ static void request_getname(int fd, int argc, char *argv[])
    request_reply(fd, process);
 }
 
+// Replies with a read-only memfd of the position page of a stream, see maru_stream_position_fd().
+static void request_getposition(int fd, int argc, char *argv[])
+{
+   if (argc < 1)
+   {
+      fprintf(stderr, "Invalid request!\n");
+      close(fd);
+      return;
+   }
+
+   errno = 0;
+   unsigned stream = strtoul(argv[0], NULL, 0);
+   if (errno)
+      return request_reply(fd, "NAK");
+
+   if (stream >= MAX_STREAMS)
+      return request_reply(fd, "NAK");
+
+   int page_fd = -1;
+
+   pthread_mutex_lock(&g_state.lock);
+
+   const struct cuse_stream_info *info = &g_state.stream_info[stream];
+   if (info->active && info->stream != LIBMARU_STREAM_MASTER)
+      page_fd = maru_stream_position_fd(g_state.ctx, info->stream);
+
+   pthread_mutex_unlock(&g_state.lock);
+
+   if (page_fd < 0)
+      return request_reply(fd, "NOSTREAM");
+
+   request_reply_fd(fd, "ACK", page_fd);
+   close(page_fd);
+}
+
+// Only the same user may take over the device.
+static void request_handover(int fd, int argc, char *argv[])
+{
+   struct ucred cred;
+   socklen_t len = sizeof(cred);
+   if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+         (cred.uid != 0 && cred.uid != geteuid()))
+   {
+      fprintf(stderr, "Handover refused!\n");
+      close(fd);
+      return;
+   }
+
+   // Handover protocol is not driven by epoll.
+   if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0)
+   {
+      perror("fcntl");
+      close(fd);
+      return;
+   }
+
+   if (handover_send(fd))
+      fprintf(stderr, "Handed over to new process.\n");
+
+   close(fd);
+}
+
 static void parse_request(int fd, int argc, char *argv[])
 {
 #if 0
@@ -200,6 +300,10 @@ static void parse_request(int fd, int argc, char *argv[])
       request_getplayvol(fd, argc - 1, argv + 1);
    else if (strcmp(argv[0], "GETNAME") == 0)
       request_getname(fd, argc - 1, argv + 1);
+   else if (strcmp(argv[0], "GETPOSITION") == 0)
+      request_getposition(fd, argc - 1, argv + 1);
+   else if (strcmp(argv[0], "HANDOVER") == 0)
+      request_handover(fd, argc - 1, argv + 1);
    else
    {
       fprintf(stderr, "Invalid request!\n");
@@ -343,7 +447,7 @@ bool start_control_thread(void)
       return false;
    }
 
-   listen_fd = create_unix_socket("/tmp/maru");
+   listen_fd = create_unix_socket(CONTROL_SOCKET);
    if (listen_fd < 0)
       return false;
 
@@ -19,6 +19,8 @@
 
 #include <stdbool.h>
 
+#define CONTROL_SOCKET "/tmp/maru"
+
 bool start_control_thread(void);
 
 #endif
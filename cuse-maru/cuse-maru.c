@@ -16,6 +16,8 @@
 
 #include "utils.h"
 #include "control.h"
+#include "session.h"
+#include "handover.h"
 #include "cuse-maru.h"
 
 #include <sys/soundcard.h>
@@ -33,6 +35,10 @@
 #include <sys/poll.h>
 #include <signal.h>
 #include <assert.h>
+#include <time.h>
+
+CUSE_PROBE_SEMAPHORE(write);
+CUSE_PROBE_SEMAPHORE(poll);
 
 struct cuse_maru_state g_state = {
    .lock = PTHREAD_MUTEX_INITIALIZER,
@@ -97,6 +103,7 @@ static void maru_open(fuse_req_t req, struct fuse_file_info *info)
    stream_info->channels = 2;
    stream_info->bits = 16;
    stream_info->stream = LIBMARU_STREAM_MASTER; // Invalid stream for writing.
+   stream_info->flushed = false;
 
    stream_info->fragsize = g_state.fragsize;
    stream_info->frags = g_state.frags;
@@ -128,6 +135,11 @@ static void write_notification_cb(void *data)
    pthread_mutex_unlock(&info->lock);
 }
 
+void set_write_notification(struct cuse_stream_info *info)
+{
+   maru_stream_set_write_notification(g_state.ctx, info->stream, write_notification_cb, info);
+}
+
 static bool init_stream(struct cuse_stream_info *info)
 {
    int stream = maru_find_available_stream(g_state.ctx);
@@ -146,9 +158,8 @@ static bool init_stream(struct cuse_stream_info *info)
    if (err != LIBMARU_SUCCESS)
       return false;
 
-   maru_stream_set_write_notification(g_state.ctx, stream, write_notification_cb, info);
-
    info->stream = stream;
+   set_write_notification(info);
    return true;
 }
 
@@ -198,6 +209,9 @@ static void maru_write(fuse_req_t req, const char *data, size_t size, off_t off,
    }
 
    size_t ret = maru_stream_write(g_state.ctx, stream_info->stream, data, to_write);
+   stream_info->flushed = false;
+
+   CUSE_PROBE4(write, stream_info->stream, size, ret, nonblock);
 
    if (ret == 0)
       fuse_reply_err(req, EIO);
@@ -261,17 +275,36 @@ bool read_volume(struct cuse_stream_info *stream_info)
 /** \ingroup cuse
  * \brief Verify mapping between cuse and userspace, and retry if not present.
  *
- * Almost straight copypasta from OSS Proxy.
+ * The device is registered with restricted ioctls, so the kernel maps arguments
+ * as encoded in the standard _IOC commands, and they are present on the first call.
+ *
+ * Almost straight copypasta from OSS Proxy for unrestricted ioctls.
  * It seems that memory is mapped directly between two different processes.
  * Since ioctl() does not contain any size information for its arguments, we first have to tell it how much
  * memory we want to map between the two different processes, then ask it to call ioctl() again.
  */
-static bool ioctl_prep_uarg(fuse_req_t req,
+static bool ioctl_prep_uarg(fuse_req_t req, unsigned flags,
       void *in, size_t in_size,
       void *out, size_t out_size,
       void *uarg,
       const void *in_buf, size_t in_bufsize, size_t out_bufsize)
 {
+   // With restricted ioctls, the kernel has already mapped what the command encodes,
+   // and retrying is not allowed. Arguments not encoded are simply not passed.
+   if (!(flags & FUSE_IOCTL_UNRESTRICTED))
+   {
+      if ((in && in_bufsize && in_bufsize != in_size) ||
+            (out && out_bufsize && out_bufsize != out_size))
+      {
+         fuse_reply_err(req, EINVAL);
+         return true;
+      }
+
+      if (in && in_bufsize)
+         memcpy(in, in_buf, in_size);
+      return false;
+   }
+
    bool retry = false;
    struct iovec in_iov = {};
    struct iovec out_iov = {};
@@ -310,7 +343,7 @@ static bool ioctl_prep_uarg(fuse_req_t req,
 }
 
 #define IOCTL_RETURN(addr) do { \
-   fuse_reply_ioctl(req, 0, addr, sizeof(*(addr))); \
+   fuse_reply_ioctl(req, 0, addr, out_bufsize ? sizeof(*(addr)) : 0); \
 } while(0)
 
 #define IOCTL_RETURN_NULL() do { \
@@ -318,7 +351,7 @@ static bool ioctl_prep_uarg(fuse_req_t req,
 } while(0)
 
 #define PREP_UARG(inp, inp_s, outp, outp_s) do { \
-   if (ioctl_prep_uarg(req, inp, inp_s, \
+   if (ioctl_prep_uarg(req, flags, inp, inp_s, \
             outp, outp_s, uarg, \
             in_buf, in_bufsize, out_bufsize)) \
       return; \
@@ -354,6 +387,48 @@ struct
 };
 #endif
 
+// A stream flushed by SNDCTL_DSP_RESET is kept open with its old format.
+// If it is reconfigured, close it, and let next write open it again.
+static void close_flushed_stream(struct cuse_stream_info *stream_info)
+{
+   if (stream_info->stream == LIBMARU_STREAM_MASTER || !stream_info->flushed)
+      return;
+
+   maru_stream_close(g_state.ctx, stream_info->stream);
+   stream_info->stream = LIBMARU_STREAM_MASTER;
+   stream_info->flushed = false;
+}
+
+// Status ioctls are polled every frame by some clients,
+// so they are answered from the lock-free status of libmaru.
+static bool stream_status(const struct cuse_stream_info *stream_info,
+      struct maru_stream_status *status)
+{
+   return stream_info->stream != LIBMARU_STREAM_MASTER &&
+      maru_stream_get_status(g_state.ctx, stream_info->stream, status) == LIBMARU_SUCCESS;
+}
+
+// Bytes written which have not been played yet. Transfers queued on the device
+// are assumed to have played out in real time since status was published.
+static int stream_delay(const struct cuse_stream_info *stream_info)
+{
+   struct maru_stream_status status;
+   if (!stream_status(stream_info, &status))
+      return 0;
+
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   maru_usec elapsed = now.tv_sec * INT64_C(1000000) + now.tv_nsec / 1000 - status.timestamp;
+
+   uint64_t played = 0;
+   if (elapsed > 0)
+      played = (elapsed * stream_info->sample_rate / 1000000) * stream_info->channels * stream_info->bits / 8;
+   if (played > status.bytes_queued)
+      played = status.bytes_queued;
+
+   return status.bytes_buffered - played;
+}
+
 static void maru_ioctl(fuse_req_t req, int signed_cmd, void *uarg,
       struct fuse_file_info *info, unsigned flags,
       const void *in_buf, size_t in_bufsize, size_t out_bufsize)
@@ -413,10 +488,16 @@ static void maru_ioctl(fuse_req_t req, int signed_cmd, void *uarg,
 #if defined(SNDCTL_DSP_HALT) && (SNDCTL_DSP_HALT != SNDCTL_DSP_RESET)
       case SNDCTL_DSP_HALT:
 #endif
+         // Keep stream configured, so the next write can start playing right away.
          if (stream_info->stream != LIBMARU_STREAM_MASTER)
          {
-            maru_stream_close(g_state.ctx, stream_info->stream);
-            stream_info->stream = LIBMARU_STREAM_MASTER;
+            if (maru_stream_flush(g_state.ctx, stream_info->stream) == LIBMARU_SUCCESS)
+               stream_info->flushed = true;
+            else
+            {
+               maru_stream_close(g_state.ctx, stream_info->stream);
+               stream_info->stream = LIBMARU_STREAM_MASTER;
+            }
             stream_info->write_cnt = 0;
          }
          IOCTL_RETURN_NULL();
@@ -465,6 +546,9 @@ static void maru_ioctl(fuse_req_t req, int signed_cmd, void *uarg,
                i = desc.sample_rate_min;
          }
 
+         if (i != stream_info->sample_rate)
+            close_flushed_stream(stream_info);
+
          stream_info->sample_rate = i;
          IOCTL_RETURN(&i);
          break;
@@ -513,8 +597,9 @@ static void maru_ioctl(fuse_req_t req, int signed_cmd, void *uarg,
       case SNDCTL_DSP_GETOSPACE:
       {
          size_t write_avail = stream_info->fragsize * stream_info->frags - 1;
-         if (stream_info->stream != LIBMARU_STREAM_MASTER)
-            write_avail = maru_stream_write_avail(g_state.ctx, stream_info->stream);
+         struct maru_stream_status status;
+         if (stream_status(stream_info, &status))
+            write_avail = status.write_avail;
 
          audio_buf_info audio_info = {
             .bytes      = write_avail,
@@ -540,12 +625,6 @@ static void maru_ioctl(fuse_req_t req, int signed_cmd, void *uarg,
 #ifdef SNDCTL_DSP_SETFRAGMENT
       case SNDCTL_DSP_SETFRAGMENT:
       {
-         if (stream_info->stream != LIBMARU_STREAM_MASTER)
-         {
-            fuse_reply_err(req, EINVAL);
-            break;
-         }
-
          PREP_UARG_INOUT(&i, &i);
          int frags = (i >> 16) & 0xffff;
          int fragsize = 1 << (i & 0xffff);
@@ -556,6 +635,22 @@ static void maru_ioctl(fuse_req_t req, int signed_cmd, void *uarg,
             break;
          }
 
+         if (fragsize != stream_info->fragsize || next_pot(frags) != stream_info->frags)
+         {
+            // A playing stream is resized in place, keeping what has been written so far.
+            if (stream_info->stream != LIBMARU_STREAM_MASTER && !stream_info->flushed)
+            {
+               if (maru_stream_set_buffer(g_state.ctx, stream_info->stream,
+                        fragsize * next_pot(frags), fragsize) != LIBMARU_SUCCESS)
+               {
+                  fuse_reply_err(req, EINVAL);
+                  break;
+               }
+            }
+            else
+               close_flushed_stream(stream_info);
+         }
+
          stream_info->fragsize = fragsize;
          stream_info->frags    = next_pot(frags);
 
@@ -568,13 +663,7 @@ static void maru_ioctl(fuse_req_t req, int signed_cmd, void *uarg,
       case SNDCTL_DSP_GETODELAY:
       {
          PREP_UARG_OUT(&i);
-         maru_usec lat = maru_stream_current_latency(g_state.ctx, stream_info->stream);
-
-         if (lat < 0)
-            i = 0;
-         else
-            i = (lat * stream_info->sample_rate * stream_info->channels * stream_info->bits / 8) / 1000000;
-
+         i = stream_delay(stream_info);
          IOCTL_RETURN(&i);
          break;
       }
@@ -597,14 +686,12 @@ static void maru_ioctl(fuse_req_t req, int signed_cmd, void *uarg,
       case SNDCTL_DSP_GETOPTR:
       {
          size_t driver_write_cnt = 0;
+         struct maru_stream_status status;
 
-         if (stream_info->stream != LIBMARU_STREAM_MASTER)
+         if (stream_status(stream_info, &status))
          {
-            driver_write_cnt   = stream_info->write_cnt;
-            size_t write_avail = maru_stream_write_avail(g_state.ctx, stream_info->stream);
-            
-            driver_write_cnt  += write_avail;
-            driver_write_cnt  -= stream_info->fragsize * stream_info->frags - 1;
+            driver_write_cnt  = stream_info->write_cnt;
+            driver_write_cnt -= status.bytes_buffered;
          }
 
          count_info ci = {
@@ -699,13 +786,21 @@ static void maru_poll(fuse_req_t req, struct fuse_file_info *info,
 
    maru_update_pollhandle(stream_info, ph);
 
+   unsigned revents = 0;
+   size_t avail = 0;
    if (stream_info->error)
-      fuse_reply_poll(req, POLLHUP);
-   else if (stream_info->stream == LIBMARU_STREAM_MASTER ||
-         maru_stream_write_avail(g_state.ctx, stream_info->stream) >= stream_info->fragsize)
-      fuse_reply_poll(req, POLLOUT);
+      revents = POLLHUP;
+   else if (stream_info->stream == LIBMARU_STREAM_MASTER)
+      revents = POLLOUT;
    else
-      fuse_reply_poll(req, 0);
+   {
+      avail = maru_stream_write_avail(g_state.ctx, stream_info->stream);
+      if (avail >= stream_info->fragsize)
+         revents = POLLOUT;
+   }
+
+   CUSE_PROBE4(poll, stream_info->stream, avail, stream_info->fragsize, revents);
+   fuse_reply_poll(req, revents);
 
    pthread_mutex_unlock(&stream_info->lock);
 }
@@ -736,6 +831,8 @@ struct maru_param
    unsigned hw_frags;
    unsigned hw_fragsize;
    unsigned hw_rate;
+
+   unsigned handover;
 };
 
 static const struct fuse_opt maru_opts[] = {
@@ -748,6 +845,7 @@ static const struct fuse_opt maru_opts[] = {
    MARU_OPT("--hw-frags=%u", hw_frags),
    MARU_OPT("--hw-fragsize=%u", hw_fragsize),
    MARU_OPT("--hw-rate=%u", hw_rate),
+   MARU_OPT("--handover", handover),
    FUSE_OPT_KEY("-h", 0),
    FUSE_OPT_KEY("--help", 0),
    FUSE_OPT_KEY("-D", 1),
@@ -765,6 +863,7 @@ static void print_help(void)
    fprintf(stderr, "\t--hw-fragsize=fragsize (default: 4096)\n");
    fprintf(stderr, "\t--hw-rate=rate (default: 48000)\n");
    fprintf(stderr, "\t-D, --daemon, run in background\n");
+   fprintf(stderr, "\t--handover, take over device and open streams from a running cuse-maru\n");
    fprintf(stderr, "\t\tDevice will be created in /dev/$name.\n");
    fprintf(stderr, "\n");
 }
@@ -822,42 +921,63 @@ int main(int argc, char *argv[])
       .dev_minor = param.minor,
       .dev_info_argc = 1,
       .dev_info_argv = dev_info_argv,
-      .flags = CUSE_UNRESTRICTED_IOCTL,
    };
 
-   struct maru_audio_device device;
-   struct maru_audio_device *list;
-   unsigned list_size;
-   maru_error err = maru_list_audio_devices(&list, &list_size);
-   if (err != LIBMARU_SUCCESS || list_size == 0)
+   struct session_handover handover;
+   if (param.handover)
    {
-      MARU_LOG_ERROR(err);
-      return 1;
+      // Streams play on from here, and the CUSE session is picked up below.
+      if (!handover_receive(&handover))
+         return 1;
    }
+   else
+   {
+      struct maru_audio_device device;
+      struct maru_audio_device *list;
+      unsigned list_size;
+      maru_error err = maru_list_audio_devices(&list, &list_size);
+      if (err != LIBMARU_SUCCESS || list_size == 0)
+      {
+         MARU_LOG_ERROR(err);
+         return 1;
+      }
 
-   device = list[0];
-   free(list);
+      device = list[0];
+      free(list);
 
-   err = maru_create_context_from_vid_pid(&g_state.ctx, device.vendor_id, device.product_id,
-         &(const struct maru_stream_desc) { .bits = 16, .channels = 2 });
+      err = maru_create_context_from_vid_pid(&g_state.ctx, device.vendor_id, device.product_id,
+            &(const struct maru_stream_desc) { .bits = 16, .channels = 2 });
 
-   if (err != LIBMARU_SUCCESS)
-   {
-      MARU_LOG_ERROR(err);
-      return 1;
+      if (err != LIBMARU_SUCCESS)
+      {
+         MARU_LOG_ERROR(err);
+         return 1;
+      }
+
+      if (maru_stream_get_volume(g_state.ctx, LIBMARU_STREAM_MASTER,
+               NULL, &g_state.min_volume, &g_state.max_volume, 50000) != LIBMARU_SUCCESS)
+      {
+         return 1;
+      }
    }
 
-   if (maru_stream_get_volume(g_state.ctx, LIBMARU_STREAM_MASTER,
-            NULL, &g_state.min_volume, &g_state.max_volume, 50000) != LIBMARU_SUCCESS)
+   if (!start_control_thread())
+      return 1;
+
+   int multithreaded;
+   struct fuse_session *se = session_setup(args.argc, args.argv, &ci, &maru_op,
+         param.handover ? &handover : NULL, &multithreaded);
+   if (!se)
    {
+      maru_destroy_context(g_state.ctx);
       return 1;
    }
 
-   if (!start_control_thread())
-      return 1;
+   int ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+   session_teardown(se);
 
-   int ret = cuse_lowlevel_main(args.argc, args.argv, &ci, &maru_op, NULL);
+   // Leaves device alone if it has been handed over.
    maru_destroy_context(g_state.ctx);
-   return ret;
+   return ret == -1 ? 1 : 0;
 }
 
@@ -65,6 +65,10 @@ struct cuse_stream_info
    /** Set if SNDCTL_DSP_NONBLOCK has been explicitly called. */
    bool nonblock;
 
+   /** Set if stream has been flushed by SNDCTL_DSP_RESET, and not written to since.
+    * Stream is kept open, but is closed if it is reconfigured. */
+   bool flushed;
+
    /** Number of bytes written to current stream. (Wraps around at 2^32 according to OSS API). */
    uint32_t write_cnt;
 };
@@ -86,6 +90,7 @@ extern struct cuse_maru_state g_state;
 
 bool read_volume(struct cuse_stream_info *stream);
 bool set_volume(struct cuse_stream_info *stream, int vol);
+void set_write_notification(struct cuse_stream_info *stream);
 
 #endif
 
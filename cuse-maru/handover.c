@@ -0,0 +1,228 @@
+/*  cuse-maru - CUSE implementation of Open Sound System using libmaru.
+ *  Copyright (C) 2012 - Hans-Kristian Arntzen
+ *  Copyright (C) 2012 - Agnes Heyer
+ *
+ *  cuse-maru is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  cuse-maru is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with cuse-maru.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "handover.h"
+#include "control.h"
+#include "cuse-maru.h"
+#include <cuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Time for new process to take over before this one carries on.
+#define HANDOVER_TIMEOUT 5000000
+
+#define HANDOVER_STATE_MAGIC 0x4d415255
+#define HANDOVER_STATE_VERSION 1
+
+/** \ingroup internal
+ * \brief State passed along to new process. Both processes run the same build. */
+struct handover_state
+{
+   uint32_t magic;
+   uint32_t version;
+
+   unsigned proto_major;
+   unsigned proto_minor;
+
+   maru_volume min_volume;
+   maru_volume max_volume;
+   int sample_rate;
+   int frags;
+   int fragsize;
+
+   /** Copied as is. Locks and poll handles are set up again by the new process. */
+   struct cuse_stream_info stream_info[MAX_STREAMS];
+};
+
+// Pollers are woken up, so they poll again on the new process.
+static void wake_pollers(void)
+{
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+   {
+      struct cuse_stream_info *info = &g_state.stream_info[i];
+      if (!info->active)
+         continue;
+
+      pthread_mutex_lock(&info->lock);
+
+      if (info->ph)
+      {
+         fuse_lowlevel_notify_poll(info->ph);
+         fuse_pollhandle_destroy(info->ph);
+         info->ph = NULL;
+      }
+
+      pthread_mutex_unlock(&info->lock);
+   }
+}
+
+bool handover_send(int fd)
+{
+   // No requests are being processed from here on, so stream state stays put.
+   session_pause();
+
+   struct session_handover session;
+   session_get_handover(&session);
+
+   struct handover_state *state = calloc(1, sizeof(*state));
+   if (!state)
+   {
+      session_resume();
+      return false;
+   }
+
+   state->magic = HANDOVER_STATE_MAGIC;
+   state->version = HANDOVER_STATE_VERSION;
+   state->proto_major = session.proto_major;
+   state->proto_minor = session.proto_minor;
+
+   pthread_mutex_lock(&g_state.lock);
+   state->min_volume = g_state.min_volume;
+   state->max_volume = g_state.max_volume;
+   state->sample_rate = g_state.sample_rate;
+   state->frags = g_state.frags;
+   state->fragsize = g_state.fragsize;
+   memcpy(state->stream_info, g_state.stream_info, sizeof(state->stream_info));
+   pthread_mutex_unlock(&g_state.lock);
+
+   maru_error err = maru_handover_context(g_state.ctx, fd,
+         state, sizeof(*state), &session.fd, 1, HANDOVER_TIMEOUT);
+   free(state);
+
+   if (err != LIBMARU_SUCCESS)
+   {
+      MARU_LOG_ERROR(err);
+      session_resume();
+      return false;
+   }
+
+   wake_pollers();
+   session_end();
+   return true;
+}
+
+// Runs before anything is taken over, so the old process keeps the device on a mismatch.
+static bool validate_state(const void *data, size_t size, unsigned num_fds, void *userdata)
+{
+   (void)userdata;
+   const struct handover_state *state = data;
+
+   if (size != sizeof(*state) || num_fds != 1 ||
+         state->magic != HANDOVER_STATE_MAGIC || state->version != HANDOVER_STATE_VERSION)
+   {
+      fprintf(stderr, "Handover from incompatible cuse-maru!\n");
+      return false;
+   }
+
+   return true;
+}
+
+static int connect_control_socket(void)
+{
+   struct sockaddr_un un;
+   memset(&un, 0, sizeof(un));
+
+   un.sun_family = AF_UNIX;
+   strncpy(un.sun_path, CONTROL_SOCKET, sizeof(un.sun_path) - 1);
+
+   int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (fd < 0)
+      return -1;
+
+   if (connect(fd, (struct sockaddr*)&un, sizeof(un)) < 0)
+   {
+      close(fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+bool handover_receive(struct session_handover *session)
+{
+   int fd = connect_control_socket();
+   if (fd < 0)
+   {
+      perror("connect");
+      return false;
+   }
+
+   const char *req = "HANDOVER";
+   char msg[64];
+   snprintf(msg, sizeof(msg), "MARU %3zu%s", strlen(req), req);
+   ssize_t len = strlen(msg);
+   if (write(fd, msg, len) != len)
+   {
+      perror("write");
+      close(fd);
+      return false;
+   }
+
+   struct handover_state *state = calloc(1, sizeof(*state));
+   if (!state)
+   {
+      close(fd);
+      return false;
+   }
+
+   size_t size = sizeof(*state);
+   int fds[1];
+   unsigned num_fds = 1;
+
+   maru_error err = maru_create_context_from_handover(&g_state.ctx, fd,
+         state, &size, fds, &num_fds, validate_state, NULL);
+   close(fd);
+
+   if (err != LIBMARU_SUCCESS)
+   {
+      MARU_LOG_ERROR(err);
+      free(state);
+      return false;
+   }
+
+   session->fd = fds[0];
+   session->proto_major = state->proto_major;
+   session->proto_minor = state->proto_minor;
+
+   g_state.min_volume = state->min_volume;
+   g_state.max_volume = state->max_volume;
+   g_state.sample_rate = state->sample_rate;
+   g_state.frags = state->frags;
+   g_state.fragsize = state->fragsize;
+
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+   {
+      struct cuse_stream_info *info = &g_state.stream_info[i];
+      *info = state->stream_info[i];
+      if (!info->active)
+         continue;
+
+      pthread_mutex_init(&info->lock, NULL);
+      info->ph = NULL;
+
+      if (info->stream != LIBMARU_STREAM_MASTER)
+         set_write_notification(info);
+   }
+
+   free(state);
+   return true;
+}
@@ -0,0 +1,40 @@
+/*  cuse-maru - CUSE implementation of Open Sound System using libmaru.
+ *  Copyright (C) 2012 - Hans-Kristian Arntzen
+ *  Copyright (C) 2012 - Agnes Heyer
+ *
+ *  cuse-maru is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  cuse-maru is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with cuse-maru.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HANDOVER_H__
+#define HANDOVER_H__
+
+#include <stdbool.h>
+#include "session.h"
+
+/** \ingroup internal
+ * \brief Hands device, streams and CUSE session over to a new process connected on fd.
+ *
+ * Called from control thread. On success, the session loop has been ended,
+ * and the process should exit after destroying its libmaru context.
+ * On failure, this process carries on.
+ */
+bool handover_send(int fd);
+
+/** \ingroup internal
+ * \brief Takes over from a running cuse-maru through its control socket.
+ *
+ * Sets up g_state, and fills in session so the CUSE session can be picked up.
+ */
+bool handover_receive(struct session_handover *session);
+
+#endif
+
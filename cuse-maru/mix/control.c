@@ -18,6 +18,7 @@
 
 #include "control.h"
 #include "cuse-mix.h"
+#include "protocol.h"
 #include <sys/socket.h>
 #include <pthread.h>
 #include <string.h>
@@ -29,11 +30,80 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
 
+#define MAX_CONNECTIONS 16
+// Room for the largest binary request. Text requests are smaller.
+#define CONNECTION_BUFFER_SIZE (sizeof(struct maru_proto_header) + MARU_PROTO_MAX_PAYLOAD)
+#define REQUEST_MAX_LEN 255
+#define LEVEL_INTERVAL_NSEC (50 * 1000 * 1000)
+
+struct connection
+{
+   int fd;
+   // Mask of MARU_PROTO_EVENT_* pushed to this connection.
+   uint32_t subscriptions;
+
+   // Partial requests are kept here until the rest arrives.
+   size_t buf_size;
+   uint8_t buf[CONNECTION_BUFFER_SIZE];
+};
+
 static int g_epfd;
 static pthread_t g_thread;
 static int listen_fd;
+static int event_fd;
+static int timer_fd;
+
+static struct connection g_conn[MAX_CONNECTIONS];
+
+// Last state pushed to subscribers. Used to find out what changed.
+static struct maru_proto_stream g_published[MAX_STREAMS];
+static unsigned g_published_generation[MAX_STREAMS];
+
+void control_notify(void)
+{
+   eventfd_write(event_fd, 1);
+}
+
+static void update_level_timer(void)
+{
+   bool metering = false;
+   for (unsigned i = 0; i < MAX_CONNECTIONS; i++)
+   {
+      if (g_conn[i].fd >= 0 && (g_conn[i].subscriptions & MARU_PROTO_EVENT_LEVEL))
+         metering = true;
+   }
+
+   __atomic_store_n(&g_state.level_meter, metering, __ATOMIC_RELAXED);
+
+   struct itimerspec spec = {
+      .it_interval = { .tv_nsec = metering ? LEVEL_INTERVAL_NSEC : 0 },
+      .it_value    = { .tv_nsec = metering ? LEVEL_INTERVAL_NSEC : 0 },
+   };
+
+   if (timerfd_settime(timer_fd, 0, &spec, NULL) < 0)
+      perror("timerfd_settime");
+}
+
+static void close_connection(struct connection *conn)
+{
+   if (conn->fd < 0)
+      return;
+
+   close(conn->fd);
+   conn->fd = -1;
+   conn->buf_size = 0;
+
+   if (conn->subscriptions & MARU_PROTO_EVENT_LEVEL)
+   {
+      conn->subscriptions = 0;
+      update_level_timer();
+   }
+   conn->subscriptions = 0;
+}
 
 static void accept_connection(void)
 {
@@ -51,37 +121,320 @@ static void accept_connection(void)
       return;
    }
 
+   struct connection *conn = NULL;
+   for (unsigned i = 0; i < MAX_CONNECTIONS; i++)
+   {
+      if (g_conn[i].fd < 0)
+      {
+         conn = &g_conn[i];
+         break;
+      }
+   }
+
+   if (!conn)
+   {
+      fprintf(stderr, "Too many connections!\n");
+      close(fd);
+      return;
+   }
+
    if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd,
          &(struct epoll_event) {
             .events = POLLIN,
             .data = {
-               .fd = fd
+               .ptr = conn
             },
          }) < 0)
    {
       perror("epoll_ctl");
       close(fd);
+      return;
    }
+
+   conn->fd = fd;
+   conn->subscriptions = 0;
+   conn->buf_size = 0;
+}
+
+static bool write_message(struct connection *conn, const void *msg, size_t size)
+{
+   // Clients that cannot keep up with their subscriptions are dropped, we never block here.
+   if (write(conn->fd, msg, size) != (ssize_t)size)
+   {
+      fprintf(stderr, "Failed to write ...\n");
+      close_connection(conn);
+      return false;
+   }
+
+   return true;
+}
+
+static bool send_message(struct connection *conn, enum maru_proto_type type,
+      const void *payload, size_t size)
+{
+   uint8_t msg[sizeof(struct maru_proto_header) + MARU_PROTO_MAX_PAYLOAD];
+   if (size > sizeof(msg) - sizeof(struct maru_proto_header))
+      return false;
+
+   struct maru_proto_header header = {
+      .magic = MARU_PROTO_MAGIC,
+      .type  = type,
+      .size  = size,
+   };
+
+   memcpy(msg, &header, sizeof(header));
+   memcpy(msg + sizeof(header), payload, size);
+   return write_message(conn, msg, sizeof(header) + size);
+}
+
+static void send_ack(struct connection *conn, uint32_t handled)
+{
+   send_message(conn, MARU_PROTO_ACK, &handled, sizeof(handled));
+}
+
+static void send_nak(struct connection *conn)
+{
+   send_message(conn, MARU_PROTO_NAK, NULL, 0);
 }
 
-static void request_reply(int fd, const char *str)
+static void request_reply(struct connection *conn, const char *str)
 {
    char msg[256];
    snprintf(msg, sizeof(msg), "MARU%4zu %s", strlen(str) + 1, str);
-   ssize_t len = strlen(msg);
-   if (write(fd, msg, len) != len)
+   write_message(conn, msg, strlen(msg));
+}
+
+static unsigned fill_stream(unsigned index, struct maru_proto_stream *out)
+{
+   struct stream_info *info = &g_state.stream_info[index];
+   memset(out, 0, sizeof(*out));
+   out->stream = index;
+
+   stream_lock(info);
+   out->active = info->active;
+   out->volume = info->volume;
+   if (info->active)
+      strncpy(out->name, info->process_name, sizeof(out->name) - 1);
+   unsigned generation = info->generation;
+   stream_unlock(info);
+
+   out->level = __atomic_load_n(&info->level, __ATOMIC_RELAXED);
+   return generation;
+}
+
+static void broadcast_event(uint32_t event, const struct maru_proto_stream *stream)
+{
+   struct maru_proto_event ev = {
+      .event  = event,
+      .stream = *stream,
+   };
+
+   for (unsigned i = 0; i < MAX_CONNECTIONS; i++)
    {
-      fprintf(stderr, "Failed to write ...\n");
-      close(fd);
+      if (g_conn[i].fd >= 0 && (g_conn[i].subscriptions & event))
+         send_message(&g_conn[i], MARU_PROTO_EVENT, &ev, sizeof(ev));
+   }
+}
+
+// Compares current stream state against what was published last time,
+// and pushes open, close and volume events for the difference.
+static void publish_changes(void)
+{
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+   {
+      struct maru_proto_stream cur;
+      unsigned generation = fill_stream(i, &cur);
+      struct maru_proto_stream *old = &g_published[i];
+
+      bool reopened = generation != g_published_generation[i];
+
+      if (old->active && (!cur.active || reopened))
+      {
+         old->active = 0;
+         broadcast_event(MARU_PROTO_EVENT_CLOSE, old);
+      }
+
+      if (cur.active && (!old->active || reopened))
+         broadcast_event(MARU_PROTO_EVENT_OPEN, &cur);
+      else if (cur.active && cur.volume != old->volume)
+         broadcast_event(MARU_PROTO_EVENT_VOLUME, &cur);
+
+      *old = cur;
+      g_published_generation[i] = generation;
+   }
+}
+
+static void publish_levels(void)
+{
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+   {
+      struct maru_proto_stream *old = &g_published[i];
+      uint8_t level = __atomic_load_n(&g_state.stream_info[i].level, __ATOMIC_RELAXED);
+
+      if (old->active && level != old->level)
+      {
+         old->level = level;
+         broadcast_event(MARU_PROTO_EVENT_LEVEL, old);
+      }
+   }
+}
+
+static void request_get_streams(struct connection *conn)
+{
+   struct maru_proto_stream streams[MAX_STREAMS];
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+      fill_stream(i, &streams[i]);
+
+   send_message(conn, MARU_PROTO_STREAMS, streams, sizeof(streams));
+}
+
+static void request_set_volumes(struct connection *conn, const uint8_t *payload, size_t size)
+{
+   if (size % sizeof(struct maru_proto_volume))
+      return send_nak(conn);
+
+   unsigned handled = 0;
+   for (size_t i = 0; i < size; i += sizeof(struct maru_proto_volume))
+   {
+      struct maru_proto_volume vol;
+      memcpy(&vol, payload + i, sizeof(vol));
+
+      if (vol.stream >= MAX_STREAMS || vol.volume > 100)
+         continue;
+
+      struct stream_info *info = &g_state.stream_info[vol.stream];
+      stream_lock(info);
+      if (info->active)
+      {
+         info->volume = vol.volume;
+         info->volume_f = vol.volume / 100.0f;
+         handled++;
+      }
+      stream_unlock(info);
+   }
+
+   send_ack(conn, handled);
+   publish_changes();
+}
+
+static void request_subscribe(struct connection *conn, const uint8_t *payload, size_t size)
+{
+   uint32_t mask;
+   if (size != sizeof(mask))
+      return send_nak(conn);
+
+   memcpy(&mask, payload, sizeof(mask));
+
+   bool level_changed = (mask ^ conn->subscriptions) & MARU_PROTO_EVENT_LEVEL;
+   conn->subscriptions = mask;
+   if (level_changed)
+      update_level_timer();
+
+   send_ack(conn, 1);
+}
+
+static void request_get_stats(struct connection *conn)
+{
+   struct
+   {
+      struct maru_proto_mix_stats mix;
+      struct maru_proto_stream_stats streams[MAX_STREAMS];
+   } __attribute__((packed)) stats;
+
+   const struct mix_stats *mix = &g_state.mix_stats;
+   stats.mix = (struct maru_proto_mix_stats) {
+      .cycles      = stats_get(&mix->cycles),
+      .late_cycles = stats_get(&mix->late_cycles),
+      .deadline_ns = stats_get(&mix->deadline_ns),
+      .last_ns     = stats_get(&mix->last_ns),
+      .max_ns      = stats_get(&mix->max_ns),
+      .total_ns    = stats_get(&mix->total_ns),
+   };
+
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+   {
+      struct stream_info *info = &g_state.stream_info[i];
+      struct maru_proto_stream_stats *out = &stats.streams[i];
+
+      stream_lock(info);
+      *out = (struct maru_proto_stream_stats) {
+         .stream      = i,
+         .active      = info->active,
+         .channels    = info->channels,
+         .bits        = info->bits,
+         .sample_rate = info->sample_rate,
+      };
+      stream_unlock(info);
+
+      out->resample_ns = stats_get(&info->stats.resample_ns);
+      out->convert_ns  = stats_get(&info->stats.convert_ns);
+      out->mix_ns      = stats_get(&info->stats.mix_ns);
+      out->fragments   = stats_get(&info->stats.fragments);
+      out->silent_fragments = stats_get(&info->stats.silent_fragments);
+   }
+
+   send_message(conn, MARU_PROTO_STATS, &stats, sizeof(stats));
+}
+
+static void request_get_trace(struct connection *conn)
+{
+   if (!g_state.trace.enabled)
+      return send_nak(conn);
+
+   struct mix_trace_entry entries[MARU_PROTO_MAX_PAYLOAD / sizeof(struct maru_proto_trace_entry)];
+   unsigned num = mix_trace_read(&g_state.trace, entries,
+         sizeof(entries) / sizeof(entries[0]));
+
+   struct maru_proto_trace_entry out[sizeof(entries) / sizeof(entries[0])];
+   for (unsigned i = 0; i < num; i++)
+   {
+      out[i] = (struct maru_proto_trace_entry) {
+         .time_ns = entries[i].time_ns,
+         .mix_ns  = entries[i].mix_ns,
+         .streams = entries[i].streams,
+         .late    = entries[i].late,
+      };
+   }
+
+   send_message(conn, MARU_PROTO_TRACE, out, num * sizeof(out[0]));
+}
+
+static void parse_binary_request(struct connection *conn, unsigned type,
+      const uint8_t *payload, size_t size)
+{
+   switch (type)
+   {
+      case MARU_PROTO_GET_STREAMS:
+         request_get_streams(conn);
+         break;
+
+      case MARU_PROTO_SET_VOLUMES:
+         request_set_volumes(conn, payload, size);
+         break;
+
+      case MARU_PROTO_SUBSCRIBE:
+         request_subscribe(conn, payload, size);
+         break;
+
+      case MARU_PROTO_GET_STATS:
+         request_get_stats(conn);
+         break;
+
+      case MARU_PROTO_GET_TRACE:
+         request_get_trace(conn);
+         break;
+
+      default:
+         send_nak(conn);
    }
 }
 
-static void request_setplayvol(int fd, int argc, char *argv[])
+static void request_setplayvol(struct connection *conn, int argc, char *argv[])
 {
    if (argc < 2)
    {
       fprintf(stderr, "Invalid request!\n");
-      close(fd);
+      close_connection(conn);
       return;
    }
 
@@ -90,88 +443,92 @@ static void request_setplayvol(int fd, int argc, char *argv[])
    int vol = strtol(argv[1], NULL, 0);
 
    if (errno)
-      return request_reply(fd, "NAK");
+      return request_reply(conn, "NAK");
 
    if (stream >= MAX_STREAMS)
-      return request_reply(fd, "NAK");
+      return request_reply(conn, "NAK");
 
    if (vol < 0 || vol > 100)
-      return request_reply(fd, "NAK");
+      return request_reply(conn, "NAK");
 
    const char *reply;
-   global_lock();
+   struct stream_info *info = &g_state.stream_info[stream];
+   stream_lock(info);
 
-   if (g_state.stream_info[stream].active)
+   if (info->active)
    {
-      g_state.stream_info[stream].volume = vol;
-      g_state.stream_info[stream].volume_f = vol / 100.0f;
+      info->volume = vol;
+      info->volume_f = vol / 100.0f;
       reply = "ACK";
    }
    else
       reply = "NOSTREAM";
 
-   global_unlock();
+   stream_unlock(info);
 
-   request_reply(fd, reply);
+   request_reply(conn, reply);
+   publish_changes();
 }
 
-static void request_getplayvol(int fd, int argc, char *argv[])
+static void request_getplayvol(struct connection *conn, int argc, char *argv[])
 {
    if (argc < 1)
    {
       fprintf(stderr, "Invalid request!\n");
-      close(fd);
+      close_connection(conn);
       return;
    }
 
    errno = 0;
    unsigned stream = strtoul(argv[0], NULL, 0);
    if (errno)
-      return request_reply(fd, "NAK");
+      return request_reply(conn, "NAK");
 
    if (stream >= MAX_STREAMS)
-      return request_reply(fd, "NAK");
+      return request_reply(conn, "NAK");
 
    char vol[16] = "NOSTREAM";
+   struct stream_info *info = &g_state.stream_info[stream];
 
-   global_lock();
+   stream_lock(info);
 
-   if (g_state.stream_info[stream].active)
-      snprintf(vol, sizeof(vol), "%d", g_state.stream_info[stream].volume);
+   if (info->active)
+      snprintf(vol, sizeof(vol), "%d", info->volume);
 
-   global_unlock();
+   stream_unlock(info);
 
-   request_reply(fd, vol);
+   request_reply(conn, vol);
 }
 
-static void request_getname(int fd, int argc, char *argv[])
+static void request_getname(struct connection *conn, int argc, char *argv[])
 {
    if (argc < 1)
    {
       fprintf(stderr, "Invalid request!\n");
-      close(fd);
+      close_connection(conn);
       return;
    }
 
    errno = 0;
    unsigned stream = strtoul(argv[0], NULL, 0);
    if (errno)
-      return request_reply(fd, "NAK");
+      return request_reply(conn, "NAK");
 
    if (stream >= MAX_STREAMS)
-      return request_reply(fd, "NAK");
+      return request_reply(conn, "NAK");
 
    char process[256] = "";
+   struct stream_info *info = &g_state.stream_info[stream];
 
-   global_lock();
-   if (g_state.stream_info[stream].active)
-      strncpy(process, g_state.stream_info[stream].process_name, sizeof(process));
-   global_unlock();
+   stream_lock(info);
+   if (info->active)
+      strncpy(process, info->process_name, sizeof(process));
+   stream_unlock(info);
 
-   request_reply(fd, process);
+   request_reply(conn, process);
 }
 
-static void parse_request(int fd, int argc, char *argv[])
+static void parse_request(struct connection *conn, int argc, char *argv[])
 {
 #if 0
    fprintf(stderr, "Parsing request:\n");
@@ -182,85 +539,131 @@ static void parse_request(int fd, int argc, char *argv[])
    if (!argc)
    {
       fprintf(stderr, "Invalid request ...\n");
-      close(fd);
+      close_connection(conn);
       return;
    }
 
    if (strcmp(argv[0], "SETPLAYVOL") == 0)
-      request_setplayvol(fd, argc - 1, argv + 1);
+      request_setplayvol(conn, argc - 1, argv + 1);
    else if (strcmp(argv[0], "GETPLAYVOL") == 0)
-      request_getplayvol(fd, argc - 1, argv + 1);
+      request_getplayvol(conn, argc - 1, argv + 1);
    else if (strcmp(argv[0], "GETNAME") == 0)
-      request_getname(fd, argc - 1, argv + 1);
+      request_getname(conn, argc - 1, argv + 1);
    else
    {
       fprintf(stderr, "Invalid request!\n");
-      close(fd);
+      close_connection(conn);
    }
 }
 
-static void handle_request(int fd)
+static void parse_text_request(struct connection *conn, const uint8_t *data, size_t size)
 {
-   char req_header[8];
-   ssize_t ret = read(fd, req_header, sizeof(req_header));
-   if (ret < (ssize_t)sizeof(req_header))
-   {
-      close(fd);
-      return;
-   }
+   char request[REQUEST_MAX_LEN + 1];
+   memcpy(request, data, size);
+   request[size] = '\0';
 
-   size_t maru_len = strlen("MARU ");
-   char *substr = memmem(req_header, sizeof(req_header),
-         "MARU ", maru_len);
+   int argc = 0;
+   char *argv[REQUEST_MAX_LEN];
+   char *tok;
 
-   if (!substr)
+   argv[argc] = strtok_r(request, " ", &tok);
+   while (argv[argc])
    {
-      fprintf(stderr, "Invalid proto header!\n");
-      close(fd);
-      return;
+      argc++;
+      argv[argc] = strtok_r(NULL, " ", &tok);
    }
-   substr += maru_len;
 
-   errno = 0;
-   unsigned request_len = strtoul(substr, NULL, 10);
-   if (errno)
+   parse_request(conn, argc, argv);
+}
+
+// Parses one request at the start of data.
+// Returns size of the request, 0 if it is not complete yet, or -1 if invalid.
+static ssize_t parse_frame(struct connection *conn, const uint8_t *data, size_t size)
+{
+   if (size < sizeof(struct maru_proto_header))
+      return 0;
+
+   if (memcmp(data, MARU_PROTO_MAGIC, 4) == 0)
    {
-      fprintf(stderr, "Invalid length!\n");
-      close(fd);
-      return;
-   }
+      struct maru_proto_header header;
+      memcpy(&header, data, sizeof(header));
 
-#define REQUEST_MAX_LEN 255
-   if (request_len > REQUEST_MAX_LEN)
+      size_t frame_size = sizeof(header) + header.size;
+      if (header.size > MARU_PROTO_MAX_PAYLOAD)
+      {
+         fprintf(stderr, "Invalid length!\n");
+         return -1;
+      }
+
+      if (size < frame_size)
+         return 0;
+
+      parse_binary_request(conn, header.type, data + sizeof(header), header.size);
+      return frame_size;
+   }
+   else if (memcmp(data, "MARU", 4) == 0)
    {
-      fprintf(stderr, "Invalid length!\n");
-      close(fd);
-      return;
+      char len_str[5];
+      memcpy(len_str, data + 4, 4);
+      len_str[4] = '\0';
+
+      char *end = NULL;
+      unsigned long request_len = strtoul(len_str, &end, 10);
+      if (end == len_str || request_len > REQUEST_MAX_LEN)
+      {
+         fprintf(stderr, "Invalid length!\n");
+         return -1;
+      }
+
+      size_t frame_size = 8 + request_len;
+      if (size < frame_size)
+         return 0;
+
+      parse_text_request(conn, data + 8, request_len);
+      return frame_size;
    }
 
-   char request[REQUEST_MAX_LEN + 1];
+   fprintf(stderr, "Invalid proto header!\n");
+   return -1;
+}
+
+static void handle_request(struct connection *conn)
+{
+   ssize_t ret = read(conn->fd, conn->buf + conn->buf_size,
+         sizeof(conn->buf) - conn->buf_size);
+
+   if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
 
-   ret = read(fd, request, request_len);
-   if (ret < (ssize_t)request_len)
+   if (ret <= 0)
    {
-      fprintf(stderr, "Couldn't read complete request.\n");
-      close(fd);
+      close_connection(conn);
       return;
    }
-   request[ret] = '\0';
 
-   int argc = 0;
-   char *argv[REQUEST_MAX_LEN];
-   char *tok;
+   conn->buf_size += ret;
 
-   argv[argc] = strtok_r(request, " ", &tok);
-   while (argv[argc])
+   // Handle every complete request we got in one go.
+   size_t consumed = 0;
+   while (conn->fd >= 0)
    {
-      argc++;
-      argv[argc] = strtok_r(NULL, " ", &tok);
+      ssize_t frame = parse_frame(conn, conn->buf + consumed, conn->buf_size - consumed);
+      if (frame < 0)
+      {
+         close_connection(conn);
+         return;
+      }
+      else if (frame == 0)
+         break;
+
+      consumed += frame;
    }
 
-   parse_request(fd, argc, argv);
+   if (conn->fd < 0)
+      return;
+
+   memmove(conn->buf, conn->buf + consumed, conn->buf_size - consumed);
+   conn->buf_size -= consumed;
 }
 
 static void *thread_entry(void *data)
@@ -286,10 +689,23 @@ static void *thread_entry(void *data)
 
       for (int i = 0; i < ret; i++)
       {
-         if (events[i].data.fd == listen_fd)
+         void *ptr = events[i].data.ptr;
+         if (ptr == &listen_fd)
             accept_connection();
+         else if (ptr == &event_fd)
+         {
+            eventfd_t dummy;
+            eventfd_read(event_fd, &dummy);
+            publish_changes();
+         }
+         else if (ptr == &timer_fd)
+         {
+            uint64_t expirations;
+            if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+               publish_levels();
+         }
          else
-            handle_request(events[i].data.fd);
+            handle_request(ptr);
       }
    }
 
@@ -326,8 +742,28 @@ static int create_unix_socket(const char *path)
    return fd;
 }
 
+static bool add_fd(int *fd)
+{
+   if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, *fd,
+            &(struct epoll_event) {
+               .events = POLLIN,
+               .data = {
+                  .ptr = fd
+               }
+            }) < 0)
+   {
+      perror("epoll_ctl");
+      return false;
+   }
+
+   return true;
+}
+
 bool start_control_thread(void)
 {
+   for (unsigned i = 0; i < MAX_CONNECTIONS; i++)
+      g_conn[i].fd = -1;
+
    g_epfd = epoll_create(MAX_EVENTS);
    if (g_epfd < 0)
    {
@@ -339,18 +775,23 @@ bool start_control_thread(void)
    if (listen_fd < 0)
       return false;
 
-   if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, listen_fd,
-            &(struct epoll_event) {
-               .events = POLLIN,
-               .data = {
-                  .fd = listen_fd
-               }
-            }) < 0)
+   event_fd = eventfd(0, EFD_NONBLOCK);
+   if (event_fd < 0)
    {
-      perror("epoll_ctl");
+      perror("eventfd");
       return false;
    }
 
+   timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+   if (timer_fd < 0)
+   {
+      perror("timerfd_create");
+      return false;
+   }
+
+   if (!add_fd(&listen_fd) || !add_fd(&event_fd) || !add_fd(&timer_fd))
+      return false;
+
    if (pthread_create(&g_thread, NULL, thread_entry, NULL) < 0)
    {
       perror("pthread_create");
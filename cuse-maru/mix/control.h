@@ -21,5 +21,8 @@
 
 bool start_control_thread(void);
 
+// Wakes up control thread to push open, close and volume changes to subscribers.
+void control_notify(void);
+
 #endif
 
@@ -18,6 +18,7 @@
 #include "../utils.h"
 #include "cuse-mix.h"
 #include "mixthread.h"
+#include "reserve.h"
 #include "control.h"
 
 #include <sys/soundcard.h>
@@ -53,6 +54,16 @@ void global_unlock(void)
    pthread_mutex_unlock(&g_state.lock);
 }
 
+void stream_lock(struct stream_info *info)
+{
+   pthread_mutex_lock(&info->lock);
+}
+
+void stream_unlock(struct stream_info *info)
+{
+   pthread_mutex_unlock(&info->lock);
+}
+
 static bool set_hw_formats(void)
 {
    int fragshift = 0;
@@ -144,7 +155,10 @@ static void maru_open(fuse_req_t req, struct fuse_file_info *info)
    {
       if (!g_state.stream_info[i].active)
       {
+         // Held until the stream is filled in, so control clients never see a half-opened stream.
+         stream_lock(&g_state.stream_info[i]);
          g_state.stream_info[i].active = true;
+         g_state.stream_info[i].generation++;
          info->fh = i;
          found = true;
          break;
@@ -160,6 +174,7 @@ static void maru_open(fuse_req_t req, struct fuse_file_info *info)
 
    struct stream_info *stream_info = &g_state.stream_info[info->fh];
 
+   memset(&stream_info->stats, 0, sizeof(stream_info->stats));
    stream_info->sample_rate = g_state.format.sample_rate;
    stream_info->channels = g_state.format.channels;
    stream_info->bits = g_state.format.bits;
@@ -176,37 +191,57 @@ static void maru_open(fuse_req_t req, struct fuse_file_info *info)
       get_process_name(stream_info->process_name,
             sizeof(stream_info->process_name), ctx->pid);
    }
+   stream_unlock(stream_info);
 
+   control_notify();
    fuse_reply_open(req, info);
 }
 
-static bool init_stream(struct stream_info *stream_info)
+// Returns 0, or an errno value if stream could not be set up.
+static int init_stream(struct stream_info *stream_info)
 {
    maru_fifo *fifo = maru_fifo_new(stream_info->frags * stream_info->fragsize);
    if (!fifo)
-      return false;
+      return ENOMEM;
 
    stream_info->sync_fd = eventfd(0, 0);
    if (stream_info->sync_fd < 0)
    {
       maru_fifo_free(fifo);
-      return false;
+      return ENOMEM;
    }
 
    maru_fifo_set_read_trigger(fifo, g_state.format.fragsize);
 
    if (stream_info->sample_rate != g_state.format.sample_rate)
    {
-      stream_info->src = resampler_init(fifo,
-            stream_info->sample_rate, g_state.format.sample_rate);
+      if (g_state.fixed_point)
+         stream_info->src_q15 = resampler_q15_init(stream_info->sample_rate,
+               g_state.format.sample_rate);
+      else
+         stream_info->src = resampler_init(stream_info->sample_rate,
+               g_state.format.sample_rate);
 
-      if (!stream_info->src)
+      if (!stream_info->src && !stream_info->src_q15)
       {
+         close(stream_info->sync_fd);
          maru_fifo_free(fifo);
-         return false;
+         return ENOMEM;
       }
    }
 
+   // A resampled stream which would make the mixer miss its deadline is refused.
+   if (!reserve_join(stream_info->src || stream_info->src_q15))
+   {
+      resampler_free(stream_info->src);
+      resampler_q15_free(stream_info->src_q15);
+      stream_info->src = NULL;
+      stream_info->src_q15 = NULL;
+      close(stream_info->sync_fd);
+      maru_fifo_free(fifo);
+      return EBUSY;
+   }
+
    stream_info->fifo = fifo;
 
    epoll_ctl(g_state.epfd, EPOLL_CTL_ADD, maru_fifo_read_notify_fd(fifo),
@@ -217,7 +252,7 @@ static bool init_stream(struct stream_info *stream_info)
             }
          });
 
-   return true;
+   return 0;
 }
 
 static void reset_stream(struct stream_info *stream_info)
@@ -236,12 +271,19 @@ static void reset_stream(struct stream_info *stream_info)
    maru_fifo_free(fifo);
 
    eventfd_write(g_state.ping_fd, 1);
+   reserve_leave(stream_info->src || stream_info->src_q15);
 
    if (stream_info->src)
    {
       resampler_free(stream_info->src);
       stream_info->src = NULL;
    }
+
+   if (stream_info->src_q15)
+   {
+      resampler_q15_free(stream_info->src_q15);
+      stream_info->src_q15 = NULL;
+   }
 }
 
 static void maru_write(fuse_req_t req, const char *data, size_t size,
@@ -249,10 +291,14 @@ static void maru_write(fuse_req_t req, const char *data, size_t size,
 {
    struct stream_info *stream_info = &g_state.stream_info[info->fh];
 
-   if (!stream_info->fifo && !init_stream(stream_info))
+   if (!stream_info->fifo)
    {
-      fuse_reply_err(req, ENOMEM);
-      return;
+      int err = init_stream(stream_info);
+      if (err)
+      {
+         fuse_reply_err(req, err);
+         return;
+      }
    }
 
    ssize_t ret;
@@ -277,22 +323,102 @@ static void maru_write(fuse_req_t req, const char *data, size_t size,
 
 static void maru_update_pollhandle(struct stream_info *info, struct fuse_pollhandle *ph)
 {
-   struct fuse_pollhandle *tmp_ph = info->ph;
-   info->ph = ph;
+   struct fuse_pollhandle *tmp_ph = __atomic_exchange_n(&info->ph, ph, __ATOMIC_SEQ_CST);
    if (tmp_ph)
       fuse_pollhandle_destroy(tmp_ph);
 }
 
-void stream_poll_signal(struct stream_info *info)
+// Called from mixer thread after a stream has been read from.
+// A pollhandle is only held while the stream has less than fragsize writable
+// (see maru_poll()), so queuing it here means write_avail crossed fragsize.
+// Returns true if a pollhandle was queued for the poll thread.
+bool stream_poll_queue(struct stream_info *info)
 {
-   global_lock();
-   if (info->ph)
+   if (!__atomic_load_n(&info->ph, __ATOMIC_SEQ_CST))
+      return false;
+
+   if (maru_fifo_write_avail(info->fifo) < info->fragsize)
+      return false;
+
+   struct fuse_pollhandle *ph = __atomic_exchange_n(&info->ph, NULL, __ATOMIC_SEQ_CST);
+   if (!ph)
+      return false;
+
+   // A handle still queued is superseded, notifying the newest wakes the same poller.
+   struct fuse_pollhandle *old_ph = __atomic_exchange_n(&info->notify_ph, ph, __ATOMIC_SEQ_CST);
+   if (old_ph)
+      fuse_pollhandle_destroy(old_ph);
+
+   return true;
+}
+
+// Wakes up the poll thread. Never blocks.
+// If the pipe is full, a wakeup is already pending, and it will pick up what was queued.
+void stream_poll_signal(void)
+{
+   char dummy = 0;
+   if (write(g_state.poll_fd[1], &dummy, sizeof(dummy)) < 0 && errno != EAGAIN)
+      perror("write");
+}
+
+static void *poll_thread_entry(void *data)
+{
+   (void)data;
+
+   for (;;)
+   {
+      // Drain every pending wakeup at once, they are coalesced.
+      char dummy[64];
+      ssize_t ret = read(g_state.poll_fd[0], dummy, sizeof(dummy));
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+            continue;
+
+         perror("read");
+         exit(1);
+      }
+
+      for (unsigned i = 0; i < MAX_STREAMS; i++)
+      {
+         struct fuse_pollhandle *ph = __atomic_exchange_n(&g_state.stream_info[i].notify_ph,
+               NULL, __ATOMIC_SEQ_CST);
+
+         if (ph)
+         {
+            fuse_lowlevel_notify_poll(ph);
+            fuse_pollhandle_destroy(ph);
+         }
+      }
+   }
+
+   return NULL;
+}
+
+static bool start_poll_thread(void)
+{
+   if (pipe(g_state.poll_fd) < 0)
    {
-      fuse_lowlevel_notify_poll(info->ph);
-      fuse_pollhandle_destroy(info->ph);
-      info->ph = NULL;
+      perror("pipe");
+      return false;
    }
-   global_unlock();
+
+   if (fcntl(g_state.poll_fd[1], F_SETFL,
+            fcntl(g_state.poll_fd[1], F_GETFL) | O_NONBLOCK) < 0)
+   {
+      perror("fcntl");
+      return false;
+   }
+
+   pthread_t thread;
+   if (pthread_create(&thread, NULL, poll_thread_entry, NULL) < 0)
+   {
+      perror("pthread_create");
+      return false;
+   }
+
+   pthread_detach(thread);
+   return true;
 }
 
 static void maru_poll(fuse_req_t req, struct fuse_file_info *info,
@@ -300,12 +426,15 @@ static void maru_poll(fuse_req_t req, struct fuse_file_info *info,
 {
    struct stream_info *stream_info = &g_state.stream_info[info->fh];
 
-   global_lock();
+   // Register pollhandle before checking, so we cannot miss the mixer thread draining the fifo.
    maru_update_pollhandle(stream_info, ph);
-   global_unlock();
 
    if (!stream_info->fifo || maru_fifo_write_avail(stream_info->fifo) >= stream_info->fragsize)
+   {
+      // Ready right away. No need to keep the pollhandle around.
+      maru_update_pollhandle(stream_info, NULL);
       fuse_reply_poll(req, POLLOUT);
+   }
    else
       fuse_reply_poll(req, 0);
 }
@@ -314,12 +443,28 @@ static void maru_poll(fuse_req_t req, struct fuse_file_info *info,
 // It seems that memory is mapped directly between two different processes.
 // Since ioctl() does not contain any size information for its arguments, we first have to tell it how much
 // memory we want to map between the two different processes, then ask it to call ioctl() again.
-static bool ioctl_prep_uarg(fuse_req_t req,
+static bool ioctl_prep_uarg(fuse_req_t req, unsigned flags,
       void *in, size_t in_size,
       void *out, size_t out_size,
       void *uarg,
       const void *in_buf, size_t in_bufsize, size_t out_bufsize)
 {
+   // With restricted ioctls, the kernel has already mapped what the command encodes,
+   // and retrying is not allowed. Arguments not encoded are simply not passed.
+   if (!(flags & FUSE_IOCTL_UNRESTRICTED))
+   {
+      if ((in && in_bufsize && in_bufsize != in_size) ||
+            (out && out_bufsize && out_bufsize != out_size))
+      {
+         fuse_reply_err(req, EINVAL);
+         return true;
+      }
+
+      if (in && in_bufsize)
+         memcpy(in, in_buf, in_size);
+      return false;
+   }
+
    bool retry = false;
    struct iovec in_iov = {};
    struct iovec out_iov = {};
@@ -358,7 +503,7 @@ static bool ioctl_prep_uarg(fuse_req_t req,
 }
 
 #define IOCTL_RETURN(addr) do { \
-   fuse_reply_ioctl(req, 0, addr, sizeof(*(addr))); \
+   fuse_reply_ioctl(req, 0, addr, out_bufsize ? sizeof(*(addr)) : 0); \
 } while(0)
 
 #define IOCTL_RETURN_NULL() do { \
@@ -366,7 +511,7 @@ static bool ioctl_prep_uarg(fuse_req_t req,
 } while(0)
 
 #define PREP_UARG(inp, inp_s, outp, outp_s) do { \
-   if (ioctl_prep_uarg(req, inp, inp_s, \
+   if (ioctl_prep_uarg(req, flags, inp, inp_s, \
             outp, outp_s, uarg, \
             in_buf, in_bufsize, out_bufsize)) \
       return; \
@@ -596,13 +741,12 @@ static void maru_ioctl(fuse_req_t req, int signed_cmd, void *uarg,
 #ifdef SNDCTL_DSP_GETOPTR
       case SNDCTL_DSP_GETOPTR:
       {
-         global_lock();
+         uint64_t write_cnt = __atomic_load_n(&stream_info->write_cnt, __ATOMIC_RELAXED);
          count_info ci = {
-            .bytes  = stream_info->write_cnt,
-            .blocks = stream_info->write_cnt / stream_info->fragsize,
-            .ptr    = stream_info->write_cnt % (stream_info->fragsize * stream_info->frags),
+            .bytes  = write_cnt,
+            .blocks = write_cnt / stream_info->fragsize,
+            .ptr    = write_cnt % (stream_info->fragsize * stream_info->frags),
          };
-         global_unlock();
 
          PREP_UARG_OUT(&ci);
          IOCTL_RETURN(&ci);
@@ -624,10 +768,11 @@ static void maru_ioctl(fuse_req_t req, int signed_cmd, void *uarg,
          else if (i < 0)
             i = 0;
 
-         global_lock();
+         stream_lock(stream_info);
          stream_info->volume = i;
          stream_info->volume_f = i / 100.0f;
-         global_unlock();
+         stream_unlock(stream_info);
+         control_notify();
 
          i |= i << 8;
 
@@ -671,20 +816,19 @@ static void maru_release(fuse_req_t req, struct fuse_file_info *info)
    struct stream_info *stream_info = &g_state.stream_info[info->fh];
 
    reset_stream(stream_info);
+   maru_update_pollhandle(stream_info, NULL);
 
-   if (stream_info->ph)
-      fuse_pollhandle_destroy(stream_info->ph);
-
-   // Keep volume for stream.
-   int vol = stream_info->volume;
-   float vol_f = stream_info->volume_f;
-
+   // Keep volume for stream. Format is reinitialized in maru_open().
    global_lock();
-   memset(stream_info, 0, sizeof(*stream_info));
-   stream_info->volume = vol;
-   stream_info->volume_f = vol_f;
+   stream_lock(stream_info);
+   stream_info->active = false;
+   stream_info->process_name[0] = '\0';
+   stream_info->nonblock = false;
+   stream_info->write_cnt = 0;
+   stream_unlock(stream_info);
    global_unlock();
 
+   control_notify();
    fuse_reply_err(req, 0);
 }
 
@@ -702,6 +846,11 @@ struct maru_param
 
    unsigned sw_frags;
    unsigned sw_fragsize;
+
+   int trace;
+   int skip_idle;
+   int fixed_point;
+   unsigned deadline;
 };
 
 static const struct fuse_opt maru_opts[] = {
@@ -717,6 +866,10 @@ static const struct fuse_opt maru_opts[] = {
    MARU_OPT("--sw-frags=%u", sw_frags),
    MARU_OPT("--sw-fragsize=%u", sw_fragsize),
    MARU_OPT("--hw-rate=%u", hw_rate),
+   MARU_OPT("--trace", trace),
+   MARU_OPT("--skip-idle", skip_idle),
+   MARU_OPT("--fixed-point", fixed_point),
+   MARU_OPT("--deadline=%u", deadline),
    FUSE_OPT_KEY("-h", 0),
    FUSE_OPT_KEY("--help", 0),
    FUSE_OPT_KEY("-D", 1),
@@ -736,6 +889,10 @@ static void print_help(void)
    fprintf(stderr, "\t--sw-frags=frags (default: 4)\n");
    fprintf(stderr, "\t--sw-fragsize=fragsize (default: 4096)\n");
    fprintf(stderr, "\t--hw-rate=rate (default: 48000)\n");
+   fprintf(stderr, "\t--trace, record mixer cycle timings for the control socket\n");
+   fprintf(stderr, "\t--skip-idle, do not write to sink while all streams are silent\n");
+   fprintf(stderr, "\t--fixed-point, resample and mix in Q15 fixed point instead of float\n");
+   fprintf(stderr, "\t--deadline=percent, run mixer with SCHED_DEADLINE, reserving at most percent of a fragment period\n");
    fprintf(stderr, "\t-D, --daemon, run in background\n");
    fprintf(stderr, "\t\tDevice will be created in /dev/$name.\n");
    fprintf(stderr, "\n");
@@ -764,7 +921,7 @@ static const struct cuse_lowlevel_ops maru_op = {
    .release = maru_release,
 };
 
-static bool init_cuse_mix(const char *sink_name)
+static bool init_cuse_mix(const char *sink_name, unsigned deadline)
 {
    g_state.dev = open(sink_name, O_WRONLY);
    if (g_state.dev < 0)
@@ -806,10 +963,22 @@ static bool init_cuse_mix(const char *sink_name)
 
    for (unsigned i = 0; i < MAX_STREAMS; i++)
    {
+      if (pthread_mutex_init(&g_state.stream_info[i].lock, NULL) < 0)
+      {
+         perror("pthread_mutex_init");
+         return false;
+      }
+
       g_state.stream_info[i].volume = 100;
       g_state.stream_info[i].volume_f = 1.0f;
    }
 
+   if (!start_poll_thread())
+      return false;
+
+   if (deadline && !reserve_init(deadline))
+      return false;
+
    if (!start_mix_thread())
       return false;
 
@@ -845,6 +1014,9 @@ int main(int argc, char *argv[])
    g_state.format.sw_frags    = next_pot(param.sw_frags);
    g_state.format.sw_fragsize = next_pot(param.sw_fragsize);
    g_state.format.sample_rate = param.hw_rate;
+   g_state.trace.enabled      = param.trace;
+   g_state.skip_idle          = param.skip_idle;
+   g_state.fixed_point        = param.fixed_point;
 
    snprintf(dev_name, sizeof(dev_name), "DEVNAME=%s",
          param.dev_name ? param.dev_name : "marumix");
@@ -854,10 +1026,9 @@ int main(int argc, char *argv[])
       .dev_minor = param.minor,
       .dev_info_argc = 1,
       .dev_info_argv = dev_info_argv,
-      .flags = CUSE_UNRESTRICTED_IOCTL,
    };
 
-   if (!init_cuse_mix(param.sink_name ? param.sink_name : "/dev/maru"))
+   if (!init_cuse_mix(param.sink_name ? param.sink_name : "/dev/maru", param.deadline))
       return 1;
 
    return cuse_lowlevel_main(args.argc, args.argv, &ci, &maru_op, NULL);
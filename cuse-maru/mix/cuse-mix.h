@@ -19,8 +19,12 @@
 
 #include <libmaru/fifo.h>
 #include "resampler.h"
+#include "stats.h"
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+
+struct fuse_pollhandle;
 
 struct stream_info
 {
@@ -28,7 +32,15 @@ struct stream_info
    maru_fifo *fifo;
    char process_name[256];
 
+   // Per-stream lock. Guards volume and process name,
+   // so control requests do not have to serialize on the global lock.
+   pthread_mutex_t lock;
+
+   // Pending pollhandle. Only accessed with atomic exchanges
+   // so that the mixer thread never has to take a lock to signal it.
    struct fuse_pollhandle *ph;
+   // Pollhandle queued by the mixer thread, waiting for the poll thread to notify it.
+   struct fuse_pollhandle *notify_ph;
    int sync_fd;
 
    int sample_rate;
@@ -42,9 +54,19 @@ struct stream_info
    int volume;
    float volume_f;
 
+   // Peak level of last mixed fragment (0 - 100). Written by mixer thread
+   // only while level metering is enabled.
+   uint8_t level;
+   // Bumped on every open so control clients can tell a reopened stream apart.
+   unsigned generation;
+
+   struct stream_stats stats;
+
    bool nonblock;
 
+   // Resampler of the float or fixed-point pipeline, if stream rate differs from sink.
    maru_resampler_t *src;
+   maru_resampler_q15_t *src_q15;
 };
 
 struct global
@@ -52,8 +74,19 @@ struct global
    int dev;
    int epfd;
    int ping_fd;
+   int poll_fd[2];
    pthread_mutex_t lock;
 
+   // Set by control thread when a client subscribed to level events.
+   bool level_meter;
+   // Do not write to sink while all streams are silent.
+   bool skip_idle;
+   // Resample and mix in Q15 fixed point instead of float.
+   bool fixed_point;
+
+   struct mix_stats mix_stats;
+   struct mix_trace trace;
+
    struct
    {
       int fragsize;
@@ -77,7 +110,11 @@ extern struct global g_state;
 void global_lock(void);
 void global_unlock(void);
 
-void stream_poll_signal(struct stream_info *info);
+void stream_lock(struct stream_info *info);
+void stream_unlock(struct stream_info *info);
+
+bool stream_poll_queue(struct stream_info *info);
+void stream_poll_signal(void);
 
 #endif
 
@@ -4,37 +4,61 @@ from gi.repository import Gtk, GObject
 import socket, os, sys, fcntl, array, struct
 
 class Connection:
-   def __init__(self, sock):
+   # See protocol.h.
+   HEADER = struct.Struct('=4sHH')
+   STREAM = struct.Struct('=BBBB64s')
+   EVENT = struct.Struct('=I')
+
+   GET_STREAMS = 1
+   SET_VOLUMES = 2
+   SUBSCRIBE = 3
+   STREAMS = 66
+   EVENT_MSG = 67
+
+   EVENT_ALL = 0xf
+
+   def __init__(self, sock, callback):
       self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
       self.sock.connect(sock)
+      self.callback = callback
+      self.buf = b''
 
-   def get_reply(self):
-      reply = self.sock.recv(8)
-      length = int(reply.decode().split(" ")[-1])
-      return self.sock.recv(length)
+      GObject.io_add_watch(self.sock, GObject.IO_IN, self.readable)
+      self.send(self.SUBSCRIBE, struct.pack('=I', self.EVENT_ALL))
+      self.send(self.GET_STREAMS, b'')
+
+   def send(self, msg_type, payload):
+      self.sock.send(self.HEADER.pack(b'MARB', msg_type, len(payload)) + payload)
 
    def set_volume(self, stream, vol):
-      command = "SETPLAYVOL {} {}".format(stream, vol)
-      message = "MARU{:4} {}".format(len(command) + 1, command)
-      self.sock.send(message.encode())
+      self.send(self.SET_VOLUMES, struct.pack('=BB', stream, vol))
+
+   def parse_stream(self, data):
+      stream, active, vol, level, name = self.STREAM.unpack(data)
+      name = name.split(b'\0')[0].decode(errors = 'replace')
+      return stream, bool(active), vol, level, os.path.basename(name)
 
-      return self.get_reply()
+   def readable(self, source, condition):
+      data = self.sock.recv(4096)
+      if not data:
+         return False
 
-   def get_volume(self, stream):
-      command = "GETPLAYVOL {}".format(stream)
-      message = "MARU{:4} {}".format(len(command) + 1, command)
-      self.sock.send(message.encode())
+      self.buf += data
+      while len(self.buf) >= self.HEADER.size:
+         magic, msg_type, size = self.HEADER.unpack_from(self.buf)
+         if len(self.buf) < self.HEADER.size + size:
+            break
 
-      reply = self.get_reply()
-      vol = int(reply.decode().split(" ")[-1])
-      return vol
+         payload = self.buf[self.HEADER.size:self.HEADER.size + size]
+         self.buf = self.buf[self.HEADER.size + size:]
 
-   def get_name(self, stream):
-      command = "GETNAME {}".format(stream)
-      message = "MARU{:4} {}".format(len(command) + 1, command)
-      self.sock.send(message.encode())
+         if msg_type == self.STREAMS:
+            for off in range(0, size, self.STREAM.size):
+               self.callback(self.parse_stream(payload[off:off + self.STREAM.size]))
+         elif msg_type == self.EVENT_MSG:
+            self.callback(self.parse_stream(payload[self.EVENT.size:]))
 
-      return self.get_reply().decode().split(" ")[-1]
+      return True
 
 class MasterControl(Gtk.HBox):
    def __init__(self, path):
@@ -47,7 +71,6 @@ class MasterControl(Gtk.HBox):
       self.scale.set_size_request(200, -1)
       self.scale.set_round_digits(0)
       self.scale.set_sensitive(False)
-      self.scale.connect("value-changed", self.vol_change)
 
       self.setplayvol = 0xc0045018 # IOCTL stuff
       self.getplayvol = 0x80045018 # IOCTL stuff
@@ -56,7 +79,14 @@ class MasterControl(Gtk.HBox):
 
       self.pack_start(self.scale, True, True, 20)
 
-      self.update_timer()
+      # Master volume only changes through us, no need to poll it.
+      try:
+         self.scale.set_value(self.get_volume())
+         self.scale.set_sensitive(True)
+      except:
+         self.scale.set_sensitive(False)
+
+      self.scale.connect("value-changed", self.vol_change)
 
    def set_volume(self, vol):
       buf = array.array('i', [vol])
@@ -70,21 +100,14 @@ class MasterControl(Gtk.HBox):
    def vol_change(self, widget):
       self.set_volume(int(self.scale.get_value()))
 
-   def update_timer(self):
-      try:
-         self.scale.set_value(self.get_volume())
-         self.scale.set_sensitive(True)
-      except:
-         self.scale.set_sensitive(False)
-         self.scale.set_value(0)
-
-      GObject.timeout_add_seconds(5, self.update_timer)
-
 class Control(Gtk.VBox):
-   def __init__(self, conn, i):
+   def __init__(self, i):
       Gtk.VBox.__init__(self)
       self.scale = Gtk.VScale()
       self.process = Gtk.Label()
+      self.level = Gtk.ProgressBar()
+      self.level.set_orientation(Gtk.Orientation.VERTICAL)
+      self.level.set_inverted(True)
       self.pack_start(self.process, False, True, 10)
       self.scale.set_range(0, 100)
       self.scale.set_value(0)
@@ -92,33 +115,34 @@ class Control(Gtk.VBox):
       self.scale.set_round_digits(0)
       self.set_size_request(25, -1)
       self.scale.set_inverted(True)
-      self.scale.set_sensitive(False)
-      self.pack_start(self.scale, True, True, 10)
+
+      hbox = Gtk.HBox()
+      hbox.pack_start(self.scale, True, True, 0)
+      hbox.pack_start(self.level, False, True, 0)
+      self.pack_start(hbox, True, True, 10)
+
       self.i = i
-      self.conn = conn
+      self.conn = None
+      self.updating = False
 
       self.scale.connect("value-changed", self.vol_change)
-      self.update_timer()
 
    def vol_change(self, widget):
-      self.conn.set_volume(self.i, int(self.scale.get_value()))
+      if self.conn and not self.updating:
+         self.conn.set_volume(self.i, int(self.scale.get_value()))
 
-   def update_timer(self):
-      try:
-         self.scale.set_value(self.conn.get_volume(self.i))
-         self.process.set_text(self.conn.get_name(self.i))
-         self.scale.set_sensitive(True)
-      except:
-         self.scale.set_sensitive(False)
-         self.process.set_text("")
-         self.scale.set_value(0)
-
-      GObject.timeout_add(100, self.update_timer)
+   def update(self, vol, level, name):
+      self.updating = True
+      self.scale.set_value(vol)
+      self.updating = False
+      self.level.set_fraction(level / 100.0)
+      self.process.set_text(name)
 
 class Window(Gtk.Window):
+   MAX_STREAMS = 16
+
    def __init__(self):
       Gtk.Window.__init__(self, title = "MARU Volume Control")
-      self.conn = Connection("/tmp/maru")
       self.set_border_width(5)
 
       vbox = Gtk.VBox()
@@ -127,21 +151,34 @@ class Window(Gtk.Window):
       vbox.pack_start(Gtk.HSeparator(), False, True, 3)
 
       box = Gtk.HBox()
-
-      box.pack_start(Control(self.conn, 0), True, True, 3)
-      box.pack_start(Gtk.VSeparator(), False, True, 3)
-      box.pack_start(Control(self.conn, 1), True, True, 3)
-      box.pack_start(Gtk.VSeparator(), False, True, 3)
-      box.pack_start(Control(self.conn, 2), True, True, 3)
-      box.pack_start(Gtk.VSeparator(), False, True, 3)
-      box.pack_start(Control(self.conn, 3), True, True, 3)
+      self.controls = [Control(i) for i in range(self.MAX_STREAMS)]
+      for control in self.controls:
+         box.pack_start(control, True, True, 3)
+         control.set_no_show_all(True)
 
       vbox.pack_start(box, True, True, 0)
       self.add(vbox)
 
+      # Controls are shown and updated as the mixer pushes events, nothing is polled.
+      self.conn = Connection("/tmp/marumix", self.stream_update)
+      for control in self.controls:
+         control.conn = self.conn
+
+   def stream_update(self, stream):
+      i, active, vol, level, name = stream
+      if i >= len(self.controls):
+         return
+
+      control = self.controls[i]
+      if active:
+         control.update(vol, level, name)
+         control.set_no_show_all(False)
+         control.show_all()
+      else:
+         control.hide()
+
 if __name__ == '__main__':
    win = Window()
    win.connect("delete-event", Gtk.main_quit)
    win.show_all()
    Gtk.main()
-
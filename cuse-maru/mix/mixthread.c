@@ -16,6 +16,7 @@
 
 #include "cuse-mix.h"
 #include "mixthread.h"
+#include "reserve.h"
 #include "utils.h"
 #include <string.h>
 #include <unistd.h>
@@ -28,6 +29,7 @@
 #include <pthread.h>
 #include <sys/soundcard.h>
 #include <sys/ioctl.h>
+#include <time.h>
 
 static pthread_t g_thread;
 
@@ -48,22 +50,146 @@ static bool write_all(int fd, const void *data_, size_t size)
    return true;
 }
 
-static void mix_streams(const struct epoll_event *events, size_t num_events,
+static bool region_is_silent(const struct maru_fifo_locked_region *region)
+{
+   return audio_is_silent(region->first, region->first_size / sizeof(int16_t)) &&
+      (!region->second || audio_is_silent(region->second, region->second_size / sizeof(int16_t)));
+}
+
+// Feeds resampler from the stream fifo. Missing input is padded with silence.
+// Returns number of bytes read from fifo.
+// If output is silent, *silent is set and data is not written to.
+static size_t resample_fifo(struct stream_info *info, float *data, size_t frames, bool *silent)
+{
+   size_t needed_frames = resampler_required_input(info->src, frames);
+   size_t needed_size = needed_frames * 2 * sizeof(int16_t); // Hardcode for stereo 16-bit.
+
+   float conv_buf[2 * needed_frames + 2];
+
+   size_t avail = maru_fifo_read_avail(info->fifo);
+   if (avail > needed_size)
+      avail = needed_size;
+
+   struct maru_fifo_locked_region region;
+   maru_fifo_read_lock(info->fifo, avail, &region);
+
+   // Silent input only needs to advance resampler, which is nearly free once filter is flushed.
+   if (region_is_silent(&region))
+   {
+      maru_fifo_read_unlock(info->fifo, &region);
+
+      size_t consumed;
+      *silent = resampler_process_silence(info->src, data, frames, &consumed);
+      return avail;
+   }
+
+   *silent = false;
+
+   audio_convert_s16_to_float(conv_buf,
+         region.first,
+         region.first_size / sizeof(int16_t));
+
+   if (region.second)
+   {
+      audio_convert_s16_to_float(conv_buf + region.first_size / sizeof(int16_t),
+            region.second,
+            region.second_size / sizeof(int16_t));
+   }
+
+   maru_fifo_read_unlock(info->fifo, &region);
+
+   // conv_buf holds floats, so pad by samples, not by bytes of input.
+   size_t read_samples = avail / sizeof(int16_t);
+   memset(conv_buf + read_samples, 0,
+         (needed_size / sizeof(int16_t) - read_samples) * sizeof(float));
+
+   size_t consumed, produced;
+   resampler_process(info->src, conv_buf, needed_frames, &consumed, data, frames, &produced);
+
+   return avail;
+}
+
+// Fixed-point counterpart of resample_fifo(). Input is copied as is.
+static size_t resample_fifo_q15(struct stream_info *info, int16_t *data, size_t frames, bool *silent)
+{
+   size_t needed_frames = resampler_q15_required_input(info->src_q15, frames);
+   size_t needed_size = needed_frames * 2 * sizeof(int16_t); // Hardcode for stereo 16-bit.
+
+   int16_t conv_buf[2 * needed_frames + 2];
+
+   size_t avail = maru_fifo_read_avail(info->fifo);
+   if (avail > needed_size)
+      avail = needed_size;
+
+   struct maru_fifo_locked_region region;
+   maru_fifo_read_lock(info->fifo, avail, &region);
+
+   if (region_is_silent(&region))
+   {
+      maru_fifo_read_unlock(info->fifo, &region);
+
+      size_t consumed;
+      *silent = resampler_q15_process_silence(info->src_q15, data, frames, &consumed);
+      return avail;
+   }
+
+   *silent = false;
+
+   memcpy(conv_buf, region.first, region.first_size);
+   if (region.second)
+      memcpy((uint8_t*)conv_buf + region.first_size, region.second, region.second_size);
+
+   maru_fifo_read_unlock(info->fifo, &region);
+
+   memset((uint8_t*)conv_buf + avail, 0, needed_size - avail);
+
+   size_t consumed, produced;
+   resampler_q15_process(info->src_q15, conv_buf, needed_frames, &consumed, data, frames, &produced);
+
+   return avail;
+}
+
+// Reads a fragment of a stream that needs no resampling into buf, padding it with silence.
+// Returns number of bytes read from fifo.
+static size_t read_fifo(struct stream_info *info, int16_t *buf, size_t fragsize, bool *silent)
+{
+   ssize_t has_read = maru_fifo_read(info->fifo, buf, fragsize);
+   if (has_read < 0)
+      has_read = 0;
+
+   *silent = audio_is_silent(buf, has_read / sizeof(int16_t));
+   if (!*silent)
+      memset((uint8_t*)buf + has_read, 0, fragsize - has_read);
+
+   return has_read;
+}
+
+// Returns false if every stream was silent, and mix_buffer only holds silence.
+static bool mix_streams(const struct epoll_event *events, size_t num_events,
       int16_t *mix_buffer,
       size_t fragsize)
 {
    size_t samples = fragsize / (g_state.format.bits / 8);
 
-   float tmp_mix_buffer_f[samples] AUDIO_ALIGNED;
+   // Float pipeline converts streams to float right away.
+   // Fixed-point pipeline keeps them in s16, and mixes into 32-bit integers.
+   bool fixed = g_state.fixed_point;
+
+   float tmp_mix_buffer_f[fixed ? 1 : samples] AUDIO_ALIGNED;
    int16_t tmp_mix_buffer_i[samples] AUDIO_ALIGNED;
-   float mix_buffer_f[samples] AUDIO_ALIGNED;
+   float mix_buffer_f[fixed ? 1 : samples] AUDIO_ALIGNED;
+   int32_t mix_buffer_q[fixed ? samples : 1] AUDIO_ALIGNED;
+
+   if (fixed)
+      memset(mix_buffer_q, 0, sizeof(mix_buffer_q));
+   else
+      memset(mix_buffer_f, 0, sizeof(mix_buffer_f));
 
-   memset(mix_buffer_f, 0, sizeof(mix_buffer_f));
+   bool poll_queued = false;
+   bool active = false;
 
    for (unsigned i = 0; i < num_events; i++)
    {
-      memset(tmp_mix_buffer_f, 0, sizeof(tmp_mix_buffer_f));
-
       struct stream_info *info = events[i].data.ptr;
 
       // We were pinged, clear eventfd.
@@ -74,25 +200,30 @@ static void mix_streams(const struct epoll_event *events, size_t num_events,
          continue;
       }
 
-      if (info->src)
-      {
-         size_t has_read = resampler_process(info->src,
-               tmp_mix_buffer_f,
-               samples / info->channels);
+      uint64_t start_ns = stats_time_ns();
+      uint64_t start_cpu_ns = reserve_time_ns();
+      bool silent;
+      size_t has_read;
 
-         info->write_cnt += has_read;
-      }
+      if (info->src)
+         has_read = resample_fifo(info, tmp_mix_buffer_f, samples / info->channels, &silent);
+      else if (info->src_q15)
+         has_read = resample_fifo_q15(info, tmp_mix_buffer_i, samples / info->channels, &silent);
       else
       {
-         ssize_t has_read = maru_fifo_read(info->fifo, tmp_mix_buffer_i, fragsize);
+         has_read = read_fifo(info, tmp_mix_buffer_i, fragsize, &silent);
+         if (!silent && !fixed)
+            audio_convert_s16_to_float(tmp_mix_buffer_f, tmp_mix_buffer_i, samples);
+      }
 
-         if (has_read > 0)
-            info->write_cnt += has_read;
+      __atomic_add_fetch(&info->write_cnt, has_read, __ATOMIC_RELAXED);
 
-         audio_convert_s16_to_float(tmp_mix_buffer_f, tmp_mix_buffer_i, samples);
-      }
+      uint64_t converted_ns = stats_time_ns();
+      stats_add(info->src || info->src_q15 ? &info->stats.resample_ns : &info->stats.convert_ns,
+            converted_ns - start_ns);
 
-      stream_poll_signal(info);
+      if (stream_poll_queue(info))
+         poll_queued = true;
 
       if (maru_fifo_read_notify_ack(info->fifo) != LIBMARU_SUCCESS)
       {
@@ -102,23 +233,94 @@ static void mix_streams(const struct epoll_event *events, size_t num_events,
          eventfd_write(info->sync_fd, 1);
       }
 
-      audio_mix_volume(mix_buffer_f, tmp_mix_buffer_f, info->volume_f, samples);
+      if (silent)
+      {
+         __atomic_store_n(&info->level, 0, __ATOMIC_RELAXED);
+         stats_add(&info->stats.silent_fragments, 1);
+         stats_add(&info->stats.fragments, 1);
+         continue;
+      }
+
+      active = true;
+
+      if (__atomic_load_n(&g_state.level_meter, __ATOMIC_RELAXED))
+      {
+         float peak = fixed ?
+            audio_peak_s16(tmp_mix_buffer_i, samples) / (float)0x8000 :
+            audio_peak(tmp_mix_buffer_f, samples);
+
+         peak *= info->volume_f;
+         __atomic_store_n(&info->level,
+               peak >= 1.0f ? 100 : (uint8_t)(peak * 100.0f), __ATOMIC_RELAXED);
+      }
+
+      if (fixed)
+      {
+         audio_mix_volume_s16(mix_buffer_q, tmp_mix_buffer_i,
+               (int32_t)(info->volume_f * 0x8000 + 0.5f), samples);
+      }
+      else
+         audio_mix_volume(mix_buffer_f, tmp_mix_buffer_f, info->volume_f, samples);
+
+      uint64_t end_ns = stats_time_ns();
+      stats_add(&info->stats.mix_ns, end_ns - converted_ns);
+      stats_add(&info->stats.fragments, 1);
+
+      // Silent fragments are nearly free, so only these count towards the worst case.
+      reserve_record_stream(info->src || info->src_q15, reserve_time_ns() - start_cpu_ns);
    }
 
-   audio_convert_float_to_s16(mix_buffer, mix_buffer_f, samples);
+   if (active)
+   {
+      if (fixed)
+         audio_convert_s32_to_s16(mix_buffer, mix_buffer_q, samples);
+      else
+         audio_convert_float_to_s16(mix_buffer, mix_buffer_f, samples);
+   }
+
+   // Signal all streams at once. Actual notification happens in a separate thread.
+   if (poll_queued)
+      stream_poll_signal();
+   return active;
+}
+
+// Stands in for the blocking write to the sink while it is skipped,
+// so streams are still drained in real time.
+static void wait_idle_period(uint64_t *next_ns, uint64_t period_ns)
+{
+   uint64_t now_ns = stats_time_ns();
+   if (*next_ns < now_ns)
+      *next_ns = now_ns;
+
+   *next_ns += period_ns;
+
+   struct timespec tv = {
+      .tv_sec  = *next_ns / UINT64_C(1000000000),
+      .tv_nsec = *next_ns % UINT64_C(1000000000),
+   };
+
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tv, NULL) == EINTR);
 }
 
 static void *thread_entry(void *data)
 {
    (void)data;
 
-   int16_t *mix_buffer = malloc(g_state.format.fragsize);
+   int16_t *mix_buffer = calloc(1, g_state.format.fragsize);
    if (!mix_buffer)
    {
       fprintf(stderr, "Failed to allocate mixbuffer.\n");
       exit(1);
    }
 
+   unsigned frame_size = g_state.format.channels * g_state.format.bits / 8;
+   g_state.mix_stats.deadline_ns = UINT64_C(1000000000) *
+      (g_state.format.fragsize / frame_size) / g_state.format.sample_rate;
+
+   uint64_t idle_next_ns = 0;
+
+   reserve_start();
+
    for (;;)
    {
       struct epoll_event events[MAX_STREAMS];
@@ -133,7 +335,20 @@ static void *thread_entry(void *data)
          exit(1);
       }
 
-      mix_streams(events, ret, mix_buffer, g_state.format.fragsize);
+      uint64_t start_ns = stats_time_ns();
+      uint64_t start_cpu_ns = reserve_time_ns();
+      bool active = mix_streams(events, ret, mix_buffer, g_state.format.fragsize);
+      uint64_t mix_ns = stats_time_ns() - start_ns;
+      stats_record_cycle(&g_state.mix_stats, &g_state.trace, start_ns, mix_ns, ret);
+      reserve_record_cycle(reserve_time_ns() - start_cpu_ns);
+
+      if (!active && g_state.skip_idle)
+      {
+         wait_idle_period(&idle_next_ns, g_state.mix_stats.deadline_ns);
+         continue;
+      }
+
+      idle_next_ns = 0;
 
       if (!write_all(g_state.dev, mix_buffer, g_state.format.fragsize))
       {
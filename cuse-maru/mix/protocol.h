@@ -0,0 +1,122 @@
+/*  cuse-maru - CUSE implementation of Open Sound System using libmaru.
+ *  Copyright (C) 2012 - Hans-Kristian Arntzen
+ *  Copyright (C) 2012 - Agnes Heyer
+ *
+ *  cuse-maru is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  cuse-maru is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with cuse-maru.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MARU_PROTOCOL_H__
+#define MARU_PROTOCOL_H__
+
+#include <stdint.h>
+
+// Binary control protocol for the cuse-mix control socket.
+//
+// Every message starts with a struct maru_proto_header, followed by size bytes of payload.
+// All fields are in host byte order as the socket is local only.
+// Several messages may be sent back-to-back in a single write.
+//
+// The old text protocol ("MARU <len> <command>") is still accepted on the same socket.
+
+#define MARU_PROTO_MAGIC "MARB"
+
+// Largest payload of any message.
+#define MARU_PROTO_MAX_PAYLOAD 4096
+
+struct maru_proto_header
+{
+   char magic[4];
+   uint16_t type;
+   uint16_t size;
+} __attribute__((packed));
+
+enum maru_proto_type
+{
+   // Client -> server.
+   MARU_PROTO_GET_STREAMS = 1, // No payload. Replied with MARU_PROTO_STREAMS.
+   MARU_PROTO_SET_VOLUMES = 2, // Array of struct maru_proto_volume. Replied with ACK or NAK.
+   MARU_PROTO_SUBSCRIBE   = 3, // uint32_t mask of MARU_PROTO_EVENT_*. 0 unsubscribes. Replied with ACK.
+   MARU_PROTO_GET_STATS   = 4, // No payload. Replied with MARU_PROTO_STATS.
+   MARU_PROTO_GET_TRACE   = 5, // No payload. Replied with MARU_PROTO_TRACE, or NAK if tracing is disabled.
+
+   // Server -> client.
+   MARU_PROTO_ACK         = 64, // uint32_t number of items handled.
+   MARU_PROTO_NAK         = 65, // No payload.
+   MARU_PROTO_STREAMS     = 66, // Array of MAX_STREAMS struct maru_proto_stream.
+   MARU_PROTO_EVENT       = 67, // struct maru_proto_event.
+   MARU_PROTO_STATS       = 68, // struct maru_proto_mix_stats, followed by MAX_STREAMS struct maru_proto_stream_stats.
+   MARU_PROTO_TRACE       = 69, // Array of struct maru_proto_trace_entry, oldest first.
+};
+
+#define MARU_PROTO_EVENT_OPEN   (1 << 0)
+#define MARU_PROTO_EVENT_CLOSE  (1 << 1)
+#define MARU_PROTO_EVENT_VOLUME (1 << 2)
+#define MARU_PROTO_EVENT_LEVEL  (1 << 3)
+
+#define MARU_PROTO_NAME_SIZE 64
+
+struct maru_proto_volume
+{
+   uint8_t stream;
+   uint8_t volume; // 0 - 100
+} __attribute__((packed));
+
+struct maru_proto_stream
+{
+   uint8_t stream;
+   uint8_t active;
+   uint8_t volume; // 0 - 100
+   uint8_t level;  // Peak level of last mixed fragment, 0 - 100.
+   char name[MARU_PROTO_NAME_SIZE];
+} __attribute__((packed));
+
+struct maru_proto_event
+{
+   uint32_t event; // A single MARU_PROTO_EVENT_*.
+   struct maru_proto_stream stream;
+} __attribute__((packed));
+
+// Times are in nanoseconds, counters are totals since start of mixer (or opening of stream).
+struct maru_proto_mix_stats
+{
+   uint64_t cycles;
+   uint64_t late_cycles;
+   uint64_t deadline_ns;
+   uint64_t last_ns;
+   uint64_t max_ns;
+   uint64_t total_ns;
+} __attribute__((packed));
+
+struct maru_proto_stream_stats
+{
+   uint8_t stream;
+   uint8_t active;
+   uint8_t channels;
+   uint8_t bits;
+   uint32_t sample_rate;
+   uint64_t resample_ns;
+   uint64_t convert_ns;
+   uint64_t mix_ns;
+   uint64_t fragments;
+   uint64_t silent_fragments;
+} __attribute__((packed));
+
+struct maru_proto_trace_entry
+{
+   uint64_t time_ns; // CLOCK_MONOTONIC when mixing cycle started.
+   uint32_t mix_ns;
+   uint16_t streams;
+   uint16_t late;
+} __attribute__((packed));
+
+#endif
+
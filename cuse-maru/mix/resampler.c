@@ -26,10 +26,20 @@
 #include <assert.h>
 #include <malloc.h>
 
-#if __SSE__
+#if __AVX__
+#include <immintrin.h>
+#elif __SSE__
 #include <xmmintrin.h>
 #endif
 
+#if __SSSE3__
+#include <tmmintrin.h>
+#elif __SSE2__
+#include <emmintrin.h>
+#elif __ARM_NEON__ || __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #define PHASE_BITS 8
 #define SUBPHASE_BITS 16
 
@@ -46,21 +56,148 @@
 #define TAPS (SIDELOBES * 2)
 #define CUTOFF 0.9
 
+// Taps of a stage are scaled to its ratio, in steps of eight for the kernels.
+#define MIN_TAPS 16
+#define MAX_TAPS (TAPS * 2)
+
 #define PHASE_INDEX 0
 #define DELTA_INDEX 1
 
-struct maru_resampler
-{
-   float phase_table[PHASES][2][2 * SIDELOBES];
-   float buffer_l[2 * TAPS];
-   float buffer_r[2 * TAPS];
+// Half-band stages in a cascade. Each halves or doubles the rate.
+#define MAX_STAGES 8
+
+// Frames handed from one stage to the next at a time.
+#define STAGE_FRAMES 512
+
+// Output frames computed per kernel call. 4, 8 or 16.
+#ifndef RESAMPLER_BLOCK
+#define RESAMPLER_BLOCK 8
+#endif
 
-   unsigned ptr;
+#if RESAMPLER_BLOCK != 4 && RESAMPLER_BLOCK != 8 && RESAMPLER_BLOCK != 16
+#error "RESAMPLER_BLOCK must be 4, 8 or 16."
+#endif
+
+// Input history is kept linear, so every output frame of a block can see its own window.
+// Once full, the last taps frames are moved back to the start.
+#define HISTORY (MAX_TAPS + 512)
+
+#define FRAC_MASK (PHASES_WRAP - 1)
+
+// Position in input, shared by the float and fixed-point resamplers.
+struct resampler_clock
+{
+   // Input frames in history. Window of the next output frame ends here.
+   unsigned pos;
 
    uint32_t ratio;
    uint32_t time;
 
-   maru_fifo *fifo;
+   unsigned taps;
+
+   // Number of silent frames last pushed into filter, saturates at taps.
+   unsigned silent_frames;
+};
+
+enum stage_kind
+{
+   STAGE_FRACTIONAL,
+   STAGE_HALVE,
+   STAGE_DOUBLE,
+};
+
+// Filter of one stage. Cutoff is relative to nyquist of the input rate.
+// Half-band stages have their cutoff at nyquist of the lower rate, and only count taps which are not zero.
+struct stage_design
+{
+   enum stage_kind kind;
+   unsigned in_rate;
+   unsigned out_rate;
+   unsigned taps;
+   double cutoff;
+};
+
+// One sinc filter, converting between the rates of its design.
+// Phase table holds [PHASES][2][taps] coefficients.
+struct sinc_stage
+{
+   float buffer_l[HISTORY];
+   float buffer_r[HISTORY];
+   float *phase_table;
+
+   struct resampler_clock clock;
+};
+
+// Same filter with Q15 coefficients and s16 history.
+// Delta table holds the difference to the next phase, which is scaled by a Q15 subphase.
+struct sinc_stage_q15
+{
+   int16_t buffer_l[HISTORY];
+   int16_t buffer_r[HISTORY];
+   int16_t *phase_table;
+
+   struct resampler_clock clock;
+};
+
+// Half-band filter halving or doubling the rate, on top of a sinc stage with a single phase.
+// Taps at even distances from the center are zero, apart from the center itself, which is 0.5.
+// The sinc stage holds the taps at odd distances, and works out their part of each output frame.
+// Doubling, every other output frame falls on the center tap, and is a copy of input.
+// Halving, history of the sinc stage only holds the odd input frames. Even ones are kept here for the center tap.
+struct halfband_stage
+{
+   struct sinc_stage sinc;
+   float center_l[HISTORY];
+   float center_r[HISTORY];
+};
+
+struct halfband_stage_q15
+{
+   struct sinc_stage_q15 sinc;
+   int16_t center_l[HISTORY];
+   int16_t center_r[HISTORY];
+};
+
+// Stage of a chain, with what the chain needs to drive it.
+struct chain_stage
+{
+   void *data;
+   struct resampler_clock *clock;
+
+   // Runs the stage on exactly the input it needs for out_frames. With in set to NULL, input is silence.
+   void (*process)(void *data, const void *in, size_t in_frames, void *out, size_t out_frames);
+   void (*free)(void *data);
+};
+
+// Stages run one after another, shared by the float and fixed-point resamplers.
+// Large ratios are brought within a factor of two by half-band stages, and a fractional stage does the rest.
+struct resampler_chain
+{
+   unsigned num_stages;
+   struct chain_stage stages[MAX_STAGES + 1];
+   size_t frame_size;
+
+   // Output of a stage, until the next one has consumed it.
+   void *buffer[2];
+};
+
+struct maru_resampler
+{
+   struct resampler_chain chain;
+};
+
+struct maru_resampler_q15
+{
+   struct resampler_chain chain;
+};
+
+// Output frames gathered for one kernel call.
+struct sinc_block
+{
+   unsigned frames;
+   // Start of window in history, and fraction of time selecting the filter phase.
+   unsigned start[RESAMPLER_BLOCK];
+   uint32_t frac[RESAMPLER_BLOCK];
 };
 
 static inline double sinc(double val)
@@ -76,192 +213,1447 @@ static inline double lanzcos(double phase)
    return sinc(phase);
 }
 
-static void init_sinc_table(struct maru_resampler *resamp)
+// Filter coefficient of tap j at phase p (0.0 - 1.0).
+static double sinc_window(const struct stage_design *design, double p, int j)
+{
+   int sidelobes = design->taps / 2;
+   double sinc_phase = M_PI * (p + (sidelobes - 1 - j));
+   return design->cutoff * sinc(design->cutoff * sinc_phase) * lanzcos(sinc_phase / sidelobes);
+}
+
+static inline unsigned round_taps(double taps)
+{
+   unsigned ret = ((unsigned)ceil(taps) + 7) & ~7u;
+   return ret < MIN_TAPS ? MIN_TAPS : (ret > MAX_TAPS ? MAX_TAPS : ret);
+}
+
+// Designs the filter of a stage in a conversion from in_rate to out_rate.
+// Audio up to CUTOFF of the lower nyquist survives the conversion.
+//
+// The fractional stage always works at the lower nyquist, so it defines the passband.
+// Its cutoff is scaled to the ratio, with taps scaled along so the transition band keeps its width.
+// That is TAPS taps at a ratio of one, giving a transition band of (1 - CUTOFF) / 2 of nyquist.
+//
+// A half-band stage has its transition band centered on the lower nyquist.
+// If it works at the lower nyquist of the conversion, it gets the same width as the fractional stage.
+// Anything else only has to keep the passband away from what folds into it,
+// so its transition band spans from the passband to the mirror image of it. That takes far fewer taps.
+static void design_stage(struct stage_design *design, unsigned in_rate, unsigned out_rate)
+{
+   unsigned lowest = design->in_rate < design->out_rate ? design->in_rate : design->out_rate;
+   unsigned overall = in_rate < out_rate ? in_rate : out_rate;
+
+   if (design->kind == STAGE_FRACTIONAL)
+   {
+      // Upsampling leaves lowest at in_rate, so cutoff and taps are what a single stage always had.
+      // Downsampling by any ratio, even below two, has its cutoff lowered to the output nyquist.
+      design->cutoff = CUTOFF * lowest / design->in_rate;
+      design->taps = round_taps((double)TAPS * design->in_rate / lowest);
+   }
+   else if (lowest == overall)
+   {
+      design->cutoff = (double)lowest / design->in_rate;
+      design->taps = TAPS;
+   }
+   else
+   {
+      // Taps which are not zero are every other one at the higher rate,
+      // so there are as many of them as of a filter at the lower rate.
+      double passband = CUTOFF * overall / 2.0;
+      design->cutoff = (double)lowest / design->in_rate;
+      design->taps = round_taps(TAPS * (1.0 - CUTOFF) / 4.0 * lowest / (lowest / 2.0 - passband));
+   }
+}
+
+static void add_stage(struct stage_design *designs, unsigned *stages,
+      enum stage_kind kind, unsigned in_rate, unsigned out_rate)
+{
+   designs[*stages].kind = kind;
+   designs[*stages].in_rate = in_rate;
+   designs[*stages].out_rate = out_rate;
+   (*stages)++;
+}
+
+// Plans stages of a conversion. Returns number of stages.
+// The fractional stage runs where the rate is lowest, as it needs the most taps.
+// Downsampling first halves the rate while it stays at least twice the output rate.
+// Upsampling converts to the output rate halved as often as it stays above input rate, and doubles from there.
+// The fractional stage is left out if half-band stages connect the rates by themselves.
+static unsigned design_stages(struct stage_design *designs, unsigned in_rate, unsigned out_rate)
+{
+   unsigned stages = 0;
+   unsigned rate = in_rate;
+
+   for (; stages < MAX_STAGES && rate >= 2 * out_rate && !(rate & 1); rate /= 2)
+      add_stage(designs, &stages, STAGE_HALVE, rate, rate / 2);
+
+   unsigned doublings = 0;
+   unsigned mid_rate = out_rate;
+   while (doublings < MAX_STAGES && !(mid_rate & 1) && mid_rate / 2 >= rate)
+   {
+      mid_rate /= 2;
+      doublings++;
+   }
+
+   if (rate != mid_rate || (!stages && !doublings))
+      add_stage(designs, &stages, STAGE_FRACTIONAL, rate, mid_rate);
+
+   for (rate = mid_rate; doublings; doublings--, rate *= 2)
+      add_stage(designs, &stages, STAGE_DOUBLE, rate, rate * 2);
+
+   for (unsigned i = 0; i < stages; i++)
+      design_stage(&designs[i], in_rate, out_rate);
+
+   return stages;
+}
+
+// Tap i of a half-band filter with taps at odd distances from its center.
+static double halfband_tap(const struct stage_design *design, unsigned i)
+{
+   double phase = M_PI * (2.0 * i + 1.0 - design->taps);
+   return 0.5 * sinc(0.5 * phase) * lanzcos(phase / design->taps);
+}
+
+static inline const float *stage_table(const struct sinc_stage *stage, unsigned phase, unsigned index)
+{
+   return stage->phase_table + (2 * phase + index) * stage->clock.taps;
+}
+
+static inline const int16_t *stage_table_q15(const struct sinc_stage_q15 *stage, unsigned phase, unsigned index)
+{
+   return stage->phase_table + (2 * phase + index) * stage->clock.taps;
+}
+
+static void init_sinc_table(float *table, const struct stage_design *design)
 {
+   unsigned taps = design->taps;
+
    // Sinc phases: [..., p + 3, p + 2, p + 1, p + 0, p - 1, p - 2, p - 3, p - 4, ...]
    for (int i = 0; i < PHASES; i++)
    {
-      for (int j = 0; j < 2 * SIDELOBES; j++)
-      {
-         double p = (double)i / PHASES;
-         double sinc_phase = M_PI * (p + (SIDELOBES - 1 - j));
-         resamp->phase_table[i][PHASE_INDEX][j] = CUTOFF * sinc(CUTOFF * sinc_phase) * lanzcos(sinc_phase / SIDELOBES);
-      }
+      for (int j = 0; j < taps; j++)
+         table[(2 * i + PHASE_INDEX) * taps + j] = sinc_window(design, (double)i / PHASES, j);
    }
 
    // Optimize linear interpolation.
    for (int i = 0; i < PHASES - 1; i++)
    {
-      for (int j = 0; j < 2 * SIDELOBES; j++)
+      for (int j = 0; j < taps; j++)
       {
-         resamp->phase_table[i][DELTA_INDEX][j] =
-            (resamp->phase_table[i + 1][PHASE_INDEX][j] - resamp->phase_table[i][PHASE_INDEX][j]) / SUBPHASES;
+         table[(2 * i + DELTA_INDEX) * taps + j] =
+            (table[(2 * i + 2 + PHASE_INDEX) * taps + j] - table[(2 * i + PHASE_INDEX) * taps + j]) / SUBPHASES;
       }
    }
 
    // Interpolation between [PHASES - 1] => [PHASES] 
-   for (int j = 0; j < TAPS; j++)
+   for (int j = 0; j < taps; j++)
    {
-      double p = 1.0;
-      double sinc_phase = M_PI * (p + (SIDELOBES - 1 - j));
-      double phase = CUTOFF * sinc(CUTOFF * sinc_phase) * lanzcos(sinc_phase / SIDELOBES);
+      double phase = sinc_window(design, 1.0, j);
 
-      float result = (phase - resamp->phase_table[PHASES - 1][PHASE_INDEX][j]) / SUBPHASES;
-      resamp->phase_table[PHASES - 1][DELTA_INDEX][j] = result;
+      float result = (phase - table[(2 * (PHASES - 1) + PHASE_INDEX) * taps + j]) / SUBPHASES;
+      table[(2 * (PHASES - 1) + DELTA_INDEX) * taps + j] = result;
    }
 }
 
-#if __SSE__
-static void process_sinc(struct maru_resampler *resamp, float * restrict out_buffer)
+static int16_t to_q15(double val)
+{
+   long q = lrint(val * 0x8000);
+   return q > 0x7fff ? 0x7fff : (q < -0x8000 ? -0x8000 : q);
+}
+
+static void init_sinc_table_q15(int16_t *table, const struct stage_design *design)
 {
-   __m128 sum_l = _mm_setzero_ps();
-   __m128 sum_r = _mm_setzero_ps();
+   unsigned taps = design->taps;
 
-   const float *buffer_l = resamp->buffer_l + resamp->ptr;
-   const float *buffer_r = resamp->buffer_r + resamp->ptr;
+   for (int i = 0; i < PHASES; i++)
+   {
+      for (int j = 0; j < taps; j++)
+      {
+         int16_t phase = to_q15(sinc_window(design, (double)i / PHASES, j));
+         int16_t next  = to_q15(sinc_window(design, (double)(i + 1) / PHASES, j));
+         table[(2 * i + PHASE_INDEX) * taps + j] = phase;
+         table[(2 * i + DELTA_INDEX) * taps + j] = next - phase;
+      }
+   }
+}
 
-   unsigned phase = resamp->time >> PHASES_SHIFT;
-   unsigned delta = (resamp->time >> SUBPHASES_SHIFT) & SUBPHASES_MASK;
-   __m128 delta_f = _mm_set1_ps(delta);
+#if __AVX__
+// Same as the SSE kernel below, eight taps at a time.
+// Halves of each accumulator are folded together before the transpose.
+static inline void process_sinc_4(const struct sinc_stage *stage,
+      const unsigned *start, const uint32_t *frac, float *out)
+{
+   unsigned taps = stage->clock.taps;
+   __m256 l0 = _mm256_setzero_ps(), l1 = _mm256_setzero_ps(), l2 = _mm256_setzero_ps(), l3 = _mm256_setzero_ps();
+   __m256 r0 = _mm256_setzero_ps(), r1 = _mm256_setzero_ps(), r2 = _mm256_setzero_ps(), r3 = _mm256_setzero_ps();
 
-   const float *phase_table = resamp->phase_table[phase][PHASE_INDEX];
-   const float *delta_table = resamp->phase_table[phase][DELTA_INDEX];
+   const float *buffer_l = stage->buffer_l;
+   const float *buffer_r = stage->buffer_r;
 
-   for (unsigned i = 0; i < TAPS; i += 4)
+   const float *phase_table[4], *delta_table[4];
+   __m256 delta_f[4];
+   for (unsigned n = 0; n < 4; n++)
    {
-      __m128 buf_l  = _mm_loadu_ps(buffer_l + i);
-      __m128 buf_r  = _mm_loadu_ps(buffer_r + i);
+      unsigned phase = frac[n] >> PHASES_SHIFT;
+      delta_f[n]     = _mm256_set1_ps((frac[n] >> SUBPHASES_SHIFT) & SUBPHASES_MASK);
+      phase_table[n] = stage_table(stage, phase, PHASE_INDEX);
+      delta_table[n] = stage_table(stage, phase, DELTA_INDEX);
+   }
+
+#if __FMA__
+#define MADD(a, b, c) _mm256_fmadd_ps(a, b, c)
+#else
+#define MADD(a, b, c) _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#endif
 
-      __m128 phases = _mm_load_ps(phase_table + i);
-      __m128 deltas = _mm_load_ps(delta_table + i);
+#define SINC(n) MADD(_mm256_load_ps(delta_table[n] + i), delta_f[n], _mm256_load_ps(phase_table[n] + i))
 
-      __m128 sinc   = _mm_add_ps(phases, _mm_mul_ps(deltas, delta_f));
+#define ACCUM(n, sinc) \
+   do { \
+      l##n = MADD(_mm256_loadu_ps(buffer_l + start[n] + i), sinc, l##n); \
+      r##n = MADD(_mm256_loadu_ps(buffer_r + start[n] + i), sinc, r##n); \
+   } while (0)
 
-      sum_l         = _mm_add_ps(sum_l, _mm_mul_ps(buf_l, sinc));
-      sum_r         = _mm_add_ps(sum_r, _mm_mul_ps(buf_r, sinc));
+   if (frac[0] == frac[1] && frac[0] == frac[2] && frac[0] == frac[3])
+   {
+      for (unsigned i = 0; i < taps; i += 8)
+      {
+         __m256 sinc = SINC(0);
+         ACCUM(0, sinc);
+         ACCUM(1, sinc);
+         ACCUM(2, sinc);
+         ACCUM(3, sinc);
+      }
+   }
+   else
+   {
+      for (unsigned i = 0; i < taps; i += 8)
+      {
+         ACCUM(0, SINC(0));
+         ACCUM(1, SINC(1));
+         ACCUM(2, SINC(2));
+         ACCUM(3, SINC(3));
+      }
    }
 
-   // Them annoying shuffles :V
-   // sum_l = { l3, l2, l1, l0 }
-   // sum_r = { r3, r2, r1, r0 }
+#undef ACCUM
+#undef SINC
+#undef MADD
+
+#define FOLD(v) _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1))
+   __m128 sl0 = FOLD(l0), sl1 = FOLD(l1), sl2 = FOLD(l2), sl3 = FOLD(l3);
+   __m128 sr0 = FOLD(r0), sr1 = FOLD(r1), sr2 = FOLD(r2), sr3 = FOLD(r3);
+#undef FOLD
+
+   _MM_TRANSPOSE4_PS(sl0, sl1, sl2, sl3);
+   _MM_TRANSPOSE4_PS(sr0, sr1, sr2, sr3);
+   __m128 sum_l = _mm_add_ps(_mm_add_ps(sl0, sl1), _mm_add_ps(sl2, sl3));
+   __m128 sum_r = _mm_add_ps(_mm_add_ps(sr0, sr1), _mm_add_ps(sr2, sr3));
+
+   _mm_storeu_ps(out + 0, _mm_unpacklo_ps(sum_l, sum_r));
+   _mm_storeu_ps(out + 4, _mm_unpackhi_ps(sum_l, sum_r));
+}
+#elif __SSE__
+// Accumulates four output frames side by side, so there is no reduction per frame.
+// The four partial sums of each frame are added up with a single transpose at the end.
+static inline void process_sinc_4(const struct sinc_stage *stage,
+      const unsigned *start, const uint32_t *frac, float *out)
+{
+   unsigned taps = stage->clock.taps;
+   __m128 l0 = _mm_setzero_ps(), l1 = _mm_setzero_ps(), l2 = _mm_setzero_ps(), l3 = _mm_setzero_ps();
+   __m128 r0 = _mm_setzero_ps(), r1 = _mm_setzero_ps(), r2 = _mm_setzero_ps(), r3 = _mm_setzero_ps();
+
+   const float *buffer_l = stage->buffer_l;
+   const float *buffer_r = stage->buffer_r;
+
+   const float *phase_table[4], *delta_table[4];
+   __m128 delta_f[4];
+   for (unsigned n = 0; n < 4; n++)
+   {
+      unsigned phase = frac[n] >> PHASES_SHIFT;
+      delta_f[n]     = _mm_set1_ps((frac[n] >> SUBPHASES_SHIFT) & SUBPHASES_MASK);
+      phase_table[n] = stage_table(stage, phase, PHASE_INDEX);
+      delta_table[n] = stage_table(stage, phase, DELTA_INDEX);
+   }
 
-   __m128 sum = _mm_add_ps(_mm_shuffle_ps(sum_l, sum_r, _MM_SHUFFLE(1, 0, 1, 0)),
-         _mm_shuffle_ps(sum_l, sum_r, _MM_SHUFFLE(3, 2, 3, 2)));
+#define SINC(n) _mm_add_ps(_mm_load_ps(phase_table[n] + i), \
+      _mm_mul_ps(_mm_load_ps(delta_table[n] + i), delta_f[n]))
 
-   // sum   = { r1, r0, l1, l0 } + { r3, r2, l3, l2 }
-   // sum   = { R1, R0, L1, L0 }
+#define ACCUM(n, sinc) \
+   do { \
+      l##n = _mm_add_ps(l##n, _mm_mul_ps(_mm_loadu_ps(buffer_l + start[n] + i), sinc)); \
+      r##n = _mm_add_ps(r##n, _mm_mul_ps(_mm_loadu_ps(buffer_r + start[n] + i), sinc)); \
+   } while (0)
 
-   sum = _mm_add_ps(_mm_shuffle_ps(sum, sum, _MM_SHUFFLE(3, 3, 1, 1)), sum);
+   if (frac[0] == frac[1] && frac[0] == frac[2] && frac[0] == frac[3])
+   {
+      // All frames share a phase, e.g. with integer ratios. Interpolate coefficients once.
+      for (unsigned i = 0; i < taps; i += 4)
+      {
+         __m128 sinc = SINC(0);
+         ACCUM(0, sinc);
+         ACCUM(1, sinc);
+         ACCUM(2, sinc);
+         ACCUM(3, sinc);
+      }
+   }
+   else
+   {
+      for (unsigned i = 0; i < taps; i += 4)
+      {
+         ACCUM(0, SINC(0));
+         ACCUM(1, SINC(1));
+         ACCUM(2, SINC(2));
+         ACCUM(3, SINC(3));
+      }
+   }
 
-   // sum   = {R1, R1, L1, L1 } + { R1, R0, L1, L0 }
-   // sum   = { X,  R,  X,  L } 
+#undef ACCUM
+#undef SINC
 
-   // Store L
-   _mm_store_ss(out_buffer + 0, sum);
+   // { l0, l1, l2, l3 } holds partial sums of frame 0 to 3 in its lanes.
+   // After transposing, adding them up gives { L0, L1, L2, L3 }.
+   _MM_TRANSPOSE4_PS(l0, l1, l2, l3);
+   _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+   __m128 sum_l = _mm_add_ps(_mm_add_ps(l0, l1), _mm_add_ps(l2, l3));
+   __m128 sum_r = _mm_add_ps(_mm_add_ps(r0, r1), _mm_add_ps(r2, r3));
 
-   // movehl { X, R, X, L } == { X, R, X, R }
-   _mm_store_ss(out_buffer + 1, _mm_movehl_ps(sum, sum));
+   // Interleave back to { L0, R0, L1, R1 }, { L2, R2, L3, R3 }.
+   _mm_storeu_ps(out + 0, _mm_unpacklo_ps(sum_l, sum_r));
+   _mm_storeu_ps(out + 4, _mm_unpackhi_ps(sum_l, sum_r));
 }
 #else // Plain ol' C99
-static void process_sinc(struct maru_resampler *resamp, float * restrict out_buffer)
+static inline void process_sinc_4(const struct sinc_stage *stage,
+      const unsigned *start, const uint32_t *frac, float *out)
 {
-   float sum_l = 0.0f;
-   float sum_r = 0.0f;
-   const float *buffer_l = resamp->buffer_l + resamp->ptr;
-   const float *buffer_r = resamp->buffer_r + resamp->ptr;
+   unsigned taps = stage->clock.taps;
+   float sum_l[4] = {0.0f};
+   float sum_r[4] = {0.0f};
 
-   unsigned phase = resamp->time >> PHASES_SHIFT;
-   unsigned delta = (resamp->time >> SUBPHASES_SHIFT) & SUBPHASES_MASK;
-   float delta_f = (float)delta;
+   for (unsigned n = 0; n < 4; n++)
+   {
+      // Consecutive frames sharing a phase share their coefficients.
+      if (n && frac[n] == frac[n - 1])
+         continue;
 
-   const float *phase_table = resamp->phase_table[phase][PHASE_INDEX];
-   const float *delta_table = resamp->phase_table[phase][DELTA_INDEX];
+      unsigned phase = frac[n] >> PHASES_SHIFT;
+      float delta_f  = (frac[n] >> SUBPHASES_SHIFT) & SUBPHASES_MASK;
 
-   for (unsigned i = 0; i < TAPS; i++)
-   {
-      float sinc_val = phase_table[i] + delta_f * delta_table[i];
-      sum_l         += buffer_l[i] * sinc_val;
-      sum_r         += buffer_r[i] * sinc_val;
+      const float *phase_table = stage_table(stage, phase, PHASE_INDEX);
+      const float *delta_table = stage_table(stage, phase, DELTA_INDEX);
+
+      unsigned last = n + 1;
+      while (last < 4 && frac[last] == frac[n])
+         last++;
+
+      for (unsigned i = 0; i < taps; i++)
+      {
+         float sinc_val = phase_table[i] + delta_f * delta_table[i];
+         for (unsigned m = n; m < last; m++)
+         {
+            sum_l[m] += stage->buffer_l[start[m] + i] * sinc_val;
+            sum_r[m] += stage->buffer_r[start[m] + i] * sinc_val;
+         }
+      }
    }
 
-   out_buffer[0] = sum_l;
-   out_buffer[1] = sum_r;
+   for (unsigned n = 0; n < 4; n++)
+   {
+      out[2 * n + 0] = sum_l[n];
+      out[2 * n + 1] = sum_r[n];
+   }
 }
 #endif
 
-size_t resampler_process(struct maru_resampler *resamp, float *data, size_t frames)
+// Computes every frame of a block. Slots past a partial block repeat its first frame
+// and are thrown away.
+static void process_sinc_block(struct sinc_stage *stage,
+      struct sinc_block *block, float *out)
+{
+   for (unsigned i = block->frames; i < RESAMPLER_BLOCK; i++)
+   {
+      block->start[i] = block->start[0];
+      block->frac[i]  = block->frac[0];
+   }
+
+   float tmp[2 * RESAMPLER_BLOCK] AUDIO_ALIGNED;
+   float *dst = block->frames == RESAMPLER_BLOCK ? out : tmp;
+
+   for (unsigned i = 0; i < RESAMPLER_BLOCK; i += 4)
+      process_sinc_4(stage, block->start + i, block->frac + i, dst + 2 * i);
+
+   if (dst == tmp)
+      memcpy(out, tmp, 2 * block->frames * sizeof(float));
+}
+
+
+static size_t clock_required_input(const struct resampler_clock *clock, size_t out_frames)
+{
+   if (!out_frames)
+      return 0;
+
+   // Input is shuffled in right before the output frame that needs it.
+   return ((uint64_t)clock->time + (uint64_t)clock->ratio * (out_frames - 1)) >> FRAMES_SHIFT;
+}
+
+// Limits out_frames to what history has room for the input of.
+// Returns true if the last taps frames of history must be moved back to the start first.
+static bool clock_reserve(struct resampler_clock *clock, size_t *out_frames)
+{
+   while (*out_frames > 1 && clock_required_input(clock, *out_frames) > HISTORY - clock->taps)
+      (*out_frames)--;
+
+   return clock->pos + clock_required_input(clock, *out_frames) > HISTORY;
+}
+
+// Plans a block of up to out_frames output frames from in_frames of available input,
+// and records where their windows are. Stops early if input runs out.
+// Returns how many input frames are to be appended to history, starting at the old position.
+static size_t clock_plan_block(struct resampler_clock *clock, struct sinc_block *block,
+      size_t in_frames, size_t out_frames)
+{
+   size_t pushed = 0;
+
+   for (block->frames = 0; block->frames < out_frames; block->frames++)
+   {
+      // Shuffle in new data.
+      while (clock->time >= PHASES_WRAP)
+      {
+         if (pushed == in_frames)
+            return pushed;
+
+         pushed++;
+         clock->pos++;
+         clock->time -= PHASES_WRAP;
+      }
+
+      block->start[block->frames] = clock->pos - clock->taps;
+      block->frac[block->frames]  = clock->time & FRAC_MASK;
+
+      clock->time += clock->ratio;
+   }
+
+   return pushed;
+}
+
+static void clock_pushed(struct resampler_clock *clock, size_t frames, bool silent)
 {
-   float conv_buf[2 * frames];
-   const float *input = conv_buf;
+   if (!silent)
+      clock->silent_frames = 0;
+   else if (clock->silent_frames + frames < clock->taps)
+      clock->silent_frames += frames;
+   else
+      clock->silent_frames = clock->taps;
+}
 
-   uint32_t needed_input_frames = ((uint64_t)resamp->time + (uint64_t)resamp->ratio * frames) >> FRAMES_SHIFT;
-   size_t needed_size = needed_input_frames * 2 * sizeof(int16_t); // Hardcode for stereo 16-bit.
+static inline bool clock_flushed(const struct resampler_clock *clock)
+{
+   return clock->silent_frames >= clock->taps;
+}
 
-   size_t avail = maru_fifo_read_avail(resamp->fifo);
-   if (avail > needed_size)
-      avail = needed_size;
+// Filter only holds zeros, so output is zero as well.
+// Advances time as if in_frames of silence produced out_frames.
+static void clock_skip(struct resampler_clock *clock, size_t in_frames, size_t out_frames)
+{
+   clock->time = (uint32_t)((uint64_t)clock->time +
+         (uint64_t)clock->ratio * out_frames - ((uint64_t)in_frames << FRAMES_SHIFT));
+}
 
-   struct maru_fifo_locked_region region;
-   maru_fifo_read_lock(resamp->fifo, avail, &region);
+static void clock_init(struct resampler_clock *clock, const struct stage_design *design)
+{
+   clock->ratio = ((uint64_t)PHASES_WRAP * design->in_rate) / design->out_rate;
+   clock->time = 0;
+   clock->taps = design->taps;
+   clock->pos = clock->taps;
+   clock->silent_frames = clock->taps;
+}
 
-   audio_convert_s16_to_float(conv_buf,
-         region.first,
-         region.first_size / sizeof(int16_t));
+// Makes room in history for the input of up to out_frames output frames,
+// moving the last taps frames back to the start if needed. Returns how many output frames there is room for.
+static size_t stage_reserve(struct sinc_stage *stage, size_t out_frames)
+{
+   struct resampler_clock *clock = &stage->clock;
 
-   if (region.second)
+   if (clock_reserve(clock, &out_frames))
    {
-      audio_convert_s16_to_float(conv_buf + region.first_size / sizeof(int16_t),
-            region.second,
-            region.second_size / sizeof(int16_t));
+      memmove(stage->buffer_l, stage->buffer_l + clock->pos - clock->taps, clock->taps * sizeof(float));
+      memmove(stage->buffer_r, stage->buffer_r + clock->pos - clock->taps, clock->taps * sizeof(float));
+      clock->pos = clock->taps;
    }
 
-   maru_fifo_read_unlock(resamp->fifo, &region);
+   return out_frames;
+}
+
+// Shuffles in input for up to out_frames output frames, and records where their windows are.
+// With in set to NULL, silence is shuffled in.
+// Stops early if input runs out.
+static void gather_block(struct sinc_stage *stage, struct sinc_block *block,
+      const float **in, size_t *in_frames, size_t out_frames)
+{
+   struct resampler_clock *clock = &stage->clock;
+
+   out_frames = stage_reserve(stage, out_frames);
 
-   memset(conv_buf + avail / (2 * sizeof(int16_t)), 0, needed_size - avail);
+   float *buffer_l = stage->buffer_l + clock->pos;
+   float *buffer_r = stage->buffer_r + clock->pos;
+   size_t pushed = clock_plan_block(clock, block, *in ? *in_frames : SIZE_MAX, out_frames);
 
-   while (frames)
+   if (*in)
    {
-      process_sinc(resamp, data);
-      data += 2;
-      frames--;
+      for (size_t i = 0; i < pushed; i++)
+      {
+         buffer_l[i] = (*in)[2 * i + 0];
+         buffer_r[i] = (*in)[2 * i + 1];
+      }
 
-      // Shuffle in new data.
-      resamp->time += resamp->ratio;
-      if (resamp->time >= PHASES_WRAP)
+      *in += 2 * pushed;
+      *in_frames -= pushed;
+   }
+   else
+   {
+      memset(buffer_l, 0, pushed * sizeof(float));
+      memset(buffer_r, 0, pushed * sizeof(float));
+   }
+
+   clock_pushed(clock, pushed, !*in);
+}
+
+static void stage_process(void *data, const void *in_data, size_t in_frames,
+      void *out_data, size_t out_frames)
+{
+   struct sinc_stage *stage = data;
+   const float *in = in_data;
+   float *out = out_data;
+
+   for (size_t out_ptr = 0; out_ptr < out_frames; )
+   {
+      size_t frames = out_frames - out_ptr;
+      if (frames > RESAMPLER_BLOCK)
+         frames = RESAMPLER_BLOCK;
+
+      struct sinc_block block;
+      gather_block(stage, &block, &in, &in_frames, frames);
+      if (!block.frames)
+         break;
+
+      process_sinc_block(stage, &block, out);
+      out += 2 * block.frames;
+      out_ptr += block.frames;
+   }
+}
+
+static void halfband_double(void *data, const void *in_data, size_t in_frames,
+      void *out_data, size_t out_frames)
+{
+   struct halfband_stage *hb = data;
+   struct sinc_stage *stage = &hb->sinc;
+   const float *in = in_data;
+   float *out = out_data;
+   unsigned center = stage->clock.taps / 2 - 1;
+
+   for (size_t out_ptr = 0; out_ptr < out_frames; )
+   {
+      // Only every other frame goes through the kernel, so gather two blocks worth.
+      // History must not move in between, as the first block still refers to it.
+      size_t frames = out_frames - out_ptr;
+      if (frames > 2 * RESAMPLER_BLOCK)
+         frames = 2 * RESAMPLER_BLOCK;
+      frames = stage_reserve(stage, frames);
+
+      struct sinc_block filtered = {0};
+      unsigned index[RESAMPLER_BLOCK];
+      size_t gathered = 0;
+
+      while (gathered < frames)
+      {
+         size_t block_frames = frames - gathered;
+         if (block_frames > RESAMPLER_BLOCK)
+            block_frames = RESAMPLER_BLOCK;
+
+         struct sinc_block block;
+         gather_block(stage, &block, &in, &in_frames, block_frames);
+         if (!block.frames)
+            break;
+
+         for (unsigned i = 0; i < block.frames; i++, gathered++)
+         {
+            if (block.frac[i])
+            {
+               index[filtered.frames] = gathered;
+               filtered.start[filtered.frames++] = block.start[i];
+            }
+            else
+            {
+               out[2 * gathered + 0] = stage->buffer_l[block.start[i] + center];
+               out[2 * gathered + 1] = stage->buffer_r[block.start[i] + center];
+            }
+         }
+      }
+
+      if (!gathered)
+         break;
+
+      if (filtered.frames)
+      {
+         float tmp[2 * RESAMPLER_BLOCK] AUDIO_ALIGNED;
+         process_sinc_block(stage, &filtered, tmp);
+
+         for (unsigned i = 0; i < filtered.frames; i++)
+         {
+            out[2 * index[i] + 0] = tmp[2 * i + 0];
+            out[2 * index[i] + 1] = tmp[2 * i + 1];
+         }
+      }
+
+      out += 2 * gathered;
+      out_ptr += gathered;
+   }
+}
+
+static void halfband_halve(void *data, const void *in_data, size_t in_frames,
+      void *out_data, size_t out_frames)
+{
+   struct halfband_stage *hb = data;
+   struct sinc_stage *stage = &hb->sinc;
+   struct resampler_clock *clock = &stage->clock;
+   const float *in = in_data;
+   float *out = out_data;
+   unsigned taps = clock->taps;
+
+   (void)in_frames;
+
+   for (size_t out_ptr = 0; out_ptr < out_frames; )
+   {
+      size_t frames = out_frames - out_ptr;
+      if (frames > RESAMPLER_BLOCK)
+         frames = RESAMPLER_BLOCK;
+
+      // Position in history counts pairs of input frames.
+      if (clock->pos + frames > HISTORY)
+      {
+         memmove(stage->buffer_l, stage->buffer_l + clock->pos - taps, taps * sizeof(float));
+         memmove(stage->buffer_r, stage->buffer_r + clock->pos - taps, taps * sizeof(float));
+         memmove(hb->center_l, hb->center_l + clock->pos - taps, taps * sizeof(float));
+         memmove(hb->center_r, hb->center_r + clock->pos - taps, taps * sizeof(float));
+         clock->pos = taps;
+      }
+
+      struct sinc_block block = { .frames = frames };
+      for (unsigned i = 0; i < frames; i++)
       {
-         resamp->buffer_l[resamp->ptr + TAPS] = resamp->buffer_l[resamp->ptr] = *input++;
-         resamp->buffer_r[resamp->ptr + TAPS] = resamp->buffer_r[resamp->ptr] = *input++;
-         resamp->ptr = (resamp->ptr + 1) & (TAPS - 1);
+         unsigned pos = clock->pos + i;
+
+         if (in)
+         {
+            hb->center_l[pos]     = in[4 * i + 0];
+            hb->center_r[pos]     = in[4 * i + 1];
+            stage->buffer_l[pos] = in[4 * i + 2];
+            stage->buffer_r[pos] = in[4 * i + 3];
+         }
+         else
+         {
+            hb->center_l[pos] = hb->center_r[pos] = 0.0f;
+            stage->buffer_l[pos] = stage->buffer_r[pos] = 0.0f;
+         }
+
+         block.start[i] = pos + 1 - taps;
+         block.frac[i] = 0;
+      }
 
-         resamp->time -= PHASES_WRAP;
+      process_sinc_block(stage, &block, out);
+
+      for (unsigned i = 0; i < frames; i++)
+      {
+         unsigned center = clock->pos + i + 1 - taps / 2;
+         out[2 * i + 0] += 0.5f * hb->center_l[center];
+         out[2 * i + 1] += 0.5f * hb->center_r[center];
       }
+
+      clock->pos += frames;
+      clock_pushed(clock, frames, !in);
+
+      if (in)
+         in += 4 * frames;
+      out += 2 * frames;
+      out_ptr += frames;
    }
+}
 
-   return avail;
+static void stage_free(void *data)
+{
+   struct sinc_stage *stage = data;
+   if (stage)
+      free(stage->phase_table);
+   free(stage);
 }
 
-maru_resampler_t *resampler_init(maru_fifo *fifo,
-      unsigned in_rate, unsigned out_rate)
+static bool stage_init(const struct stage_design *design, struct chain_stage *chain_stage)
 {
-   maru_resampler_t *resamp = memalign(16, sizeof(*resamp));
-   if (!resamp)
-      return NULL;
+   bool halfband = design->kind != STAGE_FRACTIONAL;
+   struct sinc_stage *stage = memalign(32, halfband ? sizeof(struct halfband_stage) : sizeof(*stage));
+   if (!stage)
+      return false;
 
-   memset(resamp, 0, sizeof(*resamp));
+   memset(stage, 0, halfband ? sizeof(struct halfband_stage) : sizeof(*stage));
 
-   resamp->ratio = ((uint64_t)PHASES_WRAP * in_rate) / out_rate;
-   resamp->fifo = fifo;
-   resamp->time = 0;
-   resamp->ptr = 0;
-   init_sinc_table(resamp);
-   memset(resamp->buffer_l, 0, sizeof(resamp->buffer_l));
-   memset(resamp->buffer_r, 0, sizeof(resamp->buffer_r));
+   // Half-band stages have a single phase, which does not change.
+   unsigned phases = halfband ? 1 : PHASES;
+   stage->phase_table = memalign(32, phases * 2 * design->taps * sizeof(float));
+   if (!stage->phase_table)
+   {
+      free(stage);
+      return false;
+   }
 
-   return resamp;
+   clock_init(&stage->clock, design);
+
+   if (halfband)
+   {
+      // Unlike a fractional stage, the first output frame already needs new input.
+      stage->clock.time = design->kind == STAGE_HALVE ? stage->clock.ratio : PHASES_WRAP;
+
+      for (unsigned i = 0; i < design->taps; i++)
+      {
+         // Doubling puts zeros in between input frames, which takes a gain of two to make up for.
+         double tap = halfband_tap(design, i);
+         stage->phase_table[PHASE_INDEX * design->taps + i] = design->kind == STAGE_DOUBLE ? 2.0 * tap : tap;
+         stage->phase_table[DELTA_INDEX * design->taps + i] = 0.0f;
+      }
+   }
+   else
+      init_sinc_table(stage->phase_table, design);
+
+   *chain_stage = (struct chain_stage) {
+      .data = stage,
+      .clock = &stage->clock,
+      .process = design->kind == STAGE_HALVE ? halfband_halve :
+         (design->kind == STAGE_DOUBLE ? halfband_double : stage_process),
+      .free = stage_free,
+   };
+
+   return true;
 }
 
-void resampler_free(maru_resampler_t *resamp)
+// Input frames of every stage for out_frames frames out of the last one.
+// need[i] is input of stage i, and need[num_stages] is out_frames.
+static void chain_required(const struct resampler_chain *chain, size_t out_frames, size_t *need)
 {
-   free(resamp);
+   need[chain->num_stages] = out_frames;
+   for (unsigned i = chain->num_stages; i > 0; i--)
+      need[i - 1] = clock_required_input(chain->stages[i - 1].clock, need[i]);
 }
 
+// Limits out_frames to what in_frames of input and the buffers between stages allow.
+// Fills need as chain_required() does, and returns the new out_frames.
+static size_t chain_plan(const struct resampler_chain *chain, size_t out_frames, size_t in_frames, size_t *need)
+{
+   for (;;)
+   {
+      chain_required(chain, out_frames, need);
+
+      size_t limited = out_frames;
+      if (need[0] > in_frames)
+         limited = out_frames * in_frames / need[0];
+
+      for (unsigned i = 1; i < chain->num_stages; i++)
+      {
+         if (need[i] > STAGE_FRAMES && out_frames * STAGE_FRAMES / need[i] < limited)
+            limited = out_frames * STAGE_FRAMES / need[i];
+      }
+
+      if (limited == out_frames || !out_frames)
+         return out_frames;
+
+      // Estimate is proportional to the ratios, which can be off by a frame.
+      out_frames = limited < out_frames - 1 ? limited : out_frames - 1;
+   }
+}
+
+// Runs every stage on the input planned by chain_plan().
+// Stages with flushed filters and silent input are skipped if skip_silent is set.
+// Returns false if output was written, and true if output is silent and was left alone.
+static bool chain_run(struct resampler_chain *chain, const void *in, const size_t *need,
+      void *out, bool skip_silent)
+{
+   // NULL is silence.
+   const void *src = in;
+
+   for (unsigned i = 0; i < chain->num_stages; i++)
+   {
+      struct chain_stage *stage = &chain->stages[i];
+      void *dst = i + 1 == chain->num_stages ? out : chain->buffer[i & 1];
+
+      if (!src && skip_silent && clock_flushed(stage->clock))
+         clock_skip(stage->clock, need[i], need[i + 1]);
+      else
+      {
+         stage->process(stage->data, src, need[i], dst, need[i + 1]);
+         src = dst;
+      }
+   }
+
+   return !src;
+}
+
+static void chain_process(struct resampler_chain *chain,
+      const void *in, size_t in_frames, size_t *consumed,
+      void *out, size_t out_frames, size_t *produced)
+{
+   size_t in_left = in_frames;
+   size_t out_ptr = 0;
+   const uint8_t *src = in;
+   uint8_t *dst = out;
+
+   while (out_ptr < out_frames)
+   {
+      size_t need[MAX_STAGES + 2];
+      size_t frames = chain_plan(chain, out_frames - out_ptr, in_left, need);
+      if (!frames)
+         break;
+
+      chain_run(chain, src, need, dst, false);
+
+      src += need[0] * chain->frame_size;
+      in_left -= need[0];
+      dst += frames * chain->frame_size;
+      out_ptr += frames;
+   }
+
+   *consumed = in_frames - in_left;
+   *produced = out_ptr;
+}
+
+static bool chain_process_silence(struct resampler_chain *chain,
+      void *out, size_t out_frames, size_t *consumed)
+{
+   size_t need[MAX_STAGES + 2];
+   chain_required(chain, out_frames, need);
+   *consumed = need[0];
+
+   bool flushed = true;
+   for (unsigned i = 0; i < chain->num_stages; i++)
+      flushed = flushed && clock_flushed(chain->stages[i].clock);
+
+   if (flushed)
+   {
+      for (unsigned i = 0; i < chain->num_stages; i++)
+         clock_skip(chain->stages[i].clock, need[i], need[i + 1]);
+      return true;
+   }
+
+   uint8_t *out_data = out;
+   for (size_t out_ptr = 0; out_ptr < out_frames; )
+   {
+      size_t frames = chain_plan(chain, out_frames - out_ptr, SIZE_MAX, need);
+
+      // Later stages can still have earlier input left after the first ones are flushed.
+      if (chain_run(chain, NULL, need, out_data, true))
+         memset(out_data, 0, frames * chain->frame_size);
+
+      out_data += frames * chain->frame_size;
+      out_ptr += frames;
+   }
+
+   return false;
+}
+
+static void chain_free(struct resampler_chain *chain)
+{
+   for (unsigned i = 0; i < chain->num_stages; i++)
+      chain->stages[i].free(chain->stages[i].data);
+
+   free(chain->buffer[0]);
+   free(chain->buffer[1]);
+}
+
+static bool chain_init(struct resampler_chain *chain, unsigned in_rate, unsigned out_rate, size_t frame_size,
+      bool (*init)(const struct stage_design *design, struct chain_stage *stage))
+{
+   struct stage_design designs[MAX_STAGES + 1];
+   unsigned stages = design_stages(designs, in_rate, out_rate);
+
+   chain->frame_size = frame_size;
+   for (unsigned i = 0; i < 2; i++)
+   {
+      chain->buffer[i] = memalign(32, STAGE_FRAMES * frame_size);
+      if (!chain->buffer[i])
+         return false;
+   }
+
+   for (; chain->num_stages < stages; chain->num_stages++)
+   {
+      if (!init(&designs[chain->num_stages], &chain->stages[chain->num_stages]))
+         return false;
+   }
+
+   return true;
+}
+
+size_t resampler_required_input(const maru_resampler_t *resamp, size_t out_frames)
+{
+   size_t need[MAX_STAGES + 2];
+   chain_required(&resamp->chain, out_frames, need);
+   return need[0];
+}
+
+void resampler_process(maru_resampler_t *resamp,
+      const float *in, size_t in_frames, size_t *consumed,
+      float *out, size_t out_frames, size_t *produced)
+{
+   chain_process(&resamp->chain, in, in_frames, consumed, out, out_frames, produced);
+}
+
+bool resampler_process_silence(maru_resampler_t *resamp,
+      float *out, size_t out_frames, size_t *consumed)
+{
+   return chain_process_silence(&resamp->chain, out, out_frames, consumed);
+}
+
+maru_resampler_t *resampler_init(unsigned in_rate, unsigned out_rate)
+{
+   maru_resampler_t *resamp = calloc(1, sizeof(*resamp));
+   if (!resamp)
+      return NULL;
+
+   if (!chain_init(&resamp->chain, in_rate, out_rate, 2 * sizeof(float), stage_init))
+   {
+      resampler_free(resamp);
+      return NULL;
+   }
+
+   return resamp;
+}
+
+void resampler_free(maru_resampler_t *resamp)
+{
+   if (resamp)
+      chain_free(&resamp->chain);
+   free(resamp);
+}
+
+// Fixed-point path.
+// Coefficients are Q15. Each 16x16 bit multiply-add of a pair of taps is halved before it is accumulated
+// in 32 bits, so the sum cannot overflow for any input (sum of |coefficients| stays below 3.1, where 4 would overflow).
+// The result is rounded and narrowed back to s16 with saturation.
+
+#define Q15_SHIFT 14
+#define Q15_ROUND (1 << (Q15_SHIFT - 1))
+
+static inline int16_t q15_subphase(uint32_t frac)
+{
+   return ((frac >> SUBPHASES_SHIFT) & SUBPHASES_MASK) >> 1;
+}
+
+static inline int16_t saturate_s16(int32_t val)
+{
+   return val > 0x7fff ? 0x7fff : (val < -0x8000 ? -0x8000 : val);
+}
+
+#if __SSE2__
+// Sums each of the vectors, returning { sum(a), sum(b), sum(c), sum(d) }.
+static inline __m128i sum_4_epi32(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+   __m128i ab_lo = _mm_unpacklo_epi32(a, b);
+   __m128i cd_lo = _mm_unpacklo_epi32(c, d);
+   __m128i ab_hi = _mm_unpackhi_epi32(a, b);
+   __m128i cd_hi = _mm_unpackhi_epi32(c, d);
+
+   return _mm_add_epi32(
+         _mm_add_epi32(_mm_unpacklo_epi64(ab_lo, cd_lo), _mm_unpackhi_epi64(ab_lo, cd_lo)),
+         _mm_add_epi32(_mm_unpacklo_epi64(ab_hi, cd_hi), _mm_unpackhi_epi64(ab_hi, cd_hi)));
+}
+
+// Rounded (a * b) >> 15. Truncating instead costs about 15 dB of SNR.
+static inline __m128i mul_q15(__m128i a, __m128i b)
+{
+#if __SSSE3__
+   return _mm_mulhrs_epi16(a, b);
+#else
+   // High half of 2 * a * b, plus the bit below it.
+   __m128i a2 = _mm_add_epi16(a, a);
+   return _mm_add_epi16(_mm_mulhi_epi16(a2, b), _mm_srli_epi16(_mm_mullo_epi16(a2, b), 15));
+#endif
+}
+
+static inline void process_sinc_q15_4(const struct sinc_stage_q15 *stage,
+      const unsigned *start, const uint32_t *frac, int16_t *out)
+{
+   unsigned taps = stage->clock.taps;
+   __m128i l0 = _mm_setzero_si128(), l1 = _mm_setzero_si128(), l2 = _mm_setzero_si128(), l3 = _mm_setzero_si128();
+   __m128i r0 = _mm_setzero_si128(), r1 = _mm_setzero_si128(), r2 = _mm_setzero_si128(), r3 = _mm_setzero_si128();
+
+   const int16_t *buffer_l = stage->buffer_l;
+   const int16_t *buffer_r = stage->buffer_r;
+
+   const int16_t *phase_table[4], *delta_table[4];
+   __m128i subphase[4];
+   for (unsigned n = 0; n < 4; n++)
+   {
+      unsigned phase = frac[n] >> PHASES_SHIFT;
+      subphase[n]    = _mm_set1_epi16(q15_subphase(frac[n]));
+      phase_table[n] = stage_table_q15(stage, phase, PHASE_INDEX);
+      delta_table[n] = stage_table_q15(stage, phase, DELTA_INDEX);
+   }
+
+#define SINC(n) _mm_add_epi16(_mm_load_si128((const __m128i*)(phase_table[n] + i)), \
+      mul_q15(_mm_load_si128((const __m128i*)(delta_table[n] + i)), subphase[n]))
+
+#define ACCUM(n, sinc) \
+   do { \
+      l##n = _mm_add_epi32(l##n, _mm_srai_epi32(_mm_madd_epi16( \
+                  _mm_loadu_si128((const __m128i*)(buffer_l + start[n] + i)), sinc), 1)); \
+      r##n = _mm_add_epi32(r##n, _mm_srai_epi32(_mm_madd_epi16( \
+                  _mm_loadu_si128((const __m128i*)(buffer_r + start[n] + i)), sinc), 1)); \
+   } while (0)
+
+   if (frac[0] == frac[1] && frac[0] == frac[2] && frac[0] == frac[3])
+   {
+      for (unsigned i = 0; i < taps; i += 8)
+      {
+         __m128i sinc = SINC(0);
+         ACCUM(0, sinc);
+         ACCUM(1, sinc);
+         ACCUM(2, sinc);
+         ACCUM(3, sinc);
+      }
+   }
+   else
+   {
+      for (unsigned i = 0; i < taps; i += 8)
+      {
+         ACCUM(0, SINC(0));
+         ACCUM(1, SINC(1));
+         ACCUM(2, SINC(2));
+         ACCUM(3, SINC(3));
+      }
+   }
+
+#undef ACCUM
+#undef SINC
+
+   __m128i round = _mm_set1_epi32(Q15_ROUND);
+   __m128i sum_l = _mm_srai_epi32(_mm_add_epi32(sum_4_epi32(l0, l1, l2, l3), round), Q15_SHIFT);
+   __m128i sum_r = _mm_srai_epi32(_mm_add_epi32(sum_4_epi32(r0, r1, r2, r3), round), Q15_SHIFT);
+
+   // { L0, L1, L2, L3, R0, R1, R2, R3 } => { L0, R0, L1, R1, L2, R2, L3, R3 }
+   __m128i packed = _mm_packs_epi32(sum_l, sum_r);
+   _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi16(packed, _mm_srli_si128(packed, 8)));
+}
+#elif __ARM_NEON__ || __ARM_NEON
+static inline int32x4_t sum_4_s32(int32x4_t a, int32x4_t b, int32x4_t c, int32x4_t d)
+{
+   int32x2_t ab = vpadd_s32(vpadd_s32(vget_low_s32(a), vget_high_s32(a)),
+         vpadd_s32(vget_low_s32(b), vget_high_s32(b)));
+   int32x2_t cd = vpadd_s32(vpadd_s32(vget_low_s32(c), vget_high_s32(c)),
+         vpadd_s32(vget_low_s32(d), vget_high_s32(d)));
+   return vcombine_s32(ab, cd);
+}
+
+static inline void process_sinc_q15_4(const struct sinc_stage_q15 *stage,
+      const unsigned *start, const uint32_t *frac, int16_t *out)
+{
+   unsigned taps = stage->clock.taps;
+   int32x4_t l[4], r[4];
+   const int16_t *phase_table[4], *delta_table[4];
+   int16x8_t subphase[4];
+
+   for (unsigned n = 0; n < 4; n++)
+   {
+      unsigned phase = frac[n] >> PHASES_SHIFT;
+      subphase[n]    = vdupq_n_s16(q15_subphase(frac[n]));
+      phase_table[n] = stage_table_q15(stage, phase, PHASE_INDEX);
+      delta_table[n] = stage_table_q15(stage, phase, DELTA_INDEX);
+      l[n] = vdupq_n_s32(0);
+      r[n] = vdupq_n_s32(0);
+   }
+
+   for (unsigned i = 0; i < taps; i += 8)
+   {
+      for (unsigned n = 0; n < 4; n++)
+      {
+         // Rounding doubling high multiply is delta scaled by the Q15 subphase.
+         int16x8_t sinc = vaddq_s16(vld1q_s16(phase_table[n] + i),
+               vqrdmulhq_s16(vld1q_s16(delta_table[n] + i), subphase[n]));
+
+         int16x8_t buf_l = vld1q_s16(stage->buffer_l + start[n] + i);
+         int16x8_t buf_r = vld1q_s16(stage->buffer_r + start[n] + i);
+
+         l[n] = vsraq_n_s32(l[n], vmull_s16(vget_low_s16(buf_l), vget_low_s16(sinc)), 1);
+         l[n] = vsraq_n_s32(l[n], vmull_s16(vget_high_s16(buf_l), vget_high_s16(sinc)), 1);
+         r[n] = vsraq_n_s32(r[n], vmull_s16(vget_low_s16(buf_r), vget_low_s16(sinc)), 1);
+         r[n] = vsraq_n_s32(r[n], vmull_s16(vget_high_s16(buf_r), vget_high_s16(sinc)), 1);
+      }
+   }
+
+   // Rounding, saturating narrow, and interleaving store.
+   int16x4x2_t res = {{
+      vqrshrn_n_s32(sum_4_s32(l[0], l[1], l[2], l[3]), Q15_SHIFT),
+      vqrshrn_n_s32(sum_4_s32(r[0], r[1], r[2], r[3]), Q15_SHIFT),
+   }};
+   vst2_s16(out, res);
+}
+#else
+static inline void process_sinc_q15_4(const struct sinc_stage_q15 *stage,
+      const unsigned *start, const uint32_t *frac, int16_t *out)
+{
+   unsigned taps = stage->clock.taps;
+   int16_t sinc[MAX_TAPS];
+
+   for (unsigned n = 0; n < 4; n++)
+   {
+      // Consecutive frames sharing a phase share their coefficients.
+      if (!n || frac[n] != frac[n - 1])
+      {
+         unsigned phase = frac[n] >> PHASES_SHIFT;
+         int32_t subphase = q15_subphase(frac[n]);
+
+         const int16_t *phase_table = stage_table_q15(stage, phase, PHASE_INDEX);
+         const int16_t *delta_table = stage_table_q15(stage, phase, DELTA_INDEX);
+
+         for (unsigned i = 0; i < taps; i++)
+            sinc[i] = phase_table[i] + ((delta_table[i] * subphase + (1 << 14)) >> 15);
+      }
+
+      const int16_t *buffer_l = stage->buffer_l + start[n];
+      const int16_t *buffer_r = stage->buffer_r + start[n];
+      int32_t sum_l = 0, sum_r = 0;
+
+      for (unsigned i = 0; i < taps; i += 2)
+      {
+         sum_l += (buffer_l[i] * sinc[i] + buffer_l[i + 1] * sinc[i + 1]) >> 1;
+         sum_r += (buffer_r[i] * sinc[i] + buffer_r[i + 1] * sinc[i + 1]) >> 1;
+      }
+
+      out[2 * n + 0] = saturate_s16((sum_l + Q15_ROUND) >> Q15_SHIFT);
+      out[2 * n + 1] = saturate_s16((sum_r + Q15_ROUND) >> Q15_SHIFT);
+   }
+}
+#endif
+
+static void process_sinc_q15_block(struct sinc_stage_q15 *stage,
+      struct sinc_block *block, int16_t *out)
+{
+   for (unsigned i = block->frames; i < RESAMPLER_BLOCK; i++)
+   {
+      block->start[i] = block->start[0];
+      block->frac[i]  = block->frac[0];
+   }
+
+   int16_t tmp[2 * RESAMPLER_BLOCK] AUDIO_ALIGNED;
+   int16_t *dst = block->frames == RESAMPLER_BLOCK ? out : tmp;
+
+   for (unsigned i = 0; i < RESAMPLER_BLOCK; i += 4)
+      process_sinc_q15_4(stage, block->start + i, block->frac + i, dst + 2 * i);
+
+   if (dst == tmp)
+      memcpy(out, tmp, 2 * block->frames * sizeof(int16_t));
+}
+
+
+// Makes room in history for the input of up to out_frames output frames,
+// moving the last taps frames back to the start if needed. Returns how many output frames there is room for.
+static size_t stage_reserve_q15(struct sinc_stage_q15 *stage, size_t out_frames)
+{
+   struct resampler_clock *clock = &stage->clock;
+
+   if (clock_reserve(clock, &out_frames))
+   {
+      memmove(stage->buffer_l, stage->buffer_l + clock->pos - clock->taps, clock->taps * sizeof(int16_t));
+      memmove(stage->buffer_r, stage->buffer_r + clock->pos - clock->taps, clock->taps * sizeof(int16_t));
+      clock->pos = clock->taps;
+   }
+
+   return out_frames;
+}
+
+// Shuffles in input for up to out_frames output frames, and records where their windows are.
+// With in set to NULL, silence is shuffled in.
+// Stops early if input runs out.
+static void gather_block_q15(struct sinc_stage_q15 *stage, struct sinc_block *block,
+      const int16_t **in, size_t *in_frames, size_t out_frames)
+{
+   struct resampler_clock *clock = &stage->clock;
+
+   out_frames = stage_reserve_q15(stage, out_frames);
+
+   int16_t *buffer_l = stage->buffer_l + clock->pos;
+   int16_t *buffer_r = stage->buffer_r + clock->pos;
+   size_t pushed = clock_plan_block(clock, block, *in ? *in_frames : SIZE_MAX, out_frames);
+
+   if (*in)
+   {
+      for (size_t i = 0; i < pushed; i++)
+      {
+         buffer_l[i] = (*in)[2 * i + 0];
+         buffer_r[i] = (*in)[2 * i + 1];
+      }
+
+      *in += 2 * pushed;
+      *in_frames -= pushed;
+   }
+   else
+   {
+      memset(buffer_l, 0, pushed * sizeof(int16_t));
+      memset(buffer_r, 0, pushed * sizeof(int16_t));
+   }
+
+   clock_pushed(clock, pushed, !*in);
+}
+
+static void stage_process_q15(void *data, const void *in_data, size_t in_frames,
+      void *out_data, size_t out_frames)
+{
+   struct sinc_stage_q15 *stage = data;
+   const int16_t *in = in_data;
+   int16_t *out = out_data;
+
+   for (size_t out_ptr = 0; out_ptr < out_frames; )
+   {
+      size_t frames = out_frames - out_ptr;
+      if (frames > RESAMPLER_BLOCK)
+         frames = RESAMPLER_BLOCK;
+
+      struct sinc_block block;
+      gather_block_q15(stage, &block, &in, &in_frames, frames);
+      if (!block.frames)
+         break;
+
+      process_sinc_q15_block(stage, &block, out);
+      out += 2 * block.frames;
+      out_ptr += block.frames;
+   }
+}
+
+static void halfband_double_q15(void *data, const void *in_data, size_t in_frames,
+      void *out_data, size_t out_frames)
+{
+   struct halfband_stage_q15 *hb = data;
+   struct sinc_stage_q15 *stage = &hb->sinc;
+   const int16_t *in = in_data;
+   int16_t *out = out_data;
+   unsigned center = stage->clock.taps / 2 - 1;
+
+   for (size_t out_ptr = 0; out_ptr < out_frames; )
+   {
+      // Only every other frame goes through the kernel, so gather two blocks worth.
+      // History must not move in between, as the first block still refers to it.
+      size_t frames = out_frames - out_ptr;
+      if (frames > 2 * RESAMPLER_BLOCK)
+         frames = 2 * RESAMPLER_BLOCK;
+      frames = stage_reserve_q15(stage, frames);
+
+      struct sinc_block filtered = {0};
+      unsigned index[RESAMPLER_BLOCK];
+      size_t gathered = 0;
+
+      while (gathered < frames)
+      {
+         size_t block_frames = frames - gathered;
+         if (block_frames > RESAMPLER_BLOCK)
+            block_frames = RESAMPLER_BLOCK;
+
+         struct sinc_block block;
+         gather_block_q15(stage, &block, &in, &in_frames, block_frames);
+         if (!block.frames)
+            break;
+
+         for (unsigned i = 0; i < block.frames; i++, gathered++)
+         {
+            if (block.frac[i])
+            {
+               index[filtered.frames] = gathered;
+               filtered.start[filtered.frames++] = block.start[i];
+            }
+            else
+            {
+               out[2 * gathered + 0] = stage->buffer_l[block.start[i] + center];
+               out[2 * gathered + 1] = stage->buffer_r[block.start[i] + center];
+            }
+         }
+      }
+
+      if (!gathered)
+         break;
+
+      if (filtered.frames)
+      {
+         int16_t tmp[2 * RESAMPLER_BLOCK] AUDIO_ALIGNED;
+         process_sinc_q15_block(stage, &filtered, tmp);
+
+         for (unsigned i = 0; i < filtered.frames; i++)
+         {
+            out[2 * index[i] + 0] = tmp[2 * i + 0];
+            out[2 * index[i] + 1] = tmp[2 * i + 1];
+         }
+      }
+
+      out += 2 * gathered;
+      out_ptr += gathered;
+   }
+}
+
+static void halfband_halve_q15(void *data, const void *in_data, size_t in_frames,
+      void *out_data, size_t out_frames)
+{
+   struct halfband_stage_q15 *hb = data;
+   struct sinc_stage_q15 *stage = &hb->sinc;
+   struct resampler_clock *clock = &stage->clock;
+   const int16_t *in = in_data;
+   int16_t *out = out_data;
+   unsigned taps = clock->taps;
+
+   (void)in_frames;
+
+   for (size_t out_ptr = 0; out_ptr < out_frames; )
+   {
+      size_t frames = out_frames - out_ptr;
+      if (frames > RESAMPLER_BLOCK)
+         frames = RESAMPLER_BLOCK;
+
+      // Position in history counts pairs of input frames.
+      if (clock->pos + frames > HISTORY)
+      {
+         memmove(stage->buffer_l, stage->buffer_l + clock->pos - taps, taps * sizeof(int16_t));
+         memmove(stage->buffer_r, stage->buffer_r + clock->pos - taps, taps * sizeof(int16_t));
+         memmove(hb->center_l, hb->center_l + clock->pos - taps, taps * sizeof(int16_t));
+         memmove(hb->center_r, hb->center_r + clock->pos - taps, taps * sizeof(int16_t));
+         clock->pos = taps;
+      }
+
+      struct sinc_block block = { .frames = frames };
+      for (unsigned i = 0; i < frames; i++)
+      {
+         unsigned pos = clock->pos + i;
+
+         if (in)
+         {
+            hb->center_l[pos]     = in[4 * i + 0];
+            hb->center_r[pos]     = in[4 * i + 1];
+            stage->buffer_l[pos] = in[4 * i + 2];
+            stage->buffer_r[pos] = in[4 * i + 3];
+         }
+         else
+         {
+            hb->center_l[pos] = hb->center_r[pos] = 0;
+            stage->buffer_l[pos] = stage->buffer_r[pos] = 0;
+         }
+
+         block.start[i] = pos + 1 - taps;
+         block.frac[i] = 0;
+      }
+
+      process_sinc_q15_block(stage, &block, out);
+
+      for (unsigned i = 0; i < frames; i++)
+      {
+         unsigned center = clock->pos + i + 1 - taps / 2;
+         out[2 * i + 0] = saturate_s16(out[2 * i + 0] + ((hb->center_l[center] + 1) >> 1));
+         out[2 * i + 1] = saturate_s16(out[2 * i + 1] + ((hb->center_r[center] + 1) >> 1));
+      }
+
+      clock->pos += frames;
+      clock_pushed(clock, frames, !in);
+
+      if (in)
+         in += 4 * frames;
+      out += 2 * frames;
+      out_ptr += frames;
+   }
+}
+
+static void stage_free_q15(void *data)
+{
+   struct sinc_stage_q15 *stage = data;
+   if (stage)
+      free(stage->phase_table);
+   free(stage);
+}
+
+static bool stage_init_q15(const struct stage_design *design, struct chain_stage *chain_stage)
+{
+   bool halfband = design->kind != STAGE_FRACTIONAL;
+   struct sinc_stage_q15 *stage = memalign(16, halfband ? sizeof(struct halfband_stage_q15) : sizeof(*stage));
+   if (!stage)
+      return false;
+
+   memset(stage, 0, halfband ? sizeof(struct halfband_stage_q15) : sizeof(*stage));
+
+   // Half-band stages have a single phase, which does not change.
+   unsigned phases = halfband ? 1 : PHASES;
+   stage->phase_table = memalign(16, phases * 2 * design->taps * sizeof(int16_t));
+   if (!stage->phase_table)
+   {
+      free(stage);
+      return false;
+   }
+
+   clock_init(&stage->clock, design);
+
+   if (halfband)
+   {
+      // Unlike a fractional stage, the first output frame already needs new input.
+      stage->clock.time = design->kind == STAGE_HALVE ? stage->clock.ratio : PHASES_WRAP;
+
+      for (unsigned i = 0; i < design->taps; i++)
+      {
+         // Doubling puts zeros in between input frames, which takes a gain of two to make up for.
+         double tap = halfband_tap(design, i);
+         stage->phase_table[PHASE_INDEX * design->taps + i] = to_q15(design->kind == STAGE_DOUBLE ? 2.0 * tap : tap);
+         stage->phase_table[DELTA_INDEX * design->taps + i] = 0;
+      }
+   }
+   else
+      init_sinc_table_q15(stage->phase_table, design);
+
+   *chain_stage = (struct chain_stage) {
+      .data = stage,
+      .clock = &stage->clock,
+      .process = design->kind == STAGE_HALVE ? halfband_halve_q15 :
+         (design->kind == STAGE_DOUBLE ? halfband_double_q15 : stage_process_q15),
+      .free = stage_free_q15,
+   };
+
+   return true;
+}
+
+size_t resampler_q15_required_input(const maru_resampler_q15_t *resamp, size_t out_frames)
+{
+   size_t need[MAX_STAGES + 2];
+   chain_required(&resamp->chain, out_frames, need);
+   return need[0];
+}
+
+void resampler_q15_process(maru_resampler_q15_t *resamp,
+      const int16_t *in, size_t in_frames, size_t *consumed,
+      int16_t *out, size_t out_frames, size_t *produced)
+{
+   chain_process(&resamp->chain, in, in_frames, consumed, out, out_frames, produced);
+}
+
+bool resampler_q15_process_silence(maru_resampler_q15_t *resamp,
+      int16_t *out, size_t out_frames, size_t *consumed)
+{
+   return chain_process_silence(&resamp->chain, out, out_frames, consumed);
+}
+
+maru_resampler_q15_t *resampler_q15_init(unsigned in_rate, unsigned out_rate)
+{
+   maru_resampler_q15_t *resamp = calloc(1, sizeof(*resamp));
+   if (!resamp)
+      return NULL;
+
+   if (!chain_init(&resamp->chain, in_rate, out_rate, 2 * sizeof(int16_t), stage_init_q15))
+   {
+      resampler_q15_free(resamp);
+      return NULL;
+   }
+
+   return resamp;
+}
+
+void resampler_q15_free(maru_resampler_q15_t *resamp)
+{
+   if (resamp)
+      chain_free(&resamp->chain);
+   free(resamp);
+}
@@ -17,18 +17,53 @@
 #ifndef RESAMPLER_H__
 #define RESAMPLER_H__
 
-#include <libmaru/fifo.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
 
+// Stereo sinc resampler working on blocks of interleaved float samples.
+// It does not care where input comes from, so it can be driven by any source.
 typedef struct maru_resampler maru_resampler_t;
 
-maru_resampler_t *resampler_init(maru_fifo *fifo,
-      unsigned in_rate, unsigned out_rate);
+maru_resampler_t *resampler_init(unsigned in_rate, unsigned out_rate);
 
 void resampler_free(maru_resampler_t *resamp);
 
-size_t resampler_process(struct maru_resampler *resamp,
-      float *data,
-      size_t frames);
+// Number of input frames needed to produce out_frames output frames from current state.
+size_t resampler_required_input(const maru_resampler_t *resamp, size_t out_frames);
+
+// Resamples until either out_frames frames have been produced or in_frames frames have been consumed.
+// Number of frames consumed and produced are returned in consumed and produced.
+// Input which is not consumed must be passed in again on next call.
+void resampler_process(maru_resampler_t *resamp,
+      const float *in, size_t in_frames, size_t *consumed,
+      float *out, size_t out_frames, size_t *produced);
+
+// Produces out_frames frames from resampler_required_input() frames of silent input,
+// which are returned in consumed.
+// Once earlier input has left the filter, this only advances resampler state.
+// Returns true if output is silent, in which case out is not written to.
+bool resampler_process_silence(maru_resampler_t *resamp,
+      float *out, size_t out_frames, size_t *consumed);
+
+// Fixed-point flavour of the same resampler, for targets where float SIMD is weak.
+// Input and output are interleaved stereo s16. Filter coefficients are Q15,
+// products are accumulated in 32 bits and narrowed back to s16 with saturation.
+// Functions behave like their float counterparts above.
+typedef struct maru_resampler_q15 maru_resampler_q15_t;
+
+maru_resampler_q15_t *resampler_q15_init(unsigned in_rate, unsigned out_rate);
+
+void resampler_q15_free(maru_resampler_q15_t *resamp);
+
+size_t resampler_q15_required_input(const maru_resampler_q15_t *resamp, size_t out_frames);
+
+void resampler_q15_process(maru_resampler_q15_t *resamp,
+      const int16_t *in, size_t in_frames, size_t *consumed,
+      int16_t *out, size_t out_frames, size_t *produced);
+
+bool resampler_q15_process_silence(maru_resampler_q15_t *resamp,
+      int16_t *out, size_t out_frames, size_t *consumed);
 
 #endif
 
@@ -0,0 +1,346 @@
+/*  cuse-maru - CUSE implementation of Open Sound System using libmaru.
+ *  Copyright (C) 2012 - Hans-Kristian Arntzen
+ *  Copyright (C) 2012 - Agnes Heyer
+ *
+ *  cuse-maru is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  cuse-maru is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with cuse-maru.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "reserve.h"
+#include "cuse-mix.h"
+#include "utils.h"
+#include <sched.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+// Argument of sched_setattr(), which older C libraries do not wrap.
+struct reserve_sched_attr
+{
+   uint32_t size;
+   uint32_t sched_policy;
+   uint64_t sched_flags;
+   int32_t sched_nice;
+   uint32_t sched_priority;
+   uint64_t sched_runtime;
+   uint64_t sched_deadline;
+   uint64_t sched_period;
+};
+
+// Runtime is this much more than the measured worst case, plus a fixed amount
+// for the write to the sink and wakeups, which are not measured.
+#define RESERVE_MARGIN_NUM 3
+#define RESERVE_MARGIN_DEN 2
+#define RESERVE_SLACK_NS UINT64_C(200000)
+// Smallest runtime kernel accepts.
+#define RESERVE_MIN_NS UINT64_C(1024)
+#define RESERVE_FIFO_PRIORITY 10
+#define RESERVE_CALIBRATE_FRAGMENTS 8
+
+enum reserve_policy
+{
+   RESERVE_NONE,
+   RESERVE_DEADLINE,
+   RESERVE_FIFO
+};
+
+static struct
+{
+   pthread_mutex_t lock;
+   enum reserve_policy policy;
+   pid_t tid; // Mixer thread.
+
+   uint64_t period_ns;
+   uint64_t max_runtime_ns;
+   uint64_t runtime_ns;
+
+   // Streams being mixed, and worst-case cost of each, indexed by whether they are resampled.
+   unsigned streams[2];
+   uint64_t stream_ns[2];
+   // Worst-case cost of a cycle besides its streams.
+   uint64_t cycle_ns;
+} g_reserve = {
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Mixer thread keeps its own copy of worst cases, so it only locks when one grows.
+static struct
+{
+   uint64_t stream_ns[2];
+   uint64_t cycle_ns;
+   uint64_t streams_ns; // Spent on streams so far in current cycle.
+   bool grown;
+} g_measured;
+
+static int set_deadline(pid_t tid, uint64_t runtime_ns, uint64_t period_ns)
+{
+#ifdef SYS_sched_setattr
+   struct reserve_sched_attr attr = {
+      .size           = sizeof(attr),
+      .sched_policy   = SCHED_DEADLINE,
+      .sched_runtime  = runtime_ns,
+      .sched_deadline = period_ns,
+      .sched_period   = period_ns,
+   };
+
+   return syscall(SYS_sched_setattr, tid, &attr, 0);
+#else
+   errno = ENOSYS;
+   return -1;
+#endif
+}
+
+static uint64_t thread_time_ns(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tv);
+   return tv.tv_sec * UINT64_C(1000000000) + tv.tv_nsec;
+}
+
+static uint64_t reserve_runtime_nolock(const unsigned *streams)
+{
+   uint64_t ns = g_reserve.cycle_ns +
+      streams[0] * g_reserve.stream_ns[0] +
+      streams[1] * g_reserve.stream_ns[1];
+
+   ns = ns * RESERVE_MARGIN_NUM / RESERVE_MARGIN_DEN + RESERVE_SLACK_NS;
+   return ns < RESERVE_MIN_NS ? RESERVE_MIN_NS : ns;
+}
+
+// Returns false if kernel did not grant the reservation. The old one is then kept.
+static bool reserve_apply_nolock(uint64_t runtime_ns)
+{
+   if (runtime_ns > g_reserve.max_runtime_ns)
+      runtime_ns = g_reserve.max_runtime_ns;
+
+   if (runtime_ns == g_reserve.runtime_ns)
+      return true;
+
+   if (g_reserve.policy == RESERVE_DEADLINE &&
+         set_deadline(g_reserve.tid, runtime_ns, g_reserve.period_ns) < 0)
+      return false;
+
+   g_reserve.runtime_ns = runtime_ns;
+   return true;
+}
+
+// Worst case of resampling a fragment, so resampled streams can be admitted before any has been measured.
+// Input is noise at a rate with an awkward ratio to the sink rate.
+static uint64_t calibrate_resampler(void)
+{
+   unsigned out_rate = g_state.format.sample_rate;
+   unsigned in_rate = out_rate == 44100 ? 48000 : 44100;
+   size_t frames = g_state.format.fragsize / (g_state.format.channels * g_state.format.bits / 8);
+
+   maru_resampler_t *src = NULL;
+   maru_resampler_q15_t *src_q15 = NULL;
+
+   if (g_state.fixed_point)
+      src_q15 = resampler_q15_init(in_rate, out_rate);
+   else
+      src = resampler_init(in_rate, out_rate);
+
+   if (!src && !src_q15)
+      return 0;
+
+   uint64_t worst = 0;
+   uint32_t seed = 1;
+
+   for (unsigned i = 0; i < RESERVE_CALIBRATE_FRAGMENTS; i++)
+   {
+      size_t in_frames = src ? resampler_required_input(src, frames) :
+         resampler_q15_required_input(src_q15, frames);
+
+      int16_t in[2 * in_frames];
+      float in_f[src ? 2 * in_frames : 1] AUDIO_ALIGNED;
+      float out_f[src ? 2 * frames : 1] AUDIO_ALIGNED;
+      int16_t out[src ? 1 : 2 * frames] AUDIO_ALIGNED;
+
+      for (size_t s = 0; s < 2 * in_frames; s++)
+      {
+         seed = seed * 1664525 + 1013904223;
+         in[s] = (int16_t)(seed >> 16) >> 2;
+      }
+
+      size_t consumed, produced;
+      uint64_t start_ns = thread_time_ns();
+
+      if (src)
+      {
+         audio_convert_s16_to_float(in_f, in, 2 * in_frames);
+         resampler_process(src, in_f, in_frames, &consumed, out_f, frames, &produced);
+      }
+      else
+         resampler_q15_process(src_q15, in, in_frames, &consumed, out, frames, &produced);
+
+      uint64_t ns = thread_time_ns() - start_ns;
+      if (ns > worst)
+         worst = ns;
+   }
+
+   if (src)
+      resampler_free(src);
+   if (src_q15)
+      resampler_q15_free(src_q15);
+
+   return worst;
+}
+
+bool reserve_init(unsigned percent)
+{
+   if (!percent || percent >= 100)
+   {
+      fprintf(stderr, "Reservation must be between 1 and 99 percent of fragment period.\n");
+      return false;
+   }
+
+   unsigned frame_size = g_state.format.channels * g_state.format.bits / 8;
+   g_reserve.period_ns = UINT64_C(1000000000) *
+      (g_state.format.fragsize / frame_size) / g_state.format.sample_rate;
+   g_reserve.max_runtime_ns = g_reserve.period_ns * percent / 100;
+   g_reserve.stream_ns[true] = calibrate_resampler();
+
+   fprintf(stderr, "Resampling a fragment takes %llu us, fragment period is %llu us.\n",
+         (unsigned long long)(g_reserve.stream_ns[true] / 1000),
+         (unsigned long long)(g_reserve.period_ns / 1000));
+
+   return true;
+}
+
+void reserve_start(void)
+{
+   if (!g_reserve.period_ns)
+      return;
+
+   pthread_mutex_lock(&g_reserve.lock);
+
+   g_reserve.tid = syscall(SYS_gettid);
+   memcpy(g_measured.stream_ns, g_reserve.stream_ns, sizeof(g_measured.stream_ns));
+   g_measured.cycle_ns = g_reserve.cycle_ns;
+
+   uint64_t runtime_ns = reserve_runtime_nolock(g_reserve.streams);
+   if (runtime_ns > g_reserve.max_runtime_ns)
+      runtime_ns = g_reserve.max_runtime_ns;
+
+   if (set_deadline(g_reserve.tid, runtime_ns, g_reserve.period_ns) == 0)
+   {
+      g_reserve.policy = RESERVE_DEADLINE;
+      g_reserve.runtime_ns = runtime_ns;
+   }
+   else
+   {
+      int err = errno;
+      struct sched_param param = { .sched_priority = RESERVE_FIFO_PRIORITY };
+
+      // Admission is still done against the reservation, it is just not enforced by the kernel.
+      if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0)
+      {
+         fprintf(stderr, "SCHED_DEADLINE is not available (%s), mixing with SCHED_FIFO.\n", strerror(err));
+         g_reserve.policy = RESERVE_FIFO;
+         g_reserve.runtime_ns = runtime_ns;
+      }
+      else
+         fprintf(stderr, "Neither SCHED_DEADLINE nor SCHED_FIFO is available, mixer is not reserved.\n");
+   }
+
+   pthread_mutex_unlock(&g_reserve.lock);
+}
+
+bool reserve_join(bool resampled)
+{
+   bool ret = true;
+   pthread_mutex_lock(&g_reserve.lock);
+
+   if (g_reserve.policy != RESERVE_NONE)
+   {
+      unsigned streams[2] = { g_reserve.streams[0], g_reserve.streams[1] };
+      streams[resampled]++;
+
+      uint64_t runtime_ns = reserve_runtime_nolock(streams);
+      bool fits = runtime_ns <= g_reserve.max_runtime_ns && reserve_apply_nolock(runtime_ns);
+
+      // Streams which are not resampled cost next to nothing, so they are let through regardless.
+      if (!fits && resampled)
+         ret = false;
+   }
+
+   if (ret)
+      g_reserve.streams[resampled]++;
+
+   pthread_mutex_unlock(&g_reserve.lock);
+   return ret;
+}
+
+void reserve_leave(bool resampled)
+{
+   pthread_mutex_lock(&g_reserve.lock);
+
+   if (g_reserve.streams[resampled])
+      g_reserve.streams[resampled]--;
+
+   if (g_reserve.policy != RESERVE_NONE)
+      reserve_apply_nolock(reserve_runtime_nolock(g_reserve.streams));
+
+   pthread_mutex_unlock(&g_reserve.lock);
+}
+
+uint64_t reserve_time_ns(void)
+{
+   // Only set before mixer thread starts.
+   if (!g_reserve.period_ns)
+      return 0;
+
+   return thread_time_ns();
+}
+
+void reserve_record_stream(bool resampled, uint64_t ns)
+{
+   g_measured.streams_ns += ns;
+
+   if (ns > g_measured.stream_ns[resampled])
+   {
+      g_measured.stream_ns[resampled] = ns;
+      g_measured.grown = true;
+   }
+}
+
+void reserve_record_cycle(uint64_t ns)
+{
+   uint64_t overhead_ns = ns > g_measured.streams_ns ? ns - g_measured.streams_ns : 0;
+   g_measured.streams_ns = 0;
+
+   if (overhead_ns > g_measured.cycle_ns)
+   {
+      g_measured.cycle_ns = overhead_ns;
+      g_measured.grown = true;
+   }
+
+   if (!g_measured.grown || g_reserve.policy == RESERVE_NONE)
+      return;
+
+   g_measured.grown = false;
+
+   // Streams already admitted are kept, even if they turn out to cost more than estimated.
+   pthread_mutex_lock(&g_reserve.lock);
+   memcpy(g_reserve.stream_ns, g_measured.stream_ns, sizeof(g_reserve.stream_ns));
+   g_reserve.cycle_ns = g_measured.cycle_ns;
+   reserve_apply_nolock(reserve_runtime_nolock(g_reserve.streams));
+   pthread_mutex_unlock(&g_reserve.lock);
+}
@@ -0,0 +1,51 @@
+/*  cuse-maru - CUSE implementation of Open Sound System using libmaru.
+ *  Copyright (C) 2012 - Hans-Kristian Arntzen
+ *  Copyright (C) 2012 - Agnes Heyer
+ *
+ *  cuse-maru is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  cuse-maru is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with cuse-maru.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RESERVE_H__
+#define RESERVE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// CPU reservation of the mixer thread.
+// The mixer runs under SCHED_DEADLINE, with the fragment period as period and deadline,
+// and a runtime derived from the worst-case cost of mixing the streams currently open.
+// Where SCHED_DEADLINE is not available, it runs under SCHED_FIFO, and the runtime is only used for admission.
+
+// Enables the reservation, which may take up to percent of the fragment period.
+// Must be called after the sink format is set, and before the mixer thread is started.
+bool reserve_init(unsigned percent);
+
+// Called by mixer thread when it starts.
+void reserve_start(void);
+
+// Accounts for a stream which is about to be mixed, and grows the reservation to fit it.
+// Returns false if a resampled stream does not fit. Other streams are always admitted.
+bool reserve_join(bool resampled);
+void reserve_leave(bool resampled);
+
+// CPU time of the calling thread, which the mixer thread measures its cost with.
+// Time it is preempted or blocked is left out, so it does not inflate the worst case.
+// Returns 0 if the reservation is not enabled.
+uint64_t reserve_time_ns(void);
+
+// Called by mixer thread with the CPU time spent on a stream in a cycle,
+// and the CPU time spent on the whole cycle, as measured with reserve_time_ns().
+void reserve_record_stream(bool resampled, uint64_t ns);
+void reserve_record_cycle(uint64_t ns);
+
+#endif
+
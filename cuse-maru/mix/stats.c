@@ -0,0 +1,82 @@
+/*  cuse-maru - CUSE implementation of Open Sound System using libmaru.
+ *  Copyright (C) 2012 - Hans-Kristian Arntzen
+ *  Copyright (C) 2012 - Agnes Heyer
+ *
+ *  cuse-maru is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  cuse-maru is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with cuse-maru.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+uint64_t stats_time_ns(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return tv.tv_sec * UINT64_C(1000000000) + tv.tv_nsec;
+}
+
+void stats_record_cycle(struct mix_stats *stats, struct mix_trace *trace,
+      uint64_t start_ns, uint64_t mix_ns, unsigned streams)
+{
+   bool late = mix_ns > stats->deadline_ns;
+
+   stats_add(&stats->cycles, 1);
+   stats_add(&stats->total_ns, mix_ns);
+   if (late)
+      stats_add(&stats->late_cycles, 1);
+   __atomic_store_n(&stats->last_ns, mix_ns, __ATOMIC_RELAXED);
+   if (mix_ns > stats_get(&stats->max_ns))
+      __atomic_store_n(&stats->max_ns, mix_ns, __ATOMIC_RELAXED);
+
+   if (!trace->enabled)
+      return;
+
+   uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+   trace->entries[head & (MIX_TRACE_SIZE - 1)] = (struct mix_trace_entry) {
+      .time_ns = start_ns,
+      .mix_ns  = mix_ns > UINT32_MAX ? UINT32_MAX : mix_ns,
+      .streams = streams,
+      .late    = late,
+   };
+
+   // Publish entry after it has been written.
+   __atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned mix_trace_read(const struct mix_trace *trace,
+      struct mix_trace_entry *entries, unsigned max)
+{
+   if (max > MIX_TRACE_SIZE)
+      max = MIX_TRACE_SIZE;
+
+   uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+   uint64_t start = head > max ? head - max : 0;
+
+   for (uint64_t i = start; i < head; i++)
+      entries[i - start] = trace->entries[i & (MIX_TRACE_SIZE - 1)];
+
+   // Entries which the writer might have lapped while we copied are not trustworthy.
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   uint64_t new_head = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+   uint64_t valid_start = new_head > MIX_TRACE_SIZE ? new_head - MIX_TRACE_SIZE + 1 : 0;
+
+   if (valid_start <= start)
+      return head - start;
+   if (valid_start >= head)
+      return 0;
+
+   unsigned skip = valid_start - start;
+   memmove(entries, entries + skip, (head - valid_start) * sizeof(*entries));
+   return head - valid_start;
+}
+
@@ -0,0 +1,84 @@
+/*  cuse-maru - CUSE implementation of Open Sound System using libmaru.
+ *  Copyright (C) 2012 - Hans-Kristian Arntzen
+ *  Copyright (C) 2012 - Agnes Heyer
+ *
+ *  cuse-maru is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  cuse-maru is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with cuse-maru.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H__
+#define STATS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Time spent on a stream by the mixer thread. Only written by mixer thread.
+struct stream_stats
+{
+   uint64_t resample_ns; // Resampler, including reading from fifo.
+   uint64_t convert_ns;  // Reading from fifo and converting to float when not resampling.
+   uint64_t mix_ns;      // Level metering and mixing into master buffer.
+   uint64_t fragments;
+   uint64_t silent_fragments; // Fragments skipped as digital silence.
+};
+
+// Per-cycle statistics of the mixer thread.
+struct mix_stats
+{
+   uint64_t cycles;
+   uint64_t late_cycles; // Cycles where mixing took longer than a fragment period.
+   uint64_t deadline_ns; // Length of a fragment period.
+   uint64_t last_ns;
+   uint64_t max_ns;
+   uint64_t total_ns;
+};
+
+struct mix_trace_entry
+{
+   uint64_t time_ns; // CLOCK_MONOTONIC when cycle started.
+   uint32_t mix_ns;
+   uint16_t streams;
+   uint16_t late;
+};
+
+// Single producer trace ring. Mixer thread never waits for readers,
+// old entries are simply overwritten.
+#define MIX_TRACE_SIZE 256
+struct mix_trace
+{
+   bool enabled;
+   uint64_t head;
+   struct mix_trace_entry entries[MIX_TRACE_SIZE];
+};
+
+uint64_t stats_time_ns(void);
+
+static inline void stats_add(uint64_t *counter, uint64_t val)
+{
+   // Single writer, so a relaxed load + store is enough for readers to see a consistent value.
+   __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + val, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stats_get(const uint64_t *counter)
+{
+   return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void stats_record_cycle(struct mix_stats *stats, struct mix_trace *trace,
+      uint64_t start_ns, uint64_t mix_ns, unsigned streams);
+
+// Copies out up to max of the most recent trace entries, oldest first.
+// Returns number of entries copied.
+unsigned mix_trace_read(const struct mix_trace *trace,
+      struct mix_trace_entry *entries, unsigned max);
+
+#endif
+
@@ -0,0 +1,467 @@
+/*  cuse-maru - CUSE implementation of Open Sound System using libmaru.
+ *  Copyright (C) 2012 - Hans-Kristian Arntzen
+ *  Copyright (C) 2012 - Agnes Heyer
+ *
+ *  cuse-maru is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  cuse-maru is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with cuse-maru.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Quality and throughput bench for the sinc resampler.
+// Feeds stepped sine sweeps, impulses and white noise through resampler_process()
+// for a matrix of rate pairs.
+// With -q, the same signals go through the Q15 resampler, resampler_q15_process().
+
+#include "../resampler.h"
+#include "../utils.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#if __AVX__ && __FMA__
+#define KERNEL "AVX+FMA"
+#elif __AVX__
+#define KERNEL "AVX"
+#elif __SSE__
+#define KERNEL "SSE"
+#else
+#define KERNEL "C"
+#endif
+
+#if __SSSE3__
+#define KERNEL_Q15 "Q15 SSSE3"
+#elif __SSE2__
+#define KERNEL_Q15 "Q15 SSE2"
+#elif __ARM_NEON__ || __ARM_NEON
+#define KERNEL_Q15 "Q15 NEON"
+#else
+#define KERNEL_Q15 "Q15 C"
+#endif
+
+#define INPUT_FRAMES (1 << 15)
+#define CHUNK_FRAMES 512
+#define SKIP_FRAMES 1024
+#define AMPLITUDE 0.5
+
+struct rate_pair
+{
+   unsigned in_rate;
+   unsigned out_rate;
+};
+
+static const struct rate_pair rate_pairs[] = {
+   { 44100, 48000 },
+   { 32000, 48000 },
+   { 22050, 48000 },
+   { 11025, 44100 },
+   {  8000, 48000 },
+   { 48000, 48000 },
+   { 48000, 44100 },
+   { 96000, 48000 },
+};
+
+static bool fixed_point;
+
+static double time_now(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return tv.tv_sec + tv.tv_nsec / 1e9;
+}
+
+// Same as resample(), through the Q15 resampler. Input is rounded to s16,
+// output is scaled back to float.
+static void resample_q15(const struct rate_pair *pair,
+      const float *stereo, size_t in_frames, float *out, size_t out_frames, double *elapsed)
+{
+   int16_t *input = malloc(in_frames * 2 * sizeof(int16_t));
+   if (!input)
+      exit(1);
+
+   audio_convert_float_to_s16(input, stereo, in_frames * 2);
+
+   maru_resampler_q15_t *resamp = resampler_q15_init(pair->in_rate, pair->out_rate);
+   if (!resamp)
+      exit(1);
+
+   int16_t buf[2 * CHUNK_FRAMES] AUDIO_ALIGNED;
+   const int16_t *ptr = input;
+   size_t i;
+   for (i = 0; i < out_frames && in_frames; )
+   {
+      size_t frames = out_frames - i < CHUNK_FRAMES ? out_frames - i : CHUNK_FRAMES;
+      size_t consumed, produced;
+
+      double start = elapsed ? time_now() : 0.0;
+      resampler_q15_process(resamp, ptr, in_frames, &consumed, buf, frames, &produced);
+      if (elapsed)
+         *elapsed += time_now() - start;
+
+      ptr += 2 * consumed;
+      in_frames -= consumed;
+
+      for (size_t j = 0; j < produced; j++)
+         out[i + j] = buf[2 * j] / (float)0x8000;
+
+      i += produced;
+      if (!produced)
+         break;
+   }
+
+   // Never reached with the margin of output_frames(), but analysis must not see garbage.
+   memset(out + i, 0, (out_frames - i) * sizeof(*out));
+
+   resampler_q15_free(resamp);
+   free(input);
+}
+
+// Resamples mono input, duplicated to both channels, and returns left channel of the output.
+// Time spent in resampler_process() is added to elapsed if not NULL.
+static void resample(const struct rate_pair *pair,
+      const float *in, size_t in_frames, float *out, size_t out_frames, double *elapsed)
+{
+   float *stereo = malloc(in_frames * 2 * sizeof(float));
+   if (!stereo)
+      exit(1);
+
+   for (size_t i = 0; i < in_frames; i++)
+      stereo[2 * i + 0] = stereo[2 * i + 1] = in[i];
+
+   if (fixed_point)
+   {
+      resample_q15(pair, stereo, in_frames, out, out_frames, elapsed);
+      free(stereo);
+      return;
+   }
+
+   maru_resampler_t *resamp = resampler_init(pair->in_rate, pair->out_rate);
+   if (!resamp)
+      exit(1);
+
+   float buf[2 * CHUNK_FRAMES] AUDIO_ALIGNED;
+   const float *input = stereo;
+   size_t i;
+   for (i = 0; i < out_frames && in_frames; )
+   {
+      size_t frames = out_frames - i < CHUNK_FRAMES ? out_frames - i : CHUNK_FRAMES;
+      size_t consumed, produced;
+
+      double start = elapsed ? time_now() : 0.0;
+      resampler_process(resamp, input, in_frames, &consumed, buf, frames, &produced);
+      if (elapsed)
+         *elapsed += time_now() - start;
+
+      input += 2 * consumed;
+      in_frames -= consumed;
+
+      for (size_t j = 0; j < produced; j++)
+         out[i + j] = buf[2 * j];
+
+      i += produced;
+      if (!produced)
+         break;
+   }
+
+   memset(out + i, 0, (out_frames - i) * sizeof(*out));
+
+   resampler_free(resamp);
+   free(stereo);
+}
+
+static size_t output_frames(const struct rate_pair *pair)
+{
+   // Leave some margin so the analysis never sees zero-padding at the end of input.
+   return (uint64_t)(INPUT_FRAMES - 2 * SKIP_FRAMES) * pair->out_rate / pair->in_rate;
+}
+
+static void gen_tone(float *out, size_t frames, double freq, unsigned rate)
+{
+   for (size_t i = 0; i < frames; i++)
+      out[i] = AMPLITUDE * sin(2.0 * M_PI * freq * i / rate);
+}
+
+// Least-squares fit of sinusoids at the given frequencies.
+// Amplitude of each is written to amp. Returns residual energy over fitted energy.
+#define MAX_FIT 2
+static double fit_tones(const float *data, size_t frames, unsigned rate,
+      const double *freqs, unsigned num, double *amp)
+{
+   unsigned n = 2 * num;
+   double ata[2 * MAX_FIT][2 * MAX_FIT + 1] = {{0}};
+
+   for (size_t i = 0; i < frames; i++)
+   {
+      double basis[2 * MAX_FIT];
+      for (unsigned k = 0; k < num; k++)
+      {
+         double w = 2.0 * M_PI * freqs[k] * i / rate;
+         basis[2 * k + 0] = cos(w);
+         basis[2 * k + 1] = sin(w);
+      }
+
+      for (unsigned r = 0; r < n; r++)
+      {
+         for (unsigned c = 0; c < n; c++)
+            ata[r][c] += basis[r] * basis[c];
+         ata[r][n] += basis[r] * data[i];
+      }
+   }
+
+   // Gaussian elimination, system is tiny and well conditioned.
+   for (unsigned p = 0; p < n; p++)
+   {
+      for (unsigned r = p + 1; r < n; r++)
+      {
+         double f = ata[r][p] / ata[p][p];
+         for (unsigned c = p; c <= n; c++)
+            ata[r][c] -= f * ata[p][c];
+      }
+   }
+
+   double coeff[2 * MAX_FIT];
+   for (int r = n - 1; r >= 0; r--)
+   {
+      double sum = ata[r][n];
+      for (unsigned c = r + 1; c < n; c++)
+         sum -= ata[r][c] * coeff[c];
+      coeff[r] = sum / ata[r][r];
+   }
+
+   for (unsigned k = 0; k < num; k++)
+      amp[k] = hypot(coeff[2 * k], coeff[2 * k + 1]);
+
+   double fit_energy = 0.0, res_energy = 0.0;
+   for (size_t i = 0; i < frames; i++)
+   {
+      double fit = 0.0;
+      for (unsigned k = 0; k < num; k++)
+      {
+         double w = 2.0 * M_PI * freqs[k] * i / rate;
+         fit += coeff[2 * k] * cos(w) + coeff[2 * k + 1] * sin(w);
+      }
+
+      fit_energy += fit * fit;
+      res_energy += (data[i] - fit) * (data[i] - fit);
+   }
+
+   return res_energy / fit_energy;
+}
+
+static void print_db(double val)
+{
+   if (isnan(val))
+      printf(" %9s", "-");
+   else
+      printf(" %9.2f", val);
+}
+
+static double db(double val)
+{
+   return 20.0 * log10(val);
+}
+
+// Where a frequency ends up after being sampled at rate.
+static double fold(double freq, unsigned rate)
+{
+   freq = fmod(freq, rate);
+   return freq > rate / 2.0 ? rate - freq : freq;
+}
+
+struct result
+{
+   double thd_n;
+   double ripple;
+   double stopband;
+   double aliasing;
+   double delay;
+   double fps;
+};
+
+static double measure_thd_n(const struct rate_pair *pair, float *in, float *out)
+{
+   size_t frames = output_frames(pair);
+   const double freq = 997.0;
+   double amp;
+
+   gen_tone(in, INPUT_FRAMES, freq, pair->in_rate);
+   resample(pair, in, INPUT_FRAMES, out, frames, NULL);
+   return 10.0 * log10(fit_tones(out + SKIP_FRAMES, frames - SKIP_FRAMES,
+            pair->out_rate, &freq, 1, &amp));
+}
+
+static double measure_ripple(const struct rate_pair *pair, float *in, float *out)
+{
+   size_t frames = output_frames(pair);
+   double top = 0.8 * (pair->in_rate < pair->out_rate ? pair->in_rate : pair->out_rate) / 2.0;
+   double min_gain = HUGE_VAL, max_gain = -HUGE_VAL;
+
+   // Stepped log sweep over the passband.
+   for (double freq = 20.0; freq < top; freq *= 1.25)
+   {
+      double amp;
+      gen_tone(in, INPUT_FRAMES, freq, pair->in_rate);
+      resample(pair, in, INPUT_FRAMES, out, frames, NULL);
+      fit_tones(out + SKIP_FRAMES, frames - SKIP_FRAMES, pair->out_rate, &freq, 1, &amp);
+
+      double gain = db(amp / AMPLITUDE);
+      if (gain < min_gain)
+         min_gain = gain;
+      if (gain > max_gain)
+         max_gain = gain;
+   }
+
+   return max_gain - min_gain;
+}
+
+// Worst level of an unwanted tone relative to the input tone, or NAN if no tone applies.
+static double measure_spurious(const struct rate_pair *pair, float *in, float *out, bool aliasing)
+{
+   size_t frames = output_frames(pair);
+   double worst = NAN;
+
+   for (unsigned i = 1; i < 20; i++)
+   {
+      double freq = pair->in_rate * 0.5 * i / 20.0;
+      bool above_nyquist = freq >= pair->out_rate * 0.5;
+
+      // Aliasing is input above output nyquist folding back,
+      // stopband is images of passband tones around the input rate.
+      if (aliasing != above_nyquist)
+         continue;
+
+      // A tone right at output nyquist is its own alias, and its level depends on phase.
+      if (aliasing && freq == pair->out_rate * 0.5)
+         continue;
+
+      double tones[2] = { aliasing ? fold(freq, pair->out_rate) : freq,
+         fold(pair->in_rate - freq, pair->out_rate) };
+
+      // Image lands on the tone itself or on DC/nyquist, it cannot be measured.
+      if (!aliasing && (fabs(tones[1] - tones[0]) < 50.0 ||
+               tones[1] < 50.0 || tones[1] > pair->out_rate * 0.5 - 50.0))
+         continue;
+
+      // Past the filter cutoff, tone is not supposed to pass.
+      if (!aliasing && freq > 0.8 * pair->in_rate * 0.5)
+         continue;
+
+      double amp[2];
+      gen_tone(in, INPUT_FRAMES, freq, pair->in_rate);
+      resample(pair, in, INPUT_FRAMES, out, frames, NULL);
+      fit_tones(out + SKIP_FRAMES, frames - SKIP_FRAMES, pair->out_rate,
+            tones, aliasing ? 1 : 2, amp);
+
+      double level = db((aliasing ? amp[0] : amp[1]) / AMPLITUDE);
+      if (isnan(worst) || level > worst)
+         worst = level;
+   }
+
+   return worst;
+}
+
+// Delay in input frames between an impulse and the peak of the output.
+static double measure_delay(const struct rate_pair *pair, float *in, float *out)
+{
+   size_t frames = output_frames(pair);
+   const size_t pos = 1000;
+
+   memset(in, 0, INPUT_FRAMES * sizeof(float));
+   in[pos] = 1.0f;
+   resample(pair, in, INPUT_FRAMES, out, frames, NULL);
+
+   size_t peak = 1;
+   for (size_t i = 1; i < frames - 1; i++)
+      if (fabsf(out[i]) > fabsf(out[peak]))
+         peak = i;
+
+   // Parabolic interpolation around peak.
+   double a = out[peak - 1], b = out[peak], c = out[peak + 1];
+   double denom = a - 2.0 * b + c;
+   double offset = denom != 0.0 ? 0.5 * (a - c) / denom : 0.0;
+
+   return (peak + offset) * pair->in_rate / pair->out_rate - pos;
+}
+
+static double measure_fps(const struct rate_pair *pair, float *in, float *out)
+{
+   size_t frames = output_frames(pair);
+
+   srand(0);
+   for (size_t i = 0; i < INPUT_FRAMES; i++)
+      in[i] = AMPLITUDE * (2.0f * rand() / RAND_MAX - 1.0f);
+
+   unsigned iterations = 0;
+   double elapsed = 0.0;
+
+   do
+   {
+      resample(pair, in, INPUT_FRAMES, out, frames, &elapsed);
+      iterations++;
+   } while (elapsed < 0.5);
+
+   return iterations * frames / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+   if (argc > 1)
+   {
+      if (argc > 2 || strcmp(argv[1], "-q"))
+      {
+         fprintf(stderr, "Usage: %s [-q]\n", argv[0]);
+         return 1;
+      }
+
+      fixed_point = true;
+   }
+
+   float *in = malloc(INPUT_FRAMES * sizeof(float));
+   float *out = malloc(2 * INPUT_FRAMES * 8 * sizeof(float));
+   if (!in || !out)
+      return 1;
+
+   printf("Kernel: %s\n", fixed_point ? KERNEL_Q15 : KERNEL);
+   printf("Delay is in input frames. Aliasing only applies when downsampling.\n");
+   printf("%13s %9s %9s %9s %9s %9s %12s\n",
+         "rates", "THD+N dB", "ripple dB", "stop dB", "alias dB", "delay", "frames/s");
+
+   for (unsigned i = 0; i < sizeof(rate_pairs) / sizeof(rate_pairs[0]); i++)
+   {
+      const struct rate_pair *pair = &rate_pairs[i];
+      struct result res = {
+         .thd_n    = measure_thd_n(pair, in, out),
+         .ripple   = measure_ripple(pair, in, out),
+         .stopband = measure_spurious(pair, in, out, false),
+         .aliasing = measure_spurious(pair, in, out, true),
+         .delay    = measure_delay(pair, in, out),
+         .fps      = measure_fps(pair, in, out),
+      };
+
+      char rates[32];
+      snprintf(rates, sizeof(rates), "%u>%u", pair->in_rate, pair->out_rate);
+
+      printf("%13s", rates);
+      print_db(res.thd_n);
+      printf(" %9.3f", res.ripple);
+      print_db(res.stopband);
+      print_db(res.aliasing);
+      printf(" %9.2f %12.0f\n", res.delay, res.fps);
+   }
+
+   free(in);
+   free(out);
+   return 0;
+}
+
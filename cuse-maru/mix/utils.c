@@ -15,11 +15,14 @@
  */
 
 #include "utils.h"
+#include <math.h>
 
 #if __SSE2__
 #include <emmintrin.h>
 #elif __ALTIVEC__
 #include <altivec.h>
+#elif __ARM_NEON__ || __ARM_NEON
+#include <arm_neon.h>
 #endif
 
 void audio_convert_s16_to_float_C(float *out,
@@ -45,6 +48,53 @@ void audio_mix_volume_C(float *out, const float *in, float vol, size_t samples)
       out[i] += in[i] * vol;
 }
 
+float audio_peak_C(const float *in, size_t samples)
+{
+   float peak = 0.0f;
+   for (size_t i = 0; i < samples; i++)
+   {
+      float val = fabsf(in[i]);
+      if (val > peak)
+         peak = val;
+   }
+
+   return peak;
+}
+
+bool audio_is_silent_C(const int16_t *in, size_t samples)
+{
+   int16_t bits = 0;
+   for (size_t i = 0; i < samples; i++)
+      bits |= in[i];
+
+   return bits == 0;
+}
+
+void audio_mix_volume_s16_C(int32_t *out, const int16_t *in, int32_t vol, size_t samples)
+{
+   for (size_t i = 0; i < samples; i++)
+      out[i] += (in[i] * vol) >> 15;
+}
+
+void audio_convert_s32_to_s16_C(int16_t *out, const int32_t *in, size_t samples)
+{
+   for (size_t i = 0; i < samples; i++)
+      out[i] = (in[i] > 0x7FFF) ? 0x7FFF : (in[i] < -0x8000 ? -0x8000 : (int16_t)in[i]);
+}
+
+int16_t audio_peak_s16_C(const int16_t *in, size_t samples)
+{
+   int32_t peak = 0;
+   for (size_t i = 0; i < samples; i++)
+   {
+      int32_t val = in[i] < 0 ? -in[i] : in[i];
+      if (val > peak)
+         peak = val;
+   }
+
+   return peak > 0x7FFF ? 0x7FFF : peak;
+}
+
 #if __SSE2__
 void audio_convert_s16_to_float_SSE2(float *out,
       const int16_t *in, size_t samples)
@@ -118,6 +168,112 @@ void audio_mix_volume_SSE2(float *out, const float *in, float vol, size_t sample
    audio_mix_volume_C(out + i, in + i, vol, samples - i);
 }
 
+float audio_peak_SSE2(const float *in, size_t samples)
+{
+   // Clearing sign bit gives absolute value.
+   __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+   __m128 peak = _mm_setzero_ps();
+
+   size_t i;
+   for (i = 0; i + 4 <= samples; i += 4)
+      peak = _mm_max_ps(peak, _mm_and_ps(abs_mask, _mm_loadu_ps(in + i)));
+
+   peak = _mm_max_ps(peak, _mm_shuffle_ps(peak, peak, _MM_SHUFFLE(1, 0, 3, 2)));
+   peak = _mm_max_ps(peak, _mm_shuffle_ps(peak, peak, _MM_SHUFFLE(2, 3, 0, 1)));
+
+   float res = _mm_cvtss_f32(peak);
+   float rest = audio_peak_C(in + i, samples - i);
+   return rest > res ? rest : res;
+}
+
+bool audio_is_silent_SSE2(const int16_t *in, size_t samples)
+{
+   size_t i;
+   for (i = 0; i + 32 <= samples; i += 32)
+   {
+      // OR a few vectors together before testing to keep branches out of the way.
+      __m128i bits = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(in + i +  0)),
+               _mm_loadu_si128((const __m128i*)(in + i +  8))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(in + i + 16)),
+               _mm_loadu_si128((const __m128i*)(in + i + 24))));
+
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) != 0xffff)
+         return false;
+   }
+
+   return audio_is_silent_C(in + i, samples - i);
+}
+
+void audio_mix_volume_s16_SSE2(int32_t *out, const int16_t *in, int32_t vol, size_t samples)
+{
+   // Unity volume does not fit in 16 bits, it is a plain sign extension.
+   bool unity = vol >= 0x8000;
+   __m128i volume = _mm_set1_epi16(unity ? 0 : vol);
+
+   size_t i;
+   for (i = 0; i + 8 <= samples; i += 8)
+   {
+      __m128i input = _mm_loadu_si128((const __m128i*)(in + i));
+      __m128i res[2];
+
+      if (unity)
+      {
+         res[0] = _mm_srai_epi32(_mm_unpacklo_epi16(input, input), 16);
+         res[1] = _mm_srai_epi32(_mm_unpackhi_epi16(input, input), 16);
+      }
+      else
+      {
+         // Full 32-bit products from their low and high halves.
+         __m128i lo = _mm_mullo_epi16(input, volume);
+         __m128i hi = _mm_mulhi_epi16(input, volume);
+         res[0] = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 15);
+         res[1] = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 15);
+      }
+
+      _mm_storeu_si128((__m128i*)(out + i + 0),
+            _mm_add_epi32(_mm_loadu_si128((const __m128i*)(out + i + 0)), res[0]));
+      _mm_storeu_si128((__m128i*)(out + i + 4),
+            _mm_add_epi32(_mm_loadu_si128((const __m128i*)(out + i + 4)), res[1]));
+   }
+
+   audio_mix_volume_s16_C(out + i, in + i, vol, samples - i);
+}
+
+void audio_convert_s32_to_s16_SSE2(int16_t *out, const int32_t *in, size_t samples)
+{
+   size_t i;
+   for (i = 0; i + 8 <= samples; i += 8)
+   {
+      __m128i packed = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)(in + i + 0)),
+            _mm_loadu_si128((const __m128i*)(in + i + 4)));
+      _mm_storeu_si128((__m128i*)(out + i), packed);
+   }
+
+   audio_convert_s32_to_s16_C(out + i, in + i, samples - i);
+}
+
+int16_t audio_peak_s16_SSE2(const int16_t *in, size_t samples)
+{
+   __m128i peak = _mm_setzero_si128();
+
+   size_t i;
+   for (i = 0; i + 8 <= samples; i += 8)
+   {
+      // Saturating negation, so -0x8000 ends up as 0x7fff.
+      __m128i input = _mm_loadu_si128((const __m128i*)(in + i));
+      peak = _mm_max_epi16(peak, _mm_max_epi16(input, _mm_subs_epi16(_mm_setzero_si128(), input)));
+   }
+
+   peak = _mm_max_epi16(peak, _mm_srli_si128(peak, 8));
+   peak = _mm_max_epi16(peak, _mm_srli_si128(peak, 4));
+   peak = _mm_max_epi16(peak, _mm_srli_si128(peak, 2));
+
+   int16_t res = _mm_cvtsi128_si32(peak);
+   int16_t rest = audio_peak_s16_C(in + i, samples - i);
+   return rest > res ? rest : res;
+}
+
 #elif __ALTIVEC__
 void audio_convert_s16_to_float_altivec(float *out,
       const int16_t *in, size_t samples)
@@ -166,5 +322,50 @@ void audio_convert_float_to_s16_altivec(int16_t *out,
       audio_convert_float_to_s16_C(out, in, samples);
 }
 
-#endif
+#elif __ARM_NEON__ || __ARM_NEON
+void audio_mix_volume_s16_NEON(int32_t *out, const int16_t *in, int32_t vol, size_t samples)
+{
+   size_t i;
+   for (i = 0; i + 8 <= samples; i += 8)
+   {
+      int16x8_t input = vld1q_s16(in + i);
+      int32x4_t lo = vshrq_n_s32(vmulq_n_s32(vmovl_s16(vget_low_s16(input)), vol), 15);
+      int32x4_t hi = vshrq_n_s32(vmulq_n_s32(vmovl_s16(vget_high_s16(input)), vol), 15);
+
+      vst1q_s32(out + i + 0, vaddq_s32(vld1q_s32(out + i + 0), lo));
+      vst1q_s32(out + i + 4, vaddq_s32(vld1q_s32(out + i + 4), hi));
+   }
 
+   audio_mix_volume_s16_C(out + i, in + i, vol, samples - i);
+}
+
+void audio_convert_s32_to_s16_NEON(int16_t *out, const int32_t *in, size_t samples)
+{
+   size_t i;
+   for (i = 0; i + 8 <= samples; i += 8)
+   {
+      vst1q_s16(out + i, vcombine_s16(vqmovn_s32(vld1q_s32(in + i + 0)),
+               vqmovn_s32(vld1q_s32(in + i + 4))));
+   }
+
+   audio_convert_s32_to_s16_C(out + i, in + i, samples - i);
+}
+
+int16_t audio_peak_s16_NEON(const int16_t *in, size_t samples)
+{
+   int16x8_t peak = vdupq_n_s16(0);
+
+   size_t i;
+   for (i = 0; i + 8 <= samples; i += 8)
+      peak = vmaxq_s16(peak, vqabsq_s16(vld1q_s16(in + i)));
+
+   int16x4_t half = vmax_s16(vget_low_s16(peak), vget_high_s16(peak));
+   half = vpmax_s16(half, half);
+   half = vpmax_s16(half, half);
+
+   int16_t res = vget_lane_s16(half, 0);
+   int16_t rest = audio_peak_s16_C(in + i, samples - i);
+   return rest > res ? rest : res;
+}
+
+#endif
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #define AUDIO_ALIGNED __attribute__((aligned(16)))
 
@@ -26,6 +27,11 @@
 #define audio_convert_s16_to_float audio_convert_s16_to_float_SSE2
 #define audio_convert_float_to_s16 audio_convert_float_to_s16_SSE2
 #define audio_mix_volume           audio_mix_volume_SSE2
+#define audio_peak                 audio_peak_SSE2
+#define audio_is_silent            audio_is_silent_SSE2
+#define audio_mix_volume_s16       audio_mix_volume_s16_SSE2
+#define audio_convert_s32_to_s16   audio_convert_s32_to_s16_SSE2
+#define audio_peak_s16             audio_peak_s16_SSE2
 
 void audio_convert_s16_to_float_SSE2(float *out,
       const int16_t *in, size_t samples);
@@ -36,9 +42,26 @@ void audio_convert_float_to_s16_SSE2(int16_t *out,
 void audio_mix_volume_SSE2(float *out,
       const float *in, float vol, size_t samples);
 
+float audio_peak_SSE2(const float *in, size_t samples);
+
+bool audio_is_silent_SSE2(const int16_t *in, size_t samples);
+
+void audio_mix_volume_s16_SSE2(int32_t *out,
+      const int16_t *in, int32_t vol, size_t samples);
+
+void audio_convert_s32_to_s16_SSE2(int16_t *out,
+      const int32_t *in, size_t samples);
+
+int16_t audio_peak_s16_SSE2(const int16_t *in, size_t samples);
+
 #elif __ALTIVEC__
 #define audio_convert_s16_to_float audio_convert_s16_to_float_altivec
 #define audio_convert_float_to_s16 audio_convert_float_to_s16_altivec
+#define audio_peak                 audio_peak_C
+#define audio_is_silent            audio_is_silent_C
+#define audio_mix_volume_s16       audio_mix_volume_s16_C
+#define audio_convert_s32_to_s16   audio_convert_s32_to_s16_C
+#define audio_peak_s16             audio_peak_s16_C
 
 void audio_convert_s16_to_float_altivec(float *out,
       const int16_t *in, size_t samples);
@@ -46,10 +69,34 @@ void audio_convert_s16_to_float_altivec(float *out,
 void audio_convert_float_to_s16_altivec(int16_t *out,
       const float *in, size_t samples);
 
+#elif __ARM_NEON__ || __ARM_NEON
+// Only the fixed-point path has NEON kernels.
+#define audio_convert_s16_to_float audio_convert_s16_to_float_C
+#define audio_convert_float_to_s16 audio_convert_float_to_s16_C
+#define audio_mix_volume           audio_mix_volume_C
+#define audio_peak                 audio_peak_C
+#define audio_is_silent            audio_is_silent_C
+#define audio_mix_volume_s16       audio_mix_volume_s16_NEON
+#define audio_convert_s32_to_s16   audio_convert_s32_to_s16_NEON
+#define audio_peak_s16             audio_peak_s16_NEON
+
+void audio_mix_volume_s16_NEON(int32_t *out,
+      const int16_t *in, int32_t vol, size_t samples);
+
+void audio_convert_s32_to_s16_NEON(int16_t *out,
+      const int32_t *in, size_t samples);
+
+int16_t audio_peak_s16_NEON(const int16_t *in, size_t samples);
+
 #else
 #define audio_convert_s16_to_float audio_convert_s16_to_float_C
 #define audio_convert_float_to_s16 audio_convert_float_to_s16_C
 #define audio_mix_volume           audio_mix_volume_C
+#define audio_peak                 audio_peak_C
+#define audio_is_silent            audio_is_silent_C
+#define audio_mix_volume_s16       audio_mix_volume_s16_C
+#define audio_convert_s32_to_s16   audio_convert_s32_to_s16_C
+#define audio_peak_s16             audio_peak_s16_C
 #endif
 
 void audio_convert_s16_to_float_C(float *out,
@@ -59,5 +106,19 @@ void audio_convert_float_to_s16_C(int16_t *out,
 
 void audio_mix_volume_C(float *dst, const float *src, float vol, size_t samples);
 
+// Returns largest absolute sample value.
+float audio_peak_C(const float *in, size_t samples);
+
+// Returns true if every sample is zero (digital silence).
+bool audio_is_silent_C(const int16_t *in, size_t samples);
+
+// Fixed-point mixing. Samples are mixed into 32-bit accumulators with a Q15 volume,
+// where 0x8000 is unity, and narrowed back to s16 with saturation.
+void audio_mix_volume_s16_C(int32_t *out, const int16_t *in, int32_t vol, size_t samples);
+void audio_convert_s32_to_s16_C(int16_t *out, const int32_t *in, size_t samples);
+
+// Returns largest absolute sample value, saturated to 0x7fff.
+int16_t audio_peak_s16_C(const int16_t *in, size_t samples);
+
 #endif
 
@@ -0,0 +1,327 @@
+/*  cuse-maru - CUSE implementation of Open Sound System using libmaru.
+ *  Copyright (C) 2012 - Hans-Kristian Arntzen
+ *  Copyright (C) 2012 - Agnes Heyer
+ *
+ *  cuse-maru is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  cuse-maru is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with cuse-maru.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "session.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+// Same buffer size as libfuse uses for /dev/cuse.
+#define SESSION_BUFSIZE 0x21000
+
+// Kernel protocol, as in linux/fuse.h. That header clashes with libfuse headers.
+#define SESSION_CUSE_INIT 4096
+
+struct session_in_header
+{
+   uint32_t len;
+   uint32_t opcode;
+   uint64_t unique;
+   uint64_t nodeid;
+   uint32_t uid;
+   uint32_t gid;
+   uint32_t pid;
+   uint32_t padding;
+};
+
+struct session_cuse_init_in
+{
+   uint32_t major;
+   uint32_t minor;
+   uint32_t unused;
+   uint32_t flags;
+};
+
+static struct fuse_session *g_se;
+static struct fuse_chan *g_ch;
+static struct cuse_lowlevel_ops g_clop;
+static void (*g_init)(void *userdata, struct fuse_conn_info *conn);
+static struct session_handover g_handover = { .fd = -1 };
+
+// Readable while paused or ended, so workers waiting for requests wake up.
+static int g_wake_fd = -1;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static bool g_paused;
+// Requests read, but not processed yet.
+static unsigned g_busy;
+// Set while replaying CUSE_INIT to a session taken over, which kernel has already replied to.
+static bool g_replaying;
+
+// Set if worker holds a request in g_busy.
+static __thread bool t_busy;
+
+static void session_init(void *userdata, struct fuse_conn_info *conn)
+{
+   g_handover.proto_major = conn->proto_major;
+   g_handover.proto_minor = conn->proto_minor;
+
+   if (g_init)
+      g_init(userdata, conn);
+}
+
+static void request_done(void)
+{
+   if (!t_busy)
+      return;
+
+   pthread_mutex_lock(&g_lock);
+   g_busy--;
+   pthread_cond_broadcast(&g_cond);
+   pthread_mutex_unlock(&g_lock);
+   t_busy = false;
+}
+
+// Processing a request is not reported back to the channel,
+// so a request is done once its worker comes back for the next one.
+static int chan_receive(struct fuse_chan **chp, char *buf, size_t size)
+{
+   struct fuse_chan *ch = *chp;
+   struct fuse_session *se = fuse_chan_session(ch);
+
+   request_done();
+
+   for (;;)
+   {
+      struct pollfd fds[2] = {
+         { .fd = fuse_chan_fd(ch), .events = POLLIN },
+         { .fd = g_wake_fd, .events = POLLIN },
+      };
+
+      if (poll(fds, 2, -1) < 0)
+         return errno == EINTR ? -EINTR : -errno;
+
+      pthread_mutex_lock(&g_lock);
+
+      while (g_paused && !fuse_session_exited(se))
+         pthread_cond_wait(&g_cond, &g_lock);
+
+      if (fuse_session_exited(se))
+      {
+         pthread_mutex_unlock(&g_lock);
+         return 0;
+      }
+
+      ssize_t ret = read(fuse_chan_fd(ch), buf, size);
+      int err = errno;
+      if (ret >= 0)
+      {
+         g_busy++;
+         t_busy = true;
+      }
+
+      pthread_mutex_unlock(&g_lock);
+
+      if (ret < 0)
+      {
+         // Another worker got the request, or it was interrupted.
+         if (err == EAGAIN || err == EINTR || err == ENOENT)
+            continue;
+
+         if (err == ENODEV)
+         {
+            fuse_session_exit(se);
+            return 0;
+         }
+
+         perror("cuse: reading device");
+         return -err;
+      }
+
+      if ((size_t)ret < sizeof(struct session_in_header))
+      {
+         fprintf(stderr, "cuse: short read on device\n");
+         return -EIO;
+      }
+
+      return ret;
+   }
+}
+
+static int chan_send(struct fuse_chan *ch, const struct iovec iov[], size_t count)
+{
+   if (g_replaying)
+      return 0;
+
+   if (writev(fuse_chan_fd(ch), iov, count) < 0)
+   {
+      int err = errno;
+
+      // ENOENT means the request was interrupted.
+      if (!fuse_session_exited(fuse_chan_session(ch)) && err != ENOENT)
+         perror("cuse: writing device");
+      return -err;
+   }
+
+   return 0;
+}
+
+static void chan_destroy(struct fuse_chan *ch)
+{
+   close(fuse_chan_fd(ch));
+}
+
+static struct fuse_chan_ops g_chan_ops = {
+   .receive = chan_receive,
+   .send    = chan_send,
+   .destroy = chan_destroy,
+};
+
+// Kernel only sends CUSE_INIT once per device,
+// so the new process is brought to the same state by processing a copy of it.
+static void replay_init(const struct session_handover *handover)
+{
+   struct
+   {
+      struct session_in_header hdr;
+      struct session_cuse_init_in init;
+   } req = {
+      .hdr = {
+         .len    = sizeof(req),
+         .opcode = SESSION_CUSE_INIT,
+      },
+      .init = {
+         .major = handover->proto_major,
+         .minor = handover->proto_minor,
+      },
+   };
+
+   g_replaying = true;
+   fuse_session_process(g_se, (const char*)&req, sizeof(req), g_ch);
+   g_replaying = false;
+}
+
+struct fuse_session *session_setup(int argc, char *argv[],
+      const struct cuse_info *ci, const struct cuse_lowlevel_ops *clop,
+      const struct session_handover *handover, int *multithreaded)
+{
+   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+   int foreground;
+
+   if (fuse_parse_cmdline(&args, NULL, multithreaded, &foreground) < 0)
+      return NULL;
+
+   g_clop = *clop;
+   g_init = clop->init;
+   g_clop.init = session_init;
+
+   g_se = cuse_lowlevel_new(&args, ci, &g_clop, NULL);
+   fuse_opt_free_args(&args);
+   if (!g_se)
+      return NULL;
+
+   g_wake_fd = eventfd(0, EFD_CLOEXEC);
+   if (g_wake_fd < 0)
+      goto error;
+
+   int fd = handover ? handover->fd : open("/dev/cuse", O_RDWR | O_CLOEXEC);
+   if (fd < 0)
+   {
+      if (errno == ENODEV || errno == ENOENT)
+         fprintf(stderr, "cuse: device not found, try 'modprobe cuse' first\n");
+      else
+         perror("cuse: failed to open /dev/cuse");
+      goto error;
+   }
+
+   // Several workers poll the same descriptor, and only one of them gets a request.
+   if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+   {
+      close(fd);
+      goto error;
+   }
+
+   g_ch = fuse_chan_new(&g_chan_ops, fd, SESSION_BUFSIZE, NULL);
+   if (!g_ch)
+   {
+      close(fd);
+      goto error;
+   }
+
+   fuse_session_add_chan(g_se, g_ch);
+   g_handover.fd = fd;
+
+   if (handover)
+      replay_init(handover);
+
+   if (fuse_set_signal_handlers(g_se) < 0)
+      goto error;
+
+   return g_se;
+
+error:
+   fuse_session_destroy(g_se);
+   g_se = NULL;
+   return NULL;
+}
+
+void session_teardown(struct fuse_session *se)
+{
+   fuse_remove_signal_handlers(se);
+   fuse_session_destroy(se);
+}
+
+void session_pause(void)
+{
+   pthread_mutex_lock(&g_lock);
+
+   g_paused = true;
+   eventfd_write(g_wake_fd, 1);
+
+   while (g_busy)
+      pthread_cond_wait(&g_cond, &g_lock);
+
+   pthread_mutex_unlock(&g_lock);
+}
+
+void session_resume(void)
+{
+   eventfd_t dummy;
+
+   pthread_mutex_lock(&g_lock);
+
+   g_paused = false;
+   eventfd_read(g_wake_fd, &dummy);
+   pthread_cond_broadcast(&g_cond);
+
+   pthread_mutex_unlock(&g_lock);
+}
+
+void session_end(void)
+{
+   pthread_mutex_lock(&g_lock);
+
+   fuse_session_exit(g_se);
+   eventfd_write(g_wake_fd, 1);
+   pthread_cond_broadcast(&g_cond);
+
+   pthread_mutex_unlock(&g_lock);
+}
+
+void session_get_handover(struct session_handover *handover)
+{
+   *handover = g_handover;
+}
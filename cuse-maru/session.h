@@ -0,0 +1,64 @@
+/*  cuse-maru - CUSE implementation of Open Sound System using libmaru.
+ *  Copyright (C) 2012 - Hans-Kristian Arntzen
+ *  Copyright (C) 2012 - Agnes Heyer
+ *
+ *  cuse-maru is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  cuse-maru is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with cuse-maru.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SESSION_H__
+#define SESSION_H__
+
+#include <stdbool.h>
+#include <cuse_lowlevel.h>
+
+/** \ingroup internal
+ * \brief CUSE session taken over from a previous cuse-maru process. */
+struct session_handover
+{
+   /** /dev/cuse descriptor of the session. */
+   int fd;
+   /** Protocol version the kernel initialized the session with. */
+   unsigned proto_major;
+   unsigned proto_minor;
+};
+
+/** \ingroup internal
+ * \brief Sets up a CUSE session like cuse_lowlevel_setup(), with a channel that can be paused.
+ *
+ * If handover is not NULL, the session is picked up where a previous process left it,
+ * rather than creating a new device.
+ */
+struct fuse_session *session_setup(int argc, char *argv[],
+      const struct cuse_info *ci, const struct cuse_lowlevel_ops *clop,
+      const struct session_handover *handover, int *multithreaded);
+
+void session_teardown(struct fuse_session *se);
+
+/** \ingroup internal
+ * \brief Stops reading requests, and waits until requests being processed have been replied to. */
+void session_pause(void);
+
+/** \ingroup internal
+ * \brief Reads requests again after session_pause(). */
+void session_resume(void);
+
+/** \ingroup internal
+ * \brief Ends session loop without reading any more requests.
+ * Requests not read yet are left to the process session was handed over to. */
+void session_end(void);
+
+/** \ingroup internal
+ * \brief Gets what a new process needs to take over session. */
+void session_get_handover(struct session_handover *handover);
+
+#endif
+
@@ -17,6 +17,27 @@
 #ifndef MARU_UTILS_H__
 #define MARU_UTILS_H__
 
+// USDT probes of the cuse_maru provider. They compile to a nop with sys/sdt.h,
+// and to nothing without it or with CUSE_MARU_NO_PROBES defined. See README.
+// Arguments are only evaluated while a tracer has raised the semaphore of the probe,
+// which the file using it defines with CUSE_PROBE_SEMAPHORE().
+#if !defined(CUSE_MARU_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define CUSE_PROBE_SEMAPHORE(name) \
+   unsigned short cuse_maru_##name##_semaphore __attribute__((unused, section(".probes")))
+#define CUSE_PROBE4(name, a, b, c, d) do { \
+   if (__builtin_expect(cuse_maru_##name##_semaphore != 0, 0)) \
+      DTRACE_PROBE4(cuse_maru, name, a, b, c, d); } while (0)
+#endif
+#endif
+
+#ifndef CUSE_PROBE4
+#define CUSE_PROBE_SEMAPHORE(name) struct cuse_probe_##name
+#define CUSE_PROBE4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
 static inline unsigned next_pot(unsigned v)
 {
    v--;
@@ -18,6 +18,7 @@
  */
 
 #include "fifo.h"
+#include "probes.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -31,6 +32,11 @@
 #include <pthread.h>
 #include <sys/eventfd.h>
 
+MARU_PROBE_SEMAPHORE(fifo_write_lock);
+MARU_PROBE_SEMAPHORE(fifo_write_unlock);
+MARU_PROBE_SEMAPHORE(fifo_read_lock);
+MARU_PROBE_SEMAPHORE(fifo_read_unlock);
+
 struct maru_fifo
 {
    /** The underlying ring buffer. */
@@ -77,6 +83,64 @@ struct maru_fifo
 
    /** Tells if fifo is dead (killed by maru_fifo_kill_notification(). */
    bool dead;
+
+   /** Buffer replaced by maru_fifo_resize() while the reader still held regions in it.
+    * It is freed when the last of those regions is unlocked. */
+   uint8_t *old_buffer;
+   /** Mask of old_buffer. */
+   size_t old_buffer_mask;
+   /** Offset in old_buffer of the next region to be unlocked. */
+   size_t old_read_pos;
+   /** Bytes still locked for reading in old_buffer. */
+   size_t old_locked;
+
+   /** Broadcast fifo this fifo is a reader of, or NULL.
+    * The buffer and writer side of a reader belong to the broadcast fifo. */
+   maru_bfifo *bcast;
+   /** Set if unread data is dropped rather than holding back the writer of bcast. */
+   bool drop_on_lag;
+   /** Set by writer of bcast if data up to drop_to is to be dropped.
+    * Only the reader side moves its cursors, so it drops the data itself. */
+   bool drop_pending;
+   size_t drop_to;
+   /** Set if data was dropped while regions were locked for reading.
+    * read_lock_begin jumps from skip_begin to skip_end once they are unlocked. */
+   bool skipping;
+   size_t skip_begin;
+   size_t skip_end;
+   /** Bytes dropped. */
+   uint64_t dropped;
+};
+
+struct maru_bfifo
+{
+   /** The underlying ring buffer, shared by all readers. */
+   uint8_t *buffer;
+   /** Total allocated size of the buffer. */
+   size_t buffer_size;
+   /** A bitmask to wrap around the pointers. */
+   size_t buffer_mask;
+
+   /** Holds the beginning of the locked write region. Readers have seen everything up to here. */
+   size_t write_lock_begin;
+   /** Holds the end of the locked write region. */
+   size_t write_lock_end;
+
+   /** Notification fd for writer side. Readers signal it directly. */
+   int write_fd;
+   /** Trigger for how many bytes must be available to issue a notification. */
+   size_t write_trigger;
+
+   /** Lock. Taken before the lock of any reader. */
+   pthread_mutex_t lock;
+   /** Tells if fifo is dead (killed by maru_bfifo_kill_notification(). */
+   bool dead;
+
+   /** Reader fifos. */
+   maru_fifo **readers;
+   unsigned num_readers;
+   /** Writer and readers each hold a reference. */
+   unsigned refs;
 };
 
 static inline void fifo_lock(maru_fifo *fifo)
@@ -89,11 +153,21 @@ static inline void fifo_unlock(maru_fifo *fifo)
    pthread_mutex_unlock(&fifo->lock);
 }
 
+static void bfifo_remove_reader(maru_bfifo *fifo, maru_fifo *reader);
+
 void maru_fifo_free(maru_fifo *fifo)
 {
    if (!fifo)
       return;
 
+   // Buffer and writer notification are not ours to free.
+   if (fifo->bcast)
+   {
+      bfifo_remove_reader(fifo->bcast, fifo);
+      fifo->buffer = NULL;
+      fifo->write_fd = -1;
+   }
+
    pthread_mutex_destroy(&fifo->lock);
 
    if (fifo->read_fd >= 0)
@@ -101,6 +175,7 @@ void maru_fifo_free(maru_fifo *fifo)
    if (fifo->write_fd >= 0)
       close(fifo->write_fd);
 
+   free(fifo->old_buffer);
    free(fifo->buffer);
    free(fifo);
 }
@@ -187,6 +262,55 @@ static inline size_t maru_fifo_write_avail_nolock(maru_fifo *fifo)
    return (fifo->read_lock_begin + fifo->buffer_size - fifo->write_lock_end - 1) & fifo->buffer_mask;
 }
 
+// Readers of a broadcast fifo wake its writer by the trigger of the broadcast fifo.
+static inline void maru_fifo_notify_writer_nolock(maru_fifo *fifo)
+{
+   size_t trigger = fifo->bcast ?
+      __atomic_load_n(&fifo->bcast->write_trigger, __ATOMIC_RELAXED) : fifo->write_trigger;
+
+   if (maru_fifo_write_avail_nolock(fifo) >= trigger && fifo->write_fd >= 0)
+      eventfd_write(fifo->write_fd, 1);
+}
+
+// Drops data marked by the writer of a broadcast fifo.
+// Data the reader has seen as readable is never taken away between it checking and locking it,
+// so this is only called from reader side.
+static void maru_fifo_apply_drop_nolock(maru_fifo *fifo)
+{
+   if (!fifo->drop_pending)
+      return;
+
+   size_t drop = (fifo->drop_to - fifo->read_lock_end) & fifo->buffer_mask;
+   if (!drop || drop > maru_fifo_read_avail_nolock(fifo))
+   {
+      fifo->drop_pending = false;
+      return;
+   }
+
+   if (fifo->read_lock_begin == fifo->read_lock_end)
+      fifo->read_lock_begin = fifo->drop_to;
+   else if (!fifo->skipping)
+   {
+      fifo->skipping = true;
+      fifo->skip_begin = fifo->read_lock_end;
+   }
+   else if (fifo->skip_end != fifo->read_lock_end) // Only one skipped span is tracked.
+      return;
+
+   fifo->skip_end = fifo->drop_to;
+   fifo->read_lock_end = fifo->drop_to;
+   fifo->dropped += drop;
+   fifo->drop_pending = false;
+
+   maru_fifo_notify_writer_nolock(fifo);
+}
+
+// Committed data not yet released by reader, including regions locked for reading.
+static inline size_t fifo_occupancy_nolock(maru_fifo *fifo)
+{
+   return (fifo->write_lock_begin - fifo->read_lock_begin) & fifo->buffer_mask;
+}
+
 size_t maru_fifo_buffered_size(maru_fifo *fifo)
 {
    return fifo->buffer_size - maru_fifo_write_avail(fifo) - 1;
@@ -195,6 +319,7 @@ size_t maru_fifo_buffered_size(maru_fifo *fifo)
 size_t maru_fifo_read_avail(maru_fifo *fifo)
 {
    fifo_lock(fifo);
+   maru_fifo_apply_drop_nolock(fifo);
    size_t ret = maru_fifo_read_avail_nolock(fifo);
    fifo_unlock(fifo);
    return ret;
@@ -208,27 +333,42 @@ size_t maru_fifo_write_avail(maru_fifo *fifo)
    return ret;
 }
 
-maru_error maru_fifo_write_lock(maru_fifo *fifo,
+// Locks size bytes of a ring buffer starting at *end, and moves *end past them.
+static void lock_region(uint8_t *buffer, size_t buffer_size, size_t *end,
       size_t size, struct maru_fifo_locked_region *region)
 {
-   fifo_lock(fifo);
-
-   size_t avail_first = fifo->buffer_size - fifo->write_lock_end;
-   size_t write_first = size;
-   if (write_first > avail_first)
-      write_first = avail_first;
-   size_t write_second = size - write_first;
+   size_t avail_first = buffer_size - *end;
+   size_t lock_first = size;
+   if (lock_first > avail_first)
+      lock_first = avail_first;
+   size_t lock_second = size - lock_first;
 
-   region->first = fifo->buffer + fifo->write_lock_end;
-   region->first_size = write_first;
-   region->second = write_second ? fifo->buffer : NULL;
-   region->second_size = write_second;
+   region->first = buffer + *end;
+   region->first_size = lock_first;
+   region->second = lock_second ? buffer : NULL;
+   region->second_size = lock_second;
 
    if (region->second_size)
-      fifo->write_lock_end = region->second_size;
+      *end = region->second_size;
    else
-      fifo->write_lock_end = (fifo->write_lock_end + region->first_size) & fifo->buffer_mask;
+      *end = (*end + region->first_size) & (buffer_size - 1);
+}
 
+static void maru_fifo_write_lock_nolock(maru_fifo *fifo,
+      size_t size, struct maru_fifo_locked_region *region)
+{
+   lock_region(fifo->buffer, fifo->buffer_size, &fifo->write_lock_end, size, region);
+   MARU_PROBE3(fifo_write_lock, fifo, size, fifo_occupancy_nolock(fifo));
+}
+
+maru_error maru_fifo_write_lock(maru_fifo *fifo,
+      size_t size, struct maru_fifo_locked_region *region)
+{
+   if (fifo->bcast)
+      return LIBMARU_ERROR_INVALID;
+
+   fifo_lock(fifo);
+   maru_fifo_write_lock_nolock(fifo, size, region);
    fifo_unlock(fifo);
 
    return LIBMARU_SUCCESS;
@@ -237,6 +377,9 @@ maru_error maru_fifo_write_lock(maru_fifo *fifo,
 maru_error maru_fifo_write_unlock(maru_fifo *fifo,
       const struct maru_fifo_locked_region *region)
 {
+   if (fifo->bcast)
+      return LIBMARU_ERROR_INVALID;
+
    maru_error ret = LIBMARU_SUCCESS;
    fifo_lock(fifo);
 
@@ -260,6 +403,9 @@ maru_error maru_fifo_write_unlock(maru_fifo *fifo,
    new_begin += region->second_size;
    fifo->write_lock_begin = new_begin;
 
+   MARU_PROBE3(fifo_write_unlock, fifo, region->first_size + region->second_size,
+         fifo_occupancy_nolock(fifo));
+
    if (maru_fifo_read_avail_nolock(fifo) >= fifo->read_trigger && fifo->read_fd >= 0)
       eventfd_write(fifo->read_fd, 1);
 
@@ -272,24 +418,31 @@ maru_error maru_fifo_read_lock(maru_fifo *fifo,
       size_t size, struct maru_fifo_locked_region *region)
 {
    fifo_lock(fifo);
+   lock_region(fifo->buffer, fifo->buffer_size, &fifo->read_lock_end, size, region);
+   MARU_PROBE3(fifo_read_lock, fifo, size, fifo_occupancy_nolock(fifo));
+   fifo_unlock(fifo);
 
-   size_t avail_first = fifo->buffer_size - fifo->read_lock_end;
-   size_t read_first = size;
-   if (read_first > avail_first)
-      read_first = avail_first;
-   size_t read_second = size - read_first;
+   return LIBMARU_SUCCESS;
+}
 
-   region->first = fifo->buffer + fifo->read_lock_end;
-   region->first_size = read_first;
-   region->second = read_second ? fifo->buffer : NULL;
-   region->second_size = read_second;
+// Unlocks a region locked before the fifo was resized.
+// Its data only lives in the old buffer, so the new buffer is left alone.
+static maru_error maru_fifo_read_unlock_old(maru_fifo *fifo,
+      const struct maru_fifo_locked_region *region)
+{
+   size_t size = region->first_size + region->second_size;
 
-   if (region->second_size)
-      fifo->read_lock_end = region->second_size;
-   else
-      fifo->read_lock_end = (fifo->read_lock_end + region->first_size) & fifo->buffer_mask;
+   if (fifo->old_buffer + fifo->old_read_pos != region->first || size > fifo->old_locked)
+      return LIBMARU_ERROR_INVALID;
 
-   fifo_unlock(fifo);
+   fifo->old_read_pos = (fifo->old_read_pos + size) & fifo->old_buffer_mask;
+   fifo->old_locked -= size;
+
+   if (!fifo->old_locked)
+   {
+      free(fifo->old_buffer);
+      fifo->old_buffer = NULL;
+   }
 
    return LIBMARU_SUCCESS;
 }
@@ -300,26 +453,46 @@ maru_error maru_fifo_read_unlock(maru_fifo *fifo,
    maru_error ret = LIBMARU_SUCCESS;
    fifo_lock(fifo);
 
-   // Check if ordering of unlocks differ from order of locks.
-   if (fifo->buffer + fifo->read_lock_begin != region->first)
+   if (fifo->old_locked)
    {
-      ret = LIBMARU_ERROR_INVALID;
-      goto end;
+      ret = maru_fifo_read_unlock_old(fifo, region);
+      if (ret != LIBMARU_SUCCESS)
+         goto end;
    }
+   else
+   {
+      // Check if ordering of unlocks differ from order of locks.
+      if (fifo->buffer + fifo->read_lock_begin != region->first)
+      {
+         ret = LIBMARU_ERROR_INVALID;
+         goto end;
+      }
 
-   size_t new_begin = (fifo->read_lock_begin + region->first_size) & fifo->buffer_mask;
+      size_t new_begin = (fifo->read_lock_begin + region->first_size) & fifo->buffer_mask;
 
-   if (region->second_size && new_begin != 0)
-   {
-      ret = LIBMARU_ERROR_INVALID;
-      goto end;
+      if (region->second_size && new_begin != 0)
+      {
+         ret = LIBMARU_ERROR_INVALID;
+         goto end;
+      }
+
+      new_begin += region->second_size;
+      fifo->read_lock_begin = new_begin;
+
+      // Data dropped while this region was locked is released along with it.
+      if (fifo->skipping && fifo->read_lock_begin == fifo->skip_begin)
+      {
+         fifo->read_lock_begin = fifo->skip_end;
+         fifo->skipping = false;
+      }
+
+      maru_fifo_apply_drop_nolock(fifo);
    }
 
-   new_begin += region->second_size;
-   fifo->read_lock_begin = new_begin;
+   MARU_PROBE3(fifo_read_unlock, fifo, region->first_size + region->second_size,
+         fifo_occupancy_nolock(fifo));
 
-   if (maru_fifo_write_avail_nolock(fifo) >= fifo->write_trigger && fifo->write_fd >= 0)
-      eventfd_write(fifo->write_fd, 1);
+   maru_fifo_notify_writer_nolock(fifo);
 
 end:
    fifo_unlock(fifo);
@@ -331,13 +504,18 @@ ssize_t maru_fifo_write(maru_fifo *fifo,
 {
    const uint8_t *data = data_;
 
-   size_t write_avail = maru_fifo_write_avail(fifo);
-   if (size > write_avail)
-      size = write_avail;
+   if (fifo->bcast)
+      return -1;
 
+   // Available space is checked under the same lock as the region is taken,
+   // as the reader might resize the fifo in between.
    struct maru_fifo_locked_region region;
-   if (maru_fifo_write_lock(fifo, size, &region) != LIBMARU_SUCCESS)
-      return -1;
+   fifo_lock(fifo);
+   size_t write_avail = maru_fifo_write_avail_nolock(fifo);
+   if (size > write_avail)
+      size = write_avail;
+   maru_fifo_write_lock_nolock(fifo, size, &region);
+   fifo_unlock(fifo);
 
    memcpy(region.first, data, region.first_size);
    memcpy(region.second, data + region.first_size, region.second_size);
@@ -375,6 +553,9 @@ size_t maru_fifo_blocking_write(maru_fifo *fifo,
    const uint8_t *data = data_;
    size_t written = 0;
 
+   if (fifo->bcast)
+      return 0;
+
    int fd = maru_fifo_write_notify_fd(fifo);
 
    while (written < size)
@@ -474,6 +655,7 @@ static inline void maru_fifo_write_notify_ack_nolock(maru_fifo *fifo)
 maru_error maru_fifo_read_notify_ack(maru_fifo *fifo)
 {
    fifo_lock(fifo);
+   maru_fifo_apply_drop_nolock(fifo);
    maru_error ret = fifo->dead ? LIBMARU_ERROR_DEAD : LIBMARU_SUCCESS;
    if (!fifo->dead)
       maru_fifo_read_notify_ack_nolock(fifo);
@@ -485,7 +667,8 @@ maru_error maru_fifo_write_notify_ack(maru_fifo *fifo)
 {
    fifo_lock(fifo);
    maru_error ret = fifo->dead ? LIBMARU_ERROR_DEAD : LIBMARU_SUCCESS;
-   if (!fifo->dead)
+   // Writer notification of a broadcast reader is acked by the writer of the broadcast fifo.
+   if (!fifo->dead && !fifo->bcast)
       maru_fifo_write_notify_ack_nolock(fifo);
    fifo_unlock(fifo);
    return ret;
@@ -495,11 +678,138 @@ void maru_fifo_kill_notification(maru_fifo *fifo)
 {
    fifo_lock(fifo);
    fifo->dead = true;
-   eventfd_write(fifo->write_fd, 1);
+   // The writer of a broadcast fifo outlives its readers.
+   if (!fifo->bcast)
+      eventfd_write(fifo->write_fd, 1);
    eventfd_write(fifo->read_fd, 1);
    fifo_unlock(fifo);
 }
 
+void maru_fifo_flush(maru_fifo *fifo)
+{
+   fifo_lock(fifo);
+
+   fifo->read_lock_begin = fifo->read_lock_end = fifo->write_lock_begin;
+   fifo->skipping = false;
+   fifo->drop_pending = false;
+
+   // Regions locked before a resize are dropped as well.
+   free(fifo->old_buffer);
+   fifo->old_buffer = NULL;
+   fifo->old_locked = 0;
+
+   if (!fifo->dead)
+      maru_fifo_read_notify_ack_nolock(fifo);
+
+   maru_fifo_notify_writer_nolock(fifo);
+
+   fifo_unlock(fifo);
+}
+
+// Copies size bytes starting at offset from the ring buffer.
+static void copy_from_ring(const maru_fifo *fifo, size_t offset, uint8_t *data, size_t size)
+{
+   size_t first = fifo->buffer_size - offset;
+   if (first > size)
+      first = size;
+
+   memcpy(data, fifo->buffer + offset, first);
+   memcpy(data + first, fifo->buffer, size - first);
+}
+
+size_t maru_fifo_peek(maru_fifo *fifo, void *data, size_t size)
+{
+   fifo_lock(fifo);
+
+   size_t avail = maru_fifo_read_avail_nolock(fifo);
+   if (size > avail)
+      size = avail;
+
+   copy_from_ring(fifo, fifo->read_lock_end, data, size);
+
+   fifo_unlock(fifo);
+   return size;
+}
+
+maru_error maru_fifo_resize(maru_fifo *fifo, size_t size)
+{
+   // The buffer of a broadcast reader is shared.
+   if (!size || fifo->bcast)
+      return LIBMARU_ERROR_INVALID;
+
+   size = next_pow2(size);
+
+   maru_error ret = LIBMARU_SUCCESS;
+   fifo_lock(fifo);
+
+   if (size == fifo->buffer_size)
+      goto end;
+
+   // Writer regions cannot be moved, and only one generation of reader regions is tracked.
+   if (fifo->write_lock_begin != fifo->write_lock_end || fifo->old_locked)
+   {
+      ret = LIBMARU_ERROR_BUSY;
+      goto end;
+   }
+
+   size_t locked = (fifo->read_lock_end - fifo->read_lock_begin) & fifo->buffer_mask;
+   size_t avail = maru_fifo_read_avail_nolock(fifo);
+
+   // When shrinking, the most recently written data which does not fit is dropped.
+   if (avail > size - 1)
+      avail = size - 1;
+
+   uint8_t *buffer = calloc(1, size);
+   if (!buffer)
+   {
+      ret = LIBMARU_ERROR_MEMORY;
+      goto end;
+   }
+
+   copy_from_ring(fifo, fifo->read_lock_end, buffer, avail);
+
+   // Locked regions have already been read, and keep pointing to the old buffer until they are unlocked.
+   if (locked)
+   {
+      fifo->old_buffer = fifo->buffer;
+      fifo->old_buffer_mask = fifo->buffer_mask;
+      fifo->old_read_pos = fifo->read_lock_begin;
+      fifo->old_locked = locked;
+   }
+   else
+      free(fifo->buffer);
+
+   // Triggers keep their share of the buffer.
+   fifo->read_trigger = fifo->read_trigger * size / fifo->buffer_size;
+   fifo->write_trigger = fifo->write_trigger * size / fifo->buffer_size;
+   if (!fifo->read_trigger)
+      fifo->read_trigger = 1;
+   if (!fifo->write_trigger)
+      fifo->write_trigger = 1;
+
+   fifo->buffer = buffer;
+   fifo->buffer_size = size;
+   fifo->buffer_mask = size - 1;
+
+   fifo->read_lock_begin = fifo->read_lock_end = 0;
+   fifo->write_lock_begin = fifo->write_lock_end = avail;
+
+   if (!fifo->dead)
+   {
+      maru_fifo_read_notify_ack_nolock(fifo);
+      maru_fifo_write_notify_ack_nolock(fifo);
+   }
+
+   if (maru_fifo_read_avail_nolock(fifo) >= fifo->read_trigger && fifo->read_fd >= 0)
+      eventfd_write(fifo->read_fd, 1);
+   if (maru_fifo_write_avail_nolock(fifo) >= fifo->write_trigger && fifo->write_fd >= 0)
+      eventfd_write(fifo->write_fd, 1);
+
+end:
+   fifo_unlock(fifo);
+   return ret;
+}
+
 maru_error maru_fifo_set_write_trigger(maru_fifo *fifo, size_t size)
 {
    maru_error ret = LIBMARU_SUCCESS;
@@ -542,3 +852,408 @@ end:
    return ret;
 }
 
+
+uint64_t maru_fifo_dropped(maru_fifo *fifo)
+{
+   fifo_lock(fifo);
+   uint64_t ret = fifo->dropped;
+   fifo_unlock(fifo);
+   return ret;
+}
+
+static inline void bfifo_lock(maru_bfifo *fifo)
+{
+   pthread_mutex_lock(&fifo->lock);
+}
+
+static inline void bfifo_unlock(maru_bfifo *fifo)
+{
+   pthread_mutex_unlock(&fifo->lock);
+}
+
+// Readers are locked while the writer looks at their cursors,
+// so a reader cannot wake the writer between its space being checked and the writer acking.
+static void bfifo_lock_readers(maru_bfifo *fifo)
+{
+   for (unsigned i = 0; i < fifo->num_readers; i++)
+      fifo_lock(fifo->readers[i]);
+}
+
+static void bfifo_unlock_readers(maru_bfifo *fifo)
+{
+   for (unsigned i = 0; i < fifo->num_readers; i++)
+      fifo_unlock(fifo->readers[i]);
+}
+
+static void bfifo_destroy(maru_bfifo *fifo)
+{
+   pthread_mutex_destroy(&fifo->lock);
+
+   if (fifo->write_fd >= 0)
+      close(fifo->write_fd);
+
+   free(fifo->readers);
+   free(fifo->buffer);
+   free(fifo);
+}
+
+// Drops a reference. The fifo is locked by caller, and is unlocked when this returns.
+static void bfifo_unref_unlock(maru_bfifo *fifo)
+{
+   bool last = --fifo->refs == 0;
+   bfifo_unlock(fifo);
+
+   if (last)
+      bfifo_destroy(fifo);
+}
+
+maru_bfifo *maru_bfifo_new(size_t size)
+{
+   if (!size)
+      return NULL;
+
+   size = next_pow2(size);
+
+   maru_bfifo *fifo = calloc(1, sizeof(*fifo));
+   if (!fifo)
+      return NULL;
+
+   fifo->write_fd = -1;
+
+   if (pthread_mutex_init(&fifo->lock, NULL) < 0)
+      goto error;
+
+   fifo->buffer_size = size;
+   fifo->buffer_mask = size - 1;
+   fifo->write_trigger = 1;
+   fifo->refs = 1;
+
+   fifo->buffer = calloc(1, size);
+   if (!fifo->buffer)
+      goto error;
+
+   fifo->write_fd = eventfd(1, 0);
+   if (fifo->write_fd < 0)
+      goto error;
+
+   return fifo;
+
+error:
+   bfifo_destroy(fifo);
+   return NULL;
+}
+
+void maru_bfifo_free(maru_bfifo *fifo)
+{
+   if (!fifo)
+      return;
+
+   bfifo_lock(fifo);
+   bfifo_unref_unlock(fifo);
+}
+
+maru_fifo *maru_bfifo_add_reader(maru_bfifo *bfifo, bool drop_on_lag)
+{
+   maru_fifo *fifo = calloc(1, sizeof(*fifo));
+   if (!fifo)
+      return NULL;
+
+   fifo->write_fd = fifo->read_fd = -1;
+
+   if (pthread_mutex_init(&fifo->lock, NULL) < 0)
+      goto error;
+
+   fifo->read_trigger = 1;
+   fifo->write_trigger = 1;
+   fifo->drop_on_lag = drop_on_lag;
+
+   fifo->read_fd = eventfd(0, 0);
+   if (fifo->read_fd < 0)
+      goto error;
+
+   bfifo_lock(bfifo);
+
+   maru_fifo **readers = realloc(bfifo->readers, (bfifo->num_readers + 1) * sizeof(*readers));
+   if (!readers)
+   {
+      bfifo_unlock(bfifo);
+      goto error;
+   }
+   bfifo->readers = readers;
+
+   // A reader starts out empty, and sees what is written from now on.
+   fifo->bcast = bfifo;
+   fifo->buffer = bfifo->buffer;
+   fifo->buffer_size = bfifo->buffer_size;
+   fifo->buffer_mask = bfifo->buffer_mask;
+   fifo->write_fd = bfifo->write_fd;
+   fifo->read_lock_begin = fifo->read_lock_end = bfifo->write_lock_begin;
+   fifo->write_lock_begin = fifo->write_lock_end = bfifo->write_lock_begin;
+
+   bfifo->readers[bfifo->num_readers++] = fifo;
+   bfifo->refs++;
+
+   bfifo_unlock(bfifo);
+   return fifo;
+
+error:
+   maru_fifo_free(fifo);
+   return NULL;
+}
+
+static void bfifo_remove_reader(maru_bfifo *fifo, maru_fifo *reader)
+{
+   bfifo_lock(fifo);
+
+   for (unsigned i = 0; i < fifo->num_readers; i++)
+   {
+      if (fifo->readers[i] == reader)
+      {
+         memmove(fifo->readers + i, fifo->readers + i + 1,
+               (fifo->num_readers - (i + 1)) * sizeof(*fifo->readers));
+         fifo->num_readers--;
+         break;
+      }
+   }
+
+   // A reader which goes away might have been the one holding back the writer.
+   eventfd_write(fifo->write_fd, 1);
+   bfifo_unref_unlock(fifo);
+}
+
+int maru_bfifo_write_notify_fd(maru_bfifo *fifo)
+{
+   return fifo->write_fd;
+}
+
+size_t maru_bfifo_size(maru_bfifo *fifo)
+{
+   return fifo->buffer_size;
+}
+
+// Space in front of the writer, as far as reader is concerned.
+static inline size_t bfifo_reader_space(maru_bfifo *fifo, maru_fifo *reader)
+{
+   return (reader->read_lock_begin + fifo->buffer_size - fifo->write_lock_end - 1) & fifo->buffer_mask;
+}
+
+// Marks everything reader has not read yet to be dropped, and wakes it up to do so.
+static void bfifo_drop_nolock(maru_fifo *reader)
+{
+   if (!maru_fifo_read_avail_nolock(reader) ||
+         (reader->drop_pending && reader->drop_to == reader->write_lock_begin))
+      return;
+
+   reader->drop_pending = true;
+   reader->drop_to = reader->write_lock_begin;
+   eventfd_write(reader->read_fd, 1);
+}
+
+// Writer space is bounded by the slowest reader.
+// A reader which drops on lag is told to give up its unread data instead,
+// if it alone keeps the writer below its trigger. Space is freed once it has done so.
+// Both the fifo and its readers are locked by caller.
+static size_t bfifo_write_avail_nolock(maru_bfifo *fifo)
+{
+   size_t avail = (fifo->write_lock_begin + fifo->buffer_size - fifo->write_lock_end - 1) & fifo->buffer_mask;
+
+   for (unsigned i = 0; i < fifo->num_readers; i++)
+   {
+      maru_fifo *reader = fifo->readers[i];
+      size_t space = bfifo_reader_space(fifo, reader);
+      if (!reader->drop_on_lag && space < avail)
+         avail = space;
+   }
+
+   size_t bound = avail;
+   for (unsigned i = 0; i < fifo->num_readers; i++)
+   {
+      maru_fifo *reader = fifo->readers[i];
+      if (!reader->drop_on_lag)
+         continue;
+
+      size_t space = bfifo_reader_space(fifo, reader);
+      if (space < bound && space < fifo->write_trigger)
+         bfifo_drop_nolock(reader);
+
+      if (space < avail)
+         avail = space;
+   }
+
+   return avail;
+}
+
+size_t maru_bfifo_write_avail(maru_bfifo *fifo)
+{
+   bfifo_lock(fifo);
+   bfifo_lock_readers(fifo);
+   size_t ret = bfifo_write_avail_nolock(fifo);
+   bfifo_unlock_readers(fifo);
+   bfifo_unlock(fifo);
+   return ret;
+}
+
+maru_error maru_bfifo_write_lock(maru_bfifo *fifo,
+      size_t size, struct maru_fifo_locked_region *region)
+{
+   bfifo_lock(fifo);
+   lock_region(fifo->buffer, fifo->buffer_size, &fifo->write_lock_end, size, region);
+   bfifo_unlock(fifo);
+
+   return LIBMARU_SUCCESS;
+}
+
+maru_error maru_bfifo_write_unlock(maru_bfifo *fifo,
+      const struct maru_fifo_locked_region *region)
+{
+   maru_error ret = LIBMARU_SUCCESS;
+   bfifo_lock(fifo);
+
+   // Check if ordering of unlocks differ from order of locks.
+   if (fifo->buffer + fifo->write_lock_begin != region->first)
+   {
+      ret = LIBMARU_ERROR_INVALID;
+      goto end;
+   }
+
+   size_t new_begin = (fifo->write_lock_begin + region->first_size) & fifo->buffer_mask;
+
+   if (region->second_size && new_begin != 0)
+   {
+      ret = LIBMARU_ERROR_INVALID;
+      goto end;
+   }
+
+   new_begin += region->second_size;
+   fifo->write_lock_begin = new_begin;
+
+   // Every reader sees the same data, only their read cursors differ.
+   for (unsigned i = 0; i < fifo->num_readers; i++)
+   {
+      maru_fifo *reader = fifo->readers[i];
+      fifo_lock(reader);
+
+      reader->write_lock_begin = reader->write_lock_end = new_begin;
+
+      MARU_PROBE3(fifo_write_unlock, reader, region->first_size + region->second_size,
+            fifo_occupancy_nolock(reader));
+
+      if (maru_fifo_read_avail_nolock(reader) >= reader->read_trigger)
+         eventfd_write(reader->read_fd, 1);
+
+      fifo_unlock(reader);
+   }
+
+end:
+   bfifo_unlock(fifo);
+   return ret;
+}
+
+ssize_t maru_bfifo_write(maru_bfifo *fifo,
+      const void *data_, size_t size)
+{
+   const uint8_t *data = data_;
+
+   struct maru_fifo_locked_region region;
+   bfifo_lock(fifo);
+   bfifo_lock_readers(fifo);
+   size_t write_avail = bfifo_write_avail_nolock(fifo);
+   bfifo_unlock_readers(fifo);
+   if (size > write_avail)
+      size = write_avail;
+   lock_region(fifo->buffer, fifo->buffer_size, &fifo->write_lock_end, size, &region);
+   bfifo_unlock(fifo);
+
+   memcpy(region.first, data, region.first_size);
+   memcpy(region.second, data + region.first_size, region.second_size);
+
+   if (maru_bfifo_write_unlock(fifo, &region) != LIBMARU_SUCCESS)
+      return -1;
+
+   return size;
+}
+
+maru_error maru_bfifo_write_notify_ack(maru_bfifo *fifo)
+{
+   bfifo_lock(fifo);
+   maru_error ret = fifo->dead ? LIBMARU_ERROR_DEAD : LIBMARU_SUCCESS;
+
+   // Reset counter to 0 if there is no more data to write.
+   if (!fifo->dead)
+   {
+      bfifo_lock_readers(fifo);
+      if (bfifo_write_avail_nolock(fifo) < fifo->write_trigger)
+      {
+         eventfd_t val;
+         eventfd_read(fifo->write_fd, &val);
+      }
+      bfifo_unlock_readers(fifo);
+   }
+
+   bfifo_unlock(fifo);
+   return ret;
+}
+
+size_t maru_bfifo_blocking_write(maru_bfifo *fifo,
+      const void *data_, size_t size)
+{
+   const uint8_t *data = data_;
+   size_t written = 0;
+
+   int fd = maru_bfifo_write_notify_fd(fifo);
+
+   while (written < size)
+   {
+      struct pollfd fds = { .fd = fd, .events = POLLIN };
+
+poll_retry:
+      if (poll(&fds, 1, -1) < 0)
+      {
+         if (errno == EINTR)
+            goto poll_retry;
+
+         break;
+      }
+
+      if (fds.revents & POLLIN)
+      {
+         ssize_t ret = maru_bfifo_write(fifo, data + written,
+               size - written);
+
+         if (ret < 0)
+            break;
+
+         written += ret;
+
+         if (maru_bfifo_write_notify_ack(fifo) != LIBMARU_SUCCESS)
+            break;
+      }
+      else if (fds.revents & (POLLHUP | POLLERR | POLLNVAL))
+         break;
+   }
+
+   return written;
+}
+
+void maru_bfifo_kill_notification(maru_bfifo *fifo)
+{
+   bfifo_lock(fifo);
+   fifo->dead = true;
+   eventfd_write(fifo->write_fd, 1);
+   bfifo_unlock(fifo);
+}
+
+maru_error maru_bfifo_set_write_trigger(maru_bfifo *fifo, size_t size)
+{
+   if (size == 0)
+      size = 1;
+
+   if (size >= fifo->buffer_size)
+      return LIBMARU_ERROR_INVALID;
+
+   // Readers look at it under their own lock only.
+   bfifo_lock(fifo);
+   __atomic_store_n(&fifo->write_trigger, size, __ATOMIC_RELAXED);
+   bfifo_unlock(fifo);
+   return LIBMARU_SUCCESS;
+}
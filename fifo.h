@@ -166,6 +166,44 @@ maru_error maru_fifo_read_notify_ack(maru_fifo *fifo);
  */
 void maru_fifo_kill_notification(maru_fifo *fifo);
 
+/** \ingroup buffer
+ * \brief Discard all readable data.
+ *
+ * Moves read cursor up to the writer, dropping all data written but not yet read,
+ * as well as any region currently held by reader with \c maru_fifo_read_lock.
+ * Such regions must not be unlocked afterwards.
+ * Notifications are updated as if the data had been read.
+ *
+ * A writer lock may be held while flushing. The locked region is kept.
+ * This must only be called from the reader side.
+ *
+ * \param fifo The fifo
+ */
+void maru_fifo_flush(maru_fifo *fifo);
+
+/** \ingroup buffer
+ * \brief Resizes the fifo, keeping buffered data.
+ *
+ * The size is rounded up to a power of two, as with maru_fifo_new().
+ * Buffered data is kept in order. When shrinking, the most recently written data
+ * that does not fit is dropped.
+ * Read and write triggers are scaled along with the buffer, so they keep their share of it.
+ * Notifications are updated to match the new geometry.
+ *
+ * Regions held by reader with \c maru_fifo_read_lock stay valid,
+ * and must be unlocked in order as usual.
+ * They do not take up space in the new buffer, and the old buffer is kept alive until they are unlocked.
+ *
+ * This must only be called from the reader side.
+ *
+ * \param fifo The fifo
+ * \param size New size of buffer
+ * \returns Error code \ref maru_error.
+ * LIBMARU_ERROR_BUSY if a writer region is locked,
+ * or if regions locked before an earlier resize have not been unlocked yet.
+ */
+maru_error maru_fifo_resize(maru_fifo *fifo, size_t size);
+
 /** \ingroup buffer
  * \brief Returns number of readable bytes in buffer.
  *
@@ -304,6 +342,19 @@ ssize_t maru_fifo_write(maru_fifo *fifo, const void *data, size_t size);
  */
 ssize_t maru_fifo_read(maru_fifo *fifo, void *data, size_t size);
 
+/** \ingroup buffer
+ * \brief Copy readable data from fifo without consuming it.
+ *
+ * Data starts where the next read lock would, so regions locked for reading are not included.
+ *
+ * \param fifo The fifo
+ * \param data Buffer to copy into
+ * \param size Size to copy
+ *
+ * \returns Number of bytes copied.
+ */
+size_t maru_fifo_peek(maru_fifo *fifo, void *data, size_t size);
+
 /** \ingroup buffer
  * \brief Write all data to fifo in a blocking fashion.
  *
@@ -344,6 +395,122 @@ size_t maru_fifo_blocking_write(maru_fifo *fifo, const void *data, size_t size);
  */
 size_t maru_fifo_blocking_read(maru_fifo *fifo, void *data, size_t size);
 
+/** \ingroup buffer
+ * Opaque handle to a ring buffer with one writer and any number of readers.
+ * Every reader sees everything written, through its own read cursor into the one buffer.
+ * Data is never copied per reader. */
+typedef struct maru_bfifo maru_bfifo;
+
+/** \ingroup buffer
+ * \brief Creates a new broadcast fifo.
+ *
+ * \param size Size of buffer. Rounded up to a power of two, as with maru_fifo_new().
+ *
+ * \returns Newly allocated broadcast fifo, or NULL if failure.
+ */
+maru_bfifo *maru_bfifo_new(size_t size);
+
+/** \ingroup buffer
+ * \brief Frees a broadcast fifo.
+ *
+ * Readers stay valid, and keep the buffer alive until they are freed as well.
+ *
+ * \param fifo The broadcast fifo
+ */
+void maru_bfifo_free(maru_bfifo *fifo);
+
+/** \ingroup buffer
+ * \brief Adds a reader to a broadcast fifo.
+ *
+ * The reader is a regular \ref maru_fifo, starting out empty, that sees everything written from now on.
+ * It supports the reader side of the fifo interface, including maru_fifo_flush().
+ * Writing to it or resizing it returns an error. It is freed with maru_fifo_free().
+ *
+ * Writer space is bounded by the slowest reader.
+ * If drop_on_lag is set, the reader does not hold back the writer for long:
+ * when it alone keeps writable space below the write trigger of the broadcast fifo,
+ * its read notification is signalled, and data it has not locked for reading is dropped
+ * the next time it calls maru_fifo_read_avail(), maru_fifo_read_unlock() or maru_fifo_read_notify_ack().
+ * Dropped data is counted by maru_fifo_dropped().
+ * Regions it has locked for reading stay valid, and still hold back the writer until unlocked.
+ *
+ * \param fifo The broadcast fifo
+ * \param drop_on_lag Drop unread data rather than hold back the writer.
+ *
+ * \returns Newly allocated reader, or NULL if failure.
+ */
+maru_fifo *maru_bfifo_add_reader(maru_bfifo *fifo, bool drop_on_lag);
+
+/** \ingroup buffer
+ * \brief Returns number of bytes dropped from a reader of a broadcast fifo.
+ *
+ * \param fifo A reader added with maru_bfifo_add_reader()
+ * \returns Bytes dropped since the reader was added. Always 0 for other fifos.
+ */
+uint64_t maru_fifo_dropped(maru_fifo *fifo);
+
+/** \ingroup buffer
+ * \brief Returns the size of the buffer of a broadcast fifo.
+ */
+size_t maru_bfifo_size(maru_bfifo *fifo);
+
+/** \ingroup buffer
+ * \brief Get writer side notification handle for broadcast fifo.
+ *
+ * Works as maru_fifo_write_notify_fd(). Readers signal it as they release data.
+ * After a POLLIN, maru_bfifo_write_notify_ack() must be called.
+ */
+int maru_bfifo_write_notify_fd(maru_bfifo *fifo);
+
+/** \ingroup buffer
+ * \brief Acknowledge a writer notification, as maru_fifo_write_notify_ack().
+ */
+maru_error maru_bfifo_write_notify_ack(maru_bfifo *fifo);
+
+/** \ingroup buffer
+ * \brief Set the least amount of bytes that needs to be writable for notification to occur.
+ *
+ * Also decides when readers which drop on lag give up their data, see maru_bfifo_add_reader().
+ */
+maru_error maru_bfifo_set_write_trigger(maru_bfifo *fifo, size_t size);
+
+/** \ingroup buffer
+ * \brief Returns number of writable bytes, the least of what any reader leaves.
+ *
+ * Readers which drop on lag and are in the way are told to drop their data.
+ */
+size_t maru_bfifo_write_avail(maru_bfifo *fifo);
+
+/** \ingroup buffer
+ * \brief Lock out a region of the broadcast fifo for writing, as maru_fifo_write_lock().
+ *
+ * If size is larger than maru_bfifo_write_avail(), the result is undefined.
+ */
+maru_error maru_bfifo_write_lock(maru_bfifo *fifo,
+      size_t size, struct maru_fifo_locked_region *region);
+
+/** \ingroup buffer
+ * \brief Unlock a region locked with maru_bfifo_write_lock(), making it readable to all readers.
+ */
+maru_error maru_bfifo_write_unlock(maru_bfifo *fifo, const struct maru_fifo_locked_region *region);
+
+/** \ingroup buffer
+ * \brief Write data to broadcast fifo, as maru_fifo_write().
+ */
+ssize_t maru_bfifo_write(maru_bfifo *fifo, const void *data, size_t size);
+
+/** \ingroup buffer
+ * \brief Write all data to broadcast fifo in a blocking fashion, as maru_fifo_blocking_write().
+ */
+size_t maru_bfifo_blocking_write(maru_bfifo *fifo, const void *data, size_t size);
+
+/** \ingroup buffer
+ * \brief Kill writer notification handle, as maru_fifo_kill_notification().
+ *
+ * Readers are not affected.
+ */
+void maru_bfifo_kill_notification(maru_bfifo *fifo);
+
 #ifdef __cplusplus
 }
 #endif
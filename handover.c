@@ -0,0 +1,197 @@
+/* libmaru - Userspace USB audio class driver.
+ * Copyright (C) 2012 - Hans-Kristian Arntzen
+ * Copyright (C) 2012 - Agnes Heyer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+
+#include "handover.h"
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+bool maru_handover_send_msg(int sock, const void *data_, size_t size,
+      const int *fds, unsigned num_fds)
+{
+   const uint8_t *data = data_;
+
+   if (num_fds > MARU_HANDOVER_MAX_MSG_FDS || (num_fds && !size))
+      return false;
+
+   union
+   {
+      struct cmsghdr hdr;
+      uint8_t buf[CMSG_SPACE(MARU_HANDOVER_MAX_MSG_FDS * sizeof(int))];
+   } control;
+
+   while (size)
+   {
+      struct iovec iov = { .iov_base = (void*)data, .iov_len = size };
+      struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+      // Descriptors ride along with the first chunk only.
+      if (num_fds)
+      {
+         memset(&control, 0, sizeof(control));
+         msg.msg_control = control.buf;
+         msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+
+         struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+         cmsg->cmsg_level = SOL_SOCKET;
+         cmsg->cmsg_type = SCM_RIGHTS;
+         cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+         memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+      }
+
+      ssize_t ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+
+      num_fds = 0;
+      data += ret;
+      size -= ret;
+   }
+
+   return true;
+}
+
+static void close_fds(int *fds, unsigned num_fds)
+{
+   for (unsigned i = 0; i < num_fds; i++)
+      close(fds[i]);
+}
+
+bool maru_handover_recv_msg(int sock, void *data_, size_t size,
+      int *fds, unsigned max_fds, unsigned *num_fds)
+{
+   uint8_t *data = data_;
+   unsigned received = 0;
+   bool overflow = false;
+
+   union
+   {
+      struct cmsghdr hdr;
+      uint8_t buf[CMSG_SPACE(MARU_HANDOVER_MAX_MSG_FDS * sizeof(int))];
+   } control;
+
+   while (size)
+   {
+      struct iovec iov = { .iov_base = data, .iov_len = size };
+      struct msghdr msg = {
+         .msg_iov = &iov,
+         .msg_iovlen = 1,
+         .msg_control = control.buf,
+         .msg_controllen = sizeof(control.buf),
+      };
+
+      ssize_t ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         goto error;
+
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+      {
+         if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+         unsigned count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         int *cmsg_fds = (int*)CMSG_DATA(cmsg);
+
+         for (unsigned i = 0; i < count; i++)
+         {
+            int fd;
+            memcpy(&fd, &cmsg_fds[i], sizeof(fd));
+
+            if (received < max_fds)
+               fds[received++] = fd;
+            else
+            {
+               close(fd);
+               overflow = true;
+            }
+         }
+      }
+
+      if (msg.msg_flags & MSG_CTRUNC)
+         overflow = true;
+
+      data += ret;
+      size -= ret;
+   }
+
+   if (overflow)
+      goto error;
+
+   if (num_fds)
+      *num_fds = received;
+
+   return true;
+
+error:
+   close_fds(fds, received);
+   return false;
+}
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+int maru_handover_memfd(const char *name, size_t size, void **map)
+{
+   *map = NULL;
+   void *ptr = NULL;
+
+   int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   if (fd < 0)
+      return -1;
+
+   if (size)
+   {
+      if (ftruncate(fd, size) < 0)
+         goto error;
+
+      ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (ptr == MAP_FAILED)
+      {
+         ptr = NULL;
+         goto error;
+      }
+   }
+
+   // Our mapping stays writable, but whoever gets the descriptor,
+   // even reopened through /proc, can neither resize it nor map it writable.
+   if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE) < 0)
+      goto error;
+
+   *map = ptr;
+   return fd;
+
+error:
+   if (ptr)
+      munmap(ptr, size);
+   close(fd);
+   return -1;
+}
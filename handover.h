@@ -0,0 +1,69 @@
+/* libmaru - Userspace USB audio class driver.
+ * Copyright (C) 2012 - Hans-Kristian Arntzen
+ * Copyright (C) 2012 - Agnes Heyer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef LIBMARU_HANDOVER_H__
+#define LIBMARU_HANDOVER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** \ingroup lib
+ * \brief Transport for maru_handover_context() and maru_create_context_from_handover().
+ *
+ * Messages go over a connected Unix domain stream socket.
+ * Descriptors are attached to the first byte of a message with SCM_RIGHTS,
+ * so a receiver must ask for descriptors whenever a sender may attach them.
+ */
+
+/** \ingroup lib
+ * \brief Maximum number of descriptors in one message. */
+#define MARU_HANDOVER_MAX_MSG_FDS 64
+
+/** \ingroup lib
+ * \brief Sends all of data, with descriptors attached.
+ *
+ * \returns true if everything was sent.
+ */
+bool maru_handover_send_msg(int sock, const void *data, size_t size,
+      const int *fds, unsigned num_fds);
+
+/** \ingroup lib
+ * \brief Receives exactly size bytes, and up to max_fds attached descriptors.
+ *
+ * Received descriptors are close-on-exec.
+ * If more than max_fds are attached, or the message is cut short, every received descriptor is closed.
+ *
+ * \returns true if size bytes were received.
+ */
+bool maru_handover_recv_msg(int sock, void *data, size_t size,
+      int *fds, unsigned max_fds, unsigned *num_fds);
+
+/** \ingroup lib
+ * \brief Creates a memfd of size bytes, and maps it writable.
+ *
+ * The memfd is then sealed, so it cannot be resized or mapped writable again,
+ * and only the returned mapping can change it. Requires Linux 5.1 or newer.
+ *
+ * \param map Receives mapping, to be unmapped with munmap() by caller. Set to NULL if size is 0.
+ * \returns Descriptor, or -1 on failure.
+ */
+int maru_handover_memfd(const char *name, size_t size, void **map);
+
+#endif
+
@@ -19,6 +19,11 @@
 
 #include "libmaru.h"
 #include "fifo.h"
+#include "schedule.h"
+#include "usblog.h"
+#include "usbfs.h"
+#include "handover.h"
+#include "probes.h"
 #include <libusb-1.0/libusb.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -32,8 +37,15 @@
 #include <sys/eventfd.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 
+MARU_PROBE_SEMAPHORE(transfer_submit);
+MARU_PROBE_SEMAPHORE(transfer_complete);
+MARU_PROBE_SEMAPHORE(transfer_feedback);
+MARU_PROBE_SEMAPHORE(request);
+
 /** \ingroup lib
  * \brief Struct holding information needed for a libusb transfer. */
 struct maru_transfer
@@ -56,6 +68,13 @@ struct maru_transfer
     * Used mostly for feedback endpoint. */
    bool block;
 
+   /** Sequence number of transfer in USB log. */
+   uint32_t log_id;
+
+   /** URB used in place of trans when streaming through usbfs.
+    * Allocated on first submit, and reused along with the transfer. */
+   struct maru_usbfs_urb *urb;
+
    /** Capacity of embedded_data */
    size_t embedded_data_capacity;
    /** Embeddable structure for use to transfer data that
@@ -86,6 +105,24 @@ struct volume_control
    unsigned channels[8];
    /** The feature unit that supports volume control for output stream */
    unsigned feature_unit;
+
+   /** Values mirrored from device, so reading them does not need a control request. */
+   struct
+   {
+      /** Mirrored value. */
+      maru_volume value;
+      /** Set if value is valid. */
+      bool valid;
+   } cur, min, max;
+
+   // Write-behind state. Only accessed by thread.
+
+   /** Volume to be written once SET_CUR requests in flight complete. */
+   maru_volume pending;
+   /** Set if pending must be written. */
+   bool dirty;
+   /** Number of volume batches in flight. */
+   unsigned in_flight;
 };
 
 /** \ingroup lib
@@ -112,6 +149,8 @@ struct maru_stream_internal
    unsigned transfer_speed_mult;
    /** Bytes-per-second data rate for stream. */
    size_t bps;
+   /** Format and buffering stream was opened with. Buffer and fragment sizes follow resizes. */
+   struct maru_stream_desc desc;
 
    /** Optional callback to notify write avail. */
    maru_notification_cb write_cb;
@@ -129,6 +168,24 @@ struct maru_stream_internal
    struct transfer_list trans;
    /** Transfers currently queued up. */
    unsigned trans_count;
+   /** Isochronous packets in transfers currently queued up.
+    * Times packet_period, this is how long until the device runs dry. */
+   unsigned queued_packets;
+   /** Time between isochronous packets of streaming endpoint in microseconds,
+    * from device speed and bInterval. */
+   maru_usec packet_period;
+   /** Total number of isochronous packets submitted on stream. */
+   uint64_t frame_count;
+
+   /** Set if scheduling state has been written to current USB log. */
+   bool logged;
+   /** Set if fifo is a reader of a broadcast fifo owned by the application. */
+   bool broadcast;
+
+   /** Optional loopback tap. Only accessed by thread. */
+   maru_fifo *tap;
+   /** Blocks not written to tap since last block that was. */
+   uint32_t tap_dropped;
    /** Maximum number of transfer allowed to be queued up. */
    unsigned enqueue_count;
 
@@ -144,6 +201,25 @@ struct maru_stream_internal
       uint64_t write_cnt;
    } timer;
 
+   /** Snapshot read lock-free by maru_stream_get_status().
+    * Fields are only written between status_begin() and status_end(). */
+   struct
+   {
+      /** Sequence count, odd while the snapshot is being updated. */
+      uint32_t seq;
+      /** Allocated fifo size, as write_avail and buffered size add up to this minus one. */
+      size_t fifo_size;
+      uint64_t bytes_played;
+      uint64_t bytes_queued;
+      uint64_t write_avail;
+      maru_usec timestamp;
+   } status;
+
+   /** Position page, see maru_stream_position_fd(). Only written by thread once set. */
+   struct maru_position *position;
+   /** memfd backing position, or -1 if no page has been asked for. */
+   int position_fd;
+
    struct volume_control volume;
 };
 
@@ -187,6 +263,26 @@ struct maru_context
 
    /** Volume control for master channel. */
    struct volume_control volume;
+
+   /** Direct usbfs backend for isochronous transfers, or NULL if libusb is used. */
+   maru_usbfs *usbfs;
+
+   /** Optional log of USB traffic. Only accessed by thread. */
+   maru_usblog *usblog;
+   /** Sequence number of next transfer written to usblog. */
+   uint32_t usblog_id;
+
+   /** Descriptor libusb handle was wrapped around, if context was created from a handover. Otherwise -1. */
+   int device_fd;
+   /** Set while a handover is in progress. Only accessed by thread. */
+   bool handing_over;
+   /** Set once a handover drains. Streams are no longer refilled,
+    * and completions on the device are left to the other process. Only accessed by thread. */
+   bool draining;
+   /** Set if device belongs to another process, either because it has been handed over,
+    * or because a handover to this context has not completed yet.
+    * Interfaces are then left alone when context is destroyed. */
+   bool handed_over;
 };
 
 // __attribute__((packed)) is a GNU extension.
@@ -263,10 +359,47 @@ struct usb_uac_feature_unit_descriptor
 #define UAS_FREQ_CONTROL               0x01
 #define UAS_PITCH_CONTROL              0x02
 #define USB_REQUEST_DIR_MASK           0x80
+#define USB_REQUEST_RECIPIENT_MASK     0x1f
 #define UAC_TYPE_SPEAKER               0x0301
 #define UAC_OUTPUT_TERMINAL            0x03
 #define UAC_FEATURE_UNIT               0x06
 
+/** \ingroup lib
+ * \brief Kinds of requests sent to thread.
+ */
+enum maru_request_type
+{
+   /** A plain USB control transfer. */
+   MARU_REQUEST_CONTROL = 0,
+   /** Flush a stream. */
+   MARU_REQUEST_FLUSH,
+   /** Set volume in value on every channel of a volume control. */
+   MARU_REQUEST_VOLUME,
+   /** Set loopback tap of a stream. */
+   MARU_REQUEST_TAP,
+   /** Replace USB log. */
+   MARU_REQUEST_LOG,
+   MARU_REQUEST_BUFFER,
+   /** Step through a handover, see enum maru_handover_step. */
+   MARU_REQUEST_HANDOVER,
+};
+
+/** \ingroup lib
+ * \brief Steps of MARU_REQUEST_HANDOVER.
+ */
+enum maru_handover_step
+{
+   /** Refuse requests which change stream state, wait for volume requests in flight, and save streams. */
+   MARU_HANDOVER_STOP = 0,
+   /** Stop refilling streams and taking feedback, wait for transfers in flight to play out,
+    * and stop reaping completions on the device. */
+   MARU_HANDOVER_DRAIN,
+   /** Handover failed, pick streaming up again. */
+   MARU_HANDOVER_RESUME,
+   /** Device now belongs to other process. */
+   MARU_HANDOVER_COMMIT,
+};
+
 /** \ingroup lib
  * \brief Struct holding data for a USB control request.
  */
@@ -299,6 +432,33 @@ struct maru_control_request
    maru_error error;
    /** Descriptor thread will reply on after finishing transfer */
    int reply_fd;
+
+   /** Kind of request. */
+   enum maru_request_type type;
+   /** Stream for flush and volume requests. */
+   maru_stream stream;
+   /** Set if caller does not wait for reply.
+    * Volume requests may then be coalesced. */
+   bool async;
+   /** Tap for tap requests. */
+   maru_fifo *tap;
+   /** Log for log requests. */
+   maru_usblog *usblog;
+   /** New buffer and fragment size for MARU_REQUEST_BUFFER. */
+   size_t buffer_size;
+   size_t fragment_size;
+   /** Buffered bytes dropped by MARU_REQUEST_BUFFER. Set by thread. */
+   size_t dropped;
+   /** Step of MARU_REQUEST_HANDOVER. */
+   enum maru_handover_step handover;
+   /** Stream records of a handover, one per stream.
+    * Saved by MARU_HANDOVER_STOP, along with a memfd of buffered data for every open stream,
+    * and completed by MARU_HANDOVER_DRAIN. */
+   struct handover_stream *handover_streams;
+   struct handover_drained *handover_drained;
+   int *handover_memfds;
+   /** Context the request belongs to. Set by thread. */
+   maru_context *ctx;
 };
 
 static int find_interface_class_index(const struct libusb_config_descriptor *conf,
@@ -324,6 +484,13 @@ static int find_interface_class_index(const struct libusb_config_descriptor *con
 
 static bool parse_audio_format(const uint8_t *data, size_t size, struct maru_stream_desc *desc);
 
+static void cache_volume_controls(maru_context *ctx);
+
+static maru_usec current_time(void);
+
+static maru_error submit_request(maru_context *ctx,
+      struct maru_control_request *req, maru_usec timeout);
+
 static int perform_pitch_request(maru_context *ctx,
       unsigned ep,
       maru_usec timeout);
@@ -527,7 +694,8 @@ static void poll_removed_cb(int fd, void *userdata)
    poll_list_remove(ctx->epfd, fd);
 }
 
-static bool poll_list_init(maru_context *ctx)
+// Descriptors libusb and usbfs signal completions on.
+static bool poll_list_add_device(maru_context *ctx)
 {
    bool ret = true;
 
@@ -535,36 +703,42 @@ static bool poll_list_init(maru_context *ctx)
    if (!list)
       return false;
 
-   const struct libusb_pollfd **tmp = list;
-   while (*tmp)
-   {
-      const struct libusb_pollfd *fd = *tmp;
-      if (!poll_list_add(ctx->epfd, fd->fd, fd->events))
-      {
-         ret = false;
-         goto end;
-      }
-      tmp++;
-   }
+   for (const struct libusb_pollfd **tmp = list; *tmp && ret; tmp++)
+      ret = poll_list_add(ctx->epfd, (*tmp)->fd, (*tmp)->events);
+   free(list);
 
-   if (!poll_list_add(ctx->epfd, ctx->quit_fd, POLLIN))
-   {
-      ret = false;
-      goto end;
-   }
+   // usbfs signals reapable URBs with POLLOUT.
+   if (ret && ctx->usbfs)
+      ret = poll_list_add(ctx->epfd, maru_usbfs_fd(ctx->usbfs), POLLOUT);
+
+   if (ret)
+      libusb_set_pollfd_notifiers(ctx->ctx, poll_added_cb, poll_removed_cb, ctx);
+   return ret;
+}
+
+// Completions on a device handed over are reaped by the other process from now on.
+// Device descriptors are shared, so polling them here would reap them too.
+static void poll_list_remove_device(maru_context *ctx)
+{
+   libusb_set_pollfd_notifiers(ctx->ctx, NULL, NULL, NULL);
 
-   if (!poll_list_add(ctx->epfd, ctx->request_fd[0], POLLIN))
+   const struct libusb_pollfd **list = libusb_get_pollfds(ctx->ctx);
+   if (list)
    {
-      ret = false;
-      goto end;
+      for (const struct libusb_pollfd **tmp = list; *tmp; tmp++)
+         poll_list_remove(ctx->epfd, (*tmp)->fd);
+      free(list);
    }
 
-   libusb_set_pollfd_notifiers(ctx->ctx, poll_added_cb, poll_removed_cb,
-         ctx);
+   if (ctx->usbfs)
+      poll_list_remove(ctx->epfd, maru_usbfs_fd(ctx->usbfs));
+}
 
-end:
-   free(list);
-   return ret;
+static bool poll_list_init(maru_context *ctx)
+{
+   return poll_list_add(ctx->epfd, ctx->quit_fd, POLLIN) &&
+      poll_list_add(ctx->epfd, ctx->request_fd[0], POLLIN) &&
+      poll_list_add_device(ctx);
 }
 
 static void poll_list_deinit(maru_context *ctx)
@@ -651,12 +825,289 @@ error:
    return NULL;
 }
 
+// Isochronous transfers go either through libusb, or straight to usbfs.
+// With usbfs, the libusb_transfer only describes the transfer,
+// and is filled in from the reaped URB before its callback is called as libusb would.
+
+static int submit_iso_transfer(maru_context *ctx, struct maru_transfer *transfer)
+{
+   struct libusb_transfer *trans = transfer->trans;
+
+   if (!ctx->usbfs)
+      return libusb_submit_transfer(trans);
+
+   if (!transfer->urb && !(transfer->urb = maru_usbfs_urb_new(LIBMARU_MAX_ENQUEUE_COUNT)))
+      return -1;
+
+   unsigned packet_len[LIBMARU_MAX_ENQUEUE_COUNT];
+   for (int i = 0; i < trans->num_iso_packets; i++)
+      packet_len[i] = trans->iso_packet_desc[i].length;
+
+   return maru_usbfs_submit_iso(ctx->usbfs, transfer->urb, trans->endpoint, trans->buffer,
+         packet_len, trans->num_iso_packets, transfer) ? 0 : -1;
+}
+
+static void cancel_iso_transfer(maru_context *ctx, struct maru_transfer *transfer)
+{
+   if (ctx->usbfs)
+      maru_usbfs_discard(ctx->usbfs, transfer->urb);
+   else
+      libusb_cancel_transfer(transfer->trans);
+}
+
+static enum libusb_transfer_status urb_status(int status)
+{
+   switch (status)
+   {
+      case 0:
+         return LIBUSB_TRANSFER_COMPLETED;
+      case -ENOENT:
+      case -ECONNRESET:
+         return LIBUSB_TRANSFER_CANCELLED;
+      case -ENODEV:
+      case -ESHUTDOWN:
+         return LIBUSB_TRANSFER_NO_DEVICE;
+      case -EPIPE:
+         return LIBUSB_TRANSFER_STALL;
+      case -EOVERFLOW:
+         return LIBUSB_TRANSFER_OVERFLOW;
+      default:
+         return LIBUSB_TRANSFER_ERROR;
+   }
+}
+
+// Returns false once the device is gone.
+static bool reap_usbfs(maru_context *ctx)
+{
+   struct maru_usbfs_urb *urb;
+   while ((urb = maru_usbfs_reap(ctx->usbfs)))
+   {
+      struct maru_transfer *transfer = urb->userdata;
+      struct libusb_transfer *trans = transfer->trans;
+
+      trans->status = urb_status(urb->urb.status);
+      trans->actual_length = urb->urb.actual_length;
+      for (int i = 0; i < urb->urb.number_of_packets; i++)
+      {
+         trans->iso_packet_desc[i].actual_length = urb->urb.iso_frame_desc[i].actual_length;
+         trans->iso_packet_desc[i].status = urb_status(urb->urb.iso_frame_desc[i].status);
+      }
+
+      trans->callback(trans);
+   }
+
+   return errno != ENODEV;
+}
+
+// Once the device is gone, URBs still submitted are never reaped.
+// They are completed as libusb does on disconnect, so nothing waits on them forever.
+static void fail_usbfs_urbs(maru_context *ctx)
+{
+   for (unsigned str = 0; str < ctx->num_streams; str++)
+   {
+      struct transfer_list *list = &ctx->streams[str].trans;
+
+      for (unsigned i = 0; i < list->size; i++)
+      {
+         struct maru_transfer *transfer = list->transfers[i];
+         if (!transfer->urb || !transfer->urb->active)
+            continue;
+
+         transfer->urb->active = false;
+
+         struct libusb_transfer *trans = transfer->trans;
+         trans->status = LIBUSB_TRANSFER_NO_DEVICE;
+         trans->actual_length = 0;
+         for (int j = 0; j < trans->num_iso_packets; j++)
+         {
+            trans->iso_packet_desc[j].actual_length = 0;
+            trans->iso_packet_desc[j].status = LIBUSB_TRANSFER_NO_DEVICE;
+         }
+
+         trans->callback(trans);
+      }
+   }
+}
+
+// Blocks until some transfer has completed.
+static void wait_iso_events(maru_context *ctx)
+{
+   if (ctx->usbfs)
+   {
+      poll(&(struct pollfd) { .fd = maru_usbfs_fd(ctx->usbfs), .events = POLLOUT }, 1, 100);
+      if (!reap_usbfs(ctx))
+         fail_usbfs_urbs(ctx);
+   }
+   else
+      libusb_handle_events(ctx->ctx);
+}
+
+static void log_stream(maru_context *ctx, struct maru_stream_internal *stream)
+{
+   struct maru_usblog_stream rec = {
+      .speed         = stream->transfer_speed,
+      .fraction      = stream->transfer_speed_fraction,
+      .mult          = stream->transfer_speed_mult,
+      .enqueue_count = stream->enqueue_count,
+      .bps           = stream->bps,
+   };
+
+   maru_usblog_write(ctx->usblog, MARU_USBLOG_STREAM,
+         stream - ctx->streams, 0, &rec, sizeof(rec));
+   stream->logged = true;
+}
+
+static void log_submit(maru_context *ctx, struct maru_transfer *transfer)
+{
+   const struct libusb_transfer *trans = transfer->trans;
+
+   uint8_t buf[sizeof(struct maru_usblog_submit) + LIBMARU_MAX_ENQUEUE_COUNT * sizeof(uint16_t)];
+   struct maru_usblog_submit *rec = (struct maru_usblog_submit*)buf;
+
+   rec->hash      = maru_usblog_hash(trans->buffer, trans->length);
+   rec->packets   = trans->num_iso_packets;
+   rec->in_flight = transfer->stream->trans_count;
+   for (int i = 0; i < trans->num_iso_packets; i++)
+      rec->length[i] = trans->iso_packet_desc[i].length;
+
+   transfer->log_id = ctx->usblog_id++;
+   maru_usblog_write(ctx->usblog, MARU_USBLOG_SUBMIT,
+         transfer->stream - ctx->streams, transfer->log_id,
+         rec, sizeof(*rec) + trans->num_iso_packets * sizeof(uint16_t));
+}
+
+static void log_complete(maru_context *ctx, struct maru_transfer *transfer)
+{
+   const struct libusb_transfer *trans = transfer->trans;
+
+   struct maru_usblog_complete rec = {
+      .status  = trans->status,
+      .packets = trans->num_iso_packets,
+   };
+
+   for (int i = 0; i < trans->num_iso_packets; i++)
+   {
+      rec.actual_length += trans->iso_packet_desc[i].actual_length;
+      if (trans->iso_packet_desc[i].actual_length != trans->iso_packet_desc[i].length)
+         rec.short_packets++;
+   }
+
+   maru_usblog_write(ctx->usblog, MARU_USBLOG_COMPLETE,
+         transfer->stream - ctx->streams, transfer->log_id, &rec, sizeof(rec));
+}
+
+static void log_control(maru_context *ctx, struct libusb_transfer *trans)
+{
+   const struct libusb_control_setup *setup = libusb_control_transfer_get_setup(trans);
+
+   struct maru_usblog_control rec = {
+      .status       = trans->status,
+      .request_type = setup->bmRequestType,
+      .request      = setup->bRequest,
+      .value        = libusb_le16_to_cpu(setup->wValue),
+      .index        = libusb_le16_to_cpu(setup->wIndex),
+      .length       = libusb_le16_to_cpu(setup->wLength),
+   };
+
+   maru_usblog_write(ctx->usblog, MARU_USBLOG_CONTROL, 0xff, 0, &rec, sizeof(rec));
+}
+
+// The status snapshot is written both by the thread and by writers of the stream.
+// Writers serialize on the sequence count itself, readers never wait for them.
+static uint32_t status_begin(struct maru_stream_internal *stream)
+{
+   uint32_t seq = __atomic_load_n(&stream->status.seq, __ATOMIC_RELAXED);
+   for (;;)
+   {
+      if (!(seq & 1) && __atomic_compare_exchange_n(&stream->status.seq, &seq, seq + 1,
+               true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+         break;
+
+      seq = __atomic_load_n(&stream->status.seq, __ATOMIC_RELAXED);
+   }
+
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   return seq;
+}
+
+static void status_end(struct maru_stream_internal *stream, uint32_t seq)
+{
+   __atomic_store_n(&stream->status.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Fifo sizes are rounded up to a power of two.
+static size_t fifo_alloc_size(size_t size)
+{
+   size_t pot_size = 1;
+   while (pot_size < size)
+      pot_size <<= 1;
+   return pot_size;
+}
+
+static void publish_fifo_size(struct maru_stream_internal *stream, size_t size)
+{
+   uint32_t seq = status_begin(stream);
+   __atomic_store_n(&stream->status.fifo_size, size, __ATOMIC_RELAXED);
+   status_end(stream, seq);
+}
+
+// Publishes write_avail. Called after writes, from any thread.
+static void publish_write_avail(struct maru_stream_internal *stream)
+{
+   uint32_t seq = status_begin(stream);
+   __atomic_store_n(&stream->status.write_avail,
+         maru_fifo_write_avail(stream->fifo), __ATOMIC_RELAXED);
+   status_end(stream, seq);
+}
+
+// Position page has a single writer, and is read by other processes.
+static void publish_position(struct maru_position *pos,
+      uint64_t played, uint64_t queued, maru_usec timestamp)
+{
+   uint32_t seq = __atomic_load_n(&pos->seq, __ATOMIC_RELAXED);
+   __atomic_store_n(&pos->seq, seq + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   __atomic_store_n(&pos->bytes_played, played, __ATOMIC_RELAXED);
+   __atomic_store_n(&pos->bytes_queued, queued, __ATOMIC_RELAXED);
+   __atomic_store_n(&pos->timestamp, timestamp, __ATOMIC_RELAXED);
+
+   __atomic_store_n(&pos->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Publishes the whole snapshot. Only called from the thread,
+// which is the only one changing anything but write_avail.
+static void publish_status(struct maru_stream_internal *stream,
+      uint64_t played, uint64_t queued)
+{
+   maru_usec now = current_time();
+
+   uint32_t seq = status_begin(stream);
+   __atomic_store_n(&stream->status.bytes_played, played, __ATOMIC_RELAXED);
+   __atomic_store_n(&stream->status.bytes_queued, queued, __ATOMIC_RELAXED);
+   __atomic_store_n(&stream->status.write_avail,
+         maru_fifo_write_avail(stream->fifo), __ATOMIC_RELAXED);
+   __atomic_store_n(&stream->status.timestamp, now, __ATOMIC_RELAXED);
+   status_end(stream, seq);
+
+   struct maru_position *pos = __atomic_load_n(&stream->position, __ATOMIC_ACQUIRE);
+   if (pos)
+      publish_position(pos, played, queued, now);
+}
+
 static void transfer_stream_cb(struct libusb_transfer *trans)
 {
    struct maru_transfer *transfer = trans->user_data;
    transfer->active = false;
 
    transfer->stream->trans_count--;
+   transfer->stream->queued_packets -= trans->num_iso_packets;
+
+   MARU_PROBE4(transfer_complete, transfer->stream - transfer->ctx->streams,
+         trans->status, trans->actual_length, transfer->stream->queued_packets);
+
+   if (transfer->ctx->usblog)
+      log_complete(transfer->ctx, transfer);
 
    // If we are deiniting, we will die before this can be used.
    if (!transfer->block)
@@ -667,6 +1118,12 @@ static void transfer_stream_cb(struct libusb_transfer *trans)
 
       if (maru_fifo_read_unlock(transfer->stream->fifo, &transfer->region) != LIBMARU_SUCCESS)
          fprintf(stderr, "Error occured during read unlock!\n");
+
+      uint64_t played = transfer->stream->status.bytes_played;
+      if (trans->status != LIBUSB_TRANSFER_CANCELLED)
+         played += trans->length;
+      publish_status(transfer->stream, played,
+            transfer->stream->status.bytes_queued - trans->length);
    }
 
    if (trans->status == LIBUSB_TRANSFER_CANCELLED)
@@ -706,19 +1163,29 @@ static void transfer_feedback_cb(struct libusb_transfer *trans)
 
    if (trans->status == LIBUSB_TRANSFER_COMPLETED)
    {
-      uint32_t fraction = 
-         (trans->buffer[0] <<  0) |
-         (trans->buffer[1] <<  8) |
-         (trans->buffer[2] << 16);
-
-      fraction <<= 2;
+      uint32_t fraction = maru_sched_feedback_speed(trans->buffer);
 
       transfer->stream->transfer_speed_fraction =
          transfer->stream->transfer_speed = fraction;
       //////////
    }
 
-   if (libusb_submit_transfer(trans) < 0)
+   MARU_PROBE3(transfer_feedback, transfer->stream - transfer->ctx->streams,
+         trans->status, transfer->stream->transfer_speed);
+
+   if (transfer->ctx->usblog)
+   {
+      struct maru_usblog_feedback rec = {
+         .status = trans->status,
+         .speed  = transfer->stream->transfer_speed,
+      };
+      memcpy(rec.raw, trans->buffer, USB_AUDIO_FEEDBACK_SIZE);
+
+      maru_usblog_write(transfer->ctx->usblog, MARU_USBLOG_FEEDBACK,
+            transfer->stream - transfer->ctx->streams, 0, &rec, sizeof(rec));
+   }
+
+   if (submit_iso_transfer(transfer->ctx, transfer) < 0)
       fprintf(stderr, "Resubmitting feedback transfer failed ...\n");
 }
 
@@ -751,6 +1218,55 @@ static void fill_transfer(maru_context *ctx,
    trans->region = *region;
 }
 
+static void copy_to_region(const struct maru_fifo_locked_region *region, size_t offset,
+      const void *data_, size_t size)
+{
+   const uint8_t *data = data_;
+
+   if (offset < region->first_size)
+   {
+      size_t first = region->first_size - offset;
+      if (first > size)
+         first = size;
+
+      memcpy((uint8_t*)region->first + offset, data, first);
+      data   += first;
+      size   -= first;
+      offset  = 0;
+   }
+   else
+      offset -= region->first_size;
+
+   if (size)
+      memcpy((uint8_t*)region->second + offset, data, size);
+}
+
+static void write_tap(struct maru_stream_internal *stream, const struct libusb_transfer *trans)
+{
+   // Transfer buffer is always contigous, either straight from fifo or embedded_data.
+   struct maru_tap_header header = {
+      .timestamp = current_time() + stream->queued_packets * stream->packet_period,
+      .frame     = stream->frame_count,
+      .size      = trans->length,
+      .dropped   = stream->tap_dropped,
+   };
+
+   size_t size = sizeof(header) + header.size;
+   struct maru_fifo_locked_region region;
+
+   if (maru_fifo_write_avail(stream->tap) < size ||
+         maru_fifo_write_lock(stream->tap, size, &region) != LIBMARU_SUCCESS)
+   {
+      stream->tap_dropped++;
+      return;
+   }
+
+   copy_to_region(&region, 0, &header, sizeof(header));
+   copy_to_region(&region, sizeof(header), trans->buffer, header.size);
+   maru_fifo_write_unlock(stream->tap, &region);
+   stream->tap_dropped = 0;
+}
+
 static bool enqueue_transfer(maru_context *ctx, struct maru_stream_internal *stream,
       const struct maru_fifo_locked_region *region, const unsigned *packet_len, unsigned packets)
 {
@@ -776,13 +1292,26 @@ static bool enqueue_transfer(maru_context *ctx, struct maru_stream_internal *str
 
    fill_transfer(ctx, transfer, region, packet_len, packets);
 
-   if (libusb_submit_transfer(transfer->trans) < 0)
+   if (submit_iso_transfer(ctx, transfer) < 0)
    {
       transfer->active = false;
       return false;
    }
 
+   if (stream->tap)
+      write_tap(stream, transfer->trans);
+
    stream->trans_count++;
+   if (ctx->usblog)
+      log_submit(ctx, transfer);
+
+   stream->queued_packets += packets;
+   stream->frame_count += packets;
+   publish_status(stream, stream->status.bytes_played,
+         stream->status.bytes_queued + transfer->trans->length);
+
+   MARU_PROBE5(transfer_submit, stream - ctx->streams, transfer->trans->length,
+         packets, stream->queued_packets, stream->trans_count);
    if (stream->trans_count >= LIBMARU_MAX_ENQUEUE_TRANSFERS && stream->fifo)
       poll_list_block(ctx->epfd, maru_fifo_read_notify_fd(stream->fifo));
 
@@ -811,12 +1340,13 @@ static bool enqueue_feedback_transfer(maru_context *ctx, struct maru_stream_inte
    libusb_set_iso_packet_lengths(trans->trans, USB_AUDIO_FEEDBACK_SIZE);
 
    trans->stream = stream;
+   trans->ctx    = ctx;
    trans->active = true;
 
    if (!append_transfer(&stream->trans, trans))
       goto error;
 
-   if (libusb_submit_transfer(trans->trans) < 0)
+   if (submit_iso_transfer(ctx, trans) < 0)
    {
       trans->active = false;
       return false;
@@ -833,24 +1363,28 @@ error:
    return false;
 }
 
-static size_t stream_chunk_size(struct maru_stream_internal *stream)
+// Packets per transfer, so that a transfer roughly covers a fragment.
+static unsigned stream_enqueue_count(size_t bps, size_t frag_size)
 {
-   size_t new_fraction = stream->transfer_speed_fraction + (stream->transfer_speed & 0xffff);
+   size_t frame_size = bps / 1000;
 
-   size_t to_write = new_fraction >> 16;
-   to_write *= stream->transfer_speed_mult;
+   size_t count = frag_size / frame_size + 1;
+   if (count > LIBMARU_MAX_ENQUEUE_COUNT)
+      count = LIBMARU_MAX_ENQUEUE_COUNT;
 
-   return to_write;
+   return count;
 }
 
-static void stream_chunk_size_finalize(struct maru_stream_internal *stream)
+static size_t stream_chunk_size(struct maru_stream_internal *stream)
 {
-   // Calculate fractional speeds (async isochronous).
-   stream->transfer_speed_fraction += stream->transfer_speed & 0xffff;
+   return maru_sched_packet_size(stream->transfer_speed,
+         stream->transfer_speed_fraction, stream->transfer_speed_mult);
+}
 
-   // Wrap-around.
-   stream->transfer_speed_fraction = (UINT32_C(0xffff0000) & stream->transfer_speed)
-      | (stream->transfer_speed_fraction & 0xffff);
+static void stream_chunk_size_finalize(struct maru_stream_internal *stream)
+{
+   stream->transfer_speed_fraction = maru_sched_advance(stream->transfer_speed,
+         stream->transfer_speed_fraction);
 }
 
 static void handle_stream(maru_context *ctx, struct maru_stream_internal *stream)
@@ -861,6 +1395,9 @@ static void handle_stream(maru_context *ctx, struct maru_stream_internal *stream
    unsigned packets = 0;
    size_t total_write = 0;
 
+   if (ctx->usblog && !stream->logged)
+      log_stream(ctx, stream);
+
    size_t to_write = stream_chunk_size(stream);
    while (avail >= to_write && packets < stream->enqueue_count)
    {
@@ -904,12 +1441,13 @@ static void free_transfers_stream(maru_context *ctx,
       if (transfer->active)
       {
          transfer->block = true;
-         libusb_cancel_transfer(transfer->trans);
+         cancel_iso_transfer(ctx, transfer);
          while (transfer->active)
-            libusb_handle_events(ctx->ctx);
+            wait_iso_events(ctx);
       }
 
       libusb_free_transfer(transfer->trans);
+      maru_usbfs_urb_free(transfer->urb);
       free(transfer);
    }
 
@@ -942,6 +1480,9 @@ static void transfer_control_cb(struct libusb_transfer *trans)
 {
    struct maru_control_request *buf = trans->user_data;
 
+   if (buf->ctx->usblog)
+      log_control(buf->ctx, trans);
+
    switch (trans->status)
    {
       case LIBUSB_TRANSFER_COMPLETED:
@@ -977,613 +1518,1933 @@ static void transfer_control_cb(struct libusb_transfer *trans)
    libusb_free_transfer(trans);
 }
 
-static void handle_request(maru_context *ctx,
-      int fd)
+static struct volume_control *stream_to_volume_control(maru_context *ctx, maru_stream stream);
+
+/** \ingroup lib
+ * \brief SET_CUR requests for every channel of a volume control, submitted at once. */
+struct volume_batch
 {
+   /** Associated context */
+   maru_context *ctx;
+   /** Volume control being written */
+   struct volume_control *ctrl;
+
+   /** Set if caller waits for reply. */
+   bool reply;
+   /** Request to reply to once all transfers have completed. */
    struct maru_control_request req;
-   if (read(fd, &req, sizeof(req)) != (ssize_t)sizeof(req))
-      return;
 
-   struct libusb_transfer *trans = libusb_alloc_transfer(0);
-   if (!trans)
-   {
-      req.error = LIBMARU_ERROR_MEMORY;
-      write(req.reply_fd, &req, sizeof(req));
-      return;
-   }
+   /** Number of transfers that have yet to complete. */
+   unsigned remaining;
+   /** First error encountered. */
+   maru_error error;
 
-   struct maru_control_request *buf = calloc(1, sizeof(*buf));
-   if (!buf)
-   {
-      req.error = LIBMARU_ERROR_MEMORY;
-      write(req.reply_fd, &req, sizeof(req));
-      return;
-   }
+   /** Setup packet and payload for every channel. */
+   uint8_t buffers[8][LIBUSB_CONTROL_SETUP_SIZE + sizeof(uint16_t)];
+};
 
-   *buf = req;
+static bool submit_volume_batch(maru_context *ctx, struct volume_control *ctrl,
+      maru_volume volume, const struct maru_control_request *req);
 
-   req.request_type |= req.request & USB_REQUEST_DIR_MASK;
+static void finish_volume_batch(struct volume_batch *batch)
+{
+   maru_context *ctx = batch->ctx;
+   struct volume_control *ctrl = batch->ctrl;
 
-   libusb_fill_control_setup(buf->data.setup,
-         req.request_type,
-         req.request,
-         req.value,
-         req.index,
-         req.size);
+   // Mirrored value can no longer be trusted.
+   if (batch->error != LIBMARU_SUCCESS)
+      __atomic_store_n(&ctrl->cur.valid, false, __ATOMIC_RELEASE);
 
-#if 0
-   fprintf(stderr, "Request:\n");
-   fprintf(stderr, "\tRequest Type: 0x%02x\n", (unsigned)req.request_type);
-   fprintf(stderr, "\tRequest:      0x%02x\n", (unsigned)req.request);
-   fprintf(stderr, "\tValue:        0x%04x\n", (unsigned)req.value);
-   fprintf(stderr, "\tIndex:        0x%04x\n", (unsigned)req.index);
-   fprintf(stderr, "\tSize:         0x%04x\n", (unsigned)req.size);
-#endif
+   if (batch->reply)
+   {
+      batch->req.error = batch->error;
+      write(batch->req.reply_fd, &batch->req, sizeof(batch->req));
+   }
 
-   libusb_fill_control_transfer(trans,
-         ctx->handle,
-         buf->data.setup,
-         transfer_control_cb,
-         buf,
-         1000);
+   free(batch);
 
-   if (libusb_submit_transfer(trans) < 0)
+   // Only the latest volume that came in while busy is written.
+   if (!ctrl->in_flight && ctrl->dirty)
    {
-      fprintf(stderr, "Submit transfer failed ...\n");
-      free(buf);
-      libusb_free_transfer(trans);
-
-      req.error = LIBMARU_ERROR_IO;
-      write(req.reply_fd, &req, sizeof(req));
+      ctrl->dirty = false;
+      submit_volume_batch(ctx, ctrl, ctrl->pending, NULL);
    }
 }
 
-static void *thread_entry(void *data)
+// First failure of a batch is the one reported, whatever completes after it.
+static void fail_volume_batch(struct volume_batch *batch, maru_error err)
 {
-   maru_context *ctx = data;
+   if (batch->error == LIBMARU_SUCCESS)
+      batch->error = err;
+}
 
-   bool alive = true;
+static void transfer_volume_cb(struct libusb_transfer *trans)
+{
+   struct volume_batch *batch = trans->user_data;
 
-#define MAX_EVENTS 16
-   while (alive)
-   {
-      struct epoll_event events[MAX_EVENTS];
-      int num_events;
+   if (batch->ctx->usblog)
+      log_control(batch->ctx, trans);
 
-      if ((num_events = epoll_wait(ctx->epfd, events, MAX_EVENTS, -1)) < 0)
+   if (trans->status == LIBUSB_TRANSFER_TIMED_OUT)
+      fail_volume_batch(batch, LIBMARU_ERROR_TIMEOUT);
+   else if (trans->status != LIBUSB_TRANSFER_COMPLETED)
+      fail_volume_batch(batch, LIBMARU_ERROR_IO);
+
+   libusb_free_transfer(trans);
+
+   if (--batch->remaining)
+      return;
+
+   batch->ctrl->in_flight--;
+   finish_volume_batch(batch);
+}
+
+static bool submit_volume_batch(maru_context *ctx, struct volume_control *ctrl,
+      maru_volume volume, const struct maru_control_request *req)
+{
+   struct volume_batch *batch = calloc(1, sizeof(*batch));
+   if (!batch)
+   {
+      if (req)
       {
-         if (errno == EINTR)
-            continue;
+         struct maru_control_request reply = *req;
+         reply.error = LIBMARU_ERROR_MEMORY;
+         write(reply.reply_fd, &reply, sizeof(reply));
+      }
+      return false;
+   }
 
-         perror("epoll_wait");
+   batch->ctx = ctx;
+   batch->ctrl = ctrl;
+   batch->error = LIBMARU_SUCCESS;
+   if (req)
+   {
+      batch->reply = true;
+      batch->req = *req;
+   }
+
+   uint16_t swapped = libusb_cpu_to_le16(volume);
+
+   // All channels are pipelined rather than waiting for each one in turn.
+   for (unsigned i = 0; i < ctrl->chans; i++)
+   {
+      struct libusb_transfer *trans = libusb_alloc_transfer(0);
+      if (!trans)
+      {
+         fail_volume_batch(batch, LIBMARU_ERROR_MEMORY);
          break;
       }
 
-      bool libusb_event = false;
+      libusb_fill_control_setup(batch->buffers[i],
+            LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+            USB_REQUEST_UAC_SET_CUR,
+            (USB_UAC_VOLUME_SELECTOR << 8) | ctrl->channels[i],
+            (ctrl->feature_unit << 8) | ctx->control_interface,
+            sizeof(swapped));
 
-      for (size_t i = 0; i < num_events; i++)
-      {
-         int fd = events[i].data.fd;
-         struct maru_stream_internal *stream = NULL;
+      memcpy(batch->buffers[i] + LIBUSB_CONTROL_SETUP_SIZE, &swapped, sizeof(swapped));
 
-         if ((stream = fd_to_stream(ctx, fd)))
-            handle_stream(ctx, stream);
-         else if (fd == ctx->quit_fd)
-            alive = false;
-         else if (fd == ctx->request_fd[0])
-            handle_request(ctx, fd);
-         else
-            libusb_event = true;
-      }
+      libusb_fill_control_transfer(trans,
+            ctx->handle,
+            batch->buffers[i],
+            transfer_volume_cb,
+            batch,
+            1000);
 
-      if (libusb_event)
+      if (libusb_submit_transfer(trans) < 0)
       {
-         if (libusb_handle_events_timeout(ctx->ctx, &(struct timeval) {0}) < 0)
-         {
-            fprintf(stderr, "libusb_handle_events_timeout() failed!\n");
-            alive = false;
-         }
+         libusb_free_transfer(trans);
+         fail_volume_batch(batch, LIBMARU_ERROR_IO);
+         break;
       }
+
+      batch->remaining++;
    }
 
-   free_transfers(ctx);
-   kill_write_notifications(ctx);
-   return NULL;
+   if (!batch->remaining)
+   {
+      finish_volume_batch(batch);
+      return false;
+   }
+
+   ctrl->in_flight++;
+   return true;
 }
 
-static bool add_stream(maru_context *ctx,
-      unsigned interface, unsigned altsetting,
-      unsigned stream_ep, unsigned feedback_ep)
+static void handle_volume_request(maru_context *ctx,
+      const struct maru_control_request *req)
 {
-   struct maru_stream_internal *new_streams = realloc(ctx->streams, (ctx->num_streams + 1) * sizeof(*ctx->streams));
-   if (!new_streams)
-      return false;
-
-   ctx->streams = new_streams;
+   struct volume_control *ctrl = stream_to_volume_control(ctx, req->stream);
+   if (!ctrl || !ctrl->chans)
+   {
+      if (!req->async)
+      {
+         struct maru_control_request reply = *req;
+         reply.error = LIBMARU_ERROR_INVALID;
+         write(reply.reply_fd, &reply, sizeof(reply));
+      }
+      return;
+   }
 
-   ctx->streams[ctx->num_streams] = (struct maru_stream_internal) {
-      .stream_ep = stream_ep,
-      .feedback_ep = feedback_ep,
-      .stream_interface = interface,
-      .stream_altsetting = altsetting,
-      .sync_fd = -1,
-   };
+   maru_volume volume = (maru_volume)req->value;
 
-   ctx->num_streams++;
-   return true;
+   if (req->async)
+   {
+      // Coalesce. Whatever is pending gets overwritten by newer volume.
+      if (ctrl->in_flight)
+      {
+         ctrl->pending = volume;
+         ctrl->dirty = true;
+      }
+      else
+         submit_volume_batch(ctx, ctrl, volume, NULL);
+   }
+   else
+   {
+      // This is newer than anything pending.
+      ctrl->dirty = false;
+      submit_volume_batch(ctx, ctrl, volume, req);
+   }
 }
 
-static bool init_stream_nolock(maru_context *ctx,
-      maru_stream stream,
-      const struct maru_stream_desc *desc)
+static void flush_stream(maru_context *ctx, struct maru_stream_internal *stream)
 {
-   struct maru_stream_internal *str = &ctx->streams[stream];
+   struct transfer_list *list = &stream->trans;
 
-   const struct libusb_interface_descriptor *iface =
-      &ctx->conf->interface[str->stream_interface].altsetting[str->stream_altsetting];
+   // Block every transfer before cancelling any of them.
+   // Otherwise, a transfer completing in the mean time would unlock its region out of order.
+   for (unsigned trans = 0; trans < list->size; trans++)
+   {
+      struct maru_transfer *transfer = list->transfers[trans];
+      if (transfer->active && transfer->trans->callback == transfer_stream_cb)
+      {
+         transfer->block = true;
+         cancel_iso_transfer(ctx, transfer);
+      }
+   }
 
-   if (!format_matches(iface, desc))
-      return false;
+   for (unsigned trans = 0; trans < list->size; trans++)
+   {
+      struct maru_transfer *transfer = list->transfers[trans];
+      if (transfer->trans->callback != transfer_stream_cb)
+         continue;
 
-   str->sync_fd = eventfd(0, 0);
-   if (str->sync_fd < 0)
-      return false;
+      while (transfer->active)
+         wait_iso_events(ctx);
+      transfer->block = false;
+   }
 
-   if (perform_rate_request(ctx, str->stream_ep, desc->sample_rate, 1000000) != LIBMARU_SUCCESS)
-      return false;
+   // Regions of cancelled transfers are dropped along with the rest of the data.
+   maru_fifo_flush(stream->fifo);
+   stream->trans_count = 0;
+   stream->queued_packets = 0;
+   publish_status(stream, stream->status.bytes_played, 0);
 
-   if (str->feedback_ep && !enqueue_feedback_transfer(ctx, str))
-      return false;
+   if (ctx->usblog)
+      maru_usblog_write(ctx->usblog, MARU_USBLOG_FLUSH, stream - ctx->streams, 0, NULL, 0);
 
-   size_t buffer_size = desc->buffer_size;
-   if (!buffer_size)
-      buffer_size = 1024 * 32;
+   poll_list_unblock(ctx->epfd,
+         maru_fifo_read_notify_fd(stream->fifo),
+         POLLIN);
+}
 
-   // Set fragment size.
-   size_t frag_size = desc->fragment_size;
+static maru_error resize_stream(struct maru_stream_internal *stream,
+      size_t buffer_size, size_t frag_size, size_t *dropped)
+{
+   if (!buffer_size)
+      return LIBMARU_ERROR_INVALID;
    if (!frag_size)
       frag_size = buffer_size >> 2;
 
-   size_t frame_size = desc->sample_rate * desc->channels * desc->bits / 8;
-   frame_size /= 1000;
+   // Same constraint as the triggers set in init_stream_nolock(), checked up front
+   // so the fifo is left alone if it cannot be met.
+   size_t pot_size = fifo_alloc_size(buffer_size);
+   if (!frag_size || frag_size * 2 >= pot_size)
+      return LIBMARU_ERROR_INVALID;
 
-   str->enqueue_count = frag_size / frame_size + 1;
-   if (str->enqueue_count > LIBMARU_MAX_ENQUEUE_COUNT)
-      str->enqueue_count = LIBMARU_MAX_ENQUEUE_COUNT;
+   size_t buffered = maru_fifo_read_avail(stream->fifo);
 
-   str->fifo = maru_fifo_new(buffer_size);
-   if (!str->fifo)
-      return false;
+   maru_error err = maru_fifo_resize(stream->fifo, buffer_size);
+   if (err != LIBMARU_SUCCESS)
+      return err;
 
-   if (maru_fifo_set_read_trigger(str->fifo,
-            frag_size) < 0)
-   {
-      maru_fifo_free(str->fifo);
-      str->fifo = NULL;
-      return false;
-   }
+   *dropped = buffered - maru_fifo_read_avail(stream->fifo);
 
-   if (maru_fifo_set_write_trigger(str->fifo,
-            frag_size) < 0)
-   {
-      maru_fifo_free(str->fifo);
-      str->fifo = NULL;
-      return false;
-   }
+   // Triggers are checked against each other, so drop the read trigger out of the way first.
+   maru_fifo_set_read_trigger(stream->fifo, 1);
+   if (maru_fifo_set_write_trigger(stream->fifo, frag_size) != LIBMARU_SUCCESS ||
+         maru_fifo_set_read_trigger(stream->fifo, frag_size) != LIBMARU_SUCCESS)
+      return LIBMARU_ERROR_GENERIC;
 
-   poll_list_add(ctx->epfd,
-         maru_fifo_read_notify_fd(str->fifo), POLLIN);
+   stream->enqueue_count = stream_enqueue_count(stream->bps, frag_size);
+   stream->desc.buffer_size = buffer_size;
+   stream->desc.fragment_size = frag_size;
 
-   str->transfer_speed_mult = desc->channels * desc->bits / 8;
+   publish_fifo_size(stream, pot_size);
+   publish_status(stream, stream->status.bytes_played, stream->status.bytes_queued);
+   return LIBMARU_SUCCESS;
+}
 
-   str->transfer_speed_fraction = desc->sample_rate;
-   str->transfer_speed_fraction <<= 16;
+static bool save_streams(maru_context *ctx,
+      struct handover_stream *records, int *memfds);
+static void save_drained(maru_context *ctx,
+      const struct handover_stream *records, struct handover_drained *drained);
 
-   str->transfer_speed_fraction /= 1000;
+// Transfers only hold up a handover once it drains.
+static bool handover_busy(maru_context *ctx, bool drain)
+{
+   if (ctx->volume.in_flight)
+      return true;
 
-   str->bps = desc->sample_rate * desc->channels * desc->bits / 8;
-   str->transfer_speed = str->transfer_speed_fraction;
-   str->trans_count = 0;
+   for (unsigned i = 0; i < ctx->num_streams; i++)
+   {
+      const struct maru_stream_internal *stream = &ctx->streams[i];
+      if (stream->volume.in_flight)
+         return true;
 
-   str->timer.started = false;
+      if (!drain)
+         continue;
 
-   return true;
+      for (unsigned trans = 0; trans < stream->trans.size; trans++)
+      {
+         if (stream->trans.transfers[trans]->active)
+            return true;
+      }
+   }
+
+   return false;
 }
 
-static void deinit_stream_nolock(maru_context *ctx, maru_stream stream)
+static void wait_handover_idle(maru_context *ctx, bool drain)
 {
-   struct maru_stream_internal *str = &ctx->streams[stream];
-
-   if (str->sync_fd >= 0)
+   while (handover_busy(ctx, drain))
    {
-      close(str->sync_fd);
-      str->sync_fd = -1;
-   }
+      wait_iso_events(ctx);
 
-   if (str->fifo)
-   {
-      maru_fifo_free(str->fifo);
-      str->fifo = NULL;
+      // Volume requests go through libusb even when streaming through usbfs.
+      if (ctx->usbfs)
+         libusb_handle_events_timeout(ctx->ctx, &(struct timeval) {0});
    }
 }
 
-static void deinit_stream(maru_context *ctx, maru_stream stream)
+// Streams keep playing while state is handed over.
+// They are saved here rather than by the caller,
+// so buffered data and the count of bytes submitted match.
+static maru_error stop_streams(maru_context *ctx, const struct maru_control_request *req)
 {
-   ctx_lock(ctx);
-   deinit_stream_nolock(ctx, stream);
-   ctx_unlock(ctx);
+   ctx->handing_over = true;
+   wait_handover_idle(ctx, false);
+
+   if (!save_streams(ctx, req->handover_streams, req->handover_memfds))
+      return LIBMARU_ERROR_GENERIC;
+   return LIBMARU_SUCCESS;
 }
 
-static bool find_interface_endpoints(maru_context *ctx,
-      unsigned interface,
-      unsigned altsetting,
-      const struct libusb_interface_descriptor *iface)
+// Completions have to be reaped by the process which submitted the transfers,
+// so the other process cannot start submitting before they have played out.
+static void drain_streams(maru_context *ctx, const struct maru_control_request *req)
 {
-   for (unsigned i = 0; i < iface->bNumEndpoints; i++)
+   ctx->draining = true;
+
+   for (unsigned i = 0; i < ctx->num_streams; i++)
    {
-      const struct libusb_endpoint_descriptor *endp =
-         &iface->endpoint[i];
+      struct maru_stream_internal *stream = &ctx->streams[i];
+      if (!stream->fifo)
+         continue;
 
-      if (endp->bEndpointAddress < 0x80 &&
-            endp->bmAttributes & USB_ENDPOINT_ISOCHRONOUS)
-      {
-         if (endp->bmAttributes & USB_ENDPOINT_ADAPTIVE)
-            perform_pitch_request(ctx,
-                  endp->bEndpointAddress, 100000);
+      poll_list_block(ctx->epfd, maru_fifo_read_notify_fd(stream->fifo));
 
-         return add_stream(ctx,
-                  interface, altsetting,
-                  endp->bEndpointAddress,
-                  endp->bSynchAddress);
+      // Feedback is picked up again by the other process.
+      struct transfer_list *list = &stream->trans;
+      for (unsigned trans = 0; trans < list->size; trans++)
+      {
+         struct maru_transfer *transfer = list->transfers[trans];
+         if (transfer->active && transfer->trans->callback == transfer_feedback_cb)
+         {
+            transfer->block = true;
+            cancel_iso_transfer(ctx, transfer);
+         }
       }
    }
 
-   return true;
+   wait_handover_idle(ctx, true);
+   poll_list_remove_device(ctx);
+   save_drained(ctx, req->handover_streams, req->handover_drained);
 }
 
-static bool enumerate_stream_interfaces(maru_context *ctx,
-      const struct maru_stream_desc *desc)
+static void resume_streams(maru_context *ctx)
 {
-   for (unsigned i = 0; i < ctx->conf->bNumInterfaces; i++)
+   ctx->handing_over = false;
+
+   if (!ctx->draining)
+      return;
+
+   ctx->draining = false;
+   if (!poll_list_add_device(ctx))
+      fprintf(stderr, "Polling device again failed ...\n");
+
+   for (unsigned i = 0; i < ctx->num_streams; i++)
    {
-      unsigned altsettings =
-         ctx->conf->interface[i].num_altsetting;
+      struct maru_stream_internal *stream = &ctx->streams[i];
+      if (!stream->fifo)
+         continue;
 
-      for (unsigned j = 0; j < altsettings; j++)
+      struct transfer_list *list = &stream->trans;
+      for (unsigned trans = 0; trans < list->size; trans++)
       {
-         const struct libusb_interface_descriptor *iface =
-            &ctx->conf->interface[i].altsetting[j];
+         struct maru_transfer *transfer = list->transfers[trans];
+         if (transfer->active || transfer->trans->callback != transfer_feedback_cb)
+            continue;
 
-         if (iface->bInterfaceClass == USB_CLASS_AUDIO &&
-               iface->bInterfaceSubClass == USB_SUBCLASS_AUDIO_STREAMING &&
-               iface->bNumEndpoints >= 1 &&
-               format_matches(iface, desc))
+         transfer->block = false;
+         transfer->active = true;
+         if (submit_iso_transfer(ctx, transfer) < 0)
          {
-            if (!find_interface_endpoints(ctx, i, j, iface))
-               return false;
-
-            break;
+            transfer->active = false;
+            fprintf(stderr, "Resubmitting feedback transfer failed ...\n");
          }
       }
-   }
 
-   return true;
+      poll_list_unblock(ctx->epfd,
+            maru_fifo_read_notify_fd(stream->fifo),
+            POLLIN);
+   }
 }
 
-static bool enumerate_streams(maru_context *ctx,
-      const struct maru_stream_desc *desc)
+static void handle_request(maru_context *ctx,
+      int fd)
 {
-   struct libusb_config_descriptor *conf = ctx->conf;
+   struct maru_control_request req;
+   if (read(fd, &req, sizeof(req)) != (ssize_t)sizeof(req))
+      return;
 
-   int ctrl_index = find_interface_class_index(conf,
-         USB_CLASS_AUDIO, USB_SUBCLASS_AUDIO_CONTROL, 0);
+   MARU_PROBE5(request, req.type, req.stream, req.request_type, req.request, req.value);
 
-   if (ctrl_index < 0)
-      return false;
+   // Device belongs to another process now.
+   if (ctx->handed_over)
+   {
+      req.error = LIBMARU_ERROR_DEAD;
+      write(req.reply_fd, &req, sizeof(req));
+      return;
+   }
+
+   // Stream state and volume are being handed over as they are.
+   if (ctx->handing_over && (req.type == MARU_REQUEST_FLUSH ||
+            req.type == MARU_REQUEST_VOLUME || req.type == MARU_REQUEST_BUFFER))
+   {
+      req.error = LIBMARU_ERROR_BUSY;
+      if (!req.async)
+         write(req.reply_fd, &req, sizeof(req));
+      return;
+   }
+
+   if (req.type == MARU_REQUEST_FLUSH)
+   {
+      req.error = LIBMARU_ERROR_INVALID;
+      if (req.stream < ctx->num_streams && ctx->streams[req.stream].fifo)
+      {
+         flush_stream(ctx, &ctx->streams[req.stream]);
+         req.error = LIBMARU_SUCCESS;
+      }
+
+      write(req.reply_fd, &req, sizeof(req));
+      return;
+   }
+   else if (req.type == MARU_REQUEST_VOLUME)
+   {
+      handle_volume_request(ctx, &req);
+      return;
+   }
+   else if (req.type == MARU_REQUEST_TAP)
+   {
+      req.error = LIBMARU_ERROR_INVALID;
+      if (req.stream < ctx->num_streams && ctx->streams[req.stream].fifo)
+      {
+         ctx->streams[req.stream].tap = req.tap;
+         ctx->streams[req.stream].tap_dropped = 0;
+         req.error = LIBMARU_SUCCESS;
+      }
+
+      write(req.reply_fd, &req, sizeof(req));
+      return;
+   }
+   else if (req.type == MARU_REQUEST_BUFFER)
+   {
+      req.error = LIBMARU_ERROR_INVALID;
+      if (req.stream < ctx->num_streams && ctx->streams[req.stream].fifo)
+      {
+         req.error = resize_stream(&ctx->streams[req.stream],
+               req.buffer_size, req.fragment_size, &req.dropped);
+      }
+
+      write(req.reply_fd, &req, sizeof(req));
+      return;
+   }
+   else if (req.type == MARU_REQUEST_HANDOVER)
+   {
+      req.error = LIBMARU_SUCCESS;
+      switch (req.handover)
+      {
+         case MARU_HANDOVER_STOP:
+            req.error = stop_streams(ctx, &req);
+            break;
+         case MARU_HANDOVER_DRAIN:
+            drain_streams(ctx, &req);
+            break;
+         case MARU_HANDOVER_RESUME:
+            resume_streams(ctx);
+            break;
+         case MARU_HANDOVER_COMMIT:
+            ctx->handed_over = true;
+            break;
+         default:
+            req.error = LIBMARU_ERROR_INVALID;
+      }
+
+      write(req.reply_fd, &req, sizeof(req));
+      return;
+   }
+   else if (req.type == MARU_REQUEST_LOG)
+   {
+      maru_usblog_free(ctx->usblog);
+      ctx->usblog = req.usblog;
+      ctx->usblog_id = 0;
+
+      // Scheduling state is written out again to new log.
+      for (unsigned i = 0; i < ctx->num_streams; i++)
+         ctx->streams[i].logged = false;
+
+      req.error = LIBMARU_SUCCESS;
+      write(req.reply_fd, &req, sizeof(req));
+      return;
+   }
+
+   // Endpoints of streaming interfaces belong to the usbfs descriptor,
+   // so requests to them cannot go through libusb.
+   if (ctx->usbfs && (req.request_type & USB_REQUEST_RECIPIENT_MASK) == LIBUSB_RECIPIENT_ENDPOINT)
+   {
+      int ret = maru_usbfs_control(ctx->usbfs,
+            req.request_type | (req.request & USB_REQUEST_DIR_MASK),
+            req.request, req.value, req.index,
+            req.data.data, req.size, 1000);
+
+      req.error = ret < 0 ? LIBMARU_ERROR_IO : LIBMARU_SUCCESS;
+      write(req.reply_fd, &req, sizeof(req));
+      return;
+   }
+
+   struct libusb_transfer *trans = libusb_alloc_transfer(0);
+   if (!trans)
+   {
+      req.error = LIBMARU_ERROR_MEMORY;
+      write(req.reply_fd, &req, sizeof(req));
+      return;
+   }
+
+   struct maru_control_request *buf = calloc(1, sizeof(*buf));
+   if (!buf)
+   {
+      req.error = LIBMARU_ERROR_MEMORY;
+      write(req.reply_fd, &req, sizeof(req));
+      return;
+   }
+
+   *buf = req;
+   buf->ctx = ctx;
+
+   req.request_type |= req.request & USB_REQUEST_DIR_MASK;
+
+   libusb_fill_control_setup(buf->data.setup,
+         req.request_type,
+         req.request,
+         req.value,
+         req.index,
+         req.size);
+
+#if 0
+   fprintf(stderr, "Request:\n");
+   fprintf(stderr, "\tRequest Type: 0x%02x\n", (unsigned)req.request_type);
+   fprintf(stderr, "\tRequest:      0x%02x\n", (unsigned)req.request);
+   fprintf(stderr, "\tValue:        0x%04x\n", (unsigned)req.value);
+   fprintf(stderr, "\tIndex:        0x%04x\n", (unsigned)req.index);
+   fprintf(stderr, "\tSize:         0x%04x\n", (unsigned)req.size);
+#endif
+
+   libusb_fill_control_transfer(trans,
+         ctx->handle,
+         buf->data.setup,
+         transfer_control_cb,
+         buf,
+         1000);
+
+   if (libusb_submit_transfer(trans) < 0)
+   {
+      fprintf(stderr, "Submit transfer failed ...\n");
+      free(buf);
+      libusb_free_transfer(trans);
+
+      req.error = LIBMARU_ERROR_IO;
+      write(req.reply_fd, &req, sizeof(req));
+   }
+}
+
+/** \ingroup lib
+ * \brief A stream waiting to be refilled in current pass of thread. */
+struct stream_refill
+{
+   struct maru_stream_internal *stream;
+   /** Microseconds until stream runs out of data on device. */
+   maru_usec deadline;
+   /** Bytes buffered in fifo, used to break ties. */
+   size_t buffered;
+};
+
+static void add_stream_refill(struct stream_refill *refills, unsigned *num_refills,
+      struct maru_stream_internal *stream)
+{
+   struct stream_refill refill = {
+      .stream   = stream,
+      .deadline = stream->queued_packets * stream->packet_period,
+      .buffered = maru_fifo_read_avail(stream->fifo),
+   };
+
+   // Insertion sort, earliest deadline first. There are only a handful of streams.
+   unsigned i = *num_refills;
+   while (i > 0 && (refills[i - 1].deadline > refill.deadline ||
+            (refills[i - 1].deadline == refill.deadline && refills[i - 1].buffered > refill.buffered)))
+   {
+      refills[i] = refills[i - 1];
+      i--;
+   }
+
+   refills[i] = refill;
+   (*num_refills)++;
+}
+
+static void *thread_entry(void *data)
+{
+   maru_context *ctx = data;
+
+   bool alive = true;
+
+#define MAX_EVENTS 16
+   while (alive)
+   {
+      struct epoll_event events[MAX_EVENTS];
+      int num_events;
+
+      if ((num_events = epoll_wait(ctx->epfd, events, MAX_EVENTS, -1)) < 0)
+      {
+         if (errno == EINTR)
+            continue;
+
+         perror("epoll_wait");
+         break;
+      }
+
+      bool libusb_event = false;
+      bool usbfs_event = false;
+      bool usbfs_hup = false;
+      struct stream_refill refills[MAX_EVENTS];
+      unsigned num_refills = 0;
+      int stream_fds[MAX_EVENTS];
+      unsigned num_stream_fds = 0;
+
+      for (int i = 0; i < num_events; i++)
+      {
+         int fd = events[i].data.fd;
+
+         if (fd == ctx->quit_fd)
+            alive = false;
+         else if (fd == ctx->request_fd[0])
+            handle_request(ctx, fd);
+         else if (fd_to_stream(ctx, fd))
+            stream_fds[num_stream_fds++] = fd;
+         else if (ctx->usbfs && fd == maru_usbfs_fd(ctx->usbfs))
+         {
+            usbfs_event = true;
+            usbfs_hup = events[i].events & (EPOLLHUP | EPOLLERR);
+         }
+         else
+            libusb_event = true;
+      }
+
+      // A disconnected device leaves its descriptor ready with nothing to reap,
+      // so it is taken out of the poll set rather than woken up on forever.
+      if (usbfs_event && (!reap_usbfs(ctx) || usbfs_hup))
+      {
+         poll_list_remove(ctx->epfd, maru_usbfs_fd(ctx->usbfs));
+         fail_usbfs_urbs(ctx);
+      }
+
+      // Reap completed transfers first, so in-flight counts are up to date
+      // and their transfers can be reused for refilling.
+      if (libusb_event)
+      {
+         if (libusb_handle_events_timeout(ctx->ctx, &(struct timeval) {0}) < 0)
+         {
+            fprintf(stderr, "libusb_handle_events_timeout() failed!\n");
+            alive = false;
+         }
+      }
+
+      for (unsigned i = 0; i < num_stream_fds; i++)
+      {
+         // Completions unblock streams, but nothing is submitted once a handover drains.
+         if (ctx->draining)
+         {
+            poll_list_block(ctx->epfd, stream_fds[i]);
+            continue;
+         }
+
+         struct maru_stream_internal *stream = fd_to_stream(ctx, stream_fds[i]);
+         if (stream)
+            add_stream_refill(refills, &num_refills, stream);
+      }
+
+      // Refill the stream closest to running dry first.
+      // handle_stream() submits at most one transfer per pass,
+      // so a busy stream cannot starve the others.
+      for (unsigned i = 0; i < num_refills; i++)
+         handle_stream(ctx, refills[i].stream);
+   }
+
+   free_transfers(ctx);
+   kill_write_notifications(ctx);
+   return NULL;
+}
+
+// Isochronous endpoints are serviced every 2^(bInterval - 1) frames,
+// which are 1 ms on full-speed and 125 us microframes on high-speed and faster devices.
+static maru_usec endpoint_packet_period(maru_context *ctx,
+      unsigned interface, unsigned altsetting, unsigned ep)
+{
+   const struct libusb_interface_descriptor *iface =
+      &ctx->conf->interface[interface].altsetting[altsetting];
+
+   unsigned interval = 1;
+   for (unsigned i = 0; i < iface->bNumEndpoints; i++)
+   {
+      if (iface->endpoint[i].bEndpointAddress == ep)
+      {
+         interval = iface->endpoint[i].bInterval;
+         break;
+      }
+   }
+
+   if (interval < 1)
+      interval = 1;
+   else if (interval > 16)
+      interval = 16;
+
+   maru_usec frame = libusb_get_device_speed(libusb_get_device(ctx->handle)) >= LIBUSB_SPEED_HIGH ?
+      125 : 1000;
+   return frame << (interval - 1);
+}
+
+static bool add_stream(maru_context *ctx,
+      unsigned interface, unsigned altsetting,
+      unsigned stream_ep, unsigned feedback_ep)
+{
+   struct maru_stream_internal *new_streams = realloc(ctx->streams, (ctx->num_streams + 1) * sizeof(*ctx->streams));
+   if (!new_streams)
+      return false;
+
+   ctx->streams = new_streams;
+
+   ctx->streams[ctx->num_streams] = (struct maru_stream_internal) {
+      .stream_ep = stream_ep,
+      .feedback_ep = feedback_ep,
+      .stream_interface = interface,
+      .stream_altsetting = altsetting,
+      .packet_period = endpoint_packet_period(ctx, interface, altsetting, stream_ep),
+      .sync_fd = -1,
+      .position_fd = -1,
+   };
+
+   ctx->num_streams++;
+   return true;
+}
+
+// If stream is taken over from another process, the device is set up already,
+// and nothing is submitted until the handover is complete.
+// If source is set, the stream reads from a cursor into it instead of a fifo of its own.
+static bool init_stream_nolock(maru_context *ctx,
+      maru_stream stream,
+      const struct maru_stream_desc *desc,
+      bool handover, maru_bfifo *source, bool drop_on_lag)
+{
+   struct maru_stream_internal *str = &ctx->streams[stream];
+
+   const struct libusb_interface_descriptor *iface =
+      &ctx->conf->interface[str->stream_interface].altsetting[str->stream_altsetting];
+
+   if (!format_matches(iface, desc))
+      return false;
+
+   str->sync_fd = eventfd(0, 0);
+   if (str->sync_fd < 0)
+      return false;
+
+   if (!handover)
+   {
+      if (perform_rate_request(ctx, str->stream_ep, desc->sample_rate, 1000000) != LIBMARU_SUCCESS)
+         return false;
+
+      if (str->feedback_ep && !enqueue_feedback_transfer(ctx, str))
+         return false;
+   }
+
+   size_t buffer_size = source ? maru_bfifo_size(source) : desc->buffer_size;
+   if (!buffer_size)
+      buffer_size = 1024 * 32;
+
+   // Set fragment size.
+   size_t frag_size = desc->fragment_size;
+   if (!frag_size)
+      frag_size = buffer_size >> 2;
+
+   str->enqueue_count = stream_enqueue_count(desc->sample_rate * desc->channels * desc->bits / 8,
+         frag_size);
+
+   str->fifo = source ? maru_bfifo_add_reader(source, drop_on_lag) : maru_fifo_new(buffer_size);
+   if (!str->fifo)
+      return false;
+   str->broadcast = source != NULL;
+
+   if (maru_fifo_set_read_trigger(str->fifo,
+            frag_size) < 0)
+   {
+      maru_fifo_free(str->fifo);
+      str->fifo = NULL;
+      return false;
+   }
+
+   if (maru_fifo_set_write_trigger(str->fifo,
+            frag_size) < 0)
+   {
+      maru_fifo_free(str->fifo);
+      str->fifo = NULL;
+      return false;
+   }
+
+   poll_list_add(ctx->epfd,
+         maru_fifo_read_notify_fd(str->fifo), POLLIN);
+
+   str->transfer_speed_mult = desc->channels * desc->bits / 8;
+
+   str->transfer_speed_fraction = desc->sample_rate;
+   str->transfer_speed_fraction <<= 16;
+
+   str->transfer_speed_fraction /= 1000;
+
+   str->bps = desc->sample_rate * desc->channels * desc->bits / 8;
+   str->desc = *desc;
+   str->desc.buffer_size = buffer_size;
+   str->desc.fragment_size = frag_size;
+   str->transfer_speed = str->transfer_speed_fraction;
+   str->trans_count = 0;
+   str->queued_packets = 0;
+   str->frame_count = 0;
+   str->tap = NULL;
+   str->tap_dropped = 0;
+   str->logged = false;
+
+   str->timer.started = false;
+
+   publish_fifo_size(str, fifo_alloc_size(buffer_size));
+   publish_status(str, 0, 0);
+
+   return true;
+}
+
+static void deinit_stream_nolock(maru_context *ctx, maru_stream stream)
+{
+   struct maru_stream_internal *str = &ctx->streams[stream];
+
+   if (str->sync_fd >= 0)
+   {
+      close(str->sync_fd);
+      str->sync_fd = -1;
+   }
+
+   if (str->fifo)
+   {
+      maru_fifo_free(str->fifo);
+      str->fifo = NULL;
+   }
+
+   // Other processes keep their mappings of the page.
+   if (str->position_fd >= 0)
+   {
+      munmap(str->position, sizeof(*str->position));
+      close(str->position_fd);
+      str->position = NULL;
+      str->position_fd = -1;
+   }
+
+   str->tap = NULL;
+}
+
+static void deinit_stream(maru_context *ctx, maru_stream stream)
+{
+   ctx_lock(ctx);
+   deinit_stream_nolock(ctx, stream);
+   ctx_unlock(ctx);
+}
+
+static bool find_interface_endpoints(maru_context *ctx,
+      unsigned interface,
+      unsigned altsetting,
+      const struct libusb_interface_descriptor *iface)
+{
+   for (unsigned i = 0; i < iface->bNumEndpoints; i++)
+   {
+      const struct libusb_endpoint_descriptor *endp =
+         &iface->endpoint[i];
+
+      if (endp->bEndpointAddress < 0x80 &&
+            endp->bmAttributes & USB_ENDPOINT_ISOCHRONOUS)
+      {
+         if (endp->bmAttributes & USB_ENDPOINT_ADAPTIVE)
+            perform_pitch_request(ctx,
+                  endp->bEndpointAddress, 100000);
+
+         return add_stream(ctx,
+                  interface, altsetting,
+                  endp->bEndpointAddress,
+                  endp->bSynchAddress);
+      }
+   }
+
+   return true;
+}
+
+static bool enumerate_stream_interfaces(maru_context *ctx,
+      const struct maru_stream_desc *desc)
+{
+   for (unsigned i = 0; i < ctx->conf->bNumInterfaces; i++)
+   {
+      unsigned altsettings =
+         ctx->conf->interface[i].num_altsetting;
+
+      for (unsigned j = 0; j < altsettings; j++)
+      {
+         const struct libusb_interface_descriptor *iface =
+            &ctx->conf->interface[i].altsetting[j];
+
+         if (iface->bInterfaceClass == USB_CLASS_AUDIO &&
+               iface->bInterfaceSubClass == USB_SUBCLASS_AUDIO_STREAMING &&
+               iface->bNumEndpoints >= 1 &&
+               format_matches(iface, desc))
+         {
+            if (!find_interface_endpoints(ctx, i, j, iface))
+               return false;
+
+            break;
+         }
+      }
+   }
+
+   return true;
+}
+
+static bool enumerate_streams(maru_context *ctx,
+      const struct maru_stream_desc *desc)
+{
+   struct libusb_config_descriptor *conf = ctx->conf;
+
+   int ctrl_index = find_interface_class_index(conf,
+         USB_CLASS_AUDIO, USB_SUBCLASS_AUDIO_CONTROL, 0);
+
+   if (ctrl_index < 0)
+      return false;
+
+   ctx->control_interface = ctrl_index;
+
+   if (!enumerate_stream_interfaces(ctx, desc))
+      return false;
+
+   if (libusb_kernel_driver_active(ctx->handle, ctrl_index))
+   {
+      if (libusb_detach_kernel_driver(ctx->handle, ctrl_index) < 0 ||
+            libusb_claim_interface(ctx->handle, ctrl_index) < 0)
+         return false;
+   }
+
+   for (unsigned i = 0; i < ctx->num_streams; i++)
+   {
+      unsigned iface = ctx->streams[i].stream_interface;
+      unsigned altsetting = ctx->streams[i].stream_altsetting;
+
+      if (libusb_kernel_driver_active(ctx->handle, iface) && libusb_detach_kernel_driver(ctx->handle, iface) < 0)
+         return false;
+
+      if (ctx->usbfs)
+      {
+         if (!maru_usbfs_claim_interface(ctx->usbfs, iface, altsetting))
+            return false;
+         continue;
+      }
+
+      if (libusb_claim_interface(ctx->handle, iface) < 0)
+         return false;
+
+      if (libusb_set_interface_alt_setting(ctx->handle, iface, altsetting) < 0)
+         return false;
+   }
+
+   return true;
+}
+
+static struct usb_uac_feature_unit_descriptor*
+find_volume_feature_unit(
+      const uint8_t *ctrl_extra,  size_t ctrl_extra_length,
+      const uint8_t *iface_extra, size_t iface_extra_length)
+{
+   int term = -1;
+
+   struct usb_uas_interface_descriptor *desc = NULL;
+   for (size_t i = 0; i < iface_extra_length; i += desc->bLength)
+   {
+      desc = (struct usb_uas_interface_descriptor*)&iface_extra[i];
+
+      if (desc->bLength != sizeof(*desc))
+         continue;
+
+      if (desc->bDescriptorSubtype != USB_GENERAL_DESCRIPTOR_SUBTYPE)
+         continue;
+
+      term = desc->bTerminalLink;
+      break;
+   }
+
+   if (term < 0)
+      return NULL;
+
+   struct usb_uac_feature_unit_descriptor *feature = NULL;
+
+   for (size_t i = 0; i < ctrl_extra_length; i += feature->bLength)
+   {
+      feature = (struct usb_uac_feature_unit_descriptor*)&ctrl_extra[i];
+
+      if (feature->bLength < sizeof(*feature))
+         continue;
+
+      if (feature->bDescriptorSubtype == UAC_FEATURE_UNIT &&
+            feature->bSourceID == term &&
+            feature->bControlSize)
+         return feature;
+   }
+
+   return NULL;
+}
+
+static struct usb_uac_feature_unit_descriptor*
+find_master_volume_feature_unit(const uint8_t *extra, size_t extra_length)
+{
+   int id = -1;
+   struct usb_uac_output_terminal_descriptor *desc = NULL;
+
+   // Find output terminal that maps to a speaker, and see if the last
+   // unit in the chain is a feature unit with volume controls.
+   for (size_t i = 0; i < extra_length; i += desc->bLength)
+   {
+      desc = (struct usb_uac_output_terminal_descriptor*)&extra[i];
+
+      if (desc->bLength != sizeof(*desc))
+         continue;
+
+      if (desc->bDescriptorSubtype == UAC_OUTPUT_TERMINAL &&
+            desc->wTerminalType == UAC_TYPE_SPEAKER)
+      {
+         id = desc->bSourceID;
+         break;
+      }
+   }
+
+   if (id < 0)
+   {
+      fprintf(stderr, "Didn't find speaker ...\n");
+      return NULL;
+   }
+
+   struct usb_uac_feature_unit_descriptor *feature = NULL;
+
+   for (size_t i = 0; i < extra_length; i += feature->bLength)
+   {
+      feature = (struct usb_uac_feature_unit_descriptor*)&extra[i];
+
+      if (feature->bLength < sizeof(*feature))
+         continue;
+
+      if (feature->bDescriptorSubtype == UAC_FEATURE_UNIT &&
+            feature->bUnitID == id &&
+            feature->bControlSize)
+         return feature;
+   }
+
+   return NULL;
+}
+
+static void parse_feature_unit(struct volume_control *vol,
+      const struct usb_uac_feature_unit_descriptor *feature)
+{
+   memset(vol, 0, sizeof(*vol));
+   vol->feature_unit = feature->bUnitID;
+
+   unsigned control_len = feature->bLength - 7;
+
+   // Find the two first channels that have volume control, and assume they map to left/right.
+   for (unsigned i = 0; i < control_len && vol->chans < 2; i += feature->bControlSize)
+   {
+      if (feature->bmaControls[i] & USB_UAC_VOLUME_SELECTOR)
+         vol->channels[vol->chans++] = i / feature->bControlSize;
+   }
+
+#if 0
+   fprintf(stderr, "Enumerated controls:\n");
+   fprintf(stderr, "\tUnit: %u\n", vol->feature_unit);
+   fprintf(stderr, "\tChans: %u\n", vol->chans);
+   for (unsigned i = 0; i < vol->chans; i++)
+      fprintf(stderr, "\t\tChan #%u: %u\n", i, vol->channels[i]);
+#endif
+}
+
+static bool enumerate_master_controls(maru_context *ctx)
+{
+   const struct libusb_interface_descriptor *desc =
+      &ctx->conf->interface[ctx->control_interface].altsetting[0];
+
+   struct usb_uac_feature_unit_descriptor *feature =
+      find_master_volume_feature_unit(desc->extra, desc->extra_length);
+
+   if (!feature)
+      return false;
+
+   parse_feature_unit(&ctx->volume, feature);
+
+   return true;
+}
+
+static void enumerate_stream_controls(maru_context *ctx,
+      maru_stream stream)
+{
+   const struct libusb_interface_descriptor *iface =
+      &ctx->conf->interface[ctx->streams[stream].stream_interface].altsetting[ctx->streams[stream].stream_altsetting];
+
+   const struct libusb_interface_descriptor *ctrl =
+      &ctx->conf->interface[ctx->control_interface].altsetting[0];
+
+   struct usb_uac_feature_unit_descriptor *feature =
+      find_volume_feature_unit(ctrl->extra, ctrl->extra_length, iface->extra, iface->extra_length);
+
+   if (!feature)
+      return;
+
+   parse_feature_unit(&ctx->streams[stream].volume, feature);
+}
+
+static bool enumerate_controls(maru_context *ctx)
+{
+   if (!enumerate_master_controls(ctx))
+      return false;
+
+   for (unsigned i = 0; i < ctx->num_streams; i++)
+      enumerate_stream_controls(ctx, i);
+
+   return true;
+}
+
+// The usbfs backend is selected with LIBMARU_USBFS.
+// "1" opens the usbfs node of the device, while a path opens that node instead,
+// e.g. a stand-in for testing.
+static bool open_usbfs(maru_context *ctx)
+{
+   const char *env = getenv("LIBMARU_USBFS");
+   if (!env || !*env || strcmp(env, "0") == 0)
+      return true;
+
+   char path[64];
+   if (*env != '/')
+   {
+      libusb_device *dev = libusb_get_device(ctx->handle);
+      snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u",
+            (unsigned)libusb_get_bus_number(dev), (unsigned)libusb_get_device_address(dev));
+      env = path;
+   }
+
+   ctx->usbfs = maru_usbfs_open(env);
+   if (!ctx->usbfs)
+   {
+      fprintf(stderr, "Failed to open usbfs node %s!\n", env);
+      return false;
+   }
+
+   return true;
+}
+
+static maru_error context_new(maru_context **ctx)
+{
+   maru_context *context = calloc(1, sizeof(*context));
+   if (!context)
+      return LIBMARU_ERROR_MEMORY;
+
+   context->device_fd = -1;
+   context->quit_fd = eventfd(0, 0);
+   context->epfd = epoll_create(16);
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, context->request_fd) < 0)
+      goto error;
+
+   if (fcntl(context->request_fd[0], F_SETFL,
+            fcntl(context->request_fd[0], F_GETFL) | O_NONBLOCK) < 0)
+      goto error;
+   if (fcntl(context->request_fd[1], F_SETFL,
+            fcntl(context->request_fd[1], F_GETFL) | O_NONBLOCK) < 0)
+      goto error;
+
+   if (context->quit_fd < 0 ||
+         context->epfd < 0)
+      goto error;
+
+   if (libusb_init(&context->ctx) < 0)
+      goto error;
+
+   *ctx = context;
+   return LIBMARU_SUCCESS;
+
+error:
+   maru_destroy_context(context);
+   return LIBMARU_ERROR_GENERIC;
+}
+
+// Starts thread once device and streams are set up.
+static bool context_start(maru_context *ctx)
+{
+   if (!poll_list_init(ctx))
+      return false;
+
+   if (pthread_mutex_init(&ctx->lock, NULL) < 0)
+      return false;
+
+   if (pthread_create(&ctx->thread, NULL, thread_entry, ctx) < 0)
+   {
+      ctx->thread = 0;
+      return false;
+   }
+
+   return true;
+}
+
+maru_error maru_create_context_from_vid_pid(maru_context **ctx,
+      uint16_t vid, uint16_t pid,
+      const struct maru_stream_desc *desc)
+{
+   maru_context *context;
+   maru_error err = context_new(&context);
+   if (err != LIBMARU_SUCCESS)
+      return err;
+
+   context->handle = libusb_open_device_with_vid_pid(context->ctx, vid, pid);
+   if (!context->handle)
+      goto error;
+
+   if (libusb_get_active_config_descriptor(libusb_get_device(context->handle), &context->conf) < 0)
+   {
+      context->conf = NULL;
+      goto error;
+   }
+
+   if (!conf_is_audio_class(context->conf))
+      goto error;
+
+   if (!open_usbfs(context))
+      goto error;
+
+   if (!enumerate_streams(context, desc))
+      goto error;
+
+   if (!enumerate_controls(context))
+      goto error;
+
+   if (!context_start(context))
+      goto error;
+
+   // Requests go through the thread, so this has to happen after it is started.
+   cache_volume_controls(context);
+
+   *ctx = context;
+   return LIBMARU_SUCCESS;
+
+error:
+   maru_destroy_context(context);
+   return LIBMARU_ERROR_GENERIC;
+}
+
+void maru_destroy_context(maru_context *ctx)
+{
+   if (!ctx)
+      return;
+
+   if (ctx->quit_fd >= 0)
+   {
+      eventfd_write(ctx->quit_fd, 1);
+      if (ctx->thread)
+         pthread_join(ctx->thread, NULL);
+      close(ctx->quit_fd);
+   }
+
+   if (ctx->request_fd[0] >= 0)
+      close(ctx->request_fd[0]);
+   if (ctx->request_fd[1] >= 0)
+      close(ctx->request_fd[1]);
+
+   poll_list_deinit(ctx);
+
+   for (unsigned i = 0; i < ctx->num_streams; i++)
+      deinit_stream(ctx, i);
+   free(ctx->streams);
+
+   maru_usblog_free(ctx->usblog);
+
+   pthread_mutex_destroy(&ctx->lock);
+
+   if (ctx->conf)
+      libusb_free_config_descriptor(ctx->conf);
+
+   // Interfaces stay claimed for the process device was handed over to.
+   if (ctx->handle && !ctx->handed_over)
+   {
+      libusb_release_interface(ctx->handle, ctx->control_interface);
+      libusb_attach_kernel_driver(ctx->handle, ctx->control_interface);
+
+      for (unsigned i = 0; i < ctx->num_streams; i++)
+      {
+         if (ctx->usbfs)
+            maru_usbfs_release_interface(ctx->usbfs, ctx->streams[i].stream_interface);
+         else
+            libusb_release_interface(ctx->handle, ctx->streams[i].stream_interface);
+         libusb_attach_kernel_driver(ctx->handle, ctx->streams[i].stream_interface);
+      }
+   }
+
+   if (ctx->handle)
+      libusb_close(ctx->handle);
+
+   // libusb does not close descriptors it wraps.
+   if (ctx->device_fd >= 0)
+      close(ctx->device_fd);
+
+   maru_usbfs_free(ctx->usbfs);
+
+   if (ctx->ctx)
+      libusb_exit(ctx->ctx);
+
+   free(ctx);
+}
+
+// Handover wire format. Processes on both ends are expected to run the same build of libmaru,
+// so structs go over the socket as is.
+// A struct handover_header carries every descriptor: the device, the usbfs descriptor if used,
+// a memfd with buffered data for every open stream, and application descriptors.
+// It is followed by a struct handover_stream for every stream, and application data.
+// The receiver replies with a byte once it is ready to take over.
+// The sender keeps streaming until then. Once it has let go of the device,
+// it replies with a byte followed by a struct handover_drained for every stream.
+
+#define HANDOVER_MAGIC   0x4d415255
+#define HANDOVER_VERSION 1
+
+/** \ingroup lib
+ * \brief Mirrored values of a volume control. */
+struct handover_volume
+{
+   maru_volume value[3];
+   bool valid[3];
+};
+
+/** \ingroup lib
+ * \brief Start of a handover. */
+struct handover_header
+{
+   uint32_t magic;
+   uint32_t version;
+
+   uint32_t control_interface;
+   uint32_t num_streams;
+   /** Set if streaming interfaces are claimed on a usbfs descriptor. */
+   uint32_t usbfs;
+
+   /** Size of application data. */
+   uint64_t app_size;
+   /** Number of application descriptors. */
+   uint32_t num_app_fds;
+
+   struct handover_volume volume;
+};
+
+/** \ingroup lib
+ * \brief State of a stream in a handover. */
+struct handover_stream
+{
+   uint32_t stream_interface;
+   uint32_t stream_altsetting;
+   uint32_t stream_ep;
+   uint32_t feedback_ep;
+
+   /** Set if stream is open. Remaining fields are only valid then. */
+   uint32_t open;
+   struct maru_stream_desc desc;
+
+   uint32_t transfer_speed;
+   uint32_t transfer_speed_fraction;
+   uint64_t frame_count;
+   uint64_t bytes_played;
+
+   uint32_t timer_started;
+   maru_usec timer_start_time;
+   maru_usec timer_offset;
+   uint64_t timer_write_cnt;
+
+   /** Bytes of buffered data in memfd. */
+   uint64_t buffered;
+
+   struct handover_volume volume;
+};
+
+/** \ingroup lib
+ * \brief State of a stream once transfers of the sender have played out. */
+struct handover_drained
+{
+   /** Bytes submitted since the stream was saved, which are dropped from the front of the memfd data. */
+   uint64_t consumed;
+   uint64_t bytes_played;
+   uint64_t frame_count;
+   uint32_t transfer_speed;
+   uint32_t transfer_speed_fraction;
+};
+
+#define HANDOVER_MAX_STREAMS (MARU_HANDOVER_MAX_MSG_FDS - 2 - LIBMARU_HANDOVER_MAX_FDS)
+
+static void save_volume(struct handover_volume *rec, const struct volume_control *ctrl)
+{
+   rec->value[0] = ctrl->cur.value;
+   rec->valid[0] = ctrl->cur.valid;
+   rec->value[1] = ctrl->min.value;
+   rec->valid[1] = ctrl->min.valid;
+   rec->value[2] = ctrl->max.value;
+   rec->valid[2] = ctrl->max.valid;
+}
+
+static void restore_volume(struct volume_control *ctrl, const struct handover_volume *rec)
+{
+   ctrl->cur.value = rec->value[0];
+   ctrl->cur.valid = rec->valid[0];
+   ctrl->min.value = rec->value[1];
+   ctrl->min.valid = rec->valid[1];
+   ctrl->max.value = rec->value[2];
+   ctrl->max.valid = rec->valid[2];
+}
+
+// Stream records are only used by MARU_HANDOVER_STOP and MARU_HANDOVER_DRAIN.
+static maru_error handover_request(maru_context *ctx, enum maru_handover_step step,
+      struct handover_stream *streams, struct handover_drained *drained, int *memfds)
+{
+   struct maru_control_request req = {
+      .count            = ctx->request_count++,
+      .type             = MARU_REQUEST_HANDOVER,
+      .handover         = step,
+      .handover_streams = streams,
+      .handover_drained = drained,
+      .handover_memfds  = memfds,
+      .reply_fd         = ctx->request_fd[0],
+   };
+
+   maru_error err = submit_request(ctx, &req, -1);
+   if (err != LIBMARU_SUCCESS)
+      return err;
+
+   return req.error;
+}
+
+// libusb does not expose the descriptor of a device handle.
+// A context only has one device open, which is the only descriptor libusb polls for POLLOUT.
+static int find_device_fd(maru_context *ctx)
+{
+   if (ctx->device_fd >= 0)
+      return ctx->device_fd;
+
+   const struct libusb_pollfd **list = libusb_get_pollfds(ctx->ctx);
+   if (!list)
+      return -1;
+
+   int fd = -1;
+   for (const struct libusb_pollfd **tmp = list; *tmp; tmp++)
+   {
+      if ((*tmp)->events & POLLOUT)
+      {
+         fd = (*tmp)->fd;
+         break;
+      }
+   }
+
+   free(list);
+   return fd;
+}
+
+static bool save_stream(maru_context *ctx, maru_stream stream,
+      struct handover_stream *rec, int *memfd)
+{
+   const struct maru_stream_internal *str = &ctx->streams[stream];
+
+   *rec = (struct handover_stream) {
+      .stream_interface  = str->stream_interface,
+      .stream_altsetting = str->stream_altsetting,
+      .stream_ep         = str->stream_ep,
+      .feedback_ep       = str->feedback_ep,
+      .open              = str->fifo != NULL,
+   };
+
+   save_volume(&rec->volume, &str->volume);
+
+   if (!str->fifo)
+      return true;
 
-   ctx->control_interface = ctrl_index;
+   // Writer of the broadcast fifo stays behind in this process.
+   if (str->broadcast)
+      return false;
 
-   if (!enumerate_stream_interfaces(ctx, desc))
+   rec->desc                    = str->desc;
+   rec->transfer_speed          = str->transfer_speed;
+   rec->transfer_speed_fraction = str->transfer_speed_fraction;
+   rec->frame_count             = str->frame_count;
+   rec->bytes_played            = str->status.bytes_played + str->status.bytes_queued;
+   rec->timer_started           = str->timer.started;
+   rec->timer_start_time        = str->timer.start_time;
+   rec->timer_offset            = str->timer.offset;
+   rec->timer_write_cnt         = str->timer.write_cnt;
+   rec->buffered                = maru_fifo_read_avail(str->fifo);
+
+   void *map;
+   *memfd = maru_handover_memfd("libmaru-stream", rec->buffered, &map);
+   if (*memfd < 0)
       return false;
 
-   if (libusb_kernel_driver_active(ctx->handle, ctrl_index))
+   if (map)
    {
-      if (libusb_detach_kernel_driver(ctx->handle, ctrl_index) < 0 ||
-            libusb_claim_interface(ctx->handle, ctrl_index) < 0)
-         return false;
+      maru_fifo_peek(str->fifo, map, rec->buffered);
+      munmap(map, rec->buffered);
    }
 
+   return true;
+}
+
+// Called by thread, which is the only reader of fifos,
+// so buffered data starts right after the bytes submitted so far.
+static bool save_streams(maru_context *ctx,
+      struct handover_stream *records, int *memfds)
+{
    for (unsigned i = 0; i < ctx->num_streams; i++)
    {
-      unsigned iface = ctx->streams[i].stream_interface;
-      unsigned altsetting = ctx->streams[i].stream_altsetting;
-
-      if (libusb_kernel_driver_active(ctx->handle, iface) && libusb_detach_kernel_driver(ctx->handle, iface) < 0)
-         return false;
-
-      if (libusb_claim_interface(ctx->handle, iface) < 0)
-         return false;
-
-      if (libusb_set_interface_alt_setting(ctx->handle, iface, altsetting) < 0)
+      if (!save_stream(ctx, i, &records[i], &memfds[i]))
          return false;
    }
 
    return true;
 }
 
-static struct usb_uac_feature_unit_descriptor*
-find_volume_feature_unit(
-      const uint8_t *ctrl_extra,  size_t ctrl_extra_length,
-      const uint8_t *iface_extra, size_t iface_extra_length)
+// Called by thread once transfers have played out, so every byte submitted has been played.
+static void save_drained(maru_context *ctx,
+      const struct handover_stream *records, struct handover_drained *drained)
 {
-   int term = -1;
-
-   struct usb_uas_interface_descriptor *desc = NULL;
-   for (size_t i = 0; i < iface_extra_length; i += desc->bLength)
+   for (unsigned i = 0; i < ctx->num_streams; i++)
    {
-      desc = (struct usb_uas_interface_descriptor*)&iface_extra[i];
+      const struct maru_stream_internal *str = &ctx->streams[i];
+      struct handover_drained *rec = &drained[i];
 
-      if (desc->bLength != sizeof(*desc))
+      *rec = (struct handover_drained) {0};
+      if (!str->fifo)
          continue;
 
-      if (desc->bDescriptorSubtype != USB_GENERAL_DESCRIPTOR_SUBTYPE)
-         continue;
+      uint64_t submitted = str->status.bytes_played + str->status.bytes_queued;
 
-      term = desc->bTerminalLink;
-      break;
+      rec->consumed                = submitted - records[i].bytes_played;
+      rec->bytes_played            = submitted;
+      rec->frame_count             = str->frame_count;
+      rec->transfer_speed          = str->transfer_speed;
+      rec->transfer_speed_fraction = str->transfer_speed_fraction;
    }
+}
 
-   if (term < 0)
-      return NULL;
-
-   struct usb_uac_feature_unit_descriptor *feature = NULL;
-
-   for (size_t i = 0; i < ctrl_extra_length; i += feature->bLength)
+static bool wait_handover_reply(int sock, maru_usec timeout)
+{
+   for (;;)
    {
-      feature = (struct usb_uac_feature_unit_descriptor*)&ctrl_extra[i];
+      struct pollfd fds = {
+         .fd = sock,
+         .events = POLLIN,
+      };
 
-      if (feature->bLength < sizeof(*feature))
+      int ret = poll(&fds, 1, timeout < 0 ? -1 : timeout / 1000);
+      if (ret < 0 && errno == EINTR)
          continue;
+      if (ret <= 0)
+         return false;
 
-      if (feature->bDescriptorSubtype == UAC_FEATURE_UNIT &&
-            feature->bSourceID == term &&
-            feature->bControlSize)
-         return feature;
+      uint8_t reply;
+      return read(sock, &reply, sizeof(reply)) == (ssize_t)sizeof(reply) && reply == 1;
    }
+}
 
-   return NULL;
+static bool send_handover_reply(int sock, bool ok)
+{
+   uint8_t reply = ok;
+   return maru_handover_send_msg(sock, &reply, sizeof(reply), NULL, 0);
 }
 
-static struct usb_uac_feature_unit_descriptor*
-find_master_volume_feature_unit(const uint8_t *extra, size_t extra_length)
+maru_error maru_handover_context(maru_context *ctx, int sock,
+      const void *data, size_t size,
+      const int *fds, unsigned num_fds,
+      maru_usec timeout)
 {
-   int id = -1;
-   struct usb_uac_output_terminal_descriptor *desc = NULL;
+   if (num_fds > LIBMARU_HANDOVER_MAX_FDS || (size && !data) || (num_fds && !fds))
+      return LIBMARU_ERROR_INVALID;
 
-   // Find output terminal that maps to a speaker, and see if the last
-   // unit in the chain is a feature unit with volume controls.
-   for (size_t i = 0; i < extra_length; i += desc->bLength)
-   {
-      desc = (struct usb_uac_output_terminal_descriptor*)&extra[i];
+   if (ctx->num_streams > HANDOVER_MAX_STREAMS)
+      return LIBMARU_ERROR_INVALID;
 
-      if (desc->bLength != sizeof(*desc))
-         continue;
+   int device_fd = find_device_fd(ctx);
+   if (device_fd < 0)
+      return LIBMARU_ERROR_GENERIC;
 
-      if (desc->bDescriptorSubtype == UAC_OUTPUT_TERMINAL &&
-            desc->wTerminalType == UAC_TYPE_SPEAKER)
-      {
-         id = desc->bSourceID;
-         break;
-      }
+   struct handover_stream records[HANDOVER_MAX_STREAMS];
+   struct handover_drained drained[HANDOVER_MAX_STREAMS];
+   int memfds[HANDOVER_MAX_STREAMS];
+   for (unsigned i = 0; i < ctx->num_streams; i++)
+      memfds[i] = -1;
+
+   maru_error err = handover_request(ctx, MARU_HANDOVER_STOP, records, NULL, memfds);
+   if (err != LIBMARU_SUCCESS)
+      goto end;
+
+   struct handover_header header = {
+      .magic             = HANDOVER_MAGIC,
+      .version           = HANDOVER_VERSION,
+      .control_interface = ctx->control_interface,
+      .num_streams       = ctx->num_streams,
+      .usbfs             = ctx->usbfs != NULL,
+      .app_size          = size,
+      .num_app_fds       = num_fds,
+   };
+   save_volume(&header.volume, &ctx->volume);
+
+   int msg_fds[MARU_HANDOVER_MAX_MSG_FDS];
+   unsigned num_msg_fds = 0;
+
+   msg_fds[num_msg_fds++] = device_fd;
+   if (ctx->usbfs)
+      msg_fds[num_msg_fds++] = maru_usbfs_fd(ctx->usbfs);
+
+   for (unsigned i = 0; i < ctx->num_streams; i++)
+   {
+      if (memfds[i] >= 0)
+         msg_fds[num_msg_fds++] = memfds[i];
    }
 
-   if (id < 0)
+   if (num_fds)
+      memcpy(&msg_fds[num_msg_fds], fds, num_fds * sizeof(*fds));
+   num_msg_fds += num_fds;
+
+   // Streams keep playing while the other process sets up.
+   if (!maru_handover_send_msg(sock, &header, sizeof(header), msg_fds, num_msg_fds) ||
+         !maru_handover_send_msg(sock, records, ctx->num_streams * sizeof(*records), NULL, 0) ||
+         (size && !maru_handover_send_msg(sock, data, size, NULL, 0)) ||
+         !wait_handover_reply(sock, timeout))
    {
-      fprintf(stderr, "Didn't find speaker ...\n");
-      return NULL;
+      err = LIBMARU_ERROR_IO;
+      goto end;
    }
 
-   struct usb_uac_feature_unit_descriptor *feature = NULL;
+   // Other process starts streaming as soon as it has the drained state,
+   // so audio only stops for as long as it takes to pass that on.
+   err = handover_request(ctx, MARU_HANDOVER_DRAIN, records, drained, NULL);
+   if (err != LIBMARU_SUCCESS)
+   {
+      send_handover_reply(sock, false);
+      goto end;
+   }
 
-   for (size_t i = 0; i < extra_length; i += feature->bLength)
+   if (!send_handover_reply(sock, true) ||
+         !maru_handover_send_msg(sock, drained, ctx->num_streams * sizeof(*drained), NULL, 0))
    {
-      feature = (struct usb_uac_feature_unit_descriptor*)&extra[i];
+      err = LIBMARU_ERROR_IO;
+      goto end;
+   }
 
-      if (feature->bLength < sizeof(*feature))
-         continue;
+   err = handover_request(ctx, MARU_HANDOVER_COMMIT, NULL, NULL, NULL);
 
-      if (feature->bDescriptorSubtype == UAC_FEATURE_UNIT &&
-            feature->bUnitID == id &&
-            feature->bControlSize)
-         return feature;
+end:
+   for (unsigned i = 0; i < ctx->num_streams; i++)
+   {
+      if (memfds[i] >= 0)
+         close(memfds[i]);
    }
 
-   return NULL;
+   if (err != LIBMARU_SUCCESS)
+      handover_request(ctx, MARU_HANDOVER_RESUME, NULL, NULL, NULL);
+
+   return err;
 }
 
-static void parse_feature_unit(struct volume_control *vol,
-      const struct usb_uac_feature_unit_descriptor *feature)
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000107
+static bool adopt_streams(maru_context *ctx, const struct handover_header *header,
+      const struct handover_stream *records)
 {
-   memset(vol, 0, sizeof(*vol));
-   vol->feature_unit = feature->bUnitID;
+   if (header->control_interface >= ctx->conf->bNumInterfaces)
+      return false;
 
-   unsigned control_len = feature->bLength - 7;
+   ctx->control_interface = header->control_interface;
 
-   // Find the two first channels that have volume control, and assume they map to left/right.
-   for (unsigned i = 0; i < control_len && vol->chans < 2; i += feature->bControlSize)
+   // Interfaces are claimed already on the device descriptor,
+   // so claiming them again only lets libusb know about it.
+   // Control interface is only claimed if it had a kernel driver, so it might fail.
+   libusb_claim_interface(ctx->handle, ctx->control_interface);
+
+   for (unsigned i = 0; i < header->num_streams; i++)
    {
-      if (feature->bmaControls[i] & USB_UAC_VOLUME_SELECTOR)
-         vol->channels[vol->chans++] = i / feature->bControlSize;
+      const struct handover_stream *rec = &records[i];
+      if (rec->stream_interface >= ctx->conf->bNumInterfaces ||
+            rec->stream_altsetting >= (unsigned)ctx->conf->interface[rec->stream_interface].num_altsetting)
+         return false;
+
+      if (!add_stream(ctx, rec->stream_interface, rec->stream_altsetting,
+               rec->stream_ep, rec->feedback_ep))
+         return false;
+
+      if (!ctx->usbfs && libusb_claim_interface(ctx->handle, rec->stream_interface) < 0)
+         return false;
    }
 
-#if 0
-   fprintf(stderr, "Enumerated controls:\n");
-   fprintf(stderr, "\tUnit: %u\n", vol->feature_unit);
-   fprintf(stderr, "\tChans: %u\n", vol->chans);
-   for (unsigned i = 0; i < vol->chans; i++)
-      fprintf(stderr, "\t\tChan #%u: %u\n", i, vol->channels[i]);
-#endif
+   return true;
 }
 
-static bool enumerate_master_controls(maru_context *ctx)
+static bool restore_stream(maru_context *ctx, maru_stream stream,
+      const struct handover_stream *rec, int memfd)
 {
-   const struct libusb_interface_descriptor *desc =
-      &ctx->conf->interface[ctx->control_interface].altsetting[0];
-
-   struct usb_uac_feature_unit_descriptor *feature =
-      find_master_volume_feature_unit(desc->extra, desc->extra_length);
+   struct maru_stream_internal *str = &ctx->streams[stream];
 
-   if (!feature)
+   if (!init_stream_nolock(ctx, stream, &rec->desc, true, NULL, false))
       return false;
 
-   parse_feature_unit(&ctx->volume, feature);
-
-   return true;
-}
+   str->transfer_speed          = rec->transfer_speed;
+   str->transfer_speed_fraction = rec->transfer_speed_fraction;
+   str->frame_count             = rec->frame_count;
+   str->timer.started           = rec->timer_started;
+   str->timer.start_time        = rec->timer_start_time;
+   str->timer.offset            = rec->timer_offset;
+   str->timer.write_cnt         = rec->timer_write_cnt;
+   publish_status(str, rec->bytes_played, 0);
 
-static void enumerate_stream_controls(maru_context *ctx,
-      maru_stream stream)
-{
-   const struct libusb_interface_descriptor *iface =
-      &ctx->conf->interface[ctx->streams[stream].stream_interface].altsetting[ctx->streams[stream].stream_altsetting];
+   if (!rec->buffered)
+      return true;
 
-   const struct libusb_interface_descriptor *ctrl =
-      &ctx->conf->interface[ctx->control_interface].altsetting[0];
+   struct stat st;
+   if (fstat(memfd, &st) < 0 || (uint64_t)st.st_size < rec->buffered)
+      return false;
 
-   struct usb_uac_feature_unit_descriptor *feature =
-      find_volume_feature_unit(ctrl->extra, ctrl->extra_length, iface->extra, iface->extra_length);
+   void *map = mmap(NULL, rec->buffered, PROT_READ, MAP_PRIVATE, memfd, 0);
+   if (map == MAP_FAILED)
+      return false;
 
-   if (!feature)
-      return;
+   ssize_t ret = maru_fifo_write(str->fifo, map, rec->buffered);
+   munmap(map, rec->buffered);
+   publish_write_avail(str);
 
-   parse_feature_unit(&ctx->streams[stream].volume, feature);
+   return ret == (ssize_t)rec->buffered;
 }
 
-static bool enumerate_controls(maru_context *ctx)
+// Data the sender submitted while this process set up has played already.
+static bool apply_drained(maru_context *ctx, maru_stream stream,
+      const struct handover_stream *saved, const struct handover_drained *rec)
 {
-   if (!enumerate_master_controls(ctx))
+   struct maru_stream_internal *str = &ctx->streams[stream];
+
+   if (rec->consumed > saved->buffered)
       return false;
 
-   for (unsigned i = 0; i < ctx->num_streams; i++)
-      enumerate_stream_controls(ctx, i);
+   if (rec->consumed)
+   {
+      struct maru_fifo_locked_region region;
+      if (maru_fifo_read_lock(str->fifo, rec->consumed, &region) != LIBMARU_SUCCESS ||
+            maru_fifo_read_unlock(str->fifo, &region) != LIBMARU_SUCCESS)
+         return false;
+   }
 
+   str->transfer_speed          = rec->transfer_speed;
+   str->transfer_speed_fraction = rec->transfer_speed_fraction;
+   str->frame_count             = rec->frame_count;
+   publish_status(str, rec->bytes_played, 0);
    return true;
 }
 
-maru_error maru_create_context_from_vid_pid(maru_context **ctx,
-      uint16_t vid, uint16_t pid,
-      const struct maru_stream_desc *desc)
+maru_error maru_create_context_from_handover(maru_context **ctx, int sock,
+      void *data, size_t *size,
+      int *fds, unsigned *num_fds,
+      maru_handover_validate_cb validate, void *userdata)
 {
-   maru_context *context = calloc(1, sizeof(*context));
-   if (!context)
-      return LIBMARU_ERROR_MEMORY;
-
-   context->quit_fd = eventfd(0, 0);
-   context->epfd = epoll_create(16);
-   if (socketpair(AF_UNIX, SOCK_STREAM, 0, context->request_fd) < 0)
-      goto error;
+   struct handover_header header;
+   int msg_fds[MARU_HANDOVER_MAX_MSG_FDS];
+   unsigned num_msg_fds = 0;
 
-   if (fcntl(context->request_fd[0], F_SETFL,
-            fcntl(context->request_fd[0], F_GETFL) | O_NONBLOCK) < 0)
-      goto error;
-   if (fcntl(context->request_fd[1], F_SETFL,
-            fcntl(context->request_fd[1], F_GETFL) | O_NONBLOCK) < 0)
-      goto error;
+   if (!maru_handover_recv_msg(sock, &header, sizeof(header),
+            msg_fds, MARU_HANDOVER_MAX_MSG_FDS, &num_msg_fds))
+      return LIBMARU_ERROR_IO;
 
-   if (context->quit_fd < 0 ||
-         context->epfd < 0)
-      goto error;
+   maru_error err = LIBMARU_ERROR_INVALID;
+   maru_context *context = NULL;
+   struct handover_stream *records = NULL;
+   struct handover_drained drained[HANDOVER_MAX_STREAMS];
 
-   if (libusb_init(&context->ctx) < 0)
-      goto error;
+   if (header.magic != HANDOVER_MAGIC || header.version != HANDOVER_VERSION ||
+         header.num_streams > HANDOVER_MAX_STREAMS ||
+         header.app_size > *size || header.num_app_fds > *num_fds)
+      goto refuse;
 
-   context->handle = libusb_open_device_with_vid_pid(context->ctx, vid, pid);
-   if (!context->handle)
-      goto error;
+   records = calloc(header.num_streams, sizeof(*records));
+   if (!records && header.num_streams)
+   {
+      err = LIBMARU_ERROR_MEMORY;
+      goto refuse;
+   }
 
-   if (libusb_get_active_config_descriptor(libusb_get_device(context->handle), &context->conf) < 0)
+   if (!maru_handover_recv_msg(sock, records, header.num_streams * sizeof(*records), NULL, 0, NULL) ||
+         (header.app_size && !maru_handover_recv_msg(sock, data, header.app_size, NULL, 0, NULL)))
    {
-      context->conf = NULL;
-      goto error;
+      err = LIBMARU_ERROR_IO;
+      goto refuse;
    }
 
-   if (!conf_is_audio_class(context->conf))
-      goto error;
+   unsigned open_streams = 0;
+   for (unsigned i = 0; i < header.num_streams; i++)
+      open_streams += records[i].open != 0;
 
-   if (!enumerate_streams(context, desc))
-      goto error;
+   if (num_msg_fds != 1 + !!header.usbfs + open_streams + header.num_app_fds)
+      goto refuse;
 
-   if (!enumerate_controls(context))
-      goto error;
+   if (validate && !validate(data, header.app_size, header.num_app_fds, userdata))
+      goto refuse;
 
-   if (!poll_list_init(context))
-      goto error;
+   err = context_new(&context);
+   if (err != LIBMARU_SUCCESS)
+      goto refuse;
 
-   if (pthread_mutex_init(&context->lock, NULL) < 0)
-      goto error;
+   err = LIBMARU_ERROR_GENERIC;
 
-   if (pthread_create(&context->thread, NULL, thread_entry, context) < 0)
+   // Device belongs to the other process until it has our reply.
+   context->handed_over = true;
+
+   unsigned fd_index = 0;
+   if (libusb_wrap_sys_device(context->ctx, (intptr_t)msg_fds[fd_index], &context->handle) < 0)
+      goto refuse;
+   context->device_fd = msg_fds[fd_index];
+   msg_fds[fd_index++] = -1;
+
+   if (libusb_get_active_config_descriptor(libusb_get_device(context->handle), &context->conf) < 0)
    {
-      context->thread = 0;
-      goto error;
+      context->conf = NULL;
+      goto refuse;
    }
 
-   *ctx = context;
-   return LIBMARU_SUCCESS;
+   if (!conf_is_audio_class(context->conf))
+      goto refuse;
 
-error:
-   maru_destroy_context(context);
-   return LIBMARU_ERROR_GENERIC;
-}
+   if (header.usbfs)
+   {
+      context->usbfs = maru_usbfs_new(msg_fds[fd_index], NULL);
+      if (!context->usbfs)
+         goto refuse;
+      msg_fds[fd_index++] = -1;
+   }
 
-void maru_destroy_context(maru_context *ctx)
-{
-   if (!ctx)
-      return;
+   if (!adopt_streams(context, &header, records))
+      goto refuse;
 
-   if (ctx->quit_fd >= 0)
+   if (!enumerate_controls(context))
+      goto refuse;
+
+   restore_volume(&context->volume, &header.volume);
+
+   for (unsigned i = 0; i < header.num_streams; i++)
    {
-      eventfd_write(ctx->quit_fd, 1);
-      if (ctx->thread)
-         pthread_join(ctx->thread, NULL);
-      close(ctx->quit_fd);
-   }
+      restore_volume(&context->streams[i].volume, &records[i].volume);
 
-   if (ctx->request_fd[0] >= 0)
-      close(ctx->request_fd[0]);
-   if (ctx->request_fd[1] >= 0)
-      close(ctx->request_fd[1]);
+      if (!records[i].open)
+         continue;
 
-   poll_list_deinit(ctx);
+      bool ok = restore_stream(context, i, &records[i], msg_fds[fd_index]);
+      close(msg_fds[fd_index]);
+      msg_fds[fd_index++] = -1;
+      if (!ok)
+         goto refuse;
+   }
 
-   for (unsigned i = 0; i < ctx->num_streams; i++)
-      deinit_stream(ctx, i);
-   free(ctx->streams);
+   // Other process keeps streaming until it has our reply.
+   if (!send_handover_reply(sock, true) || !wait_handover_reply(sock, -1) ||
+         !maru_handover_recv_msg(sock, drained, header.num_streams * sizeof(*drained), NULL, 0, NULL))
+   {
+      err = LIBMARU_ERROR_IO;
+      goto error;
+   }
 
-   pthread_mutex_destroy(&ctx->lock);
+   for (unsigned i = 0; i < header.num_streams; i++)
+   {
+      if (records[i].open && !apply_drained(context, i, &records[i], &drained[i]))
+         goto error;
+   }
 
-   if (ctx->conf)
-      libusb_free_config_descriptor(ctx->conf);
+   context->handed_over = false;
 
-   if (ctx->handle)
+   for (unsigned i = 0; i < context->num_streams; i++)
    {
-      libusb_release_interface(ctx->handle, ctx->control_interface);
-      libusb_attach_kernel_driver(ctx->handle, ctx->control_interface);
+      struct maru_stream_internal *str = &context->streams[i];
+      if (str->fifo && str->feedback_ep && !enqueue_feedback_transfer(context, str))
+         fprintf(stderr, "Enqueueing feedback transfer failed ...\n");
+   }
 
-      for (unsigned i = 0; i < ctx->num_streams; i++)
-      {
-         libusb_release_interface(ctx->handle, ctx->streams[i].stream_interface);
-         libusb_attach_kernel_driver(ctx->handle, ctx->streams[i].stream_interface);
-      }
+   if (!context_start(context))
+      goto error;
 
-      libusb_close(ctx->handle);
-   }
+   memcpy(fds, &msg_fds[fd_index], header.num_app_fds * sizeof(*fds));
+   *num_fds = header.num_app_fds;
+   *size = header.app_size;
 
-   if (ctx->ctx)
-      libusb_exit(ctx->ctx);
+   free(records);
+   *ctx = context;
+   return LIBMARU_SUCCESS;
 
-   free(ctx);
+refuse:
+   send_handover_reply(sock, false);
+error:
+   for (unsigned i = 0; i < num_msg_fds; i++)
+   {
+      if (msg_fds[i] >= 0)
+         close(msg_fds[i]);
+   }
+
+   free(records);
+   maru_destroy_context(context);
+   return err;
+}
+#else
+maru_error maru_create_context_from_handover(maru_context **ctx, int sock,
+      void *data, size_t *size,
+      int *fds, unsigned *num_fds,
+      maru_handover_validate_cb validate, void *userdata)
+{
+   // Device descriptors cannot be wrapped before libusb 1.0.23.
+   return LIBMARU_ERROR_GENERIC;
 }
+#endif
 
 int maru_get_num_streams(maru_context *ctx)
 {
@@ -1657,7 +3518,7 @@ maru_error maru_get_stream_desc(maru_context *ctx,
       maru_stream stream, struct maru_stream_desc **desc,
       unsigned *num_desc)
 {
-   if (stream >= maru_get_num_streams(ctx))
+   if (stream >= ctx->num_streams)
       return LIBMARU_ERROR_INVALID;
 
    struct maru_stream_desc *audio_desc = calloc(1, sizeof(*audio_desc));
@@ -1729,9 +3590,10 @@ void maru_stream_set_error_notification(maru_context *ctx,
    ctx_unlock(ctx);
 }
 
-maru_error maru_stream_open(maru_context *ctx,
+static maru_error stream_open(maru_context *ctx,
       maru_stream stream,
-      const struct maru_stream_desc *desc)
+      const struct maru_stream_desc *desc,
+      maru_bfifo *source, bool drop_on_lag)
 {
    maru_error ret = LIBMARU_SUCCESS;
    ctx_lock(ctx);
@@ -1754,7 +3616,7 @@ maru_error maru_stream_open(maru_context *ctx,
       goto end;
    }
 
-   if (!init_stream_nolock(ctx, stream, desc))
+   if (!init_stream_nolock(ctx, stream, desc, false, source, drop_on_lag))
    {
       ret = LIBMARU_ERROR_GENERIC;
       goto end;
@@ -1765,6 +3627,24 @@ end:
    return ret;
 }
 
+maru_error maru_stream_open(maru_context *ctx,
+      maru_stream stream,
+      const struct maru_stream_desc *desc)
+{
+   return stream_open(ctx, stream, desc, NULL, false);
+}
+
+maru_error maru_stream_open_broadcast(maru_context *ctx,
+      maru_stream stream,
+      const struct maru_stream_desc *desc,
+      struct maru_bfifo *source, bool drop_on_lag)
+{
+   if (!source)
+      return LIBMARU_ERROR_INVALID;
+
+   return stream_open(ctx, stream, desc, source, drop_on_lag);
+}
+
 maru_error maru_stream_close(maru_context *ctx,
       maru_stream stream)
 {
@@ -1781,11 +3661,117 @@ maru_error maru_stream_close(maru_context *ctx,
    uint64_t dummy;
    eventfd_read(ctx->streams[stream].sync_fd, &dummy);
 
-   deinit_stream_nolock(ctx, stream);
+   deinit_stream(ctx, stream);
+
+   return LIBMARU_SUCCESS;
+}
+
+maru_error maru_stream_flush(maru_context *ctx,
+      maru_stream stream)
+{
+   if (maru_is_stream_available(ctx, stream) != 0)
+      return LIBMARU_ERROR_INVALID;
+
+   // Transfers are owned by the thread, so let it do the flushing.
+   struct maru_control_request req = {
+      .count    = ctx->request_count++,
+      .type     = MARU_REQUEST_FLUSH,
+      .stream   = stream,
+      .reply_fd = ctx->request_fd[0],
+   };
+
+   maru_error err = submit_request(ctx, &req, -1);
+   if (err != LIBMARU_SUCCESS)
+      return err;
+
+   if (req.error != LIBMARU_SUCCESS)
+      return req.error;
+
+   // Latency timer restarts on next write.
+   ctx->streams[stream].timer.started = false;
+   return LIBMARU_SUCCESS;
+}
+
+maru_error maru_stream_set_buffer(maru_context *ctx,
+      maru_stream stream, size_t buffer_size, size_t fragment_size)
+{
+   if (maru_is_stream_available(ctx, stream) != 0)
+      return LIBMARU_ERROR_INVALID;
+
+   // Stream buffer is read from by the thread, so let it do the resizing.
+   struct maru_control_request req = {
+      .count         = ctx->request_count++,
+      .type          = MARU_REQUEST_BUFFER,
+      .stream        = stream,
+      .buffer_size   = buffer_size,
+      .fragment_size = fragment_size,
+      .reply_fd      = ctx->request_fd[0],
+   };
+
+   maru_error err = submit_request(ctx, &req, -1);
+   if (err != LIBMARU_SUCCESS)
+      return err;
+
+   if (req.error != LIBMARU_SUCCESS)
+      return req.error;
+
+   // Dropped audio will never be played.
+   struct maru_stream_internal *str = &ctx->streams[stream];
+   if (str->timer.started)
+      str->timer.write_cnt -= req.dropped;
 
    return LIBMARU_SUCCESS;
 }
 
+maru_error maru_set_usb_log(maru_context *ctx, int fd)
+{
+   maru_usblog *log = NULL;
+   if (fd >= 0)
+   {
+      log = maru_usblog_new(fd);
+      if (!log)
+         return LIBMARU_ERROR_IO;
+   }
+
+   struct maru_control_request req = {
+      .count    = ctx->request_count++,
+      .type     = MARU_REQUEST_LOG,
+      .usblog   = log,
+      .reply_fd = ctx->request_fd[0],
+   };
+
+   maru_error err = submit_request(ctx, &req, -1);
+   if (err != LIBMARU_SUCCESS)
+   {
+      maru_usblog_free(log);
+      return err;
+   }
+
+   return req.error;
+}
+
+maru_error maru_stream_set_tap(maru_context *ctx,
+      maru_stream stream, maru_fifo *tap)
+{
+   if (maru_is_stream_available(ctx, stream) != 0)
+      return LIBMARU_ERROR_INVALID;
+
+   // Tap is only touched by thread, so once it replies, the old tap is no longer in use.
+   struct maru_control_request req = {
+      .count    = ctx->request_count++,
+      .type     = MARU_REQUEST_TAP,
+      .stream   = stream,
+      .tap      = tap,
+      .reply_fd = ctx->request_fd[0],
+   };
+
+   maru_error err = submit_request(ctx, &req, -1);
+   if (err != LIBMARU_SUCCESS)
+      return err;
+
+   return req.error;
+}
+
 static maru_usec current_time(void)
 {
    struct timespec tv;
@@ -1825,9 +3811,44 @@ size_t maru_stream_write(maru_context *ctx, maru_stream stream,
 
    size_t ret = maru_fifo_blocking_write(fifo, data, size);
    str->timer.write_cnt += ret;
+   publish_write_avail(str);
    return ret;
 }
 
+maru_error maru_stream_write_lock(maru_context *ctx, maru_stream stream,
+      size_t size, struct maru_fifo_locked_region *region)
+{
+   if (stream >= ctx->num_streams || !ctx->streams[stream].fifo)
+      return LIBMARU_ERROR_INVALID;
+
+   maru_fifo *fifo = ctx->streams[stream].fifo;
+   if (size > maru_fifo_write_avail(fifo))
+      return LIBMARU_ERROR_BUSY;
+
+   return maru_fifo_write_lock(fifo, size, region);
+}
+
+maru_error maru_stream_write_unlock(maru_context *ctx, maru_stream stream,
+      const struct maru_fifo_locked_region *region)
+{
+   if (stream >= ctx->num_streams || !ctx->streams[stream].fifo)
+      return LIBMARU_ERROR_INVALID;
+
+   struct maru_stream_internal *str = &ctx->streams[stream];
+
+   if (!str->timer.started)
+      init_timer(str);
+
+   maru_error err = maru_fifo_write_unlock(str->fifo, region);
+   if (err == LIBMARU_SUCCESS)
+   {
+      str->timer.write_cnt += region->first_size + region->second_size;
+      publish_write_avail(str);
+   }
+
+   return err;
+}
+
 int maru_stream_notification_fd(maru_context *ctx,
       maru_stream stream)
 {
@@ -1852,34 +3873,92 @@ size_t maru_stream_write_avail(maru_context *ctx, maru_stream stream)
    return maru_fifo_write_avail(fifo);
 }
 
-static maru_error perform_request(maru_context *ctx,
-      uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
-      void *data, size_t size,
-      maru_usec timeout)
+int maru_stream_position_fd(maru_context *ctx, maru_stream stream)
 {
-   struct maru_control_request req = {
-      .count        = ctx->request_count++,
+   if (stream >= ctx->num_streams)
+      return LIBMARU_ERROR_INVALID;
 
-      .request_type = request_type,
-      .request      = request,
-      .value        = value,
-      .index        = index,
+   struct maru_stream_internal *str = &ctx->streams[stream];
+   int ret = LIBMARU_ERROR_INVALID;
 
-      .size         = size,
+   ctx_lock(ctx);
 
-      .reply_fd     = ctx->request_fd[0],
-   };
+   if (!str->fifo)
+      goto end;
 
-   if (size > sizeof(req.data.data))
+   if (str->position_fd < 0)
+   {
+      struct maru_position *pos;
+      int fd = maru_handover_memfd("libmaru-position", sizeof(*pos), (void**)&pos);
+      if (fd < 0)
+      {
+         ret = LIBMARU_ERROR_MEMORY;
+         goto end;
+      }
+
+      struct maru_stream_status status;
+      maru_stream_get_status(ctx, stream, &status);
+
+      pos->sample_rate  = str->desc.sample_rate;
+      pos->frame_size   = str->desc.channels * str->desc.bits / 8;
+      pos->bytes_played = status.bytes_played;
+      pos->bytes_queued = status.bytes_queued;
+      pos->timestamp    = status.timestamp;
+
+      // Thread picks the page up from here.
+      str->position_fd = fd;
+      __atomic_store_n(&str->position, pos, __ATOMIC_RELEASE);
+   }
+
+   // Reopened read-only. Memfd is sealed as well,
+   // so reopening it read-write does not give anyone a writable mapping either.
+   char path[64];
+   snprintf(path, sizeof(path), "/proc/self/fd/%d", str->position_fd);
+   ret = open(path, O_RDONLY | O_CLOEXEC);
+   if (ret < 0)
+      ret = LIBMARU_ERROR_IO;
+
+end:
+   ctx_unlock(ctx);
+   return ret;
+}
+
+maru_error maru_stream_get_status(maru_context *ctx, maru_stream stream,
+      struct maru_stream_status *status)
+{
+   if (stream >= ctx->num_streams || !ctx->streams[stream].fifo)
       return LIBMARU_ERROR_INVALID;
 
-   memcpy(req.data.data, data, size);
+   const struct maru_stream_internal *str = &ctx->streams[stream];
 
-   if (write(ctx->request_fd[1], &req, sizeof(req)) != (ssize_t)sizeof(req))
-      return LIBMARU_ERROR_IO;
+   uint32_t seq;
+   size_t fifo_size;
+   do
+   {
+      seq = __atomic_load_n(&str->status.seq, __ATOMIC_ACQUIRE);
 
-   if (timeout == 0 && !(request & USB_REQUEST_DIR_MASK))
-      return LIBMARU_SUCCESS;
+      fifo_size              = __atomic_load_n(&str->status.fifo_size, __ATOMIC_RELAXED);
+      status->bytes_played   = __atomic_load_n(&str->status.bytes_played, __ATOMIC_RELAXED);
+      status->bytes_queued   = __atomic_load_n(&str->status.bytes_queued, __ATOMIC_RELAXED);
+      status->write_avail    = __atomic_load_n(&str->status.write_avail, __ATOMIC_RELAXED);
+      status->timestamp      = __atomic_load_n(&str->status.timestamp, __ATOMIC_RELAXED);
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   } while ((seq & 1) || seq != __atomic_load_n(&str->status.seq, __ATOMIC_RELAXED));
+
+   // A writer can get in between a resize and the thread publishing the new size.
+   status->bytes_buffered = 0;
+   if (status->write_avail < fifo_size)
+      status->bytes_buffered = fifo_size - 1 - status->write_avail;
+
+   return LIBMARU_SUCCESS;
+}
+
+static maru_error submit_request(maru_context *ctx,
+      struct maru_control_request *req, maru_usec timeout)
+{
+   if (write(ctx->request_fd[1], req, sizeof(*req)) != (ssize_t)sizeof(*req))
+      return LIBMARU_ERROR_IO;
 
    struct maru_control_request ret_req;
 
@@ -1908,16 +3987,64 @@ static maru_error perform_request(maru_context *ctx,
       if (read(ctx->request_fd[1], &ret_req, sizeof(ret_req)) != (ssize_t)sizeof(ret_req))
          return LIBMARU_ERROR_IO;
 
-   } while (ret_req.count != req.count);
+   } while (ret_req.count != req->count);
+
+   *req = ret_req;
+   return LIBMARU_SUCCESS;
+}
+
+static maru_error perform_request(maru_context *ctx,
+      uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+      void *data, size_t size,
+      maru_usec timeout)
+{
+   struct maru_control_request req = {
+      .count        = ctx->request_count++,
+
+      .request_type = request_type,
+      .request      = request,
+      .value        = value,
+      .index        = index,
+
+      .size         = size,
+
+      .reply_fd     = ctx->request_fd[0],
+   };
+
+   if (size > sizeof(req.data.data))
+      return LIBMARU_ERROR_INVALID;
+
+   memcpy(req.data.data, data, size);
+
+   if (timeout == 0 && !(request & USB_REQUEST_DIR_MASK))
+   {
+      if (write(ctx->request_fd[1], &req, sizeof(req)) != (ssize_t)sizeof(req))
+         return LIBMARU_ERROR_IO;
+      return LIBMARU_SUCCESS;
+   }
+
+   maru_error err = submit_request(ctx, &req, timeout);
+   if (err != LIBMARU_SUCCESS)
+      return err;
 
-   memcpy(data, ret_req.data.data, size);
-   return ret_req.error;
+   memcpy(data, req.data.data, size);
+   return req.error;
 }
 
 static int perform_pitch_request(maru_context *ctx,
       unsigned ep,
       maru_usec timeout)
 {
+   if (ctx->usbfs)
+   {
+      return maru_usbfs_control(ctx->usbfs,
+            LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_ENDPOINT,
+            USB_REQUEST_UAC_SET_CUR,
+            UAS_PITCH_CONTROL << 8,
+            ep,
+            (uint8_t[]) {1}, sizeof(uint8_t), timeout < 0 ? 0 : timeout / 1000);
+   }
+
    return libusb_control_transfer(ctx->handle,
          LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_ENDPOINT,
          USB_REQUEST_UAC_SET_CUR,
@@ -1992,7 +4119,7 @@ static maru_error perform_volume_request(maru_context *ctx,
    return LIBMARU_SUCCESS;
 }
 
-const struct volume_control *stream_to_volume_control(maru_context *ctx, maru_stream stream)
+static struct volume_control *stream_to_volume_control(maru_context *ctx, maru_stream stream)
 {
    if (stream == LIBMARU_STREAM_MASTER)
       return &ctx->volume;
@@ -2002,18 +4129,59 @@ const struct volume_control *stream_to_volume_control(maru_context *ctx, maru_st
    return NULL;
 }
 
+// Reads from mirrored value if possible, otherwise from device.
+static maru_error cached_volume_request(maru_context *ctx,
+      struct volume_control *ctrl,
+      maru_volume *vol, uint8_t request, maru_usec timeout)
+{
+   maru_volume *value;
+   bool *valid;
+
+   switch (request)
+   {
+      case USB_REQUEST_UAC_GET_CUR:
+         value = &ctrl->cur.value;
+         valid = &ctrl->cur.valid;
+         break;
+      case USB_REQUEST_UAC_GET_MIN:
+         value = &ctrl->min.value;
+         valid = &ctrl->min.valid;
+         break;
+      case USB_REQUEST_UAC_GET_MAX:
+         value = &ctrl->max.value;
+         valid = &ctrl->max.valid;
+         break;
+      default:
+         return LIBMARU_ERROR_INVALID;
+   }
+
+   if (__atomic_load_n(valid, __ATOMIC_ACQUIRE))
+   {
+      *vol = *value;
+      return LIBMARU_SUCCESS;
+   }
+
+   maru_error err = perform_volume_request(ctx, ctrl, vol, request, timeout);
+   if (err != LIBMARU_SUCCESS)
+      return err;
+
+   *value = *vol;
+   __atomic_store_n(valid, true, __ATOMIC_RELEASE);
+   return LIBMARU_SUCCESS;
+}
+
 maru_error maru_stream_get_volume(maru_context *ctx,
       maru_stream stream,
       maru_volume *current, maru_volume *min, maru_volume *max,
       maru_usec timeout)
 {
-   const struct volume_control *ctrl = stream_to_volume_control(ctx, stream);
+   struct volume_control *ctrl = stream_to_volume_control(ctx, stream);
    if (!ctrl)
       return LIBMARU_ERROR_INVALID;
 
    if (current)
    {
-      maru_error err = perform_volume_request(ctx, ctrl, current,
+      maru_error err = cached_volume_request(ctx, ctrl, current,
             USB_REQUEST_UAC_GET_CUR, timeout);
 
       if (err != LIBMARU_SUCCESS)
@@ -2022,7 +4190,7 @@ maru_error maru_stream_get_volume(maru_context *ctx,
 
    if (min)
    {
-      maru_error err = perform_volume_request(ctx, ctrl, min,
+      maru_error err = cached_volume_request(ctx, ctrl, min,
             USB_REQUEST_UAC_GET_MIN, timeout);
 
       if (err != LIBMARU_SUCCESS)
@@ -2031,7 +4199,7 @@ maru_error maru_stream_get_volume(maru_context *ctx,
 
    if (max)
    {
-      maru_error err = perform_volume_request(ctx, ctrl, max,
+      maru_error err = cached_volume_request(ctx, ctrl, max,
             USB_REQUEST_UAC_GET_MAX, timeout);
 
       if (err != LIBMARU_SUCCESS)
@@ -2046,11 +4214,55 @@ maru_error maru_stream_set_volume(maru_context *ctx,
       maru_volume volume,
       maru_usec timeout)
 {
-   const struct volume_control *ctrl = stream_to_volume_control(ctx, stream);
-   if (!ctrl)
+   struct volume_control *ctrl = stream_to_volume_control(ctx, stream);
+   if (!ctrl || ctrl->chans == 0)
       return LIBMARU_ERROR_INVALID;
 
-   return perform_volume_request(ctx, ctrl, &volume, USB_REQUEST_UAC_SET_CUR, timeout);
+   // Mirror right away. Thread invalidates it if writing fails.
+   ctrl->cur.value = volume;
+   __atomic_store_n(&ctrl->cur.valid, true, __ATOMIC_RELEASE);
+
+   struct maru_control_request req = {
+      .count    = ctx->request_count++,
+      .type     = MARU_REQUEST_VOLUME,
+      .stream   = stream,
+      .value    = (uint16_t)volume,
+      .reply_fd = ctx->request_fd[0],
+      .async    = timeout == 0,
+   };
+
+   if (req.async)
+   {
+      if (write(ctx->request_fd[1], &req, sizeof(req)) != (ssize_t)sizeof(req))
+         return LIBMARU_ERROR_IO;
+      return LIBMARU_SUCCESS;
+   }
+
+   maru_error err = submit_request(ctx, &req, timeout);
+   if (err != LIBMARU_SUCCESS)
+      return err;
+
+   return req.error;
+}
+
+static void cache_volume_control(maru_context *ctx, struct volume_control *ctrl)
+{
+   if (ctrl->chans == 0)
+      return;
+
+   // Failing here is fine, values are read from device on demand instead.
+   maru_volume vol;
+   cached_volume_request(ctx, ctrl, &vol, USB_REQUEST_UAC_GET_MIN, 50000);
+   cached_volume_request(ctx, ctrl, &vol, USB_REQUEST_UAC_GET_MAX, 50000);
+   cached_volume_request(ctx, ctrl, &vol, USB_REQUEST_UAC_GET_CUR, 50000);
+}
+
+static void cache_volume_controls(maru_context *ctx)
+{
+   cache_volume_control(ctx, &ctx->volume);
+
+   for (unsigned i = 0; i < ctx->num_streams; i++)
+      cache_volume_control(ctx, &ctx->streams[i].volume);
 }
 
 // Estimate current audio latency using high-precision timers.
@@ -197,6 +197,93 @@ maru_error maru_create_context_from_vid_pid(maru_context **ctx,
  */
 void maru_destroy_context(maru_context *ctx);
 
+/** \ingroup lib
+ * \brief Maximum number of application descriptors passed along by maru_handover_context(). */
+#define LIBMARU_HANDOVER_MAX_FDS 16
+
+/** \ingroup lib
+ * \brief Hand device and open streams over to another process.
+ *
+ * Used to restart an application, e.g. to upgrade it, without closing streams or giving the device back to the kernel.
+ * The other process picks the context up with maru_create_context_from_handover() on the other end of sock.
+ *
+ * Descriptors of the device are passed over along with stream state,
+ * and data buffered in streams is passed in memfds, so nothing written to a stream is lost.
+ * Streams keep playing while the other process sets up its context.
+ * Only the process which submitted transfers can reap them, so once the other process is ready,
+ * this call stops refilling streams, waits for transfers in flight to play out,
+ * and passes on how much of the buffered data they consumed.
+ * Playback only pauses for as long as it takes the other process to pick that up and submit,
+ * which is well within a fragment.
+ * Flush, volume and buffer size requests fail with LIBMARU_ERROR_BUSY in the meantime.
+ * Loopback taps, USB logs and notification callbacks are not handed over.
+ *
+ * An application can pass its own state along in data and fds,
+ * which maru_create_context_from_handover() returns as is.
+ *
+ * Streams must not be written to, opened or closed while this call executes.
+ * If it succeeds, the context is no longer usable, and must be destroyed with maru_destroy_context(),
+ * which then leaves the device alone.
+ * If it fails, streaming resumes as if it was never called.
+ *
+ * \param ctx libmaru context.
+ * \param sock Connected Unix domain stream socket.
+ * \param data Application state. Can be NULL if size is 0.
+ * \param size Size of data.
+ * \param fds Application descriptors. Can be NULL if num_fds is 0.
+ * \param num_fds Number of application descriptors, at most \ref LIBMARU_HANDOVER_MAX_FDS.
+ * \param timeout Time to wait for the other process to take over.
+ * A negative timeout waits forever.
+ * On failure, sock should be closed, so the other process gives up as well.
+ *
+ * \returns Error code \ref maru_error
+ */
+maru_error maru_handover_context(maru_context *ctx, int sock,
+      const void *data, size_t size,
+      const int *fds, unsigned num_fds,
+      maru_usec timeout);
+
+/** \ingroup lib
+ * \brief Checks application state of a handover before it is accepted.
+ *
+ * \param data Application state.
+ * \param size Size of data.
+ * \param num_fds Number of application descriptors.
+ * \param userdata Userdata passed to maru_create_context_from_handover().
+ *
+ * \returns True if the handover should be accepted.
+ */
+typedef bool (*maru_handover_validate_cb)(const void *data, size_t size,
+      unsigned num_fds, void *userdata);
+
+/** \ingroup lib
+ * \brief Create new context from a handover.
+ *
+ * Takes over the device and streams from a process calling maru_handover_context() on the other end of sock.
+ * Stream indices, formats, buffering and volumes are kept,
+ * and streams which were open continue playback from where they left off.
+ *
+ * Requires libusb 1.0.23 or newer, which can wrap an open device descriptor.
+ *
+ * \param ctx Pointer to a context that is to be initialized.
+ * \param sock Connected Unix domain stream socket.
+ * \param data Receives application state. Can be NULL if *size is 0.
+ * \param size Size of data buffer on input, and size of application state on output.
+ * \param fds Receives application descriptors, which caller must close.
+ * Can be NULL if *num_fds is 0.
+ * \param num_fds Capacity of fds on input, and number of application descriptors on output.
+ * \param validate Called with the application state before anything is taken over. Can be NULL.
+ * \param userdata Userdata passed to validate.
+ *
+ * \returns Error code \ref maru_error.
+ * If the application state does not fit in data or fds, or validate rejects it, LIBMARU_ERROR_INVALID is returned,
+ * and the handover is refused. The other process then keeps streaming.
+ */
+maru_error maru_create_context_from_handover(maru_context **ctx, int sock,
+      void *data, size_t *size,
+      int *fds, unsigned *num_fds,
+      maru_handover_validate_cb validate, void *userdata);
+
 /** \ingroup lib
  * \brief Returns number of hardware streams in total.
  *
@@ -263,6 +350,31 @@ maru_error maru_get_stream_desc(maru_context *ctx, maru_stream stream,
  */
 maru_error maru_stream_open(maru_context *ctx, maru_stream stream, const struct maru_stream_desc *desc);
 
+struct maru_bfifo;
+
+/** \ingroup stream
+ * \brief Opens an available stream which plays what is written to a broadcast fifo.
+ *
+ * Like maru_stream_open(), but the stream has no buffer of its own.
+ * It reads through its own cursor into source, so any number of streams, on one or more contexts,
+ * play what is written to source once, without copies. See maru_bfifo_add_reader().
+ *
+ * The stream is as large as source, and desc->buffer_size is ignored.
+ * Audio is written with the maru_bfifo functions, maru_stream_write() and maru_stream_write_lock() fail on the stream.
+ * It cannot be resized, and a context with broadcast streams cannot be handed over.
+ * source must outlive the stream, or be freed with maru_bfifo_free(), which keeps the buffer alive for the stream.
+ *
+ * \param ctx libmaru context
+ * \param stream Stream index to use. Must be an available stream.
+ * \param desc The stream format to be used.
+ * \param source Broadcast fifo to play from.
+ * \param drop_on_lag If set, audio the stream has not started to play is dropped rather than holding back the writer of source.
+ *
+ * \returns Error code \ref maru_error
+ */
+maru_error maru_stream_open_broadcast(maru_context *ctx, maru_stream stream,
+      const struct maru_stream_desc *desc, struct maru_bfifo *source, bool drop_on_lag);
+
 /** \ingroup stream
  * \brief Closes an opened stream.
  *
@@ -275,6 +387,44 @@ maru_error maru_stream_open(maru_context *ctx, maru_stream stream, const struct
  */
 maru_error maru_stream_close(maru_context *ctx, maru_stream stream);
 
+/** \ingroup stream
+ * \brief Drops all audio queued up for an opened stream.
+ *
+ * Transfers in flight are cancelled, buffered data is discarded and latency accounting is reset.
+ * The stream stays opened with the same format, so writing can continue right away
+ * without reconfiguring the device.
+ *
+ * This function cannot be called if a maru_stream_write() call to the same stream is executing.
+ *
+ * \param ctx libmaru context
+ * \param stream Stream index
+ *
+ * \returns Error code \ref maru_error
+ */
+maru_error maru_stream_flush(maru_context *ctx, maru_stream stream);
+
+/** \ingroup stream
+ * \brief Changes buffer and fragment size of an opened stream.
+ *
+ * The stream buffer is resized in place while the stream keeps playing.
+ * Buffered audio is kept. If the new buffer is too small to hold all of it,
+ * the most recently written audio that does not fit is dropped.
+ * Fragment size has the same meaning as in \ref maru_stream_desc, and must be less than half the buffer size.
+ *
+ * This function cannot be called if a maru_stream_write() call to the same stream is executing,
+ * or while a region locked with maru_stream_write_lock() is held.
+ *
+ * \param ctx libmaru context
+ * \param stream Stream index
+ * \param buffer_size New buffer size in bytes. Rounded up to a power of two.
+ * \param fragment_size New fragment size in bytes. If 0, a quarter of buffer_size is used.
+ *
+ * \returns Error code \ref maru_error.
+ * LIBMARU_ERROR_BUSY if transfers queued up before an earlier resize have not completed yet.
+ */
+maru_error maru_stream_set_buffer(maru_context *ctx, maru_stream stream,
+      size_t buffer_size, size_t fragment_size);
+
 /** \ingroup stream
  * \brief Callback type that can be used to signal the caller when something of interest to the caller has occured.
  *
@@ -299,6 +449,39 @@ typedef void (*maru_notification_cb)(void *userdata);
 size_t maru_stream_write(maru_context *ctx, maru_stream stream, 
       const void *data, size_t size);
 
+struct maru_fifo_locked_region;
+
+/** \ingroup stream
+ * \brief Locks a region of the stream buffer for writing without copying.
+ *
+ * This is the zero-copy variant of maru_stream_write(). Audio can be rendered straight into region,
+ * which might be split in two as the buffer wraps around.
+ * Region must be committed with maru_stream_write_unlock().
+ *
+ * This function never blocks. size must not exceed maru_stream_write_avail().
+ *
+ * \param ctx libmaru context
+ * \param stream Stream index
+ * \param size Bytes to lock
+ * \param region Receives the locked region
+ *
+ * \returns Error code \ref maru_error. LIBMARU_ERROR_BUSY if size is larger than what is available.
+ */
+maru_error maru_stream_write_lock(maru_context *ctx, maru_stream stream,
+      size_t size, struct maru_fifo_locked_region *region);
+
+/** \ingroup stream
+ * \brief Commits a region locked with maru_stream_write_lock().
+ *
+ * \param ctx libmaru context
+ * \param stream Stream index
+ * \param region Region obtained from maru_stream_write_lock()
+ *
+ * \returns Error code \ref maru_error
+ */
+maru_error maru_stream_write_unlock(maru_context *ctx, maru_stream stream,
+      const struct maru_fifo_locked_region *region);
+
 /** \ingroup stream
  * \brief Obtain notification descriptor for write stream.
  *
@@ -330,6 +513,107 @@ int maru_stream_notification_fd(maru_context *ctx, maru_stream stream);
  */
 size_t maru_stream_write_avail(maru_context *ctx, maru_stream stream);
 
+/** \ingroup stream
+ * \brief Playback status of a stream, see maru_stream_get_status(). */
+struct maru_stream_status
+{
+   /** Bytes played since the stream was opened. Counted as transfers complete. */
+   uint64_t bytes_played;
+   /** Bytes submitted to the device which have not been played yet. */
+   uint64_t bytes_queued;
+   /** Bytes written to the stream which have not been played yet. Includes \ref bytes_queued. */
+   uint64_t bytes_buffered;
+   /** Bytes that can be written without blocking, same as maru_stream_write_avail(). */
+   uint64_t write_avail;
+   /** CLOCK_MONOTONIC time in microseconds when \ref bytes_played and \ref bytes_queued last changed. */
+   maru_usec timestamp;
+};
+
+/** \ingroup stream
+ * \brief Obtains playback status of a stream without locking.
+ *
+ * The status is a snapshot published by the libmaru thread whenever transfers are submitted or complete,
+ * and by maru_stream_write() and maru_stream_write_unlock(). Reading it takes no locks and no system calls,
+ * so it is suitable for polling every video frame.
+ *
+ * The current playback position can be estimated by adding the time elapsed since \ref maru_stream_status::timestamp
+ * to \ref maru_stream_status::bytes_played, up to \ref maru_stream_status::bytes_queued.
+ *
+ * \param ctx libmaru context
+ * \param stream Stream index
+ * \param status Receives the status
+ *
+ * \returns Error code \ref maru_error
+ */
+maru_error maru_stream_get_status(maru_context *ctx, maru_stream stream,
+      struct maru_stream_status *status);
+
+/** \ingroup stream
+ * \brief Playback position of a stream, as laid out in the page mapped from maru_stream_position_fd().
+ *
+ * The page is updated by the libmaru thread whenever transfers are submitted or complete.
+ * It is guarded by a sequence count, use maru_read_position() to read it.
+ */
+struct maru_position
+{
+   /** Sequence count. Odd while the page is being updated. */
+   uint32_t seq;
+   /** Nominal sample rate of the stream. */
+   uint32_t sample_rate;
+   /** Bytes per audio frame. */
+   uint32_t frame_size;
+   uint32_t reserved;
+   /** Bytes played since the stream was opened. Counted as transfers complete. */
+   uint64_t bytes_played;
+   /** Bytes submitted to the device which have not been played yet. */
+   uint64_t bytes_queued;
+   /** CLOCK_MONOTONIC time in microseconds when \ref bytes_played and \ref bytes_queued last changed. */
+   int64_t timestamp;
+};
+
+/** \ingroup stream
+ * \brief Copies a consistent snapshot out of a mapped position page.
+ *
+ * \param page Position page, mapped read-only from maru_stream_position_fd()
+ * \param pos Receives the snapshot. pos->seq is even.
+ */
+static inline void maru_read_position(const struct maru_position *page, struct maru_position *pos)
+{
+   uint32_t seq;
+   do
+   {
+      seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+
+      pos->seq          = seq;
+      pos->sample_rate  = __atomic_load_n(&page->sample_rate, __ATOMIC_RELAXED);
+      pos->frame_size   = __atomic_load_n(&page->frame_size, __ATOMIC_RELAXED);
+      pos->reserved     = 0;
+      pos->bytes_played = __atomic_load_n(&page->bytes_played, __ATOMIC_RELAXED);
+      pos->bytes_queued = __atomic_load_n(&page->bytes_queued, __ATOMIC_RELAXED);
+      pos->timestamp    = __atomic_load_n(&page->timestamp, __ATOMIC_RELAXED);
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   } while ((seq & 1) || seq != __atomic_load_n(&page->seq, __ATOMIC_RELAXED));
+}
+
+/** \ingroup stream
+ * \brief Obtains a descriptor for the position page of a stream.
+ *
+ * The descriptor refers to a memfd holding a \ref maru_position, which can be mapped
+ * read-only with mmap() by this or another process, e.g. after being passed over a UNIX socket.
+ * The memfd is sealed, so it cannot be resized or mapped writable by anyone but libmaru.
+ * Reading the position then takes no system calls at all.
+ *
+ * The page stays valid after the stream is closed, but is no longer updated.
+ * A stream opened again gets a new page.
+ *
+ * \param ctx libmaru context
+ * \param stream Stream index
+ *
+ * \returns New read-only file descriptor, which the caller must close, or \ref maru_error if error.
+ */
+int maru_stream_position_fd(maru_context *ctx, maru_stream stream);
+
 /** \ingroup stream
  * \brief Set notification callback to be called after data has been processed and is ready for more data.
  *
@@ -361,6 +645,72 @@ void maru_stream_set_error_notification(maru_context *ctx, maru_stream stream,
  */
 maru_usec maru_stream_current_latency(maru_context *ctx, maru_stream stream);
 
+/** \ingroup lib
+ * \brief Records USB traffic of context to a file descriptor.
+ *
+ * Every streaming transfer submitted and completed, feedback endpoint reads and control transfers
+ * are recorded in a compact binary log, along with timestamps and transfer status.
+ * Audio data itself is only recorded as a hash.
+ * The format is described in usblog.h in the libmaru source tree.
+ *
+ * A log can be replayed offline with test/usb_replay, which runs the packet scheduling of libmaru
+ * on the recorded traffic, so that problems seen with a particular device can be reproduced without it.
+ *
+ * Records are buffered, and written by the libmaru thread in large blocks.
+ * fd should therefore refer to a regular file or similar that does not block for long.
+ *
+ * \param ctx libmaru context
+ * \param fd File descriptor to write log to. It is not closed by libmaru.
+ * If fd is negative, recording is stopped. Buffered records are written out before this function returns,
+ * and the descriptor can then be closed.
+ *
+ * \returns Error code \ref maru_error
+ */
+maru_error maru_set_usb_log(maru_context *ctx, int fd);
+
+/** \ingroup stream
+ * \brief Header preceding every block written to a loopback tap.
+ *
+ * A block holds exactly the audio data of one transfer submitted to the device.
+ */
+struct maru_tap_header
+{
+   /** Estimated time (CLOCK_MONOTONIC, in microseconds) when first frame of block reaches the device. */
+   maru_usec timestamp;
+   /** Index of USB frame the block starts in, counted from the first transfer submitted on the stream.
+    * libusb does not expose the bus frame number, so this only gives relative alignment. */
+   uint64_t frame;
+   /** Size in bytes of audio data following the header. */
+   uint32_t size;
+   /** Number of blocks dropped since previous block because tap was full. */
+   uint32_t dropped;
+};
+
+struct maru_fifo;
+
+/** \ingroup stream
+ * \brief Mirrors audio submitted to the device into a fifo.
+ *
+ * After this call, every transfer submitted on the stream is written to tap
+ * as a \ref maru_tap_header followed by the audio data,
+ * after libmaru has split up, padded or dropped the data written by the application.
+ * The tap can be read with the normal fifo read functions.
+ *
+ * The thread never blocks on the tap. If it does not have room for a whole block,
+ * the block is dropped and counted in the next header.
+ * A disabled tap costs nothing, an enabled one costs a single copy per transfer.
+ *
+ * The tap stays enabled until it is disabled, or the stream is closed.
+ * The caller owns the fifo, and can free it once the tap is disabled.
+ *
+ * \param ctx libmaru context
+ * \param stream Stream index
+ * \param tap Fifo to write blocks to. If NULL, the tap is disabled.
+ *
+ * \returns Error code \ref maru_error
+ */
+maru_error maru_stream_set_tap(maru_context *ctx, maru_stream stream, struct maru_fifo *tap);
+
 /**
  * \brief Typedef for a volume value. It is encoded in dB fixed point
  * where the actual value is (val) / 256.0. The number is signed and matches
@@ -386,6 +736,10 @@ typedef int16_t maru_volume;
  * A control request like this can usually be completed in the order of
  * 5ms.
  *
+ * Volume ranges are read when the context is created, and current volume is mirrored
+ * by libmaru, so this call normally returns without talking to the device.
+ * Volume changed on the device by other means than libmaru is not seen.
+ *
  * A volume request can be performed concurrently with other stream calls, however, only one thread can perform volume handling at a time.
  *
  * \param ctx libmaru context
@@ -423,6 +777,9 @@ maru_error maru_stream_get_volume(maru_context *ctx,
  * \param timeout Timeout of request. See maru_stream_get_volume() for more considerations.
  * If timeout is 0, the function will return immediately, so no error checking can be made.
  * This is useful for GUI were operations like these cannot block for prolonged time.
+ * Such writes are coalesced. If a write is already in flight, only the latest volume set
+ * in the mean time is written once it completes.
+ * Requests for all channels are submitted at once, rather than one after another.
  * Note that this differs from maru_stream_get_volume(), where no timeout would make no sense.
  *
  * \returns Error code \ref maru_error.
@@ -0,0 +1,760 @@
+/* libmaru - Userspace USB audio class driver.
+ * Copyright (C) 2012 - Hans-Kristian Arntzen
+ * Copyright (C) 2012 - Agnes Heyer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef LIBMARU_HPP__
+#define LIBMARU_HPP__
+
+// Header-only C++17 wrapper around libmaru.
+// Contexts, streams and fifo locks are RAII objects, errors are thrown as maru::error,
+// and the sample format is part of the stream type so frame sizes are known at compile time.
+
+#include "libmaru.h"
+#include "fifo.h"
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if __has_include(<span>)
+#include <span>
+#endif
+
+namespace maru
+{
+   /** \ingroup lib
+    * \brief Exception carrying a \ref maru_error. */
+   class error : public std::runtime_error
+   {
+      public:
+         explicit error(maru_error code)
+            : std::runtime_error(maru_error_string(code)), code_(code)
+         {}
+
+         maru_error code() const noexcept { return code_; }
+
+      private:
+         maru_error code_;
+   };
+
+   inline void check(maru_error err)
+   {
+      if (err != LIBMARU_SUCCESS)
+         throw error(err);
+   }
+
+#if defined(__cpp_lib_span) && __cpp_lib_span >= 202002L
+   template<typename T>
+   using span = std::span<T>;
+#else
+   /** \brief Minimal stand-in for std::span for C++17. */
+   template<typename T>
+   class span
+   {
+      public:
+         constexpr span() noexcept = default;
+         constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+         template<typename U, std::size_t N,
+            typename = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>>
+         constexpr span(std::array<U, N> &arr) noexcept : data_(arr.data()), size_(N) {}
+
+         template<typename U, std::size_t N,
+            typename = std::enable_if_t<std::is_convertible_v<const U (*)[], T (*)[]>>>
+         constexpr span(const std::array<U, N> &arr) noexcept : data_(arr.data()), size_(N) {}
+
+         template<typename U,
+            typename = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>>
+         span(std::vector<U> &vec) noexcept : data_(vec.data()), size_(vec.size()) {}
+
+         template<typename U,
+            typename = std::enable_if_t<std::is_convertible_v<const U (*)[], T (*)[]>>>
+         span(const std::vector<U> &vec) noexcept : data_(vec.data()), size_(vec.size()) {}
+
+         template<typename U,
+            typename = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>>
+         constexpr span(const span<U> &other) noexcept : data_(other.data()), size_(other.size()) {}
+
+         constexpr T *data() const noexcept { return data_; }
+         constexpr std::size_t size() const noexcept { return size_; }
+         constexpr std::size_t size_bytes() const noexcept { return size_ * sizeof(T); }
+         constexpr bool empty() const noexcept { return size_ == 0; }
+         constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+         constexpr T *begin() const noexcept { return data_; }
+         constexpr T *end() const noexcept { return data_ + size_; }
+
+         constexpr span subspan(std::size_t offset, std::size_t count) const noexcept
+         {
+            return span(data_ + offset, count);
+         }
+
+      private:
+         T *data_ = nullptr;
+         std::size_t size_ = 0;
+   };
+#endif
+
+   /** \brief Packed 24-bit sample, three bytes as 24-bit USB audio streams carry them. */
+   struct int24
+   {
+      uint8_t bytes[3];
+
+      constexpr int24() noexcept : bytes{} {}
+
+      constexpr explicit int24(int32_t val) noexcept
+         : bytes{ static_cast<uint8_t>(val), static_cast<uint8_t>(val >> 8), static_cast<uint8_t>(val >> 16) }
+      {}
+
+      constexpr explicit operator int32_t() const noexcept
+      {
+         int32_t val = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+         return val >= 0x800000 ? val - 0x1000000 : val;
+      }
+   };
+
+   static_assert(sizeof(int24) == 3, "int24 must be packed.");
+
+   /** \brief Compile time description of a PCM sample type.
+    * USB audio data is little-endian, which matches every host libmaru runs on. */
+   template<typename Sample>
+   struct sample_traits;
+
+   template<>
+   struct sample_traits<int16_t>
+   {
+      static constexpr unsigned bits = 16;
+      static constexpr float scale = 32768.0f;
+      static constexpr int32_t min = -32768;
+      static constexpr int32_t max = 32767;
+   };
+
+   template<>
+   struct sample_traits<int24>
+   {
+      static constexpr unsigned bits = 24;
+      static constexpr float scale = 8388608.0f;
+      static constexpr int32_t min = -8388608;
+      static constexpr int32_t max = 8388607;
+   };
+
+   template<>
+   struct sample_traits<int32_t>
+   {
+      static constexpr unsigned bits = 32;
+      static constexpr float scale = 2147483648.0f;
+      static constexpr int32_t min = std::numeric_limits<int32_t>::min();
+      static constexpr int32_t max = std::numeric_limits<int32_t>::max();
+   };
+
+   /** \brief Converts a float sample in [-1.0, 1.0] to Sample, with clipping.
+    * Clamped in double, which holds the range of every sample type exactly. */
+   template<typename Sample>
+   constexpr Sample from_float(float val) noexcept
+   {
+      using traits = sample_traits<Sample>;
+      double scaled = static_cast<double>(val) * traits::scale;
+      if (scaled >= traits::max)
+         return static_cast<Sample>(traits::max);
+      if (scaled <= traits::min)
+         return static_cast<Sample>(traits::min);
+      return static_cast<Sample>(static_cast<int32_t>(scaled));
+   }
+
+   /** \brief Converts Sample to a float sample in [-1.0, 1.0). */
+   template<typename Sample>
+   constexpr float to_float(Sample val) noexcept
+   {
+      return static_cast<float>(static_cast<int32_t>(val)) / sample_traits<Sample>::scale;
+   }
+
+   /** \brief Converts float samples in [-1.0, 1.0] to Sample, with clipping.
+    *
+    * The kernel is picked at compile time. Each is a single branch-free loop the compiler can vectorize:
+    * 16-bit and 24-bit samples are clamped in float, where their range is exact,
+    * and 32-bit samples in double, as float cannot represent their maximum.
+    */
+   template<typename Sample>
+   void convert_from_float(Sample *out, const float *in, std::size_t samples) noexcept
+   {
+      using traits = sample_traits<Sample>;
+
+      if constexpr (std::is_same_v<Sample, int32_t>)
+      {
+         for (std::size_t i = 0; i < samples; i++)
+         {
+            double val = in[i] * 2147483648.0;
+            val = val > 2147483647.0 ? 2147483647.0 : val;
+            val = val < -2147483648.0 ? -2147483648.0 : val;
+            out[i] = static_cast<int32_t>(val);
+         }
+      }
+      else
+      {
+         constexpr float max = static_cast<float>(traits::max);
+         constexpr float min = static_cast<float>(traits::min);
+
+         for (std::size_t i = 0; i < samples; i++)
+         {
+            float val = in[i] * traits::scale;
+            val = val > max ? max : val;
+            val = val < min ? min : val;
+
+            if constexpr (std::is_same_v<Sample, int24>)
+               out[i] = int24(static_cast<int32_t>(val));
+            else
+               out[i] = static_cast<Sample>(val);
+         }
+      }
+   }
+
+   /** \brief Converts float samples into a region locked for writing, which must hold exactly as many samples.
+    * Fifo size is a power of two, so only a packed 24-bit sample can straddle the wrap point. */
+   template<typename Sample>
+   void convert_from_float(const maru_fifo_locked_region &region, const float *in) noexcept
+   {
+      std::size_t first = region.first_size / sizeof(Sample);
+      std::size_t split = region.first_size % sizeof(Sample);
+      convert_from_float(static_cast<Sample*>(region.first), in, first);
+      in += first;
+
+      uint8_t *second = static_cast<uint8_t*>(region.second);
+      std::size_t second_size = region.second_size;
+
+      if (split)
+      {
+         Sample straddling;
+         convert_from_float(&straddling, in++, 1);
+
+         const uint8_t *bytes = reinterpret_cast<const uint8_t*>(&straddling);
+         std::memcpy(static_cast<uint8_t*>(region.first) + first * sizeof(Sample), bytes, split);
+         std::memcpy(second, bytes + split, sizeof(Sample) - split);
+         second += sizeof(Sample) - split;
+         second_size -= sizeof(Sample) - split;
+      }
+
+      if (second_size)
+         convert_from_float(reinterpret_cast<Sample*>(second), in, second_size / sizeof(Sample));
+   }
+
+   /** \brief Converts decibels to \ref maru_volume fixed point. */
+   constexpr maru_volume volume_from_db(double db) noexcept
+   {
+      double fixed = db * 256.0;
+      if (fixed >= 32767.0)
+         return 32767;
+      if (fixed <= -32767.0)
+         return -32767;
+      return static_cast<maru_volume>(fixed < 0.0 ? fixed - 0.5 : fixed + 0.5);
+   }
+
+   /** \brief Converts \ref maru_volume fixed point to decibels. */
+   constexpr double volume_to_db(maru_volume vol) noexcept
+   {
+      return vol / 256.0;
+   }
+
+   /** \brief A frame of interleaved PCM audio. */
+   template<typename Sample, unsigned Channels>
+   using frame = std::array<Sample, Channels>;
+
+   /** \brief Size in bytes of a frame. */
+   template<typename Sample, unsigned Channels>
+   constexpr std::size_t frame_bytes = sizeof(Sample) * Channels;
+
+   /** \brief Converts a duration in microseconds to bytes of audio. */
+   template<typename Sample, unsigned Channels>
+   constexpr std::size_t usec_to_bytes(maru_usec usec, unsigned sample_rate) noexcept
+   {
+      return static_cast<std::size_t>((usec * sample_rate) / 1000000) * frame_bytes<Sample, Channels>;
+   }
+
+   /** \brief Converts bytes of audio to a duration in microseconds. */
+   template<typename Sample, unsigned Channels>
+   constexpr maru_usec bytes_to_usec(std::size_t bytes, unsigned sample_rate) noexcept
+   {
+      return static_cast<maru_usec>(bytes / frame_bytes<Sample, Channels>) * 1000000 / sample_rate;
+   }
+
+   /** \ingroup buffer
+    * \brief A locked fifo region viewed as samples.
+    *
+    * The region is unlocked (committed) when the object goes out of scope.
+    * Fifo size is a power of two, and so must the size of T be, so the wrap point never splits an element.
+    * Packed 24-bit samples and frames of other sizes can straddle it, and are written with write() or write_float() instead.
+    */
+   template<typename T, bool Write>
+   class locked_region
+   {
+      public:
+         static_assert((sizeof(T) & (sizeof(T) - 1)) == 0,
+               "Elements of other sizes can straddle the wrap point, use write() or write_float().");
+
+         using value_type = std::conditional_t<Write, T, const T>;
+
+         locked_region() noexcept = default;
+
+         locked_region(locked_region &&other) noexcept
+         {
+            *this = std::move(other);
+         }
+
+         locked_region &operator=(locked_region &&other) noexcept
+         {
+            if (this != &other)
+            {
+               unlock();
+               handle_ = std::exchange(other.handle_, nullptr);
+               index_ = other.index_;
+               unlock_ = std::exchange(other.unlock_, nullptr);
+               region_ = other.region_;
+            }
+            return *this;
+         }
+
+         locked_region(const locked_region&) = delete;
+         locked_region &operator=(const locked_region&) = delete;
+
+         ~locked_region() { unlock(); }
+
+         span<value_type> first() const noexcept
+         {
+            return span<value_type>(static_cast<value_type*>(region_.first),
+                  region_.first_size / sizeof(T));
+         }
+
+         span<value_type> second() const noexcept
+         {
+            return span<value_type>(static_cast<value_type*>(region_.second),
+                  region_.second_size / sizeof(T));
+         }
+
+         std::size_t size() const noexcept { return (region_.first_size + region_.second_size) / sizeof(T); }
+
+         /** \brief Unlocks the region before the object is destroyed. */
+         void commit() { check(unlock()); }
+
+      private:
+         template<typename, unsigned> friend class stream;
+         friend class fifo;
+
+         // Regions keep the C handles they were locked on, not the wrapper,
+         // so the wrapper can be moved while a region is alive.
+         using unlock_fn = maru_error (*)(void *handle, unsigned index, const maru_fifo_locked_region *region);
+
+         locked_region(void *handle, unsigned index, unlock_fn unlock, const maru_fifo_locked_region &region) noexcept
+            : handle_(handle), index_(index), unlock_(unlock), region_(region)
+         {}
+
+         maru_error unlock() noexcept
+         {
+            maru_error err = LIBMARU_SUCCESS;
+            if (handle_)
+               err = unlock_(handle_, index_, &region_);
+            handle_ = nullptr;
+            return err;
+         }
+
+         void *handle_ = nullptr;
+         unsigned index_ = 0;
+         unlock_fn unlock_ = nullptr;
+         maru_fifo_locked_region region_{};
+   };
+
+   /** \ingroup buffer
+    * \brief Owning wrapper around \ref maru_fifo.
+    * Locked regions are handed out as spans, so data can be produced or consumed in place. */
+   class fifo
+   {
+      public:
+         explicit fifo(std::size_t size) : fifo_(maru_fifo_new(size))
+         {
+            if (!fifo_)
+               throw error(LIBMARU_ERROR_MEMORY);
+         }
+
+         fifo(fifo &&other) noexcept : fifo_(std::exchange(other.fifo_, nullptr)) {}
+
+         fifo &operator=(fifo &&other) noexcept
+         {
+            std::swap(fifo_, other.fifo_);
+            return *this;
+         }
+
+         fifo(const fifo&) = delete;
+         fifo &operator=(const fifo&) = delete;
+
+         ~fifo()
+         {
+            if (fifo_)
+               maru_fifo_free(fifo_);
+         }
+
+         maru_fifo *get() const noexcept { return fifo_; }
+
+         std::size_t read_avail() const noexcept { return maru_fifo_read_avail(fifo_); }
+         std::size_t write_avail() const noexcept { return maru_fifo_write_avail(fifo_); }
+
+         int read_notify_fd() const noexcept { return maru_fifo_read_notify_fd(fifo_); }
+         int write_notify_fd() const noexcept { return maru_fifo_write_notify_fd(fifo_); }
+
+         /** \brief Locks count elements of T for writing. Size of T must be a power of two.
+          * Throws LIBMARU_ERROR_BUSY if there is not enough room. */
+         template<typename T>
+         locked_region<T, true> write_lock(std::size_t count)
+         {
+            if (count * sizeof(T) > write_avail())
+               throw error(LIBMARU_ERROR_BUSY);
+
+            maru_fifo_locked_region region;
+            check(maru_fifo_write_lock(fifo_, count * sizeof(T), &region));
+            return locked_region<T, true>(fifo_, 0, unlock_write, region);
+         }
+
+         /** \brief Locks count elements of T for reading. Size of T must be a power of two.
+          * Throws LIBMARU_ERROR_BUSY if not enough data is buffered. */
+         template<typename T>
+         locked_region<T, false> read_lock(std::size_t count)
+         {
+            if (count * sizeof(T) > read_avail())
+               throw error(LIBMARU_ERROR_BUSY);
+
+            maru_fifo_locked_region region;
+            check(maru_fifo_read_lock(fifo_, count * sizeof(T), &region));
+            return locked_region<T, false>(fifo_, 0, unlock_read, region);
+         }
+
+         /** \brief Non-blocking write. Returns number of elements written. */
+         template<typename T>
+         std::size_t write(span<const T> data)
+         {
+            ssize_t ret = maru_fifo_write(fifo_, data.data(), data.size_bytes());
+            if (ret < 0)
+               throw error(LIBMARU_ERROR_DEAD);
+            return ret / sizeof(T);
+         }
+
+         /** \brief Converts float samples to Sample straight into the fifo, without blocking.
+          * Returns number of samples written, which is less than requested if there is not enough room. */
+         template<typename Sample>
+         std::size_t write_float(span<const float> samples)
+         {
+            std::size_t count = write_avail() / sizeof(Sample);
+            if (count > samples.size())
+               count = samples.size();
+            if (!count)
+               return 0;
+
+            maru_fifo_locked_region region;
+            check(maru_fifo_write_lock(fifo_, count * sizeof(Sample), &region));
+            convert_from_float<Sample>(region, samples.data());
+            check(maru_fifo_write_unlock(fifo_, &region));
+            return count;
+         }
+
+         /** \brief Non-blocking read. Returns number of elements read. */
+         template<typename T>
+         std::size_t read(span<T> data)
+         {
+            ssize_t ret = maru_fifo_read(fifo_, data.data(), data.size_bytes());
+            if (ret < 0)
+               throw error(LIBMARU_ERROR_DEAD);
+            return ret / sizeof(T);
+         }
+
+      private:
+         static maru_error unlock_write(void *handle, unsigned, const maru_fifo_locked_region *region)
+         {
+            return maru_fifo_write_unlock(static_cast<maru_fifo*>(handle), region);
+         }
+
+         static maru_error unlock_read(void *handle, unsigned, const maru_fifo_locked_region *region)
+         {
+            return maru_fifo_read_unlock(static_cast<maru_fifo*>(handle), region);
+         }
+
+         maru_fifo *fifo_;
+   };
+
+   /** \ingroup lib
+    * \brief Owning wrapper around \ref maru_context. */
+   class context
+   {
+      public:
+         context(uint16_t vid, uint16_t pid, const maru_stream_desc *desc = nullptr)
+         {
+            check(maru_create_context_from_vid_pid(&ctx_, vid, pid, desc));
+         }
+
+         explicit context(const maru_audio_device &dev, const maru_stream_desc *desc = nullptr)
+            : context(dev.vendor_id, dev.product_id, desc)
+         {}
+
+         context(context &&other) noexcept : ctx_(std::exchange(other.ctx_, nullptr)) {}
+
+         context &operator=(context &&other) noexcept
+         {
+            std::swap(ctx_, other.ctx_);
+            return *this;
+         }
+
+         context(const context&) = delete;
+         context &operator=(const context&) = delete;
+
+         ~context()
+         {
+            if (ctx_)
+               maru_destroy_context(ctx_);
+         }
+
+         /** \brief Lists USB audio devices connected to the system. */
+         static std::vector<maru_audio_device> devices()
+         {
+            maru_audio_device *list = nullptr;
+            unsigned num = 0;
+            check(maru_list_audio_devices(&list, &num));
+
+            std::vector<maru_audio_device> ret(list, list + num);
+            free(list);
+            return ret;
+         }
+
+         maru_context *get() const noexcept { return ctx_; }
+
+         unsigned num_streams() const { return maru_get_num_streams(ctx_); }
+
+         bool is_stream_available(maru_stream stream) const
+         {
+            return maru_is_stream_available(ctx_, stream) == 1;
+         }
+
+         /** \brief Finds an available stream. Throws LIBMARU_ERROR_BUSY if none are available. */
+         maru_stream find_available_stream() const
+         {
+            int stream = maru_find_available_stream(ctx_);
+            if (stream < 0)
+               throw error(LIBMARU_ERROR_BUSY);
+            return stream;
+         }
+
+         /** \brief Lists formats supported by stream. */
+         std::vector<maru_stream_desc> stream_descs(maru_stream stream) const
+         {
+            maru_stream_desc *list = nullptr;
+            unsigned num = 0;
+            check(maru_get_stream_desc(ctx_, stream, &list, &num));
+
+            std::vector<maru_stream_desc> ret(list, list + num);
+            free(list);
+            return ret;
+         }
+
+         maru_volume master_volume(maru_usec timeout = -1) const
+         {
+            maru_volume vol, min, max;
+            check(maru_stream_get_volume(ctx_, LIBMARU_STREAM_MASTER, &vol, &min, &max, timeout));
+            return vol;
+         }
+
+         void set_master_volume(maru_volume vol, maru_usec timeout = -1)
+         {
+            check(maru_stream_set_volume(ctx_, LIBMARU_STREAM_MASTER, vol, timeout));
+         }
+
+      private:
+         maru_context *ctx_ = nullptr;
+   };
+
+   /** \ingroup stream
+    * \brief An open stream of interleaved Channels x Sample audio.
+    *
+    * The stream is opened on construction and closed on destruction.
+    * The context must outlive the stream.
+    */
+   template<typename Sample, unsigned Channels>
+   class stream
+   {
+      public:
+         static_assert(Channels > 0, "Stream needs at least one channel.");
+
+         using sample_type = Sample;
+         using frame_type = frame<Sample, Channels>;
+         static constexpr unsigned channels = Channels;
+         static constexpr unsigned bits = sample_traits<Sample>::bits;
+         static constexpr std::size_t frame_size = frame_bytes<Sample, Channels>;
+
+         /** \brief Opens stream. buffer_frames and fragment_frames of 0 let libmaru decide. */
+         stream(context &ctx, maru_stream index, unsigned sample_rate,
+               std::size_t buffer_frames = 0, std::size_t fragment_frames = 0)
+            : ctx_(ctx.get()), index_(index), sample_rate_(sample_rate)
+         {
+            maru_stream_desc desc{};
+            desc.sample_rate = sample_rate;
+            desc.channels = Channels;
+            desc.bits = bits;
+            desc.buffer_size = buffer_frames * frame_size;
+            desc.fragment_size = fragment_frames * frame_size;
+            check(maru_stream_open(ctx_, index_, &desc));
+         }
+
+         /** \brief Opens the first available stream. */
+         stream(context &ctx, unsigned sample_rate,
+               std::size_t buffer_frames = 0, std::size_t fragment_frames = 0)
+            : stream(ctx, ctx.find_available_stream(), sample_rate, buffer_frames, fragment_frames)
+         {}
+
+         stream(stream &&other) noexcept
+            : ctx_(std::exchange(other.ctx_, nullptr)), index_(other.index_), sample_rate_(other.sample_rate_)
+         {}
+
+         stream &operator=(stream &&other) noexcept
+         {
+            std::swap(ctx_, other.ctx_);
+            std::swap(index_, other.index_);
+            std::swap(sample_rate_, other.sample_rate_);
+            return *this;
+         }
+
+         stream(const stream&) = delete;
+         stream &operator=(const stream&) = delete;
+
+         ~stream()
+         {
+            if (ctx_)
+               maru_stream_close(ctx_, index_);
+         }
+
+         maru_stream index() const noexcept { return index_; }
+         unsigned sample_rate() const noexcept { return sample_rate_; }
+
+         /** \brief Blocking write of whole frames. Returns frames written,
+          * which is less than requested only if the stream died. */
+         std::size_t write(span<const frame_type> frames)
+         {
+            return maru_stream_write(ctx_, index_, frames.data(), frames.size_bytes()) / frame_size;
+         }
+
+         /** \brief Blocking write of interleaved samples.
+          * Throws LIBMARU_ERROR_INVALID if size is not a multiple of Channels,
+          * as a partial frame would shift channels for the rest of the stream. */
+         std::size_t write(span<const Sample> samples)
+         {
+            if (samples.size() % Channels)
+               throw error(LIBMARU_ERROR_INVALID);
+            return maru_stream_write(ctx_, index_, samples.data(), samples.size_bytes()) / frame_size;
+         }
+
+         /** \brief Frames that can be written without blocking. */
+         std::size_t write_avail() const
+         {
+            return maru_stream_write_avail(ctx_, index_) / frame_size;
+         }
+
+         /** \brief Locks frames for rendering in place, without blocking.
+          * Throws LIBMARU_ERROR_BUSY if fewer frames than requested are available.
+          * Samples are committed to the stream when the region goes out of scope. */
+         locked_region<Sample, true> lock(std::size_t frames)
+         {
+            maru_fifo_locked_region region;
+            check(maru_stream_write_lock(ctx_, index_, frames * frame_size, &region));
+            return locked_region<Sample, true>(ctx_, index_, unlock_stream, region);
+         }
+
+         /** \brief Converts interleaved float samples to Sample straight into the stream, without blocking.
+          * Size must be a multiple of Channels. Returns frames written,
+          * which is less than requested if the stream does not have room for all of them. */
+         std::size_t write_float(span<const float> samples)
+         {
+            std::size_t frames = write_avail();
+            if (frames > samples.size() / Channels)
+               frames = samples.size() / Channels;
+            if (!frames)
+               return 0;
+
+            maru_fifo_locked_region region;
+            check(maru_stream_write_lock(ctx_, index_, frames * frame_size, &region));
+            convert_from_float<Sample>(region, samples.data());
+            check(maru_stream_write_unlock(ctx_, index_, &region));
+            return frames;
+         }
+
+         void flush() { check(maru_stream_flush(ctx_, index_)); }
+
+         void set_buffer(std::size_t buffer_size, std::size_t fragment_size = 0)
+         {
+            check(maru_stream_set_buffer(ctx_, index_, buffer_size, fragment_size));
+         }
+
+         maru_usec latency() const { return maru_stream_current_latency(ctx_, index_); }
+
+         /** \brief Lock-free playback status. See maru_stream_get_status(). */
+         maru_stream_status status() const
+         {
+            maru_stream_status st;
+            check(maru_stream_get_status(ctx_, index_, &st));
+            return st;
+         }
+
+         int notification_fd() const { return maru_stream_notification_fd(ctx_, index_); }
+
+         /** \brief New descriptor for the shared position page. See maru_stream_position_fd(). */
+         int position_fd() const { return maru_stream_position_fd(ctx_, index_); }
+
+         maru_volume volume(maru_usec timeout = -1) const
+         {
+            maru_volume vol, min, max;
+            check(maru_stream_get_volume(ctx_, index_, &vol, &min, &max, timeout));
+            return vol;
+         }
+
+         void set_volume(maru_volume vol, maru_usec timeout = -1)
+         {
+            check(maru_stream_set_volume(ctx_, index_, vol, timeout));
+         }
+
+         /** \brief Mirrors submitted audio into tap. See maru_stream_set_tap(). */
+         void set_tap(fifo *tap)
+         {
+            check(maru_stream_set_tap(ctx_, index_, tap ? tap->get() : nullptr));
+         }
+
+      private:
+         static maru_error unlock_stream(void *handle, unsigned index, const maru_fifo_locked_region *region)
+         {
+            return maru_stream_write_unlock(static_cast<maru_context*>(handle), index, region);
+         }
+
+         maru_context *ctx_;
+         maru_stream index_;
+         unsigned sample_rate_;
+   };
+
+   using stereo16 = stream<int16_t, 2>;
+   using stereo24 = stream<int24, 2>;
+   using stereo32 = stream<int32_t, 2>;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/* libmaru - Userspace USB audio class driver.
+ * Copyright (C) 2012 - Hans-Kristian Arntzen
+ * Copyright (C) 2012 - Agnes Heyer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef LIBMARU_PROBES_H__
+#define LIBMARU_PROBES_H__
+
+/** \ingroup lib
+ * \brief USDT probes of the libmaru provider.
+ *
+ * If sys/sdt.h (systemtap-sdt-dev) is available, every probe compiles to a nop
+ * and a note in the ELF file, behind a test of its semaphore.
+ * bpftrace and perf raise the semaphore while attached, so arguments are only evaluated then.
+ * Every file using a probe defines its semaphore with MARU_PROBE_SEMAPHORE().
+ * Define LIBMARU_NO_PROBES to compile probes out. See README for the list of probes.
+ */
+
+#if !defined(LIBMARU_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define LIBMARU_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef LIBMARU_HAVE_PROBES
+#define MARU_PROBE_SEMAPHORE(name) \
+   unsigned short libmaru_##name##_semaphore __attribute__((unused, section(".probes")))
+#define MARU_PROBE_ENABLED(name) __builtin_expect(libmaru_##name##_semaphore != 0, 0)
+
+#define MARU_PROBE3(name, a, b, c) do { \
+   if (MARU_PROBE_ENABLED(name)) DTRACE_PROBE3(libmaru, name, a, b, c); } while (0)
+#define MARU_PROBE4(name, a, b, c, d) do { \
+   if (MARU_PROBE_ENABLED(name)) DTRACE_PROBE4(libmaru, name, a, b, c, d); } while (0)
+#define MARU_PROBE5(name, a, b, c, d, e) do { \
+   if (MARU_PROBE_ENABLED(name)) DTRACE_PROBE5(libmaru, name, a, b, c, d, e); } while (0)
+#else
+#define MARU_PROBE_SEMAPHORE(name) struct maru_probe_##name
+#define MARU_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#define MARU_PROBE4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#define MARU_PROBE5(name, a, b, c, d, e) do { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,79 @@
+/* libmaru - Userspace USB audio class driver.
+ * Copyright (C) 2012 - Hans-Kristian Arntzen
+ * Copyright (C) 2012 - Agnes Heyer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef LIBMARU_SCHEDULE_H__
+#define LIBMARU_SCHEDULE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** \ingroup lib
+ * \brief Packet scheduling of isochronous streams.
+ *
+ * Pure functions used by libmaru to size isochronous packets.
+ * They are kept apart from libusb so that tools can replay recorded traffic
+ * (see usblog.h) through the exact same logic.
+ *
+ * Transfer speed is fixed point audio frames per USB frame (16.16).
+ * The fraction keeps track of when extra frames must be sent to keep up with the speed.
+ */
+
+/** \ingroup lib
+ * \brief Size in bytes of the next packet.
+ *
+ * \param speed Transfer speed (16.16).
+ * \param fraction Current fraction.
+ * \param mult Bytes per audio frame.
+ */
+static inline size_t maru_sched_packet_size(uint32_t speed, uint32_t fraction, unsigned mult)
+{
+   size_t new_fraction = fraction + (speed & 0xffff);
+
+   size_t to_write = new_fraction >> 16;
+   to_write *= mult;
+
+   return to_write;
+}
+
+/** \ingroup lib
+ * \brief Returns fraction after a packet has been sent.
+ */
+static inline uint32_t maru_sched_advance(uint32_t speed, uint32_t fraction)
+{
+   // Calculate fractional speeds (async isochronous).
+   fraction += speed & 0xffff;
+
+   // Wrap-around.
+   return (UINT32_C(0xffff0000) & speed) | (fraction & 0xffff);
+}
+
+/** \ingroup lib
+ * \brief Converts a full-speed feedback endpoint value (10.14) to a transfer speed (16.16).
+ */
+static inline uint32_t maru_sched_feedback_speed(const uint8_t *buffer)
+{
+   uint32_t fraction =
+      (buffer[0] <<  0) |
+      (buffer[1] <<  8) |
+      (buffer[2] << 16);
+
+   return fraction << 2;
+}
+
+#endif
@@ -0,0 +1,34 @@
+#include "sim_stream.h"
+#include <stdio.h>
+
+maru_context *sim_stream_context(void)
+{
+   maru_context *ctx;
+   if (maru_create_context_from_vid_pid(&ctx, SIM_USB_VID, SIM_USB_PID, NULL) != LIBMARU_SUCCESS)
+   {
+      fprintf(stderr, "Failed to create context on simulated device.\n");
+      return NULL;
+   }
+
+   return ctx;
+}
+
+bool sim_stream_open(maru_context *ctx, maru_stream stream,
+      unsigned rate, size_t buffer_size, size_t fragment_size)
+{
+   struct maru_stream_desc desc = {
+      .sample_rate = rate,
+      .channels = 2,
+      .bits = 16,
+      .buffer_size = buffer_size,
+      .fragment_size = fragment_size,
+   };
+
+   if (maru_stream_open(ctx, stream, &desc) != LIBMARU_SUCCESS)
+   {
+      fprintf(stderr, "Failed to open stream %u.\n", stream);
+      return false;
+   }
+
+   return true;
+}
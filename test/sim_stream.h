@@ -0,0 +1,16 @@
+// Contexts and streams on the simulated device (sim_usb.h), as tests and benchmarks set them up.
+
+#ifndef SIM_STREAM_H__
+#define SIM_STREAM_H__
+
+#include "sim_usb.h"
+#include <libmaru.h>
+
+// Creates a context on the simulated device. Returns NULL on failure.
+maru_context *sim_stream_context(void);
+
+// Opens a stereo 16-bit stream. Sizes are in bytes.
+bool sim_stream_open(maru_context *ctx, maru_stream stream,
+      unsigned rate, size_t buffer_size, size_t fragment_size);
+
+#endif
@@ -0,0 +1,793 @@
+// Simulated USB audio device. See sim_usb.h.
+
+#include "sim_usb.h"
+#include <libusb-1.0/libusb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define QUEUE_SIZE 64
+// Every endpoint, both directions, can complete its whole queue, plus control transfers.
+#define DONE_SIZE ((SIM_USB_MAX_STREAMS * 2 + 1) * QUEUE_SIZE)
+#define FEEDBACK_PERIOD 8
+#define SIM_RATE_MIN 8000
+#define SIM_RATE_MAX 192000
+
+#define FEATURE_UNIT_ID 10
+#define OUTPUT_TERMINAL_ID 11
+
+struct sim_transfer
+{
+   struct libusb_transfer *trans;
+   unsigned packets_done;
+   uint64_t done_time;
+};
+
+// Every context has its own completions, like processes sharing a device do.
+struct libusb_context
+{
+   int event_fd;
+   // Descriptor of the device opened or wrapped on this context, or -1.
+   int device_fd;
+   struct libusb_pollfd pollfds[2];
+
+   struct sim_transfer done[DONE_SIZE];
+   unsigned num_done;
+   // Completions being delivered. Only touched by the thread handling events.
+   struct sim_transfer delivering[DONE_SIZE];
+};
+
+struct libusb_device { int unused; };
+struct libusb_device_handle { libusb_context *ctx; };
+
+struct sim_endpoint
+{
+   struct sim_transfer queue[QUEUE_SIZE];
+   unsigned head;
+   unsigned count;
+
+   unsigned rate;
+   bool primed;
+   bool dry;
+   unsigned dry_run;
+   uint64_t last_delivery;
+
+   struct sim_usb_stats stats;
+};
+
+static struct
+{
+   pthread_mutex_t lock;
+   pthread_t thread;
+   unsigned users;
+   // Stands in for the device node. It is never readable,
+   // and contexts poll it for POLLOUT like libusb polls a device descriptor.
+   int device_pipe[2];
+   pid_t event_tid;
+   bool feedback;
+
+   sim_usb_capture_cb capture;
+   void *capture_userdata;
+
+   // Index 1 to SIM_USB_MAX_STREAMS, by endpoint number.
+   struct sim_endpoint out[SIM_USB_MAX_STREAMS + 1];
+   struct sim_endpoint in[SIM_USB_MAX_STREAMS + 1];
+
+   struct libusb_device dev;
+
+   struct libusb_config_descriptor conf;
+   struct libusb_interface ifaces[SIM_USB_MAX_STREAMS + 1];
+   struct libusb_interface_descriptor ctrl_alt;
+   struct libusb_interface_descriptor stream_alts[SIM_USB_MAX_STREAMS][2];
+   struct libusb_endpoint_descriptor stream_eps[SIM_USB_MAX_STREAMS];
+   uint8_t ctrl_extra[32];
+   uint8_t stream_extra[32];
+} sim = {
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+   .device_pipe = { -1, -1 },
+};
+
+static uint64_t now_usec(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return tv.tv_sec * UINT64_C(1000000) + tv.tv_nsec / 1000;
+}
+
+static void build_descriptors(void)
+{
+   // Speaker output terminal, fed by a feature unit with volume on both channels.
+   static const uint8_t ctrl_extra[] = {
+      9, 0x24, 0x03, OUTPUT_TERMINAL_ID, 0x01, 0x03, 0, FEATURE_UNIT_ID, 0,
+      10, 0x24, 0x06, FEATURE_UNIT_ID, 1, 1, 0x00, 0x02, 0x02, 0,
+   };
+
+   // AS general descriptor and a continuous type I format, stereo 16-bit.
+   static const uint8_t stream_extra[] = {
+      7, 0x24, 0x01, 1, 1, 0x01, 0x00,
+      14, 0x24, 0x02, 0x01, 2, 2, 16, 0,
+      SIM_RATE_MIN & 0xff, (SIM_RATE_MIN >> 8) & 0xff, SIM_RATE_MIN >> 16,
+      SIM_RATE_MAX & 0xff, (SIM_RATE_MAX >> 8) & 0xff, SIM_RATE_MAX >> 16,
+   };
+
+   memcpy(sim.ctrl_extra, ctrl_extra, sizeof(ctrl_extra));
+   memcpy(sim.stream_extra, stream_extra, sizeof(stream_extra));
+
+   sim.ctrl_alt = (struct libusb_interface_descriptor) {
+      .bInterfaceNumber = 0,
+      .bInterfaceClass = 1,
+      .bInterfaceSubClass = 1,
+      .extra = sim.ctrl_extra,
+      .extra_length = sizeof(ctrl_extra),
+   };
+   sim.ifaces[0] = (struct libusb_interface) { .altsetting = &sim.ctrl_alt, .num_altsetting = 1 };
+
+   for (unsigned i = 0; i < SIM_USB_MAX_STREAMS; i++)
+   {
+      sim.stream_eps[i] = (struct libusb_endpoint_descriptor) {
+         .bEndpointAddress = i + 1,
+         // Isochronous, asynchronous with feedback or adaptive without.
+         .bmAttributes = sim.feedback ? 0x05 : 0x09,
+         .wMaxPacketSize = SIM_RATE_MAX / 1000 * 4 + 4,
+         .bInterval = 1,
+         .bSynchAddress = sim.feedback ? 0x80 | (i + 1) : 0,
+      };
+
+      // Zero bandwidth altsetting 0, streaming altsetting 1.
+      for (unsigned alt = 0; alt < 2; alt++)
+      {
+         sim.stream_alts[i][alt] = (struct libusb_interface_descriptor) {
+            .bInterfaceNumber = i + 1,
+            .bAlternateSetting = alt,
+            .bNumEndpoints = alt,
+            .bInterfaceClass = 1,
+            .bInterfaceSubClass = 2,
+            .endpoint = alt ? &sim.stream_eps[i] : NULL,
+            .extra = alt ? sim.stream_extra : NULL,
+            .extra_length = alt ? sizeof(stream_extra) : 0,
+         };
+      }
+
+      sim.ifaces[i + 1] = (struct libusb_interface) { .altsetting = sim.stream_alts[i], .num_altsetting = 2 };
+   }
+
+   sim.conf = (struct libusb_config_descriptor) {
+      .bNumInterfaces = SIM_USB_MAX_STREAMS + 1,
+      .bConfigurationValue = 1,
+      .interface = sim.ifaces,
+   };
+}
+
+// Completions go to the context the transfer was submitted on.
+static void push_done(struct libusb_transfer *trans, uint64_t done_time)
+{
+   libusb_context *ctx = trans->dev_handle->ctx;
+   ctx->done[ctx->num_done++] = (struct sim_transfer) {
+      .trans = trans,
+      .done_time = done_time,
+   };
+   eventfd_write(ctx->event_fd, 1);
+}
+
+static void play_endpoint(struct sim_endpoint *ep, uint64_t now)
+{
+   if (!ep->count)
+   {
+      if (ep->primed)
+      {
+         ep->stats.underruns++;
+         ep->dry = true;
+         if (++ep->dry_run > ep->stats.dry_max)
+            ep->stats.dry_max = ep->dry_run;
+      }
+      return;
+   }
+
+   ep->dry_run = 0;
+
+   struct sim_transfer *cur = &ep->queue[ep->head];
+   struct libusb_transfer *trans = cur->trans;
+
+   struct libusb_iso_packet_descriptor *packet = &trans->iso_packet_desc[cur->packets_done++];
+   packet->actual_length = packet->length;
+   packet->status = LIBUSB_TRANSFER_COMPLETED;
+   ep->stats.packets++;
+   ep->stats.bytes += packet->length;
+
+   if (cur->packets_done < (unsigned)trans->num_iso_packets)
+      return;
+
+   trans->status = LIBUSB_TRANSFER_COMPLETED;
+   trans->actual_length = trans->length;
+   push_done(trans, now);
+   ep->head = (ep->head + 1) % QUEUE_SIZE;
+   ep->count--;
+   ep->stats.transfers++;
+}
+
+static bool feed_endpoint(struct sim_endpoint *ep, uint64_t now, unsigned frame)
+{
+   if (!ep->count || frame % FEEDBACK_PERIOD)
+      return false;
+
+   struct libusb_transfer *trans = ep->queue[ep->head].trans;
+
+   // Full-speed feedback is 10.14 frames per USB frame.
+   uint32_t fb = (uint32_t)(((uint64_t)ep->rate << 14) / 1000);
+   trans->buffer[0] = fb >> 0;
+   trans->buffer[1] = fb >> 8;
+   trans->buffer[2] = fb >> 16;
+   trans->iso_packet_desc[0].actual_length = 3;
+   trans->iso_packet_desc[0].status = LIBUSB_TRANSFER_COMPLETED;
+   trans->actual_length = 3;
+   trans->status = LIBUSB_TRANSFER_COMPLETED;
+
+   push_done(trans, now);
+   ep->head = (ep->head + 1) % QUEUE_SIZE;
+   ep->count--;
+   return true;
+}
+
+static void *device_thread(void *data)
+{
+   (void)data;
+
+   struct timespec next;
+   clock_gettime(CLOCK_MONOTONIC, &next);
+   unsigned frame = 0;
+
+   for (;;)
+   {
+      next.tv_nsec += 1000000;
+      if (next.tv_nsec >= 1000000000)
+      {
+         next.tv_nsec -= 1000000000;
+         next.tv_sec++;
+      }
+
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+
+      pthread_mutex_lock(&sim.lock);
+      if (!sim.users)
+      {
+         pthread_mutex_unlock(&sim.lock);
+         break;
+      }
+
+      uint64_t now = now_usec();
+      for (unsigned i = 1; i <= SIM_USB_MAX_STREAMS; i++)
+      {
+         play_endpoint(&sim.out[i], now);
+         if (feed_endpoint(&sim.in[i], now, frame))
+            sim.out[i].stats.feedback++;
+      }
+      frame++;
+
+      pthread_mutex_unlock(&sim.lock);
+   }
+
+   return NULL;
+}
+
+static void handle_control(struct libusb_transfer *trans)
+{
+   const struct libusb_control_setup *setup = (const struct libusb_control_setup*)trans->buffer;
+   uint8_t *data = trans->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+   unsigned ep = setup->wIndex & 0x0f;
+
+   trans->status = LIBUSB_TRANSFER_COMPLETED;
+   trans->actual_length = setup->wLength;
+
+   // Sampling frequency control of an endpoint.
+   if ((setup->bmRequestType & 0x1f) == LIBUSB_RECIPIENT_ENDPOINT && (setup->wValue >> 8) == 0x01)
+   {
+      if (setup->bRequest == 0x01)
+      {
+         sim.out[ep].rate = sim.in[ep].rate = data[0] | (data[1] << 8) | (data[2] << 16);
+         if (sim.out[ep].rate < SIM_RATE_MIN || sim.out[ep].rate > SIM_RATE_MAX)
+            trans->status = LIBUSB_TRANSFER_STALL;
+      }
+      else
+      {
+         data[0] = sim.out[ep].rate >> 0;
+         data[1] = sim.out[ep].rate >> 8;
+         data[2] = sim.out[ep].rate >> 16;
+      }
+   }
+   // Volume of feature unit. 0 dB, range -127 dB to 0 dB.
+   else if (setup->bmRequestType & 0x80)
+   {
+      int16_t vol = setup->bRequest == 0x82 ? -0x7f00 : 0;
+      memset(data, 0, setup->wLength);
+      memcpy(data, &vol, setup->wLength < sizeof(vol) ? setup->wLength : sizeof(vol));
+   }
+}
+
+void sim_usb_configure(bool feedback)
+{
+   sim.feedback = feedback;
+}
+
+void sim_usb_set_capture(sim_usb_capture_cb cb, void *userdata)
+{
+   pthread_mutex_lock(&sim.lock);
+   sim.capture = cb;
+   sim.capture_userdata = userdata;
+   pthread_mutex_unlock(&sim.lock);
+}
+
+pid_t sim_usb_event_thread(void)
+{
+   pthread_mutex_lock(&sim.lock);
+   pid_t tid = sim.event_tid;
+   pthread_mutex_unlock(&sim.lock);
+   return tid;
+}
+
+void sim_usb_reset_stats(void)
+{
+   pthread_mutex_lock(&sim.lock);
+   for (unsigned i = 0; i <= SIM_USB_MAX_STREAMS; i++)
+   {
+      memset(&sim.out[i].stats, 0, sizeof(sim.out[i].stats));
+      sim.out[i].last_delivery = 0;
+      sim.out[i].dry_run = 0;
+   }
+   pthread_mutex_unlock(&sim.lock);
+}
+
+void sim_usb_get_stats(unsigned stream, struct sim_usb_stats *stats)
+{
+   memset(stats, 0, sizeof(*stats));
+   if (stream >= SIM_USB_MAX_STREAMS)
+      return;
+
+   pthread_mutex_lock(&sim.lock);
+   *stats = sim.out[stream + 1].stats;
+   pthread_mutex_unlock(&sim.lock);
+}
+
+// The device is shared by every context, and runs while any of them is alive.
+int libusb_init(libusb_context **ctx)
+{
+   libusb_context *context = calloc(1, sizeof(*context));
+   if (!context)
+      return LIBUSB_ERROR_NO_MEM;
+
+   context->device_fd = -1;
+   context->event_fd = eventfd(0, EFD_NONBLOCK);
+   if (context->event_fd < 0)
+   {
+      free(context);
+      return LIBUSB_ERROR_IO;
+   }
+
+   int ret = LIBUSB_SUCCESS;
+   pthread_mutex_lock(&sim.lock);
+
+   if (!sim.users)
+   {
+      memset(sim.out, 0, sizeof(sim.out));
+      memset(sim.in, 0, sizeof(sim.in));
+      sim.event_tid = 0;
+      build_descriptors();
+
+      if (pipe(sim.device_pipe) < 0)
+         ret = LIBUSB_ERROR_IO;
+      else if (pthread_create(&sim.thread, NULL, device_thread, NULL) != 0)
+      {
+         close(sim.device_pipe[0]);
+         close(sim.device_pipe[1]);
+         ret = LIBUSB_ERROR_IO;
+      }
+   }
+
+   if (ret == LIBUSB_SUCCESS)
+      sim.users++;
+
+   pthread_mutex_unlock(&sim.lock);
+
+   if (ret != LIBUSB_SUCCESS)
+   {
+      close(context->event_fd);
+      free(context);
+      return ret;
+   }
+
+   *ctx = context;
+   return LIBUSB_SUCCESS;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+   pthread_mutex_lock(&sim.lock);
+   bool last = --sim.users == 0;
+   pthread_mutex_unlock(&sim.lock);
+
+   if (last)
+   {
+      pthread_join(sim.thread, NULL);
+      close(sim.device_pipe[0]);
+      close(sim.device_pipe[1]);
+      sim.device_pipe[0] = sim.device_pipe[1] = -1;
+   }
+
+   close(ctx->event_fd);
+   free(ctx);
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+   (void)ctx;
+   libusb_device **devs = calloc(2, sizeof(*devs));
+   if (!devs)
+      return LIBUSB_ERROR_IO;
+
+   devs[0] = &sim.dev;
+   *list = devs;
+   return 1;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref)
+{
+   (void)unref;
+   free(list);
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+   (void)dev;
+   memset(desc, 0, sizeof(*desc));
+   desc->idVendor = SIM_USB_VID;
+   desc->idProduct = SIM_USB_PID;
+   desc->bNumConfigurations = 1;
+   return LIBUSB_SUCCESS;
+}
+
+int libusb_get_active_config_descriptor(libusb_device *dev, struct libusb_config_descriptor **config)
+{
+   (void)dev;
+   build_descriptors();
+   *config = &sim.conf;
+   return LIBUSB_SUCCESS;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config)
+{
+   (void)config;
+}
+
+static libusb_device_handle *open_handle(libusb_context *ctx, int fd)
+{
+   libusb_device_handle *handle = calloc(1, sizeof(*handle));
+   if (!handle)
+      return NULL;
+
+   handle->ctx = ctx;
+   ctx->device_fd = fd;
+   return handle;
+}
+
+libusb_device_handle *libusb_open_device_with_vid_pid(libusb_context *ctx, uint16_t vid, uint16_t pid)
+{
+   if (vid != SIM_USB_VID || pid != SIM_USB_PID)
+      return NULL;
+   return open_handle(ctx, sim.device_pipe[0]);
+}
+
+void libusb_close(libusb_device_handle *handle)
+{
+   handle->ctx->device_fd = -1;
+   free(handle);
+}
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000107
+// Only a descriptor of the simulated device, e.g. one passed along in a handover, can be wrapped.
+int libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev, libusb_device_handle **handle)
+{
+   struct stat dev, st;
+   if (fstat(sim.device_pipe[0], &dev) < 0 || fstat((int)sys_dev, &st) < 0 ||
+         dev.st_dev != st.st_dev || dev.st_ino != st.st_ino)
+      return LIBUSB_ERROR_NOT_SUPPORTED;
+
+   *handle = open_handle(ctx, (int)sys_dev);
+   return *handle ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_MEM;
+}
+#endif
+
+libusb_device *libusb_get_device(libusb_device_handle *handle)
+{
+   (void)handle;
+   return &sim.dev;
+}
+
+int libusb_get_device_speed(libusb_device *dev)
+{
+   (void)dev;
+   return LIBUSB_SPEED_FULL;
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+   (void)dev;
+   return 1;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+{
+   (void)dev;
+   return 1;
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *handle, int iface)
+{
+   (void)handle;
+   (void)iface;
+   return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *handle, int iface)
+{
+   (void)handle;
+   (void)iface;
+   return LIBUSB_SUCCESS;
+}
+
+int libusb_attach_kernel_driver(libusb_device_handle *handle, int iface)
+{
+   (void)handle;
+   (void)iface;
+   return LIBUSB_SUCCESS;
+}
+
+int libusb_claim_interface(libusb_device_handle *handle, int iface)
+{
+   (void)handle;
+   return iface <= SIM_USB_MAX_STREAMS ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_release_interface(libusb_device_handle *handle, int iface)
+{
+   (void)handle;
+   (void)iface;
+   return LIBUSB_SUCCESS;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle *handle, int iface, int alt)
+{
+   (void)handle;
+   return iface <= SIM_USB_MAX_STREAMS && alt < 2 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_clear_halt(libusb_device_handle *handle, unsigned char ep)
+{
+   (void)handle;
+   (void)ep;
+   return LIBUSB_SUCCESS;
+}
+
+int libusb_control_transfer(libusb_device_handle *handle, uint8_t request_type, uint8_t request,
+      uint16_t value, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout)
+{
+   (void)handle;
+   (void)request_type;
+   (void)request;
+   (void)value;
+   (void)index;
+   (void)data;
+   (void)timeout;
+
+   // Only pitch control is sent synchronously.
+   return length;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+   return calloc(1, sizeof(struct libusb_transfer) +
+         iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+}
+
+void libusb_free_transfer(struct libusb_transfer *trans)
+{
+   free(trans);
+}
+
+// Processes sharing a device descriptor share its completions,
+// so one of them submitting while the other still has transfers queued is a bug.
+static bool other_context_queued(libusb_context *ctx)
+{
+   for (unsigned i = 1; i <= SIM_USB_MAX_STREAMS; i++)
+   {
+      const struct sim_endpoint *eps[] = { &sim.out[i], &sim.in[i] };
+      for (unsigned e = 0; e < 2; e++)
+      {
+         for (unsigned j = 0; j < eps[e]->count; j++)
+         {
+            if (eps[e]->queue[(eps[e]->head + j) % QUEUE_SIZE].trans->dev_handle->ctx != ctx)
+               return true;
+         }
+      }
+   }
+
+   return false;
+}
+
+int libusb_submit_transfer(struct libusb_transfer *trans)
+{
+   int ret = LIBUSB_SUCCESS;
+
+   pthread_mutex_lock(&sim.lock);
+
+   if (trans->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+   {
+      handle_control(trans);
+      push_done(trans, now_usec());
+   }
+   else
+   {
+      unsigned num = trans->endpoint & 0x0f;
+      struct sim_endpoint *ep = trans->endpoint & 0x80 ? &sim.in[num] : &sim.out[num];
+
+      if (num == 0 || num > SIM_USB_MAX_STREAMS || ep->count >= QUEUE_SIZE)
+         ret = LIBUSB_ERROR_INVALID_PARAM;
+      else
+      {
+         if (other_context_queued(trans->dev_handle->ctx))
+            sim.out[num].stats.overlaps++;
+
+         ep->queue[(ep->head + ep->count++) % QUEUE_SIZE] = (struct sim_transfer) { .trans = trans };
+         ep->primed = true;
+
+         if (sim.capture && trans->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && !(trans->endpoint & 0x80))
+            sim.capture(num - 1, trans->buffer, trans->length, sim.capture_userdata);
+      }
+   }
+
+   pthread_mutex_unlock(&sim.lock);
+   return ret;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *trans)
+{
+   int ret = LIBUSB_ERROR_NOT_FOUND;
+
+   pthread_mutex_lock(&sim.lock);
+
+   unsigned num = trans->endpoint & 0x0f;
+   struct sim_endpoint *ep = trans->endpoint & 0x80 ? &sim.in[num] : &sim.out[num];
+
+   for (unsigned i = 0; i < ep->count; i++)
+   {
+      unsigned index = (ep->head + i) % QUEUE_SIZE;
+      if (ep->queue[index].trans != trans)
+         continue;
+
+      // Cancelled transfers are delivered from the event handler, as with libusb.
+      trans->status = LIBUSB_TRANSFER_CANCELLED;
+      push_done(trans, now_usec());
+
+      for (unsigned j = i; j + 1 < ep->count; j++)
+         ep->queue[(ep->head + j) % QUEUE_SIZE] = ep->queue[(ep->head + j + 1) % QUEUE_SIZE];
+      ep->count--;
+
+      // Stream stopped on purpose, so running dry is no longer an underrun.
+      if (!ep->count)
+      {
+         ep->primed = false;
+         ep->dry_run = 0;
+      }
+      ep->last_delivery = 0;
+
+      ret = LIBUSB_SUCCESS;
+      break;
+   }
+
+   pthread_mutex_unlock(&sim.lock);
+   return ret;
+}
+
+static void account_delivery(struct libusb_transfer *trans, uint64_t done_time, uint64_t now)
+{
+   if (trans->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS || (trans->endpoint & 0x80) ||
+         trans->status != LIBUSB_TRANSFER_COMPLETED)
+      return;
+
+   struct sim_endpoint *ep = &sim.out[trans->endpoint & 0x0f];
+   struct sim_usb_stats *stats = &ep->stats;
+
+   uint64_t latency = now - done_time;
+   stats->latency_total += latency;
+   if (latency > stats->latency_max)
+      stats->latency_max = latency;
+
+   // Interval is only meaningful if the device played continuously since the last completion.
+   if (ep->last_delivery && !ep->dry)
+   {
+      int64_t jitter = (int64_t)(now - ep->last_delivery) - trans->num_iso_packets * INT64_C(1000);
+      stats->jitter_samples++;
+      stats->jitter_sum += jitter;
+      stats->jitter_sq_sum += (double)jitter * jitter;
+      if (llabs(jitter) > stats->jitter_max)
+         stats->jitter_max = llabs(jitter);
+   }
+
+   ep->last_delivery = now;
+   ep->dry = false;
+}
+
+static int handle_events(libusb_context *ctx, int timeout_ms)
+{
+   if (timeout_ms)
+   {
+      struct pollfd fds = { .fd = ctx->event_fd, .events = POLLIN };
+      if (poll(&fds, 1, timeout_ms) < 0 && errno != EINTR)
+         return LIBUSB_ERROR_IO;
+   }
+
+   eventfd_t val;
+   eventfd_read(ctx->event_fd, &val);
+
+   unsigned num_done;
+
+   pthread_mutex_lock(&sim.lock);
+   sim.event_tid = syscall(SYS_gettid);
+
+   num_done = ctx->num_done;
+   memcpy(ctx->delivering, ctx->done, num_done * sizeof(*ctx->done));
+   ctx->num_done = 0;
+
+   uint64_t now = now_usec();
+   for (unsigned i = 0; i < num_done; i++)
+      account_delivery(ctx->delivering[i].trans, ctx->delivering[i].done_time, now);
+
+   pthread_mutex_unlock(&sim.lock);
+
+   for (unsigned i = 0; i < num_done; i++)
+      ctx->delivering[i].trans->callback(ctx->delivering[i].trans);
+
+   return LIBUSB_SUCCESS;
+}
+
+int libusb_handle_events(libusb_context *ctx)
+{
+   return handle_events(ctx, 100);
+}
+
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv)
+{
+   return handle_events(ctx, tv ? tv->tv_sec * 1000 + tv->tv_usec / 1000 : 100);
+}
+
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx)
+{
+   const struct libusb_pollfd **list = calloc(3, sizeof(*list));
+   if (!list)
+      return NULL;
+
+   ctx->pollfds[0] = (struct libusb_pollfd) { .fd = ctx->event_fd, .events = POLLIN };
+   list[0] = &ctx->pollfds[0];
+
+   if (ctx->device_fd >= 0)
+   {
+      ctx->pollfds[1] = (struct libusb_pollfd) { .fd = ctx->device_fd, .events = POLLOUT };
+      list[1] = &ctx->pollfds[1];
+   }
+
+   return list;
+}
+
+void libusb_set_pollfd_notifiers(libusb_context *ctx, libusb_pollfd_added_cb added_cb,
+      libusb_pollfd_removed_cb removed_cb, void *userdata)
+{
+   (void)ctx;
+   (void)added_cb;
+   (void)removed_cb;
+   (void)userdata;
+}
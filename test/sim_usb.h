@@ -0,0 +1,64 @@
+// Simulated USB audio device for benchmarking libmaru without hardware.
+//
+// sim_usb.c implements the subset of libusb that libmaru uses.
+// Linking it in place of libusb gives libmaru a full-speed UAC1 device
+// with SIM_USB_MAX_STREAMS stereo 16-bit streaming interfaces.
+// A device thread plays one isochronous packet per endpoint every millisecond,
+// and completions are delivered through libusb_handle_events*() like real libusb does.
+// Every libusb context gets the completions of its own transfers,
+// and a device descriptor which can be passed to libusb_wrap_sys_device() of another one,
+// so a handover between two contexts in one process plays out like one between processes.
+
+#ifndef SIM_USB_H__
+#define SIM_USB_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define SIM_USB_VID 0x1d6b
+#define SIM_USB_PID 0x0a10
+#define SIM_USB_MAX_STREAMS 15
+
+// Statistics of a streaming endpoint.
+struct sim_usb_stats
+{
+   uint64_t transfers;
+   uint64_t packets;
+   uint64_t bytes;
+   // USB frames where the endpoint had nothing queued up.
+   uint64_t underruns;
+   // Longest run of such frames.
+   uint64_t dry_max;
+   // Transfers completed on the feedback endpoint of the stream.
+   uint64_t feedback;
+   // Transfers submitted while another context still had transfers queued on the device.
+   uint64_t overlaps;
+
+   // Deviation of the interval between completion callbacks from the duration of the transfer.
+   uint64_t jitter_samples;
+   double jitter_sum;
+   double jitter_sq_sum;
+   int64_t jitter_max;
+
+   // Time from the device finishing a transfer until its callback runs.
+   uint64_t latency_total;
+   uint64_t latency_max;
+};
+
+// Must be called before a context is created.
+// With feedback, streams are asynchronous and have a feedback endpoint.
+void sim_usb_configure(bool feedback);
+
+// Called with the data of every isochronous transfer submitted on a stream, in order of submission.
+// Runs in the submitting thread with the device locked.
+typedef void (*sim_usb_capture_cb)(unsigned stream, const void *data, size_t size, void *userdata);
+void sim_usb_set_capture(sim_usb_capture_cb cb, void *userdata);
+
+// Thread that last handled libusb events, i.e. the libmaru thread. 0 if none yet.
+pid_t sim_usb_event_thread(void);
+
+void sim_usb_reset_stats(void);
+void sim_usb_get_stats(unsigned stream, struct sim_usb_stats *stats);
+
+#endif
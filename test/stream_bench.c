@@ -0,0 +1,287 @@
+// Multi-stream throughput benchmark of libmaru on a simulated device (sim_usb.h).
+//
+// For a growing number of streams, each stream is fed by its own writer thread,
+// and the libmaru thread is measured while the simulated device plays them in real time.
+// Reported per run:
+//    CPU time of the libmaru thread, in total and per stream
+//    Wakeups of the libmaru thread per second (voluntary context switches)
+//    Syscalls per transfer (read/write family from /proc/.../io, plus one epoll_wait per wakeup)
+//    Jitter of the interval between completion callbacks, and callback latency after the device finished
+//    Underruns, in USB frames where a stream had nothing queued up
+//
+// Usage: stream_bench [-n max_streams] [-r rate] [-f fragment] [-b buffer] [-t seconds] [-F]
+// Fragment and buffer sizes are in bytes. -F gives streams feedback endpoints.
+
+#include "sim_stream.h"
+#include <libmaru.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+
+struct writer
+{
+   pthread_t thread;
+   maru_context *ctx;
+   maru_stream stream;
+   size_t fragment;
+   volatile bool *stop;
+};
+
+struct thread_counters
+{
+   uint64_t cpu_ns;
+   uint64_t wakeups;
+   uint64_t syscalls;
+   bool has_syscalls;
+};
+
+static double time_seconds(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return tv.tv_sec + tv.tv_nsec / 1000000000.0;
+}
+
+static bool read_proc_value(pid_t tid, const char *file, const char *key, uint64_t *value)
+{
+   char path[128];
+   snprintf(path, sizeof(path), "/proc/self/task/%d/%s", (int)tid, file);
+
+   FILE *f = fopen(path, "r");
+   if (!f)
+      return false;
+
+   bool found = false;
+   char line[256];
+   size_t key_len = strlen(key);
+   while (fgets(line, sizeof(line), f))
+   {
+      if (strncmp(line, key, key_len) == 0)
+      {
+         *value = strtoull(line + key_len, NULL, 10);
+         found = true;
+         break;
+      }
+   }
+
+   fclose(f);
+   return found;
+}
+
+static void read_counters(pid_t tid, struct thread_counters *counters)
+{
+   memset(counters, 0, sizeof(*counters));
+
+   char path[128];
+   snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", (int)tid);
+   FILE *f = fopen(path, "r");
+   if (f)
+   {
+      unsigned long long ns;
+      if (fscanf(f, "%llu", &ns) == 1)
+         counters->cpu_ns = ns;
+      fclose(f);
+   }
+
+   read_proc_value(tid, "status", "voluntary_ctxt_switches:", &counters->wakeups);
+
+   uint64_t syscr, syscw;
+   if (read_proc_value(tid, "io", "syscr: ", &syscr) &&
+         read_proc_value(tid, "io", "syscw: ", &syscw))
+   {
+      counters->syscalls = syscr + syscw;
+      counters->has_syscalls = true;
+   }
+}
+
+static void *writer_thread(void *data)
+{
+   struct writer *writer = data;
+
+   void *buf = calloc(1, writer->fragment);
+   if (!buf)
+      return NULL;
+
+   while (!*writer->stop)
+   {
+      if (maru_stream_write(writer->ctx, writer->stream, buf, writer->fragment) < writer->fragment)
+      {
+         fprintf(stderr, "Stream %u died.\n", writer->stream);
+         break;
+      }
+   }
+
+   free(buf);
+   return NULL;
+}
+
+static bool run(unsigned streams, unsigned rate, size_t fragment, size_t buffer, double seconds)
+{
+   maru_context *ctx = sim_stream_context();
+   if (!ctx)
+      return false;
+
+   volatile bool stop = false;
+   struct writer writers[SIM_USB_MAX_STREAMS];
+   unsigned opened = 0, started = 0;
+   bool ret = false;
+
+   for (; opened < streams; opened++)
+   {
+      if (!sim_stream_open(ctx, opened, rate, buffer, fragment))
+         goto end;
+   }
+
+   for (; started < streams; started++)
+   {
+      writers[started] = (struct writer) {
+         .ctx = ctx,
+         .stream = started,
+         .fragment = fragment,
+         .stop = &stop,
+      };
+
+      if (pthread_create(&writers[started].thread, NULL, writer_thread, &writers[started]) != 0)
+         goto end;
+   }
+
+   // Let streams fill up before measuring.
+   usleep(500000);
+
+   pid_t tid = sim_usb_event_thread();
+   struct thread_counters before, after;
+   read_counters(tid, &before);
+   sim_usb_reset_stats();
+   double start = time_seconds();
+
+   usleep(seconds * 1000000);
+
+   double elapsed = time_seconds() - start;
+   read_counters(tid, &after);
+
+   struct sim_usb_stats total = {0};
+   double jitter_var = 0.0;
+   for (unsigned i = 0; i < streams; i++)
+   {
+      struct sim_usb_stats stats;
+      sim_usb_get_stats(i, &stats);
+
+      total.transfers      += stats.transfers;
+      total.underruns      += stats.underruns;
+      total.jitter_samples += stats.jitter_samples;
+      total.jitter_sum     += stats.jitter_sum;
+      total.jitter_sq_sum  += stats.jitter_sq_sum;
+      total.latency_total  += stats.latency_total;
+      if (stats.jitter_max > total.jitter_max)
+         total.jitter_max = stats.jitter_max;
+      if (stats.latency_max > total.latency_max)
+         total.latency_max = stats.latency_max;
+   }
+
+   if (total.jitter_samples)
+   {
+      double mean = total.jitter_sum / total.jitter_samples;
+      jitter_var = total.jitter_sq_sum / total.jitter_samples - mean * mean;
+   }
+
+   double cpu = (after.cpu_ns - before.cpu_ns) / (elapsed * 1e9);
+   double wakeups = after.wakeups - before.wakeups;
+
+   printf("%7u %7.2f%% %9.1f %9.0f %9.0f ",
+         streams, cpu * 100.0, cpu * 1e6 / streams,
+         wakeups / elapsed, total.transfers / elapsed);
+
+   if (after.has_syscalls && total.transfers)
+      printf("%9.2f ", (after.syscalls - before.syscalls + wakeups) / total.transfers);
+   else
+      printf("%9s ", "-");
+
+   printf("%9.1f %9lld %9.1f %9llu %9llu\n",
+         sqrt(jitter_var > 0.0 ? jitter_var : 0.0), (long long)total.jitter_max,
+         total.transfers ? (double)total.latency_total / total.transfers : 0.0,
+         (unsigned long long)total.latency_max,
+         (unsigned long long)total.underruns);
+
+   ret = true;
+
+end:
+   stop = true;
+   for (unsigned i = 0; i < started; i++)
+      pthread_join(writers[i].thread, NULL);
+   for (unsigned i = 0; i < opened; i++)
+      maru_stream_close(ctx, i);
+
+   maru_destroy_context(ctx);
+   return ret;
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned max_streams = 8;
+   unsigned rate = 48000;
+   size_t fragment = 1024;
+   size_t buffer = 8192;
+   double seconds = 5.0;
+   bool feedback = false;
+
+   int c;
+   while ((c = getopt(argc, argv, "n:r:f:b:t:F")) != -1)
+   {
+      switch (c)
+      {
+         case 'n':
+            max_streams = strtoul(optarg, NULL, 0);
+            break;
+         case 'r':
+            rate = strtoul(optarg, NULL, 0);
+            break;
+         case 'f':
+            fragment = strtoul(optarg, NULL, 0);
+            break;
+         case 'b':
+            buffer = strtoul(optarg, NULL, 0);
+            break;
+         case 't':
+            seconds = strtod(optarg, NULL);
+            break;
+         case 'F':
+            feedback = true;
+            break;
+         default:
+            fprintf(stderr, "Usage: %s [-n max_streams] [-r rate] [-f fragment] [-b buffer] [-t seconds] [-F]\n", argv[0]);
+            return 1;
+      }
+   }
+
+   if (max_streams < 1 || max_streams > SIM_USB_MAX_STREAMS || !fragment || buffer < fragment)
+   {
+      fprintf(stderr, "Invalid arguments. At most %u streams, buffer must hold a fragment.\n",
+            SIM_USB_MAX_STREAMS);
+      return 1;
+   }
+
+   sim_usb_configure(feedback);
+
+   printf("%u Hz stereo S16, fragment %zu, buffer %zu, %s, %.1f s per run\n",
+         rate, fragment, buffer, feedback ? "async + feedback" : "adaptive", seconds);
+   printf("%7s %8s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n",
+         "streams", "cpu", "us/s/str", "wakeup/s", "xfer/s", "sys/xfer",
+         "jit(us)", "jitmax", "lat(us)", "latmax", "underrun");
+
+   for (unsigned streams = 1; streams <= max_streams; streams = streams < max_streams && streams * 2 > max_streams ? max_streams : streams * 2)
+   {
+      if (!run(streams, rate, fragment, buffer, seconds))
+         return 1;
+
+      if (streams == max_streams)
+         break;
+   }
+
+   return 0;
+}
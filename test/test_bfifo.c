@@ -0,0 +1,289 @@
+// Writes to a broadcast fifo with several readers, one of which drops on lag
+// while holding regions as the libmaru thread does with transfers in flight,
+// and checks that every reader sees an intact byte stream.
+
+#include <fifo.h>
+#include <assert.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+static uint8_t next_write;
+
+static void write_bytes(maru_bfifo *fifo, size_t size)
+{
+   uint8_t buf[4096];
+   assert(size <= sizeof(buf));
+   for (size_t i = 0; i < size; i++)
+      buf[i] = next_write++;
+
+   assert(maru_bfifo_write(fifo, buf, size) == (ssize_t)size);
+}
+
+static void check_region(const struct maru_fifo_locked_region *region, uint8_t *next_read)
+{
+   const uint8_t *first = region->first;
+   const uint8_t *second = region->second;
+   for (size_t i = 0; i < region->first_size; i++)
+      assert(first[i] == (*next_read)++);
+   for (size_t i = 0; i < region->second_size; i++)
+      assert(second[i] == (*next_read)++);
+}
+
+static void read_bytes(maru_fifo *fifo, size_t size, uint8_t *next_read)
+{
+   uint8_t buf[4096];
+   assert(size <= sizeof(buf));
+   assert(maru_fifo_read(fifo, buf, size) == (ssize_t)size);
+   for (size_t i = 0; i < size; i++)
+      assert(buf[i] == (*next_read)++);
+}
+
+#define WORDS (1 << 20)
+#define CHUNK 256
+
+static void *writer_thread(void *data)
+{
+   maru_bfifo *fifo = data;
+   uint32_t buf[CHUNK];
+
+   for (uint32_t word = 0; word < WORDS; word += CHUNK)
+   {
+      for (unsigned i = 0; i < CHUNK; i++)
+         buf[i] = word + i;
+
+      // Whole chunks only, so words never straddle a drop.
+      while (maru_bfifo_write_avail(fifo) < sizeof(buf))
+      {
+         struct pollfd fds = { .fd = maru_bfifo_write_notify_fd(fifo), .events = POLLIN };
+         assert(poll(&fds, 1, -1) == 1);
+         assert(maru_bfifo_write_notify_ack(fifo) == LIBMARU_SUCCESS);
+      }
+
+      assert(maru_bfifo_write(fifo, buf, sizeof(buf)) == sizeof(buf));
+   }
+
+   return NULL;
+}
+
+// Reads until the last word, through held regions as libmaru does.
+// A reader which drops on lag may see gaps, but never goes backwards,
+// and may never see the last word, so it reads until killed.
+struct reader
+{
+   maru_fifo *fifo;
+   bool slow;
+};
+
+static void *reader_thread(void *data)
+{
+   const struct reader *reader = data;
+   maru_fifo *fifo = reader->fifo;
+   uint32_t next = 0;
+   uint64_t gaps = 0;
+
+   maru_fifo_set_read_trigger(fifo, CHUNK * sizeof(uint32_t));
+
+   while (next < WORDS)
+   {
+      struct pollfd fds = { .fd = maru_fifo_read_notify_fd(fifo), .events = POLLIN };
+      assert(poll(&fds, 1, -1) == 1);
+
+      size_t avail = maru_fifo_read_avail(fifo) & ~(sizeof(uint32_t) - 1);
+      struct maru_fifo_locked_region region;
+      assert(maru_fifo_read_lock(fifo, avail, &region) == LIBMARU_SUCCESS);
+
+      // Word pattern, so a region only splits on word boundaries.
+      const uint32_t *first = region.first;
+      const uint32_t *second = region.second;
+      for (size_t i = 0; i < region.first_size / sizeof(uint32_t); i++, next++)
+      {
+         if (first[i] != next)
+         {
+            assert(first[i] > next);
+            gaps++;
+            next = first[i];
+         }
+      }
+      for (size_t i = 0; i < region.second_size / sizeof(uint32_t); i++, next++)
+      {
+         if (second[i] != next)
+         {
+            assert(second[i] > next);
+            gaps++;
+            next = second[i];
+         }
+      }
+
+      if (reader->slow)
+         usleep(1000);
+
+      assert(maru_fifo_read_unlock(fifo, &region) == LIBMARU_SUCCESS);
+      if (maru_fifo_read_notify_ack(fifo) != LIBMARU_SUCCESS)
+         break;
+   }
+
+   return (void*)(uintptr_t)gaps;
+}
+
+static void test_threaded(void)
+{
+   maru_bfifo *fifo = maru_bfifo_new(CHUNK * sizeof(uint32_t) * 8);
+   assert(fifo);
+   assert(maru_bfifo_set_write_trigger(fifo, CHUNK * sizeof(uint32_t)) == LIBMARU_SUCCESS);
+
+   // Third reader is too slow to keep up, and drops what it cannot play.
+   struct reader readers[3] = {
+      { maru_bfifo_add_reader(fifo, false), false },
+      { maru_bfifo_add_reader(fifo, false), false },
+      { maru_bfifo_add_reader(fifo, true), true },
+   };
+
+   pthread_t writer, reader[3];
+   for (unsigned i = 0; i < 3; i++)
+      assert(pthread_create(&reader[i], NULL, reader_thread, &readers[i]) == 0);
+   assert(pthread_create(&writer, NULL, writer_thread, fifo) == 0);
+
+   pthread_join(writer, NULL);
+   for (unsigned i = 0; i < 3; i++)
+   {
+      if (readers[i].slow)
+         maru_fifo_kill_notification(readers[i].fifo);
+
+      void *gaps;
+      pthread_join(reader[i], &gaps);
+      if (i < 2)
+         assert(gaps == NULL && maru_fifo_dropped(readers[i].fifo) == 0);
+      else
+      {
+         assert(gaps != NULL && maru_fifo_dropped(readers[i].fifo) > 0);
+         fprintf(stderr, "Lagging reader dropped %llu bytes in %zu gaps.\n",
+               (unsigned long long)maru_fifo_dropped(readers[i].fifo), (size_t)(uintptr_t)gaps);
+      }
+   }
+
+   // Readers keep the buffer alive.
+   maru_bfifo_free(fifo);
+   for (unsigned i = 0; i < 3; i++)
+      maru_fifo_free(readers[i].fifo);
+}
+
+int main(void)
+{
+   maru_bfifo *fifo = maru_bfifo_new(1024);
+   assert(fifo);
+   assert(maru_bfifo_size(fifo) == 1024);
+   assert(maru_bfifo_set_write_trigger(fifo, 256) == LIBMARU_SUCCESS);
+
+   // Without readers, the writer is never held back.
+   write_bytes(fifo, 1000);
+   assert(maru_bfifo_write_avail(fifo) == 1023);
+
+   maru_fifo *fast = maru_bfifo_add_reader(fifo, false);
+   maru_fifo *slow = maru_bfifo_add_reader(fifo, false);
+   maru_fifo *lagging = maru_bfifo_add_reader(fifo, true);
+   assert(fast && slow && lagging);
+   uint8_t next_fast = next_write, next_slow = next_write, next_lagging = next_write;
+
+   // Readers are read-only views into the shared buffer.
+   assert(maru_fifo_write(fast, "x", 1) < 0);
+   assert(maru_fifo_resize(fast, 2048) == LIBMARU_ERROR_INVALID);
+   assert(maru_fifo_read_avail(fast) == 0);
+
+   for (unsigned round = 0; round < 32; round++)
+   {
+      write_bytes(fifo, 300 + round);
+      read_bytes(fast, 300 + round, &next_fast);
+
+      // The writer is bounded by the slowest reader which does not drop.
+      assert(maru_bfifo_write_avail(fifo) == 1023 - maru_fifo_read_avail(slow));
+      read_bytes(slow, 300 + round, &next_slow);
+      read_bytes(lagging, 300 + round, &next_lagging);
+      assert(maru_bfifo_write_avail(fifo) == 1023);
+   }
+
+   // Lagging reader holds a region, as an in-flight transfer, and stops reading.
+   uint64_t dropped = maru_fifo_dropped(lagging);
+   write_bytes(fifo, 200);
+   struct maru_fifo_locked_region inflight;
+   assert(maru_fifo_read_lock(lagging, 100, &inflight) == LIBMARU_SUCCESS);
+
+   for (unsigned round = 0; round < 8; round++)
+   {
+      write_bytes(fifo, 100);
+      read_bytes(fast, round ? 100 : 300, &next_fast);
+      read_bytes(slow, round ? 100 : 300, &next_slow);
+   }
+
+   // 1000 bytes buffered for lagging reader, and the writer is below its trigger.
+   // The reader is told to drop its unread data, and does so next time it looks.
+   assert(maru_bfifo_write_avail(fifo) == 23);
+   assert(maru_fifo_dropped(lagging) == dropped);
+   assert(maru_fifo_read_avail(lagging) == 0);
+   assert(maru_fifo_dropped(lagging) == dropped + 900);
+
+   // The held region keeps holding back the writer.
+   assert(maru_bfifo_write_avail(fifo) == 23);
+
+   // Once released, the dropped data goes with it, and the reader picks up at the writer.
+   check_region(&inflight, &next_lagging);
+   assert(maru_fifo_read_unlock(lagging, &inflight) == LIBMARU_SUCCESS);
+   assert(maru_bfifo_write_avail(fifo) == 1023);
+   next_lagging = next_write;
+
+   write_bytes(fifo, 500);
+   read_bytes(fast, 500, &next_fast);
+   read_bytes(slow, 500, &next_slow);
+   read_bytes(lagging, 500, &next_lagging);
+
+   // Readers which do not drop hold the writer back entirely.
+   write_bytes(fifo, 1023);
+   assert(maru_bfifo_write_avail(fifo) == 0);
+   maru_fifo_flush(slow);
+   next_slow = next_write;
+   assert(maru_bfifo_write_avail(fifo) == 0);
+
+   // Once they have read, the lagging reader alone is in the way, and gives up its data.
+   read_bytes(fast, 1023, &next_fast);
+   assert(maru_bfifo_write_avail(fifo) == 0);
+   struct pollfd fds = { .fd = maru_fifo_read_notify_fd(lagging), .events = POLLIN };
+   assert(poll(&fds, 1, 0) == 1);
+   assert(maru_fifo_read_notify_ack(lagging) == LIBMARU_SUCCESS);
+   assert(poll(&fds, 1, 0) == 0);
+   assert(maru_bfifo_write_avail(fifo) == 1023);
+   assert(maru_fifo_dropped(lagging) == dropped + 900 + 1023);
+   maru_fifo_free(lagging);
+
+   // A reader going away releases the writer as well.
+   write_bytes(fifo, 100);
+   assert(maru_bfifo_write_avail(fifo) == 923);
+   maru_fifo *extra = maru_bfifo_add_reader(fifo, false);
+   assert(maru_fifo_read_avail(extra) == 0);
+   read_bytes(fast, 100, &next_fast);
+   maru_fifo_flush(slow);
+   next_slow = next_write;
+   assert(maru_bfifo_write_avail(fifo) == 1023);
+   write_bytes(fifo, 1023);
+   assert(maru_bfifo_write_avail(fifo) == 0);
+   read_bytes(fast, 1023, &next_fast);
+   maru_fifo_flush(slow);
+   next_slow = next_write;
+   maru_fifo_free(extra);
+   assert(maru_bfifo_write_avail(fifo) == 1023);
+
+   // Readers outlive the writer.
+   write_bytes(fifo, 64);
+   maru_bfifo_free(fifo);
+   read_bytes(fast, 64, &next_fast);
+   read_bytes(slow, 64, &next_slow);
+   maru_fifo_free(fast);
+   maru_fifo_free(slow);
+
+   test_threaded();
+
+   fprintf(stderr, "Broadcast fifo OK.\n");
+   return 0;
+}
@@ -0,0 +1,151 @@
+// Exercises the C++ wrapper in libmaru.hpp that does not need a USB audio device:
+// compile time conversions, conversion kernels and span access to locked fifo regions.
+
+#include <libmaru.hpp>
+#include <assert.h>
+#include <stdio.h>
+
+static_assert(maru::frame_bytes<int16_t, 2> == 4, "Stereo S16 frame is 4 bytes.");
+static_assert(maru::stereo32::frame_size == 8, "Stereo S32 frame is 8 bytes.");
+static_assert(maru::stereo16::bits == 16, "S16 stream is 16 bits.");
+static_assert(sizeof(maru::stereo16::frame_type) == maru::stereo16::frame_size, "Frames are packed.");
+
+static_assert(maru::from_float<int16_t>(0.0f) == 0, "");
+static_assert(maru::from_float<int16_t>(0.5f) == 16384, "");
+static_assert(maru::from_float<int16_t>(1.0f) == 32767, "Positive full scale clips.");
+static_assert(maru::from_float<int16_t>(-2.0f) == -32768, "Negative overflow clips.");
+static_assert(maru::to_float<int16_t>(-16384) == -0.5f, "");
+
+static_assert(maru::stereo24::frame_size == 6, "Stereo S24 frame is 6 packed bytes.");
+static_assert(static_cast<int32_t>(maru::int24(-5)) == -5, "");
+static_assert(static_cast<int32_t>(maru::from_float<maru::int24>(1.0f)) == 8388607, "Positive full scale clips.");
+static_assert(static_cast<int32_t>(maru::from_float<maru::int24>(-0.5f)) == -4194304, "");
+static_assert(maru::from_float<int32_t>(1.0f) == 2147483647, "Positive full scale clips.");
+static_assert(maru::from_float<int32_t>(-1.0f) == -2147483647 - 1, "Negative full scale is exact.");
+static_assert(maru::from_float<int32_t>(0.99999994f) == 2147483520, "Largest float below 1.0 is in range.");
+static_assert(static_cast<int32_t>(maru::from_float<maru::int24>(-1.0f)) == -8388608, "Negative full scale is exact.");
+static_assert(maru::from_float<int16_t>(-1.0f) == -32768, "Negative full scale is exact.");
+
+static_assert(maru::volume_from_db(-6.0) == -1536, "");
+static_assert(maru::volume_from_db(1000.0) == 32767, "");
+static_assert(maru::volume_to_db(-1536) == -6.0, "");
+
+static_assert(maru::usec_to_bytes<int16_t, 2>(1000, 48000) == 48 * 4, "");
+static_assert(maru::bytes_to_usec<int16_t, 2>(48 * 4, 48000) == 1000, "");
+
+static const float test_values[] = {
+   0.0f, 0.5f, -0.5f, 1.0f, -1.0f, 2.0f, -2.0f, 0.999999f, -0.999999f, 1e-6f, -1e-6f, 0.123456f, -0.7654321f,
+};
+
+// Kernels must agree with the scalar conversion.
+template<typename Sample>
+static void test_kernel()
+{
+   const size_t num = sizeof(test_values) / sizeof(test_values[0]);
+   Sample out[num];
+   maru::convert_from_float(out, test_values, num);
+
+   for (size_t i = 0; i < num; i++)
+   {
+      assert(static_cast<int32_t>(out[i]) ==
+            static_cast<int32_t>(maru::from_float<Sample>(test_values[i])));
+   }
+}
+
+// Writes packed 24-bit samples through the wrap point, where samples straddle it.
+static void test_write_float()
+{
+   maru::fifo fifo(1024);
+   float in[100];
+   int32_t next = 0;
+
+   for (unsigned round = 0; round < 64; round++)
+   {
+      const size_t count = 50 + round % 50;
+      for (size_t i = 0; i < count; i++)
+         in[i] = static_cast<float>((next + static_cast<int32_t>(i)) % 1000 - 500) / 1000.0f;
+
+      assert(fifo.write_float<maru::int24>(maru::span<const float>(in, count)) == count);
+      assert(fifo.read_avail() == count * 3);
+
+      maru::int24 out[100];
+      assert(fifo.read(maru::span<maru::int24>(out, count)) == count);
+      for (size_t i = 0; i < count; i++)
+         assert(static_cast<int32_t>(out[i]) == static_cast<int32_t>(maru::from_float<maru::int24>(in[i])));
+
+      next += count;
+   }
+
+   // Only whole samples are written when room runs out.
+   std::vector<float> big(1024, 0.25f);
+   assert(fifo.write_float<int16_t>(maru::span<const float>(big.data(), big.size())) == 1023 / 2);
+}
+
+int main()
+{
+   test_kernel<int16_t>();
+   test_kernel<maru::int24>();
+   test_kernel<int32_t>();
+   test_write_float();
+
+   maru::fifo fifo(4096);
+   const size_t samples = (fifo.write_avail() + 1) / sizeof(int16_t);
+
+   // Walk the write position around the buffer so regions wrap.
+   for (unsigned round = 0; round < 64; round++)
+   {
+      const size_t count = 300 + round * 7;
+      {
+         auto region = fifo.write_lock<int16_t>(count);
+         assert(region.size() == count);
+
+         int16_t val = round;
+         for (auto &s : region.first())
+            s = val++;
+         for (auto &s : region.second())
+            s = val++;
+      }
+
+      assert(fifo.read_avail() == count * sizeof(int16_t));
+
+      {
+         auto region = fifo.read_lock<int16_t>(count);
+         int16_t val = round;
+         for (auto s : region.first())
+            assert(s == val++);
+         for (auto s : region.second())
+            assert(s == val++);
+      }
+
+      assert(fifo.read_avail() == 0);
+   }
+
+   // Locking more than is available throws.
+   bool thrown = false;
+   try
+   {
+      auto region = fifo.write_lock<int16_t>(samples);
+   }
+   catch (const maru::error &err)
+   {
+      thrown = true;
+      fprintf(stderr, "Expected error: %s\n", err.what());
+   }
+   assert(thrown);
+
+   std::vector<maru::frame<int16_t, 2>> frames(128);
+   for (size_t i = 0; i < frames.size(); i++)
+      frames[i] = {{ maru::from_float<int16_t>(0.25f), static_cast<int16_t>(i) }};
+
+   assert(fifo.write(maru::span<const maru::frame<int16_t, 2>>(frames)) == frames.size());
+
+   std::vector<maru::frame<int16_t, 2>> out(frames.size());
+   assert(fifo.read(maru::span<maru::frame<int16_t, 2>>(out)) == out.size());
+   assert(out == frames);
+
+   maru::fifo moved = std::move(fifo);
+   assert(moved.get() && !fifo.get());
+
+   fprintf(stderr, "C++ wrapper OK.\n");
+   return 0;
+}
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 int main(void)
 {
@@ -24,6 +25,16 @@ int main(void)
       assert(maru_create_context_from_vid_pid(&ctx, list[0].vendor_id,
                list[0].product_id, &(const struct maru_stream_desc) { .channels = 2, .bits = 16 }) == LIBMARU_SUCCESS);
 
+      // Record USB traffic for test/usb_replay.
+      int log_fd = -1;
+      const char *log_path = getenv("MARU_USB_LOG");
+      if (log_path)
+      {
+         log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         assert(log_fd >= 0);
+         assert(maru_set_usb_log(ctx, log_fd) == LIBMARU_SUCCESS);
+      }
+
       maru_error err = maru_stream_set_volume(ctx, LIBMARU_STREAM_MASTER, -20 * 256, 5000000);
       MARU_LOG_ERROR(err);
 
@@ -83,6 +94,13 @@ int main(void)
 
       assert(maru_stream_close(ctx, stream) == LIBMARU_SUCCESS);
       free(desc);
+
+      if (log_fd >= 0)
+      {
+         assert(maru_set_usb_log(ctx, -1) == LIBMARU_SUCCESS);
+         close(log_fd);
+      }
+
       maru_destroy_context(ctx);
    }
 
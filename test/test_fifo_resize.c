@@ -0,0 +1,113 @@
+// Resizes a fifo while the reader holds regions in it, as the libmaru thread does
+// with transfers in flight, and checks that the byte stream stays intact.
+
+#include <fifo.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+static uint8_t next_write;
+static uint8_t next_read;
+
+static void write_bytes(maru_fifo *fifo, size_t size)
+{
+   uint8_t buf[4096];
+   assert(size <= sizeof(buf));
+   for (size_t i = 0; i < size; i++)
+      buf[i] = next_write++;
+
+   assert(maru_fifo_write(fifo, buf, size) == (ssize_t)size);
+}
+
+static void check_region(const struct maru_fifo_locked_region *region)
+{
+   const uint8_t *first = region->first;
+   const uint8_t *second = region->second;
+   for (size_t i = 0; i < region->first_size; i++)
+      assert(first[i] == next_read++);
+   for (size_t i = 0; i < region->second_size; i++)
+      assert(second[i] == next_read++);
+}
+
+int main(void)
+{
+   maru_fifo *fifo = maru_fifo_new(1024);
+   assert(fifo);
+   assert(maru_fifo_set_read_trigger(fifo, 256) == LIBMARU_SUCCESS);
+   assert(maru_fifo_set_write_trigger(fifo, 256) == LIBMARU_SUCCESS);
+
+   for (unsigned round = 0; round < 32; round++)
+   {
+      // Move positions around so regions wrap.
+      write_bytes(fifo, 300 + round);
+
+      struct maru_fifo_locked_region inflight[2];
+      assert(maru_fifo_read_lock(fifo, 100, &inflight[0]) == LIBMARU_SUCCESS);
+      assert(maru_fifo_read_lock(fifo, 100, &inflight[1]) == LIBMARU_SUCCESS);
+
+      size_t buffered = maru_fifo_read_avail(fifo);
+
+      // Peeking starts after locked regions, and leaves data in place.
+      uint8_t peek[64];
+      assert(maru_fifo_peek(fifo, peek, sizeof(peek)) == sizeof(peek));
+      for (size_t i = 0; i < sizeof(peek); i++)
+         assert(peek[i] == (uint8_t)(next_read + 200 + i));
+      assert(maru_fifo_read_avail(fifo) == buffered);
+
+      // Grow, then shrink back, while both regions are held.
+      assert(maru_fifo_resize(fifo, 4096) == LIBMARU_SUCCESS);
+      assert(maru_fifo_read_avail(fifo) == buffered);
+      assert(maru_fifo_write_avail(fifo) == 4095 - buffered);
+
+      // Only one generation of locked regions is kept.
+      assert(maru_fifo_resize(fifo, 1024) == LIBMARU_ERROR_BUSY);
+
+      // Regions in old buffer still hold their data, and unlock in order.
+      check_region(&inflight[0]);
+      assert(maru_fifo_read_unlock(fifo, &inflight[0]) == LIBMARU_SUCCESS);
+      check_region(&inflight[1]);
+      assert(maru_fifo_read_unlock(fifo, &inflight[1]) == LIBMARU_SUCCESS);
+
+      write_bytes(fifo, 2048);
+      buffered += 2048;
+
+      struct maru_fifo_locked_region region;
+      assert(maru_fifo_read_lock(fifo, 64, &region) == LIBMARU_SUCCESS);
+      buffered -= 64;
+
+      // Shrinking keeps the oldest data, and drops what does not fit.
+      assert(maru_fifo_resize(fifo, 1024) == LIBMARU_SUCCESS);
+      size_t kept = maru_fifo_read_avail(fifo);
+      assert(kept == 1023);
+      next_write -= buffered - kept;
+
+      check_region(&region);
+      assert(maru_fifo_read_unlock(fifo, &region) == LIBMARU_SUCCESS);
+
+      uint8_t buf[1024];
+      assert(maru_fifo_read(fifo, buf, kept) == (ssize_t)kept);
+      for (size_t i = 0; i < kept; i++)
+         assert(buf[i] == next_read++);
+
+      assert(maru_fifo_read_avail(fifo) == 0);
+   }
+
+   // A held region may be larger than the new buffer.
+   write_bytes(fifo, 700);
+   struct maru_fifo_locked_region region;
+   assert(maru_fifo_read_lock(fifo, 600, &region) == LIBMARU_SUCCESS);
+   assert(maru_fifo_resize(fifo, 512) == LIBMARU_SUCCESS);
+   assert(maru_fifo_read_avail(fifo) == 100);
+   check_region(&region);
+   assert(maru_fifo_read_unlock(fifo, &region) == LIBMARU_SUCCESS);
+
+   uint8_t buf[100];
+   assert(maru_fifo_read(fifo, buf, 100) == 100);
+   for (size_t i = 0; i < 100; i++)
+      assert(buf[i] == next_read++);
+
+   maru_fifo_free(fifo);
+   fprintf(stderr, "Fifo resize OK.\n");
+   return 0;
+}
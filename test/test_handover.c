@@ -0,0 +1,306 @@
+// Hands a context playing on the simulated device (sim_usb.h) over a socketpair,
+// from a thread to the main thread, which stand in for two processes.
+// Checks that a refused handover leaves the sender streaming,
+// that a handover failing after the sender drained resumes feedback and refilling,
+// and that a handover which goes through continues the stream on the receiver,
+// with no buffered data lost, no overlapping transfers, and at most a fragment of silence.
+
+#define _GNU_SOURCE
+#include "sim_stream.h"
+#include <libmaru.h>
+#include <fifo.h>
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define RATE 48000
+#define FRAGMENT 1024
+#define BUFFER (32 * FRAGMENT)
+#define CAPTURE_SIZE (1 << 22)
+// USB frames a fragment takes to play.
+#define FRAGMENT_FRAMES (FRAGMENT / 4 * 1000 / RATE)
+
+static const char app_state[] = "handover test";
+
+static maru_fifo *g_submitted;
+static size_t g_captured;
+
+static void capture_cb(unsigned stream, const void *data, size_t size, void *userdata)
+{
+   (void)userdata;
+   if (stream != 0)
+      return;
+
+   assert(maru_fifo_write(g_submitted, data, size) == (ssize_t)size);
+   __atomic_add_fetch(&g_captured, size, __ATOMIC_RELAXED);
+}
+
+static size_t captured(void)
+{
+   return __atomic_load_n(&g_captured, __ATOMIC_RELAXED);
+}
+
+static uint16_t next_sample = 1;
+static size_t g_written;
+
+// Counting samples, never zero, so padding libmaru inserts can be told apart.
+static void write_pattern(maru_context *ctx, size_t size)
+{
+   uint16_t buf[FRAGMENT / sizeof(uint16_t)];
+   for (size_t written = 0; written < size; written += sizeof(buf))
+   {
+      for (unsigned i = 0; i < FRAGMENT / sizeof(uint16_t); i++)
+      {
+         buf[i] = next_sample++;
+         if (!next_sample)
+            next_sample++;
+      }
+
+      assert(maru_stream_write(ctx, 0, buf, sizeof(buf)) == sizeof(buf));
+      g_written += sizeof(buf);
+   }
+}
+
+// Less than a transfer may be held back until more is written.
+static void wait_submitted(void)
+{
+   for (unsigned i = 0; i < 2000 && captured() + FRAGMENT < g_written; i++)
+      usleep(1000);
+   assert(captured() + FRAGMENT >= g_written);
+}
+
+// Stream keeps being refilled and feedback keeps being taken, without writing anything.
+static void check_streaming(void)
+{
+   struct sim_usb_stats stats;
+   sim_usb_reset_stats();
+   size_t before = captured();
+
+   usleep(50000);
+
+   sim_usb_get_stats(0, &stats);
+   assert(captured() > before);
+   assert(stats.feedback > 0);
+   assert(stats.overlaps == 0);
+}
+
+struct sender
+{
+   pthread_t thread;
+   maru_context *ctx;
+   int sock;
+   maru_error err;
+};
+
+static void *sender_entry(void *data)
+{
+   struct sender *sender = data;
+
+   int fd = eventfd(42, EFD_CLOEXEC);
+   assert(fd >= 0);
+
+   sender->err = maru_handover_context(sender->ctx, sender->sock,
+         app_state, sizeof(app_state), &fd, 1, 1000000);
+
+   close(fd);
+   close(sender->sock);
+   return NULL;
+}
+
+static int start_sender(struct sender *sender, maru_context *ctx)
+{
+   int sv[2];
+   assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0);
+
+   sender->ctx = ctx;
+   sender->sock = sv[0];
+   assert(pthread_create(&sender->thread, NULL, sender_entry, sender) == 0);
+   return sv[1];
+}
+
+static maru_error join_sender(struct sender *sender)
+{
+   pthread_join(sender->thread, NULL);
+   return sender->err;
+}
+
+static bool refuse_cb(const void *data, size_t size, unsigned num_fds, void *userdata)
+{
+   (void)data;
+   (void)size;
+   (void)num_fds;
+   (void)userdata;
+   return false;
+}
+
+// Takes its time, like a receiver setting up would, so the sender plays on meanwhile.
+static bool accept_cb(const void *data, size_t size, unsigned num_fds, void *userdata)
+{
+   (void)userdata;
+   usleep(50000);
+   return size == sizeof(app_state) && memcmp(data, app_state, size) == 0 && num_fds == 1;
+}
+
+static maru_error receive(int sock, maru_handover_validate_cb validate, maru_context **ctx)
+{
+   char state[64];
+   size_t size = sizeof(state);
+   int fds[1];
+   unsigned num_fds = 1;
+
+   maru_error err = maru_create_context_from_handover(ctx, sock,
+         state, &size, fds, &num_fds, validate, NULL);
+   close(sock);
+
+   if (err == LIBMARU_SUCCESS)
+   {
+      assert(size == sizeof(app_state) && num_fds == 1);
+
+      eventfd_t val;
+      assert(eventfd_read(fds[0], &val) == 0 && val == 42);
+      close(fds[0]);
+   }
+
+   return err;
+}
+
+// Takes everything the sender sends without knowing its format, closing descriptors passed along,
+// and claims to be ready. It can no longer be sent to by then, so the handover fails after draining.
+static void fake_receiver(int sock)
+{
+   struct pollfd fds = { .fd = sock, .events = POLLIN };
+   while (poll(&fds, 1, 100) > 0)
+   {
+      char buf[4096];
+      union
+      {
+         struct cmsghdr hdr;
+         char buf[CMSG_SPACE(64 * sizeof(int))];
+      } control;
+
+      struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+      struct msghdr msg = {
+         .msg_iov = &iov,
+         .msg_iovlen = 1,
+         .msg_control = control.buf,
+         .msg_controllen = sizeof(control.buf),
+      };
+
+      assert(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) > 0);
+
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+      {
+         if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+         const int *fd = (const int*)CMSG_DATA(cmsg);
+         for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++)
+            close(fd[i]);
+      }
+   }
+
+   uint8_t ready = 1;
+   assert(shutdown(sock, SHUT_RD) == 0);
+   assert(write(sock, &ready, sizeof(ready)) == sizeof(ready));
+}
+
+// Everything written was submitted once and in order, by either context.
+static void check_pattern(void)
+{
+   uint16_t expected = 1;
+   size_t payload = 0;
+
+   while (maru_fifo_read_avail(g_submitted))
+   {
+      uint16_t sample;
+      assert(maru_fifo_read(g_submitted, &sample, sizeof(sample)) == sizeof(sample));
+      if (!sample)
+         continue;
+
+      assert(sample == expected);
+      if (!++expected)
+         expected++;
+      payload += sizeof(sample);
+   }
+
+   assert(payload + FRAGMENT >= g_written);
+}
+
+int main(void)
+{
+   sim_usb_configure(true);
+
+   g_submitted = maru_fifo_new(CAPTURE_SIZE);
+   assert(g_submitted);
+   sim_usb_set_capture(capture_cb, NULL);
+
+   maru_context *ctx = sim_stream_context();
+   assert(ctx);
+   assert(sim_stream_open(ctx, 0, RATE, BUFFER, FRAGMENT));
+
+   struct sender sender;
+   struct sim_usb_stats stats;
+   maru_context *rx = NULL;
+
+   // Receiver refuses, and the sender never stops streaming.
+   write_pattern(ctx, BUFFER);
+   sim_usb_reset_stats();
+   int sock = start_sender(&sender, ctx);
+   assert(receive(sock, refuse_cb, &rx) == LIBMARU_ERROR_INVALID);
+   assert(join_sender(&sender) == LIBMARU_ERROR_IO);
+
+   sim_usb_get_stats(0, &stats);
+   assert(stats.underruns == 0);
+   check_streaming();
+
+   // Receiver goes away once the sender has drained, so the sender resumes.
+   write_pattern(ctx, BUFFER);
+   sock = start_sender(&sender, ctx);
+   fake_receiver(sock);
+   assert(join_sender(&sender) == LIBMARU_ERROR_IO);
+   close(sock);
+   check_streaming();
+
+   // Handover goes through.
+   write_pattern(ctx, BUFFER);
+   struct maru_stream_status status;
+   maru_stream_get_status(ctx, 0, &status);
+
+   sim_usb_reset_stats();
+   sock = start_sender(&sender, ctx);
+   assert(receive(sock, accept_cb, &rx) == LIBMARU_SUCCESS);
+   assert(join_sender(&sender) == LIBMARU_SUCCESS);
+   maru_destroy_context(ctx);
+
+   sim_usb_get_stats(0, &stats);
+   assert(stats.overlaps == 0);
+   assert(stats.dry_max <= FRAGMENT_FRAMES);
+   uint64_t gap = stats.dry_max;
+
+   struct maru_stream_status rx_status;
+   maru_stream_get_status(rx, 0, &rx_status);
+   assert(rx_status.bytes_played >= status.bytes_played);
+
+   check_streaming();
+
+   write_pattern(rx, BUFFER);
+   wait_submitted();
+
+   maru_stream_close(rx, 0);
+   maru_destroy_context(rx);
+   sim_usb_set_capture(NULL, NULL);
+
+   check_pattern();
+   maru_fifo_free(g_submitted);
+
+   fprintf(stderr, "Handed over %zu bytes in order, %llu ms without audio.\n",
+         g_written, (unsigned long long)gap);
+   return 0;
+}
@@ -0,0 +1,92 @@
+// Maps the position page of a stream on the simulated device (sim_usb.h),
+// checks that it follows playback, and that reopening the memfd
+// read-write does not give a way to write to or resize it.
+
+#define _GNU_SOURCE
+#include "sim_stream.h"
+#include <libmaru.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define RATE 48000
+#define FRAGMENT 1024
+
+int main(void)
+{
+   sim_usb_configure(false);
+
+   maru_context *ctx = sim_stream_context();
+   assert(ctx);
+   assert(sim_stream_open(ctx, 0, RATE, 8 * FRAGMENT, FRAGMENT));
+
+   int fd = maru_stream_position_fd(ctx, 0);
+   assert(fd >= 0);
+
+   const struct maru_position *page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+   assert(page != MAP_FAILED);
+
+   struct maru_position pos;
+   maru_read_position(page, &pos);
+   assert(pos.sample_rate == RATE);
+   assert(pos.frame_size == 4);
+
+   // An eighth of a second of audio.
+   uint8_t buf[FRAGMENT] = {0};
+   for (unsigned i = 0; i < RATE / 8 * 4 / FRAGMENT; i++)
+      assert(maru_stream_write(ctx, 0, buf, sizeof(buf)) == sizeof(buf));
+
+   for (unsigned i = 0; i < 2000; i++)
+   {
+      maru_read_position(page, &pos);
+      if (pos.bytes_played)
+         break;
+      usleep(1000);
+   }
+   assert(pos.bytes_played > 0);
+   assert(pos.bytes_played % pos.frame_size == 0);
+
+   // Descriptor handed out is read-only.
+   assert(mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) == MAP_FAILED);
+
+   // Reopening it read-write through /proc does not get around that.
+   char path[64];
+   snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+   int rw = open(path, O_RDWR | O_CLOEXEC);
+   assert(rw >= 0);
+   assert(mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, rw, 0) == MAP_FAILED);
+   assert(pwrite(rw, buf, sizeof(uint32_t), 0) < 0);
+   assert(ftruncate(rw, 0) < 0);
+   assert(ftruncate(rw, 1 << 20) < 0);
+   close(rw);
+
+   int seals = fcntl(fd, F_GET_SEALS);
+   assert(seals >= 0 && (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) == (F_SEAL_SHRINK | F_SEAL_GROW));
+
+   // Page is still updated through the mapping of libmaru.
+   uint64_t played = pos.bytes_played;
+   for (unsigned i = 0; i < RATE / 8 * 4 / FRAGMENT; i++)
+      assert(maru_stream_write(ctx, 0, buf, sizeof(buf)) == sizeof(buf));
+
+   for (unsigned i = 0; i < 2000; i++)
+   {
+      maru_read_position(page, &pos);
+      if (pos.bytes_played > played)
+         break;
+      usleep(1000);
+   }
+   assert(pos.bytes_played > played);
+
+   munmap((void*)page, sizeof(*page));
+   close(fd);
+   maru_stream_close(ctx, 0);
+   maru_destroy_context(ctx);
+
+   fprintf(stderr, "Position page is sealed, %llu bytes played.\n",
+         (unsigned long long)pos.bytes_played);
+   return 0;
+}
@@ -0,0 +1,131 @@
+// Taps a stream on the simulated device (sim_usb.h), and checks that
+// the tap holds exactly what was submitted to the device,
+// and that nothing more is tapped once the tap is cleared.
+
+#include "sim_stream.h"
+#include <libmaru.h>
+#include <fifo.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RATE 48000
+#define FRAGMENT 1024
+#define TAP_SIZE (1 << 20)
+
+static maru_fifo *g_submitted;
+
+static void capture_cb(unsigned stream, const void *data, size_t size, void *userdata)
+{
+   (void)userdata;
+   if (stream == 0)
+      assert(maru_fifo_write(g_submitted, data, size) == (ssize_t)size);
+}
+
+static uint16_t next_sample = 1;
+
+// Counting samples, never zero, so padding libmaru inserts can be told apart.
+static void write_pattern(maru_context *ctx, size_t size)
+{
+   uint16_t buf[FRAGMENT / sizeof(uint16_t)];
+   for (size_t written = 0; written < size; written += sizeof(buf))
+   {
+      for (unsigned i = 0; i < FRAGMENT / sizeof(uint16_t); i++)
+      {
+         buf[i] = next_sample++;
+         if (!next_sample)
+            next_sample++;
+      }
+
+      assert(maru_stream_write(ctx, 0, buf, sizeof(buf)) == sizeof(buf));
+   }
+}
+
+// Less than a transfer may be held back until more is written.
+static void wait_submitted(size_t size)
+{
+   size -= FRAGMENT;
+   for (unsigned i = 0; i < 2000 && maru_fifo_read_avail(g_submitted) < size; i++)
+      usleep(1000);
+   assert(maru_fifo_read_avail(g_submitted) >= size);
+}
+
+int main(void)
+{
+   sim_usb_configure(false);
+
+   g_submitted = maru_fifo_new(TAP_SIZE);
+   maru_fifo *tap = maru_fifo_new(TAP_SIZE);
+   assert(g_submitted && tap);
+   sim_usb_set_capture(capture_cb, NULL);
+
+   maru_context *ctx = sim_stream_context();
+   assert(ctx);
+   assert(sim_stream_open(ctx, 0, RATE, 8 * FRAGMENT, FRAGMENT));
+   assert(maru_stream_set_tap(ctx, 0, tap) == LIBMARU_SUCCESS);
+
+   // A quarter of a second of audio.
+   size_t total = RATE / 4 * 4 / FRAGMENT * FRAGMENT;
+   write_pattern(ctx, total);
+   wait_submitted(total);
+
+   // Once cleared, the thread no longer touches the tap,
+   // so everything tapped is there, and was submitted before the submissions read below.
+   assert(maru_stream_set_tap(ctx, 0, NULL) == LIBMARU_SUCCESS);
+   size_t tapped = maru_fifo_read_avail(tap);
+   assert(tapped > 0);
+
+   uint64_t frame = 0;
+   uint16_t expected = 1;
+   size_t payload = 0;
+
+   while (maru_fifo_read_avail(tap))
+   {
+      struct maru_tap_header header;
+      assert(maru_fifo_read(tap, &header, sizeof(header)) == sizeof(header));
+      assert(header.dropped == 0);
+      assert(header.size > 0 && header.size % 4 == 0);
+      assert(header.frame >= frame);
+      frame = header.frame + 1;
+
+      uint8_t block[header.size], submitted[header.size];
+      assert(maru_fifo_read(tap, block, header.size) == header.size);
+      assert(maru_fifo_read(g_submitted, submitted, header.size) == header.size);
+
+      // Tapped block is exactly the data of the transfer.
+      assert(memcmp(block, submitted, header.size) == 0);
+      payload += header.size;
+
+      // And holds what was written, in order, besides padding.
+      const uint16_t *samples = (const uint16_t*)block;
+      for (size_t i = 0; i < header.size / sizeof(uint16_t); i++)
+      {
+         if (!samples[i])
+            continue;
+
+         assert(samples[i] == expected);
+         if (!++expected)
+            expected++;
+      }
+   }
+
+   assert(payload >= total - FRAGMENT);
+
+   // Stream keeps playing, but is no longer tapped.
+   write_pattern(ctx, total);
+   wait_submitted(total);
+   usleep(50000);
+   assert(maru_fifo_read_avail(tap) == 0);
+
+   maru_stream_close(ctx, 0);
+   maru_destroy_context(ctx);
+   sim_usb_set_capture(NULL, NULL);
+   maru_fifo_free(tap);
+   maru_fifo_free(g_submitted);
+
+   fprintf(stderr, "Tapped %zu bytes in order.\n", payload);
+   return 0;
+}
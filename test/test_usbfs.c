@@ -0,0 +1,230 @@
+// Drives the usbfs backend against a stand-in that emulates the usbfs ioctl protocol,
+// so it can be verified without a USB audio device.
+// Isochronous URBs are submitted straight from a fifo, as libmaru does.
+
+#include <fifo.h>
+#include <usbfs.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define MAX_URBS 16
+#define PACKETS 8
+#define PACKET_SIZE 256
+
+// Stand-in for a usbfs device node.
+static struct
+{
+   unsigned claimed;
+   unsigned altsetting;
+
+   // Submitted URBs, in order of submission.
+   struct usbdevfs_urb *urbs[MAX_URBS];
+   unsigned num_urbs;
+   // URBs discarded while in flight.
+   bool discarded[MAX_URBS];
+
+   unsigned submits;
+   unsigned reaps;
+} standin;
+
+static int standin_ioctl(int fd, unsigned long request, void *arg)
+{
+   (void)fd;
+
+   if (request == USBDEVFS_CLAIMINTERFACE)
+   {
+      standin.claimed |= 1u << *(unsigned int*)arg;
+      return 0;
+   }
+   else if (request == USBDEVFS_RELEASEINTERFACE)
+   {
+      standin.claimed &= ~(1u << *(unsigned int*)arg);
+      return 0;
+   }
+   else if (request == USBDEVFS_SETINTERFACE)
+   {
+      const struct usbdevfs_setinterface *setintf = arg;
+      if (!(standin.claimed & (1u << setintf->interface)))
+      {
+         errno = EINVAL;
+         return -1;
+      }
+
+      standin.altsetting = setintf->altsetting;
+      return 0;
+   }
+   else if (request == USBDEVFS_CONTROL)
+   {
+      struct usbdevfs_ctrltransfer *ctrl = arg;
+      // Echo back wValue in IN requests.
+      if (ctrl->bRequestType & 0x80)
+         memset(ctrl->data, ctrl->wValue, ctrl->wLength);
+      return ctrl->wLength;
+   }
+   else if (request == USBDEVFS_SUBMITURB)
+   {
+      struct usbdevfs_urb *urb = arg;
+      if (urb->type != USBDEVFS_URB_TYPE_ISO || standin.num_urbs >= MAX_URBS)
+      {
+         errno = EINVAL;
+         return -1;
+      }
+
+      int total = 0;
+      for (int i = 0; i < urb->number_of_packets; i++)
+         total += urb->iso_frame_desc[i].length;
+      if (total != urb->buffer_length)
+      {
+         errno = EINVAL;
+         return -1;
+      }
+
+      standin.discarded[standin.num_urbs] = false;
+      standin.urbs[standin.num_urbs++] = urb;
+      standin.submits++;
+      return 0;
+   }
+   else if (request == USBDEVFS_DISCARDURB)
+   {
+      for (unsigned i = 0; i < standin.num_urbs; i++)
+      {
+         if (standin.urbs[i] == arg)
+         {
+            standin.discarded[i] = true;
+            return 0;
+         }
+      }
+
+      errno = EINVAL;
+      return -1;
+   }
+   else if (request == USBDEVFS_REAPURBNDELAY)
+   {
+      if (!standin.num_urbs)
+      {
+         errno = EAGAIN;
+         return -1;
+      }
+
+      // Oldest URB completes first, as the device plays them in order.
+      struct usbdevfs_urb *urb = standin.urbs[0];
+      bool discarded = standin.discarded[0];
+      memmove(standin.urbs, standin.urbs + 1, --standin.num_urbs * sizeof(*standin.urbs));
+      memmove(standin.discarded, standin.discarded + 1, standin.num_urbs * sizeof(*standin.discarded));
+
+      urb->status = discarded ? -ECONNRESET : 0;
+      urb->actual_length = 0;
+      for (int i = 0; i < urb->number_of_packets; i++)
+      {
+         urb->iso_frame_desc[i].actual_length = discarded ? 0 : urb->iso_frame_desc[i].length;
+         urb->actual_length += urb->iso_frame_desc[i].actual_length;
+      }
+
+      *(struct usbdevfs_urb**)arg = urb;
+      standin.reaps++;
+      return 0;
+   }
+
+   errno = ENOTTY;
+   return -1;
+}
+
+int main(void)
+{
+   int fd = eventfd(0, 0);
+   assert(fd >= 0);
+
+   maru_usbfs *usbfs = maru_usbfs_new(fd, standin_ioctl);
+   assert(usbfs);
+
+   assert(maru_usbfs_claim_interface(usbfs, 1, 1));
+   assert(standin.claimed == (1u << 1) && standin.altsetting == 1);
+
+   uint8_t rate[3];
+   assert(maru_usbfs_control(usbfs, 0xa2, 0x81, 0x55, 0x01, rate, sizeof(rate), 1000) == sizeof(rate));
+   assert(rate[0] == 0x55 && rate[2] == 0x55);
+
+   maru_fifo *fifo = maru_fifo_new(MAX_URBS * PACKETS * PACKET_SIZE);
+   assert(fifo);
+
+   struct maru_usbfs_urb *urbs[4];
+   for (unsigned i = 0; i < 4; i++)
+   {
+      urbs[i] = maru_usbfs_urb_new(PACKETS);
+      assert(urbs[i]);
+   }
+
+   // Nothing to reap yet.
+   assert(maru_usbfs_reap(usbfs) == NULL);
+
+   unsigned packet_len[PACKETS + 1];
+   for (unsigned i = 0; i < PACKETS + 1; i++)
+      packet_len[i] = PACKET_SIZE;
+
+   // More packets than the URB was allocated for is refused.
+   assert(!maru_usbfs_submit_iso(usbfs, urbs[0], 0x01, NULL, packet_len, PACKETS + 1, NULL));
+
+   struct maru_fifo_locked_region regions[4];
+   uint8_t buf[PACKETS * PACKET_SIZE];
+
+   for (unsigned round = 0; round < 64; round++)
+   {
+      for (unsigned i = 0; i < 4; i++)
+      {
+         memset(buf, round + i, sizeof(buf));
+         assert(maru_fifo_write(fifo, buf, sizeof(buf)) == sizeof(buf));
+
+         assert(maru_fifo_read_lock(fifo, sizeof(buf), &regions[i]) == LIBMARU_SUCCESS);
+         // Fifo size is a multiple of transfer size, so regions never wrap.
+         assert(!regions[i].second);
+
+         assert(maru_usbfs_submit_iso(usbfs, urbs[i], 0x01, regions[i].first,
+                  packet_len, PACKETS, &regions[i]));
+         assert(urbs[i]->active);
+      }
+
+      // Last URB is cancelled before it is played.
+      maru_usbfs_discard(usbfs, urbs[3]);
+
+      for (unsigned i = 0; i < 4; i++)
+      {
+         struct maru_usbfs_urb *urb = maru_usbfs_reap(usbfs);
+         assert(urb == urbs[i]);
+         assert(!urb->active);
+         assert(urb->userdata == &regions[i]);
+
+         // URB points straight into fifo, no copy is made.
+         assert(urb->urb.buffer == regions[i].first);
+         assert(((uint8_t*)urb->urb.buffer)[0] == (uint8_t)(round + i));
+
+         if (i == 3)
+            assert(urb->urb.status == -ECONNRESET);
+         else
+         {
+            assert(urb->urb.status == 0);
+            assert(urb->urb.actual_length == PACKETS * PACKET_SIZE);
+         }
+
+         assert(maru_fifo_read_unlock(fifo, &regions[i]) == LIBMARU_SUCCESS);
+      }
+
+      assert(maru_usbfs_reap(usbfs) == NULL);
+   }
+
+   assert(standin.submits == 64 * 4 && standin.reaps == 64 * 4);
+
+   maru_usbfs_release_interface(usbfs, 1);
+   assert(standin.claimed == 0);
+
+   for (unsigned i = 0; i < 4; i++)
+      maru_usbfs_urb_free(urbs[i]);
+   maru_fifo_free(fifo);
+   maru_usbfs_free(usbfs);
+
+   fprintf(stderr, "usbfs backend OK.\n");
+   return 0;
+}
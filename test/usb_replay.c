@@ -0,0 +1,336 @@
+// Replays a USB log recorded with maru_set_usb_log().
+//
+// Packet sizes are recomputed with the scheduling logic of libmaru (schedule.h),
+// starting from recorded stream state and driven by recorded feedback,
+// and compared with what was actually submitted.
+// Completion latency, short packets, failed transfers and underruns are reported per stream.
+//
+// Usage: usb_replay [-b iterations] log
+// With -b, scheduling is replayed the given number of times and throughput is reported.
+// Exit status is non-zero if replayed scheduling differs from the log.
+
+#include <schedule.h>
+#include <usblog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define MAX_STREAMS 256
+#define PENDING_SIZE 1024
+
+struct stream_state
+{
+   bool active;
+
+   uint32_t speed;
+   uint32_t fraction;
+   unsigned mult;
+
+   uint64_t transfers;
+   uint64_t packets;
+   uint64_t bytes;
+   uint64_t mismatches;
+   uint64_t feedback;
+   uint64_t feedback_mismatches;
+
+   uint64_t completed;
+   uint64_t failed;
+   uint64_t short_packets;
+   uint64_t underruns;
+   uint64_t flushes;
+
+   unsigned in_flight;
+   uint64_t latency_min;
+   uint64_t latency_max;
+   uint64_t latency_total;
+
+   // Submit times of transfers in flight, indexed by id.
+   uint64_t pending[PENDING_SIZE];
+};
+
+struct replay
+{
+   struct stream_state streams[MAX_STREAMS];
+   uint64_t records;
+   uint64_t controls;
+   uint64_t failed_controls;
+   uint64_t end_time;
+};
+
+static uint8_t *load_file(const char *path, size_t *size)
+{
+   FILE *file = fopen(path, "rb");
+   if (!file)
+      return NULL;
+
+   fseek(file, 0, SEEK_END);
+   long len = ftell(file);
+   rewind(file);
+
+   uint8_t *data = malloc(len > 0 ? len : 1);
+   if (data && fread(data, 1, len, file) != (size_t)len)
+   {
+      free(data);
+      data = NULL;
+   }
+
+   fclose(file);
+   *size = len;
+   return data;
+}
+
+static void replay_submit(struct stream_state *stream, const struct maru_usblog_record *rec,
+      const struct maru_usblog_submit *submit)
+{
+   for (unsigned i = 0; i < submit->packets; i++)
+   {
+      size_t expected = maru_sched_packet_size(stream->speed, stream->fraction, stream->mult);
+      if (expected != submit->length[i])
+         stream->mismatches++;
+
+      stream->fraction = maru_sched_advance(stream->speed, stream->fraction);
+      stream->bytes += submit->length[i];
+   }
+
+   // Device ran dry if nothing was queued up when this transfer was submitted.
+   if (stream->transfers && !stream->in_flight)
+      stream->underruns++;
+
+   stream->transfers++;
+   stream->packets += submit->packets;
+   stream->in_flight++;
+   stream->pending[rec->id % PENDING_SIZE] = rec->time;
+}
+
+static void replay_complete(struct stream_state *stream, const struct maru_usblog_record *rec,
+      const struct maru_usblog_complete *complete)
+{
+   if (stream->in_flight)
+      stream->in_flight--;
+
+   // LIBUSB_TRANSFER_CANCELLED, stream was flushed or closed.
+   if (complete->status == 3)
+      return;
+
+   // LIBUSB_TRANSFER_COMPLETED
+   if (complete->status != 0)
+   {
+      stream->failed++;
+      return;
+   }
+
+   uint64_t latency = rec->time - stream->pending[rec->id % PENDING_SIZE];
+   if (!stream->completed || latency < stream->latency_min)
+      stream->latency_min = latency;
+   if (latency > stream->latency_max)
+      stream->latency_max = latency;
+   stream->latency_total += latency;
+
+   stream->completed++;
+   stream->short_packets += complete->short_packets;
+}
+
+static bool replay(struct replay *state, const uint8_t *data, size_t size)
+{
+   memset(state, 0, sizeof(*state));
+
+   const uint8_t *end = data + size;
+   data += sizeof(struct maru_usblog_header);
+
+   while (data + sizeof(struct maru_usblog_record) <= end)
+   {
+      const struct maru_usblog_record *rec = (const struct maru_usblog_record*)data;
+      const void *payload = rec + 1;
+      data += sizeof(*rec) + rec->size;
+      if (data > end)
+      {
+         fprintf(stderr, "Log is truncated.\n");
+         return false;
+      }
+
+      struct stream_state *stream = &state->streams[rec->stream];
+      state->records++;
+      state->end_time = rec->time;
+
+      switch (rec->type)
+      {
+         case MARU_USBLOG_STREAM:
+         {
+            const struct maru_usblog_stream *desc = payload;
+            stream->active   = true;
+            stream->speed    = desc->speed;
+            stream->fraction = desc->fraction;
+            stream->mult     = desc->mult;
+            break;
+         }
+
+         case MARU_USBLOG_SUBMIT:
+            replay_submit(stream, rec, payload);
+            break;
+
+         case MARU_USBLOG_COMPLETE:
+            replay_complete(stream, rec, payload);
+            break;
+
+         case MARU_USBLOG_FEEDBACK:
+         {
+            const struct maru_usblog_feedback *feedback = payload;
+            if (feedback->status == 0)
+            {
+               uint32_t speed = maru_sched_feedback_speed(feedback->raw);
+               if (speed != feedback->speed)
+                  stream->feedback_mismatches++;
+
+               stream->speed = stream->fraction = speed;
+               stream->feedback++;
+            }
+            break;
+         }
+
+         case MARU_USBLOG_CONTROL:
+         {
+            const struct maru_usblog_control *control = payload;
+            state->controls++;
+            if (control->status != 0)
+               state->failed_controls++;
+            break;
+         }
+
+         case MARU_USBLOG_FLUSH:
+            // Transfers were cancelled on purpose, so this is not an underrun.
+            stream->flushes++;
+            stream->transfers = 0;
+            stream->in_flight = 0;
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   return true;
+}
+
+static bool print_report(const struct replay *state)
+{
+   bool ok = true;
+
+   fprintf(stderr, "Records: %llu, duration: %.3f s\n",
+         (unsigned long long)state->records, state->end_time / 1000000.0);
+   fprintf(stderr, "Control transfers: %llu (%llu failed)\n",
+         (unsigned long long)state->controls, (unsigned long long)state->failed_controls);
+
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+   {
+      const struct stream_state *stream = &state->streams[i];
+      if (!stream->active)
+         continue;
+
+      fprintf(stderr, "Stream %u:\n", i);
+      fprintf(stderr, "\tTransfers: %llu, packets: %llu, bytes: %llu\n",
+            (unsigned long long)stream->completed + stream->failed,
+            (unsigned long long)stream->packets, (unsigned long long)stream->bytes);
+      fprintf(stderr, "\tScheduling mismatches: %llu packets, %llu feedback (%llu feedback reads)\n",
+            (unsigned long long)stream->mismatches,
+            (unsigned long long)stream->feedback_mismatches,
+            (unsigned long long)stream->feedback);
+      fprintf(stderr, "\tFailed transfers: %llu, short packets: %llu, underruns: %llu, flushes: %llu\n",
+            (unsigned long long)stream->failed, (unsigned long long)stream->short_packets,
+            (unsigned long long)stream->underruns, (unsigned long long)stream->flushes);
+
+      if (stream->completed)
+      {
+         fprintf(stderr, "\tCompletion latency: min %llu us, avg %llu us, max %llu us\n",
+               (unsigned long long)stream->latency_min,
+               (unsigned long long)(stream->latency_total / stream->completed),
+               (unsigned long long)stream->latency_max);
+      }
+
+      if (stream->mismatches || stream->feedback_mismatches)
+         ok = false;
+   }
+
+   return ok;
+}
+
+static double time_seconds(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return tv.tv_sec + tv.tv_nsec / 1000000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned iterations = 0;
+   int c;
+   while ((c = getopt(argc, argv, "b:")) != -1)
+   {
+      if (c == 'b')
+         iterations = strtoul(optarg, NULL, 0);
+      else
+      {
+         fprintf(stderr, "Usage: %s [-b iterations] log\n", argv[0]);
+         return 1;
+      }
+   }
+
+   if (optind >= argc)
+   {
+      fprintf(stderr, "Usage: %s [-b iterations] log\n", argv[0]);
+      return 1;
+   }
+
+   size_t size;
+   uint8_t *data = load_file(argv[optind], &size);
+   if (!data)
+   {
+      fprintf(stderr, "Failed to load %s.\n", argv[optind]);
+      return 1;
+   }
+
+   const struct maru_usblog_header *header = (const struct maru_usblog_header*)data;
+   if (size < sizeof(*header) ||
+         memcmp(header->magic, MARU_USBLOG_MAGIC, sizeof(MARU_USBLOG_MAGIC)) != 0 ||
+         header->version != MARU_USBLOG_VERSION)
+   {
+      fprintf(stderr, "%s is not a libmaru USB log.\n", argv[optind]);
+      free(data);
+      return 1;
+   }
+
+   struct replay *state = malloc(sizeof(*state));
+   if (!state || !replay(state, data, size))
+   {
+      free(state);
+      free(data);
+      return 1;
+   }
+
+   bool ok = print_report(state);
+
+   if (iterations)
+   {
+      uint64_t packets = 0;
+      for (unsigned i = 0; i < MAX_STREAMS; i++)
+         packets += state->streams[i].packets;
+
+      double start = time_seconds();
+      for (unsigned i = 0; i < iterations; i++)
+         replay(state, data, size);
+      double elapsed = time_seconds() - start;
+
+      fprintf(stderr, "Replayed %u times in %.3f s: %.0f records/s, %.0f packets/s\n",
+            iterations, elapsed,
+            state->records * iterations / elapsed,
+            packets * iterations / elapsed);
+   }
+
+   free(state);
+   free(data);
+   return ok ? 0 : 1;
+}
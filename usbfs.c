@@ -0,0 +1,187 @@
+/* libmaru - Userspace USB audio class driver.
+ * Copyright (C) 2012 - Hans-Kristian Arntzen
+ * Copyright (C) 2012 - Agnes Heyer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "usbfs.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+struct maru_usbfs
+{
+   int fd;
+   maru_usbfs_ioctl_cb ioctl_cb;
+};
+
+static int usbfs_ioctl(int fd, unsigned long request, void *arg)
+{
+   return ioctl(fd, request, arg);
+}
+
+maru_usbfs *maru_usbfs_new(int fd, maru_usbfs_ioctl_cb ioctl_cb)
+{
+   maru_usbfs *usbfs = calloc(1, sizeof(*usbfs));
+   if (!usbfs)
+      return NULL;
+
+   usbfs->fd = fd;
+   usbfs->ioctl_cb = ioctl_cb ? ioctl_cb : usbfs_ioctl;
+   return usbfs;
+}
+
+maru_usbfs *maru_usbfs_open(const char *path)
+{
+   int fd = open(path, O_RDWR | O_CLOEXEC);
+   if (fd < 0)
+      return NULL;
+
+   maru_usbfs *usbfs = maru_usbfs_new(fd, NULL);
+   if (!usbfs)
+      close(fd);
+
+   return usbfs;
+}
+
+void maru_usbfs_free(maru_usbfs *usbfs)
+{
+   if (!usbfs)
+      return;
+
+   close(usbfs->fd);
+   free(usbfs);
+}
+
+int maru_usbfs_fd(maru_usbfs *usbfs)
+{
+   return usbfs->fd;
+}
+
+bool maru_usbfs_claim_interface(maru_usbfs *usbfs, unsigned iface, unsigned altsetting)
+{
+   unsigned int ifnum = iface;
+   if (usbfs->ioctl_cb(usbfs->fd, USBDEVFS_CLAIMINTERFACE, &ifnum) < 0)
+      return false;
+
+   struct usbdevfs_setinterface setintf = {
+      .interface  = iface,
+      .altsetting = altsetting,
+   };
+
+   if (usbfs->ioctl_cb(usbfs->fd, USBDEVFS_SETINTERFACE, &setintf) < 0)
+   {
+      usbfs->ioctl_cb(usbfs->fd, USBDEVFS_RELEASEINTERFACE, &ifnum);
+      return false;
+   }
+
+   return true;
+}
+
+void maru_usbfs_release_interface(maru_usbfs *usbfs, unsigned iface)
+{
+   unsigned int ifnum = iface;
+   usbfs->ioctl_cb(usbfs->fd, USBDEVFS_RELEASEINTERFACE, &ifnum);
+}
+
+int maru_usbfs_control(maru_usbfs *usbfs,
+      uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+      void *data, uint16_t size, unsigned timeout_ms)
+{
+   struct usbdevfs_ctrltransfer ctrl = {
+      .bRequestType = request_type,
+      .bRequest     = request,
+      .wValue       = value,
+      .wIndex       = index,
+      .wLength      = size,
+      .timeout      = timeout_ms,
+      .data         = data,
+   };
+
+   return usbfs->ioctl_cb(usbfs->fd, USBDEVFS_CONTROL, &ctrl);
+}
+
+struct maru_usbfs_urb *maru_usbfs_urb_new(unsigned max_packets)
+{
+   struct maru_usbfs_urb *urb = calloc(1, sizeof(*urb) +
+         max_packets * sizeof(struct usbdevfs_iso_packet_desc));
+   if (!urb)
+      return NULL;
+
+   urb->max_packets = max_packets;
+   return urb;
+}
+
+void maru_usbfs_urb_free(struct maru_usbfs_urb *urb)
+{
+   free(urb);
+}
+
+bool maru_usbfs_submit_iso(maru_usbfs *usbfs, struct maru_usbfs_urb *urb,
+      unsigned endpoint, void *buffer,
+      const unsigned *packet_len, unsigned packets, void *userdata)
+{
+   if (packets > urb->max_packets)
+      return false;
+
+   struct usbdevfs_urb *kurb = &urb->urb;
+   memset(kurb, 0, sizeof(*kurb));
+
+   kurb->type              = USBDEVFS_URB_TYPE_ISO;
+   kurb->endpoint          = endpoint;
+   kurb->flags             = USBDEVFS_URB_ISO_ASAP;
+   kurb->buffer            = buffer;
+   kurb->number_of_packets = packets;
+   kurb->usercontext       = urb;
+
+   for (unsigned i = 0; i < packets; i++)
+   {
+      kurb->iso_frame_desc[i].length        = packet_len[i];
+      kurb->iso_frame_desc[i].actual_length = 0;
+      kurb->iso_frame_desc[i].status        = 0;
+      kurb->buffer_length                  += packet_len[i];
+   }
+
+   urb->userdata = userdata;
+   if (usbfs->ioctl_cb(usbfs->fd, USBDEVFS_SUBMITURB, kurb) < 0)
+      return false;
+
+   urb->active = true;
+   return true;
+}
+
+void maru_usbfs_discard(maru_usbfs *usbfs, struct maru_usbfs_urb *urb)
+{
+   // EINVAL means URB has already completed, and is waiting to be reaped.
+   if (usbfs->ioctl_cb(usbfs->fd, USBDEVFS_DISCARDURB, &urb->urb) < 0 && errno != EINVAL)
+      fprintf(stderr, "Discarding URB failed (errno: %d)!\n", errno);
+}
+
+struct maru_usbfs_urb *maru_usbfs_reap(maru_usbfs *usbfs)
+{
+   struct usbdevfs_urb *kurb = NULL;
+   if (usbfs->ioctl_cb(usbfs->fd, USBDEVFS_REAPURBNDELAY, &kurb) < 0)
+      return NULL;
+
+   struct maru_usbfs_urb *urb = kurb->usercontext;
+   urb->active = false;
+   return urb;
+}
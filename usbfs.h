@@ -0,0 +1,132 @@
+/* libmaru - Userspace USB audio class driver.
+ * Copyright (C) 2012 - Hans-Kristian Arntzen
+ * Copyright (C) 2012 - Agnes Heyer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef LIBMARU_USBFS_H__
+#define LIBMARU_USBFS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+/** \ingroup lib
+ * \brief Direct usbfs transport for isochronous streaming (Linux only).
+ *
+ * URBs are submitted with USBDEVFS_SUBMITURB and reaped with USBDEVFS_REAPURBNDELAY
+ * on a separate file descriptor for the device,
+ * so streaming bypasses libusb's transfer bookkeeping and event handling.
+ * Interfaces used for streaming must be claimed on this descriptor rather than through libusb.
+ *
+ * All ioctls go through a callback, so the backend can be driven by a stand-in
+ * that emulates the usbfs ioctl protocol, see test/test_usbfs.c.
+ */
+
+/** \ingroup lib
+ * \brief Function used to issue ioctls on usbfs descriptor. Returns -1 and sets errno on failure. */
+typedef int (*maru_usbfs_ioctl_cb)(int fd, unsigned long request, void *arg);
+
+typedef struct maru_usbfs maru_usbfs;
+
+/** \ingroup lib
+ * \brief A preallocated URB with room for a number of isochronous packets. */
+struct maru_usbfs_urb
+{
+   /** Owner of URB. */
+   void *userdata;
+   /** Maximum number of packets. */
+   unsigned max_packets;
+   /** Set while URB is submitted, and not yet reaped. */
+   bool active;
+   /** Kernel URB. Must be last, as iso_frame_desc follows it. */
+   struct usbdevfs_urb urb;
+};
+
+/** \ingroup lib
+ * \brief Opens a usbfs device node, e.g. /dev/bus/usb/001/002.
+ *
+ * \returns Backend, or NULL if node could not be opened.
+ */
+maru_usbfs *maru_usbfs_open(const char *path);
+
+/** \ingroup lib
+ * \brief Creates backend from an already opened descriptor, which is closed by maru_usbfs_free().
+ *
+ * \param fd Descriptor. Must be pollable, with POLLOUT signalling URBs that can be reaped.
+ * \param ioctl_cb Function to issue ioctls with. If NULL, ioctl() is used.
+ */
+maru_usbfs *maru_usbfs_new(int fd, maru_usbfs_ioctl_cb ioctl_cb);
+
+/** \ingroup lib
+ * \brief Closes descriptor and frees backend. URBs must have been reaped. */
+void maru_usbfs_free(maru_usbfs *usbfs);
+
+/** \ingroup lib
+ * \brief Pollable descriptor. POLLOUT is signalled when URBs can be reaped. */
+int maru_usbfs_fd(maru_usbfs *usbfs);
+
+/** \ingroup lib
+ * \brief Claims an interface and selects alternate setting. */
+bool maru_usbfs_claim_interface(maru_usbfs *usbfs, unsigned iface, unsigned altsetting);
+
+/** \ingroup lib
+ * \brief Releases an interface claimed with maru_usbfs_claim_interface(). */
+void maru_usbfs_release_interface(maru_usbfs *usbfs, unsigned iface);
+
+/** \ingroup lib
+ * \brief Performs a synchronous control transfer.
+ *
+ * \returns Number of bytes transferred, or -1 on failure.
+ */
+int maru_usbfs_control(maru_usbfs *usbfs,
+      uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+      void *data, uint16_t size, unsigned timeout_ms);
+
+/** \ingroup lib
+ * \brief Allocates an URB for up to max_packets packets. */
+struct maru_usbfs_urb *maru_usbfs_urb_new(unsigned max_packets);
+
+/** \ingroup lib
+ * \brief Frees URB. URB must not be active. */
+void maru_usbfs_urb_free(struct maru_usbfs_urb *urb);
+
+/** \ingroup lib
+ * \brief Submits an isochronous URB.
+ *
+ * The buffer is used as-is, no copy is made.
+ * Total length is the sum of packet lengths.
+ *
+ * \returns true if URB was submitted.
+ */
+bool maru_usbfs_submit_iso(maru_usbfs *usbfs, struct maru_usbfs_urb *urb,
+      unsigned endpoint, void *buffer,
+      const unsigned *packet_len, unsigned packets, void *userdata);
+
+/** \ingroup lib
+ * \brief Cancels a submitted URB. It must still be reaped. */
+void maru_usbfs_discard(maru_usbfs *usbfs, struct maru_usbfs_urb *urb);
+
+/** \ingroup lib
+ * \brief Reaps a completed URB without blocking.
+ *
+ * \returns Completed URB, or NULL if none has completed.
+ * errno is then ENODEV if the device is gone, and nothing more will complete.
+ */
+struct maru_usbfs_urb *maru_usbfs_reap(maru_usbfs *usbfs);
+
+#endif
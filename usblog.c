@@ -0,0 +1,136 @@
+/* libmaru - Userspace USB audio class driver.
+ * Copyright (C) 2012 - Hans-Kristian Arntzen
+ * Copyright (C) 2012 - Agnes Heyer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "usblog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+
+#define USBLOG_BUFFER_SIZE (64 * 1024)
+
+struct maru_usblog
+{
+   int fd;
+   uint64_t start_time;
+
+   size_t size;
+   uint8_t buffer[USBLOG_BUFFER_SIZE];
+};
+
+static uint64_t usblog_time(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return tv.tv_sec * UINT64_C(1000000) + tv.tv_nsec / 1000;
+}
+
+static bool write_all(int fd, const void *data_, size_t size)
+{
+   const uint8_t *data = data_;
+
+   while (size)
+   {
+      ssize_t ret = write(fd, data, size);
+      if (ret <= 0)
+         return false;
+
+      data += ret;
+      size -= ret;
+   }
+
+   return true;
+}
+
+static void usblog_flush(maru_usblog *log)
+{
+   if (log->size && !write_all(log->fd, log->buffer, log->size))
+      fprintf(stderr, "Failed to write USB log!\n");
+
+   log->size = 0;
+}
+
+maru_usblog *maru_usblog_new(int fd)
+{
+   maru_usblog *log = calloc(1, sizeof(*log));
+   if (!log)
+      return NULL;
+
+   log->fd = fd;
+   log->start_time = usblog_time();
+
+   struct maru_usblog_header header = {
+      .magic      = MARU_USBLOG_MAGIC,
+      .version    = MARU_USBLOG_VERSION,
+      .start_time = log->start_time,
+   };
+
+   if (!write_all(fd, &header, sizeof(header)))
+   {
+      free(log);
+      return NULL;
+   }
+
+   return log;
+}
+
+void maru_usblog_free(maru_usblog *log)
+{
+   if (!log)
+      return;
+
+   usblog_flush(log);
+   free(log);
+}
+
+void maru_usblog_write(maru_usblog *log, enum maru_usblog_type type,
+      unsigned stream, uint32_t id, const void *payload, size_t size)
+{
+   struct maru_usblog_record record = {
+      .time   = usblog_time() - log->start_time,
+      .type   = type,
+      .stream = stream,
+      .size   = size,
+      .id     = id,
+   };
+
+   if (log->size + sizeof(record) + size > sizeof(log->buffer))
+      usblog_flush(log);
+
+   memcpy(log->buffer + log->size, &record, sizeof(record));
+   if (size)
+      memcpy(log->buffer + log->size + sizeof(record), payload, size);
+   log->size += sizeof(record) + size;
+}
+
+uint64_t maru_usblog_hash(const void *data_, size_t size)
+{
+   const uint8_t *data = data_;
+   uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+   for (size_t i = 0; i < size; i++)
+   {
+      hash ^= data[i];
+      hash *= UINT64_C(0x100000001b3);
+   }
+
+   return hash;
+}
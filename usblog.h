@@ -0,0 +1,170 @@
+/* libmaru - Userspace USB audio class driver.
+ * Copyright (C) 2012 - Hans-Kristian Arntzen
+ * Copyright (C) 2012 - Agnes Heyer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef LIBMARU_USBLOG_H__
+#define LIBMARU_USBLOG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** \ingroup lib
+ * \brief Binary log of USB traffic, see maru_set_usb_log().
+ *
+ * A log starts with a struct maru_usblog_header.
+ * It is followed by records, each a struct maru_usblog_record and size bytes of payload.
+ * Everything is in host byte order, and packed.
+ * Audio data itself is not recorded, only a hash of it.
+ */
+
+#define MARU_USBLOG_MAGIC "MARULOG"
+#define MARU_USBLOG_VERSION 1
+
+/** \ingroup lib
+ * \brief Header of log. */
+struct maru_usblog_header
+{
+   /** MARU_USBLOG_MAGIC, including terminator */
+   char magic[8];
+   /** MARU_USBLOG_VERSION */
+   uint32_t version;
+   /** Reserved, set to 0 */
+   uint32_t reserved;
+   /** CLOCK_MONOTONIC time in microseconds that record times are relative to. */
+   uint64_t start_time;
+} __attribute__((packed));
+
+/** \ingroup lib
+ * \brief Types of records. */
+enum maru_usblog_type
+{
+   /** Scheduling state of stream, struct maru_usblog_stream.
+    * Written before first transfer of a stream is recorded. */
+   MARU_USBLOG_STREAM = 1,
+   /** Streaming transfer submitted, struct maru_usblog_submit. */
+   MARU_USBLOG_SUBMIT,
+   /** Streaming transfer completed, struct maru_usblog_complete. */
+   MARU_USBLOG_COMPLETE,
+   /** Feedback endpoint read, struct maru_usblog_feedback. */
+   MARU_USBLOG_FEEDBACK,
+   /** Control transfer completed, struct maru_usblog_control. */
+   MARU_USBLOG_CONTROL,
+   /** Stream was flushed. No payload. */
+   MARU_USBLOG_FLUSH,
+};
+
+/** \ingroup lib
+ * \brief Header of every record. */
+struct maru_usblog_record
+{
+   /** Microseconds since start_time of log. */
+   uint64_t time;
+   /** \ref maru_usblog_type */
+   uint8_t type;
+   /** Stream index, or 0xff if not related to a stream. */
+   uint8_t stream;
+   /** Size of payload following this header. */
+   uint16_t size;
+   /** Transfer sequence number, matches a SUBMIT with its COMPLETE. */
+   uint32_t id;
+} __attribute__((packed));
+
+struct maru_usblog_stream
+{
+   /** Transfer speed (16.16) */
+   uint32_t speed;
+   /** Speed fraction */
+   uint32_t fraction;
+   /** Bytes per audio frame */
+   uint32_t mult;
+   /** Maximum packets per transfer */
+   uint32_t enqueue_count;
+   /** Bytes per second */
+   uint32_t bps;
+} __attribute__((packed));
+
+struct maru_usblog_submit
+{
+   /** FNV-1a hash of payload */
+   uint64_t hash;
+   /** Number of packets */
+   uint16_t packets;
+   /** Transfers in flight on stream, including this one. */
+   uint16_t in_flight;
+   /** Followed by packets lengths. */
+   uint16_t length[];
+} __attribute__((packed));
+
+struct maru_usblog_complete
+{
+   /** libusb transfer status */
+   int32_t status;
+   /** Number of packets */
+   uint16_t packets;
+   /** Packets where actual length differed from submitted length. */
+   uint16_t short_packets;
+   /** Total bytes transferred */
+   uint32_t actual_length;
+} __attribute__((packed));
+
+struct maru_usblog_feedback
+{
+   /** libusb transfer status */
+   int32_t status;
+   /** Raw feedback value as read from endpoint. */
+   uint8_t raw[4];
+   /** Transfer speed (16.16) after feedback was applied. */
+   uint32_t speed;
+} __attribute__((packed));
+
+struct maru_usblog_control
+{
+   /** libusb transfer status */
+   int32_t status;
+   uint8_t request_type;
+   uint8_t request;
+   uint16_t value;
+   uint16_t index;
+   uint16_t length;
+} __attribute__((packed));
+
+/** \ingroup lib
+ * \brief Buffered log writer. */
+typedef struct maru_usblog maru_usblog;
+
+/** \ingroup lib
+ * \brief Creates a log writer and writes header to fd. fd is not closed by libmaru.
+ *
+ * \returns Log, or NULL if allocation or writing header failed.
+ */
+maru_usblog *maru_usblog_new(int fd);
+
+/** \ingroup lib
+ * \brief Flushes buffered records and frees log. */
+void maru_usblog_free(maru_usblog *log);
+
+/** \ingroup lib
+ * \brief Appends a record. Records are buffered, and written to fd in large blocks. */
+void maru_usblog_write(maru_usblog *log, enum maru_usblog_type type,
+      unsigned stream, uint32_t id, const void *payload, size_t size);
+
+/** \ingroup lib
+ * \brief FNV-1a hash of data. */
+uint64_t maru_usblog_hash(const void *data, size_t size);
+
+#endif